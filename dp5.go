@@ -10,6 +10,7 @@ import (
     "crypto/tls"
     "encoding/json"
     "fmt"
+    "io"
     "io/ioutil"
     "log"
     "net/http"
@@ -29,6 +30,13 @@ var dp5_dhkey_ptr *C.DHKey
 var dp5_regclient_ptr *C.struct__DP5RegClient
 var dp5_lookupclient_ptr *C.struct__DP5LookupClient
 
+// The latest epoch whose lookup metadata the client has, from a lookup
+// or a prefetch
+var dp5_metadata_epoch C.uint
+
+// When dp5_maybeprefetch may next ask the lookup server for its epoch
+var dp5_prefetch_next_check int64
+
 var dp5_friends map[string][]byte
 
 var dp5_spoof_client map[string]*strings.Replacer
@@ -60,6 +68,24 @@ func stat(path string, dir bool, mk bool) bool {
     }
 }
 
+// A nativebuffer that lends b to the library for the length of a call
+func dp5_borrow(b []byte) C.nativebuffer {
+    var buf C.nativebuffer
+    if len(b) > 0 {
+        buf.buf = (*C.char)(unsafe.Pointer(&b[0]))
+        buf.len = C.size_t(len(b))
+    }
+    return buf
+}
+
+// A view of a buffer the library handed back, valid until the arena
+// it came from is released
+func dp5_view(buf C.nativebuffer) []byte {
+    if buf.len == 0 { return nil }
+    n := int(buf.len)
+    return (*[1 << 30]byte)(unsafe.Pointer(buf.buf))[:n:n]
+}
+
 func dp5_init() {
     dp5_friends = make(map[string][]byte)
     dp5_spoof_client = make(map[string]*strings.Replacer)
@@ -141,35 +167,29 @@ func dp5_sendreg_req(server string, epoch int, msg []byte) []byte {
 
 func dp5_sendreg(username string) {
     var msg C.nativebuffer
-    var reply C.nativebuffer
 
     if len(dp5_friends) > 0 {
+        arena := C.Arena_alloc()
+        defer C.Arena_release(arena)
+
         data_slice := make([][]byte, 0, len(dp5_friends))
 
         for _, v := range dp5_friends {
             data_slice = append(data_slice, bytes.Join([][]byte{v, []byte(username)}, []byte("")))
         }
 
-        data := (*C.char)(C.CBytes(bytes.Join(data_slice, []byte(""))))
+        data := bytes.Join(data_slice, []byte(""))
         epoch := C.Config_current_epoch(dp5_config_ptr)
 
         if verbose { log.Println("dp5_sendreg epoch: " + strconv.Itoa(int(epoch))) }
 
-        _, _ = C.RegClient_start(dp5_regclient_ptr, dp5_config_ptr, epoch + 1, C.uint(len(dp5_friends)), data, &msg)
-
-        msg_gob := C.GoBytes(unsafe.Pointer(msg.buf), C.int(msg.len))
+        _, _ = C.RegClient_start(dp5_regclient_ptr, dp5_config_ptr, epoch + 1, C.uint(len(dp5_friends)), (*C.char)(unsafe.Pointer(&data[0])), arena, &msg)
 
-        reply_gob := dp5_sendreg_req(reg_server, int(epoch), msg_gob)
+        reply_gob := dp5_sendreg_req(reg_server, int(epoch), dp5_view(msg))
 
-        reply.buf = (*C.char)(C.CBytes(reply_gob))
-        reply.len = C.size_t(len(reply_gob))
-
-        ret, _ := C.RegClient_complete(dp5_regclient_ptr, epoch + 1, reply)
+        ret, _ := C.RegClient_complete(dp5_regclient_ptr, epoch + 1, dp5_borrow(reply_gob))
 
         if verbose { log.Println("dp5_sendreg ret: " + strconv.Itoa(int(ret))) }
-
-        _, _ = C.free(unsafe.Pointer(data))
-        _, _ = C.nativebuffer_purge(msg)
     }
 }
 
@@ -187,15 +207,48 @@ func dp5_sendlookup_req(server string, epoch int, msg []byte) []byte {
     return body
 }
 
+// Send a download-mode lookup request, and feed the reply to req in
+// chunks as it arrives.  Returns 0 on success.
+func dp5_streamlookup_req(server string, epoch int, msg []byte, req *C.DP5LookupClient_Request) int {
+    url := "https://" + server + "/lookup?epoch=" + strconv.Itoa(epoch)
+
+    resp, err := client.Post(url, "text/html", bytes.NewReader(msg))
+    if err != nil {
+        log.Println(err)
+        return -1
+    }
+    defer resp.Body.Close()
+
+    buf := make([]byte, 64 * 1024)
+
+    for {
+        n, err := resp.Body.Read(buf)
+        if n > 0 {
+            // The C side copies out what it needs before returning
+            ret, _ := C.LookupRequest_download_feed(req, dp5_borrow(buf[:n]))
+            if int(ret) != 0 { return int(ret) }
+        }
+        if err == io.EOF { break }
+        if err != nil {
+            log.Println(err)
+            return -1
+        }
+    }
+
+    return 0
+}
+
 func dp5_sendlookup() map[string]string {
     var md_msg C.nativebuffer
-    var md_reply C.nativebuffer
     var req_msg [2]C.nativebuffer
-    var req_reply [2]C.nativebuffer
 
     friends_alias := make(map[string]string)
 
     if len(dp5_friends) > 0 {
+        // Every buffer the library hands back for this lookup
+        arena := C.Arena_alloc()
+        defer C.Arena_release(arena)
+
         req_data_slice := make([][]byte, 0, len(dp5_friends))
         friends_slice := make([]string, 0, len(dp5_friends))
 
@@ -205,59 +258,134 @@ func dp5_sendlookup() map[string]string {
             friends_slice = append(friends_slice, k)
         }
 
-        req_data := (*C.char)(C.CBytes(bytes.Join(req_data_slice, []byte(""))))
+        req_data := bytes.Join(req_data_slice, []byte(""))
         epoch := C.Config_current_epoch(dp5_config_ptr)
 
         if verbose { log.Println("dp5_sendlookup epoch: " + strconv.Itoa(int(epoch))) }
 
-        _, _ = C.LookupClient_metadata_req(dp5_lookupclient_ptr, epoch, &md_msg)
+        // Earlier lookups in this epoch (or a prefetch) have already
+        // fetched its metadata
+        cached, _ := C.LookupClient_use_cached_metadata(dp5_lookupclient_ptr, epoch)
+        if(verbose && bool(cached)) { log.Println("dp5_sendlookup md cached") }
 
-        md_msg_gob := C.GoBytes(unsafe.Pointer(md_msg.buf), C.int(md_msg.len))
+        if !bool(cached) {
+            _, _ = C.LookupClient_metadata_req(dp5_lookupclient_ptr, epoch, arena, &md_msg)
 
-        md_reply_gob := dp5_sendlookup_req(lookup_server1, int(epoch), md_msg_gob)
+            md_start := time.Now()
+            md_reply_gob := dp5_sendlookup_req(lookup_server1, int(epoch), dp5_view(md_msg))
+            _, _ = C.LookupClient_observe_metadata(dp5_lookupclient_ptr, 0, C.double(time.Since(md_start).Seconds()))
 
-        md_reply.buf = (*C.char)(C.CBytes(md_reply_gob))
-        md_reply.len = C.size_t(len(md_reply_gob))
+            md_ret, _ := C.LookupClient_metadata_rep(dp5_lookupclient_ptr, dp5_borrow(md_reply_gob))
 
-        md_ret, _ := C.LookupClient_metadata_rep(dp5_lookupclient_ptr, md_reply)
-
-        if(verbose) { log.Println("dp5_sendlookup md ret: " + strconv.Itoa(int(md_ret))) }
-        if int(md_ret) != 0 { return friends_alias }
-
-        dp5_lookupclient_req_ptr, _ := C.LookupRequest_lookup(dp5_lookupclient_ptr, C.uint(len(dp5_friends)), unsafe.Pointer(req_data), 2, &(req_msg[0]))
-
-        req_msg1_gob := C.GoBytes(unsafe.Pointer(req_msg[0].buf), C.int(req_msg[0].len))
-        req_msg2_gob := C.GoBytes(unsafe.Pointer(req_msg[1].buf), C.int(req_msg[1].len))
+            if(verbose) { log.Println("dp5_sendlookup md ret: " + strconv.Itoa(int(md_ret))) }
+            if int(md_ret) != 0 { return friends_alias }
+        }
+        if epoch > dp5_metadata_epoch { dp5_metadata_epoch = epoch }
 
-        req_reply1_gob := dp5_sendlookup_req(lookup_server1, int(epoch), req_msg1_gob)
+        dp5_lookupclient_req_ptr, _ := C.LookupRequest_lookup(dp5_lookupclient_ptr, C.uint(len(dp5_friends)), unsafe.Pointer(&req_data[0]), 2, arena, &(req_msg[0]))
+        defer C.LookupRequest_delete(dp5_lookupclient_req_ptr)
 
-        req_reply2_gob := dp5_sendlookup_req(lookup_server2, int(epoch), req_msg2_gob)
+        req_msg1_gob := dp5_view(req_msg[0])
+        req_msg2_gob := dp5_view(req_msg[1])
 
-        req_reply[0].buf = (*C.char)(C.CBytes(req_reply1_gob))
-        req_reply[0].len = C.size_t(len(req_reply1_gob))
+        status_msg := make([]C.nativebuffer, len(dp5_friends))
 
-        req_reply[1].buf = (*C.char)(C.CBytes(req_reply2_gob))
-        req_reply[1].len = C.size_t(len(req_reply2_gob))
+        var req_ret C.int
+
+        // How long each server took to reply, for the cost model
+        reply_seconds := [2]C.double{-1, -1}
+        req_start := time.Now()
+
+        if C.LookupRequest_is_download(dp5_lookupclient_req_ptr) {
+            // Only one server was sent a request; stream the database
+            // from it rather than holding all of it in memory
+            feed_ret := 0
+            if req_msg[0].len > 0 {
+                feed_ret = dp5_streamlookup_req(lookup_server1, int(epoch), req_msg1_gob, dp5_lookupclient_req_ptr)
+                reply_seconds[0] = C.double(time.Since(req_start).Seconds())
+            } else {
+                feed_ret = dp5_streamlookup_req(lookup_server2, int(epoch), req_msg2_gob, dp5_lookupclient_req_ptr)
+                reply_seconds[1] = C.double(time.Since(req_start).Seconds())
+            }
 
-        status_msg := make([]C.nativebuffer, len(dp5_friends))
+            if verbose { log.Println("dp5_sendlookup feed ret: " + strconv.Itoa(feed_ret)) }
+            if feed_ret != 0 { return friends_alias }
 
-        req_ret, _ := C.LookupRequest_reply(dp5_lookupclient_req_ptr, 2, &(req_reply[0]), &(status_msg[0]))
+            req_ret, _ = C.LookupRequest_download_finish(dp5_lookupclient_req_ptr, arena, &(status_msg[0]))
+        } else {
+            req_reply1_gob := dp5_sendlookup_req(lookup_server1, int(epoch), req_msg1_gob)
+            reply_seconds[0] = C.double(time.Since(req_start).Seconds())
+
+            req_start = time.Now()
+            req_reply2_gob := dp5_sendlookup_req(lookup_server2, int(epoch), req_msg2_gob)
+            reply_seconds[1] = C.double(time.Since(req_start).Seconds())
+
+            // The library only reads the replies during the calls, so
+            // they are lent rather than copied into C memory
+            req_ret, _ = C.LookupRequest_add_reply(dp5_lookupclient_req_ptr, 0, dp5_borrow(req_reply1_gob))
+            if int(req_ret) == 0 {
+                req_ret, _ = C.LookupRequest_add_reply(dp5_lookupclient_req_ptr, 1, dp5_borrow(req_reply2_gob))
+            }
+            if int(req_ret) == 0 {
+                req_ret, _ = C.LookupRequest_decode(dp5_lookupclient_req_ptr, arena, &(status_msg[0]))
+            }
+        }
 
         if verbose { log.Println("dp5_sendlookup req ret: " + strconv.Itoa(int(req_ret))) }
         if int(req_ret) != 0 { return friends_alias }
 
+        _, _ = C.LookupClient_observe_lookup(dp5_lookupclient_ptr, dp5_lookupclient_req_ptr, 2, &(reply_seconds[0]))
+
         for i, f := range friends_slice {
-            friends_alias[f] = string(C.GoBytes(unsafe.Pointer(status_msg[i].buf), C.int(status_msg[i].len)))
+            friends_alias[f] = string(dp5_view(status_msg[i]))
         }
-
-        _, _ = C.free(unsafe.Pointer(req_data))
-        _, _ = C.nativebuffer_purge(md_msg)
-        // TODO: Free buffers
     }
 
     return friends_alias
 }
 
+// Ask for an epoch's metadata ahead of time, so that its first lookup
+// needs no metadata round trip.
+func dp5_prefetchmetadata(epoch C.uint) {
+    var md_msg C.nativebuffer
+
+    arena := C.Arena_alloc()
+    defer C.Arena_release(arena)
+
+    _, _ = C.LookupClient_metadata_req(dp5_lookupclient_ptr, epoch, arena, &md_msg)
+    md_reply_gob := dp5_sendlookup_req(lookup_server1, int(epoch), dp5_view(md_msg))
+
+    md_ret, _ := C.LookupClient_metadata_prefetch(dp5_lookupclient_ptr, dp5_borrow(md_reply_gob))
+    if int(md_ret) == 0 && epoch > dp5_metadata_epoch { dp5_metadata_epoch = epoch }
+
+    if verbose { log.Println("dp5_prefetchmetadata epoch " + strconv.Itoa(int(epoch)) + " ret: " + strconv.Itoa(int(md_ret))) }
+}
+
+// Prefetch the metadata for the epoch the next lookup will be in: the
+// next one, in the last quarter of an epoch, and otherwise the current
+// one.  The lookup servers only have an epoch's metadata once they have
+// moved on to it, so first check that the first one has; and check at
+// most a few times an epoch.
+func dp5_maybeprefetch() {
+    now := time.Now().Unix()
+    if now < dp5_prefetch_next_check { return }
+
+    epoch := C.Config_current_epoch(dp5_config_ptr)
+    target := epoch
+    if (int64(epoch) + 1) * int64(epoch_len) - now <= int64(epoch_len / 4) {
+        target = epoch + 1
+    }
+    if target <= dp5_metadata_epoch { return }
+
+    interval := int64(epoch_len / 8)
+    if interval < 1 { interval = 1 }
+    dp5_prefetch_next_check = now + interval
+
+    if dp5_checkepoch(lookup_server1) < int(target) { return }
+
+    dp5_prefetchmetadata(target)
+}
+
 func dp5_checkepoch(server string) int {
     url := "https://" + server + "/"
 
@@ -332,6 +460,9 @@ func dp5_loop() {
             log.Println(log_msg)
         }
 
+        // Between lookups, so that none of them waits for it
+        if prefetch_metadata && len(dp5_friends) > 0 { dp5_maybeprefetch() }
+
         time.Sleep(time.Second)
     }
 }
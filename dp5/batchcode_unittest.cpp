@@ -0,0 +1,82 @@
+#include <set>
+#include <vector>
+
+#include "dp5batchcode.h"
+
+#include "gtest/gtest.h"
+
+using namespace dp5;
+using namespace dp5::internal;
+
+using std::set;
+using std::vector;
+
+static const PRFKey seed = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+TEST(BatchCode, Layout) {
+	BatchCode code(1000, 150, seed);
+	EXPECT_EQ(code.num_partitions(), 150u);
+	EXPECT_EQ(code.total_size(), 3000u);
+	for (unsigned int b = 0; b < 1000; ++b) {
+		unsigned int parts[BatchCode::NUM_HASHES];
+		code.candidates(parts, b);
+		set<unsigned int> distinct(parts, parts + BatchCode::NUM_HASHES);
+		EXPECT_EQ(distinct.size(), (size_t) BatchCode::NUM_HASHES);
+		for (unsigned int h = 0; h < BatchCode::NUM_HASHES; ++h) {
+			unsigned int pos = code.position(parts[h], b);
+			ASSERT_LT(pos, code.partition(parts[h]).size());
+			EXPECT_EQ(code.partition(parts[h])[pos], b);
+		}
+	}
+	for (unsigned int p = 0; p < code.num_partitions(); ++p) {
+		const vector<unsigned int> &part = code.partition(p);
+		for (size_t i = 1; i < part.size(); ++i) {
+			EXPECT_LT(part[i-1], part[i]);
+		}
+	}
+}
+
+// The clients and servers must agree on the layout
+TEST(BatchCode, Deterministic) {
+	BatchCode a(500, 150, seed), b(500, 150, seed);
+	for (unsigned int p = 0; p < 150; ++p) {
+		EXPECT_EQ(a.partition(p), b.partition(p));
+	}
+}
+
+TEST(BatchCode, Schedule) {
+	BatchCode code(10000, BatchCode::num_partitions_for(100), seed);
+	unsigned int failures = 0;
+	for (unsigned int trial = 0; trial < 200; ++trial) {
+		vector<unsigned int> buckets;
+		set<unsigned int> seen;
+		while (buckets.size() < 100) {
+			unsigned int b = lrand48() % 10000;
+			if (seen.insert(b).second) buckets.push_back(b);
+		}
+		vector<unsigned int> assignment;
+		if (code.schedule(assignment, buckets)) {
+			++failures;
+			continue;
+		}
+		ASSERT_EQ(assignment.size(), buckets.size());
+		set<unsigned int> used;
+		for (size_t i = 0; i < buckets.size(); ++i) {
+			EXPECT_TRUE(used.insert(assignment[i]).second);
+			unsigned int parts[BatchCode::NUM_HASHES];
+			code.candidates(parts, buckets[i]);
+			EXPECT_TRUE(parts[0] == assignment[i] ||
+				parts[1] == assignment[i] ||
+				parts[2] == assignment[i]);
+		}
+	}
+	EXPECT_LE(failures, 1u);
+}
+
+TEST(BatchCode, TooMany) {
+	BatchCode code(100, 3, seed);
+	vector<unsigned int> buckets;
+	for (unsigned int b = 0; b < 4; ++b) buckets.push_back(b);
+	vector<unsigned int> assignment;
+	EXPECT_NE(code.schedule(assignment, buckets), 0);
+}
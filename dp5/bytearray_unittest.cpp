@@ -99,3 +99,13 @@ TYPED_TEST(ByteArrayTest, OperatorByte) {
         EXPECT_EQ(result[i], (byte) this->teststring[i]);
     }
 }
+
+TYPED_TEST(ByteArrayTest, OperatorLess) {
+    TypeParam low(this->teststring);
+    TypeParam high(this->teststring);
+    high[high.size-1] += 1;
+
+    EXPECT_TRUE(low < high);
+    EXPECT_FALSE(high < low);
+    EXPECT_FALSE(low < low);
+}
@@ -0,0 +1,142 @@
+#include "dp5costmodel.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+using namespace dp5;
+
+// A download of bytes bytes from server of num_servers
+static LookupPlan download_plan(unsigned int num_servers,
+    unsigned int server, uint64_t bytes)
+{
+    LookupPlan plan;
+    plan.method = LookupPlan::DOWNLOAD;
+    plan.sent_bytes.assign(num_servers, 0);
+    plan.received_bytes.assign(num_servers, 0);
+    plan.server_work.assign(num_servers, 0);
+    plan.sent_bytes[server] = 5;
+    plan.received_bytes[server] = bytes;
+    plan.replies_needed = 1;
+    return plan;
+}
+
+// A PIR query of every one of num_servers, each of which processes
+// work bytes of database, replies_needed of which are needed
+static LookupPlan pir_plan(unsigned int num_servers,
+    unsigned int replies_needed, uint64_t query_bytes, uint64_t work)
+{
+    LookupPlan plan;
+    plan.method = LookupPlan::PIR;
+    plan.sent_bytes.assign(num_servers, query_bytes);
+    plan.received_bytes.assign(num_servers, 1000);
+    plan.server_work.assign(num_servers, work);
+    plan.replies_needed = replies_needed;
+    plan.client_work = replies_needed * 1000;
+    return plan;
+}
+
+TEST(MeasuredCostModelTest, Priors) {
+    MeasuredCostModel model;
+    EXPECT_EQ(model.round_trip(7), MeasuredCostModel::PRIOR_ROUND_TRIP);
+    EXPECT_EQ(model.throughput(7), MeasuredCostModel::PRIOR_THROUGHPUT);
+    EXPECT_EQ(model.scan_rate(7), MeasuredCostModel::PRIOR_SCAN_RATE);
+    EXPECT_EQ(model.decode_rate(), MeasuredCostModel::PRIOR_DECODE_RATE);
+
+    LookupPlan plan = download_plan(3, 1, 1000000 - 5);
+    EXPECT_DOUBLE_EQ(model.expected_seconds(plan),
+        MeasuredCostModel::PRIOR_ROUND_TRIP +
+        1000000 / MeasuredCostModel::PRIOR_THROUGHPUT);
+}
+
+TEST(MeasuredCostModelTest, RoundTrip) {
+    MeasuredCostModel model;
+
+    // The first observation replaces the prior; later ones are
+    // averaged in
+    model.observe_round_trip(1, 2.0);
+    EXPECT_DOUBLE_EQ(model.round_trip(1), 2.0);
+    model.observe_round_trip(1, 1.0);
+    EXPECT_DOUBLE_EQ(model.round_trip(1),
+        2.0 - MeasuredCostModel::WEIGHT);
+
+    // Other servers keep the prior
+    EXPECT_EQ(model.round_trip(0), MeasuredCostModel::PRIOR_ROUND_TRIP);
+    EXPECT_EQ(model.round_trip(2), MeasuredCostModel::PRIOR_ROUND_TRIP);
+}
+
+TEST(MeasuredCostModelTest, Throughput) {
+    MeasuredCostModel model;
+    model.observe_round_trip(0, 1.0);
+
+    // Small transfers say nothing about throughput
+    LookupPlan small = download_plan(2, 0, 1000);
+    model.observe_reply(small, 0, 2.0);
+    EXPECT_EQ(model.throughput(0), MeasuredCostModel::PRIOR_THROUGHPUT);
+
+    // 10 MB in 5 seconds after a round trip of 1
+    LookupPlan big = download_plan(2, 0, 10000000 - 5);
+    model.observe_reply(big, 0, 6.0);
+    EXPECT_DOUBLE_EQ(model.throughput(0), 2e6);
+
+    // A server that was not sent anything is not affected
+    model.observe_reply(big, 1, 100.0);
+    EXPECT_EQ(model.throughput(1), MeasuredCostModel::PRIOR_THROUGHPUT);
+}
+
+TEST(MeasuredCostModelTest, ScanRate) {
+    MeasuredCostModel model;
+    model.observe_round_trip(0, 1.0);
+
+    // What the round trip and transfer do not account for is the
+    // server's processing
+    LookupPlan plan = pir_plan(3, 2, 1000000, 4000000000ULL);
+    double transfer = 1001000 / MeasuredCostModel::PRIOR_THROUGHPUT;
+    model.observe_reply(plan, 0, 1.0 + transfer + 2.0);
+    EXPECT_NEAR(model.scan_rate(0), 2e9, 1e3);
+
+    model.observe_decode(1000000, 0.5);
+    EXPECT_DOUBLE_EQ(model.decode_rate(), 2e6);
+}
+
+TEST(MeasuredCostModelTest, RepliesNeeded) {
+    MeasuredCostModel model;
+    model.observe_round_trip(0, 1.0);
+    model.observe_round_trip(1, 2.0);
+    model.observe_round_trip(2, 3.0);
+
+    // Waiting for two replies means waiting for the second quickest
+    LookupPlan plan = pir_plan(3, 2, 0, 0);
+    plan.sent_bytes.assign(3, 1);
+    plan.received_bytes.assign(3, 0);
+    plan.client_work = 0;
+    EXPECT_NEAR(model.expected_seconds(plan), 2.0, 1e-5);
+
+    // More replies than servers can never arrive
+    plan.replies_needed = 4;
+    EXPECT_GT(model.expected_seconds(plan), 1e20);
+}
+
+TEST(MeasuredCostModelTest, Choose) {
+    MeasuredCostModel model;
+    vector<LookupPlan> plans;
+
+    // 10 MB to download, against a PIR query of 100 KB to each server
+    // that has them each process 1 GB
+    plans.push_back(download_plan(3, 0, 10000000));
+    plans.push_back(pir_plan(3, 2, 100000, 1000000000ULL));
+    EXPECT_EQ(model.choose(plans), 1u);
+
+    // Servers that turn out to process the database slowly make the
+    // download quicker
+    for (unsigned int s = 0; s < 3; s++) {
+        model.observe_reply(plans[1], s, 60.0);
+    }
+    EXPECT_EQ(model.choose(plans), 0u);
+
+    // A plan must be quicker by MIN_GAIN to beat an earlier one
+    plans.clear();
+    plans.push_back(download_plan(3, 0, 1000000));
+    plans.push_back(download_plan(3, 1, 990000));
+    EXPECT_EQ(model.choose(plans), 0u);
+    plans.push_back(download_plan(3, 2, 10));
+    EXPECT_EQ(model.choose(plans), 2u);
+}
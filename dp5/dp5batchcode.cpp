@@ -0,0 +1,132 @@
+#include <algorithm>
+
+#include "dp5batchcode.h"
+
+using namespace std;
+
+namespace dp5 {
+namespace internal {
+
+// SplitMix64's output function: a cheap, well-mixed 64-bit hash.  The
+// layout is public, so it only needs to spread the buckets evenly.
+static unsigned long long mix64(unsigned long long x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Lay out num_buckets buckets into num_partitions partitions, with the
+// hash functions chosen by seed
+BatchCode::BatchCode(unsigned int num_buckets, unsigned int num_partitions,
+    const PRFKey seed) : _num_buckets(num_buckets), _seed(0),
+    _partitions(num_partitions < NUM_HASHES ? NUM_HASHES : num_partitions)
+{
+    for (unsigned int i = 0; i < PRFKEY_BYTES; ++i) {
+        _seed = (_seed << 8) | seed[i];
+    }
+    unsigned int parts[NUM_HASHES];
+    for (unsigned int b = 0; b < num_buckets; ++b) {
+        candidates(parts, b);
+        for (unsigned int h = 0; h < NUM_HASHES; ++h) {
+            // Buckets are visited in increasing order, so each
+            // partition comes out sorted
+            _partitions[parts[h]].push_back(b);
+        }
+    }
+}
+
+// The total number of buckets in all the partitions
+size_t BatchCode::total_size() const
+{
+    size_t total = 0;
+    for (size_t p = 0; p < _partitions.size(); ++p) {
+        total += _partitions[p].size();
+    }
+    return total;
+}
+
+// Fill in parts with the NUM_HASHES distinct partitions bucket is
+// replicated into
+void BatchCode::candidates(unsigned int parts[NUM_HASHES],
+    unsigned int bucket) const
+{
+    unsigned int num_partitions = _partitions.size();
+    unsigned long long h = mix64(_seed ^ bucket);
+    unsigned int found = 0;
+    while (found < NUM_HASHES) {
+        h = mix64(h);
+        unsigned int p = h % num_partitions;
+        bool dup = false;
+        for (unsigned int i = 0; i < found; ++i) {
+            dup = dup || parts[i] == p;
+        }
+        if (!dup) {
+            parts[found++] = p;
+        }
+    }
+}
+
+// The index of bucket in partition p, which must hold it
+unsigned int BatchCode::position(unsigned int p, unsigned int bucket) const
+{
+    const vector<unsigned int> &part = _partitions[p];
+    return lower_bound(part.begin(), part.end(), bucket) - part.begin();
+}
+
+// Assign each of the distinct buckets in buckets a partition holding
+// it, no two the same, by cuckoo hashing.  Return 0 on success, non-0
+// if no assignment was found.
+int BatchCode::schedule(vector<unsigned int> &assignment,
+    const vector<unsigned int> &buckets) const
+{
+    unsigned int num_partitions = _partitions.size();
+    assignment.assign(buckets.size(), 0);
+    if (buckets.size() > num_partitions) {
+        return -1;
+    }
+
+    // occupant[p] is the index into buckets of the bucket in partition
+    // p, or NONE
+    const unsigned int NONE = ~0u;
+    vector<unsigned int> occupant(num_partitions, NONE);
+    unsigned int evictions = 0;
+    for (unsigned int i = 0; i < buckets.size(); ++i) {
+        unsigned int cur = i;
+        // Which of its candidates cur was last evicted from, so that
+        // it does not go straight back there
+        unsigned int from = NONE;
+        while (true) {
+            unsigned int parts[NUM_HASHES];
+            candidates(parts, buckets[cur]);
+            unsigned int h;
+            for (h = 0; h < NUM_HASHES; ++h) {
+                if (occupant[parts[h]] == NONE) break;
+            }
+            if (h < NUM_HASHES) {
+                occupant[parts[h]] = cur;
+                assignment[cur] = parts[h];
+                break;
+            }
+            if (++evictions > MAX_EVICTIONS) {
+                return -1;
+            }
+            // Evict the occupant of one of the other candidates, picked
+            // pseudorandomly
+            h = mix64(_seed + evictions) % NUM_HASHES;
+            if (parts[h] == from) {
+                h = (h + 1) % NUM_HASHES;
+            }
+            unsigned int evicted = occupant[parts[h]];
+            occupant[parts[h]] = cur;
+            assignment[cur] = parts[h];
+            from = parts[h];
+            cur = evicted;
+        }
+    }
+    return 0;
+}
+
+} // namespace dp5::internal
+} // namespace dp5
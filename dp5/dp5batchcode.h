@@ -0,0 +1,100 @@
+#ifndef __DP5BATCHCODE_H__
+#define __DP5BATCHCODE_H__
+
+#include <vector>
+#include <algorithm>
+
+#include "dp5params.h"
+
+namespace dp5 {
+
+namespace internal {
+
+    // A probabilistic batch code built from cuckoo hashing (as in Angel
+    // et al., "PIR with Compressed Queries and Amortized Query
+    // Processing", 2018), so that a client can fetch many buckets with
+    // one PIR query per partition instead of one per bucket.
+    //
+    // Each bucket is replicated into NUM_HASHES of the partitions,
+    // chosen by hashing its number; partition p holds the buckets
+    // replicated into it, in increasing order.  A client wanting up to
+    // max_queries distinct buckets assigns each of them to a different
+    // partition that holds it, and asks each partition for one bucket
+    // (an arbitrary one where none is wanted).  The servers' work for
+    // the whole lookup is then NUM_HASHES passes over the database
+    // rather than max_queries.
+    //
+    // The layout depends only on the number of buckets and a public
+    // seed, so the servers and clients each derive it for themselves;
+    // nothing extra is stored.  Thread-safe once constructed.
+    class BatchCode {
+    public:
+        // The number of partitions each bucket is replicated into
+        static const unsigned int NUM_HASHES = 3;
+
+        // The number of partitions to use for up to max_queries
+        // distinct buckets: with half as many again as there are
+        // buckets, cuckoo hashing all but never fails
+        static unsigned int num_partitions_for(unsigned int max_queries) {
+            unsigned int n = (3 * max_queries + 1) / 2;
+            return n < NUM_HASHES ? NUM_HASHES : n;
+        }
+
+        BatchCode() : _num_buckets(0), _seed(0) {}
+
+        // Lay out num_buckets buckets into num_partitions partitions
+        // (which must be at least NUM_HASHES), with the hash functions
+        // chosen by seed
+        BatchCode(unsigned int num_buckets, unsigned int num_partitions,
+            const PRFKey seed);
+
+        // Exchange the layouts of two batch codes
+        void swap(BatchCode &other) {
+            std::swap(_num_buckets, other._num_buckets);
+            std::swap(_seed, other._seed);
+            _partitions.swap(other._partitions);
+        }
+
+        unsigned int num_buckets() const { return _num_buckets; }
+
+        unsigned int num_partitions() const {
+            return (unsigned int) _partitions.size();
+        }
+
+        // The buckets in partition p, in increasing order
+        const std::vector<unsigned int> &partition(unsigned int p) const {
+            return _partitions[p];
+        }
+
+        // The total number of buckets in all the partitions
+        size_t total_size() const;
+
+        // Fill in parts with the NUM_HASHES distinct partitions bucket
+        // is replicated into
+        void candidates(unsigned int parts[NUM_HASHES],
+            unsigned int bucket) const;
+
+        // The index of bucket in partition p, which must hold it
+        unsigned int position(unsigned int p, unsigned int bucket) const;
+
+        // Assign each of the distinct buckets in buckets a partition
+        // holding it, no two the same, by cuckoo hashing: assignment[i]
+        // is the partition for buckets[i].  Return 0 on success, non-0
+        // if no assignment was found.
+        int schedule(std::vector<unsigned int> &assignment,
+            const std::vector<unsigned int> &buckets) const;
+
+    private:
+        // Give up on cuckoo hashing after this many evictions
+        static const unsigned int MAX_EVICTIONS = 1000;
+
+        unsigned int _num_buckets;
+        unsigned long long _seed;
+        std::vector<std::vector<unsigned int> > _partitions;
+    };
+
+}  // namespace dp5::internal
+
+}  // namespace dp5
+
+#endif
@@ -238,6 +238,37 @@ unsigned int RegServer_epoch_change(
 
 // ---------- Combined Lookup client functions -----------
 
+// Process the replies to req.  A download-mode reply is streamed
+// through in place, so the database is never copied; the others are
+// copied once, into the strings lookup_reply takes.
+template<typename Request, typename Presence>
+static int request_reply(
+    Request * req,
+    unsigned int num_servers,
+    nativebuffer * replies,
+    vector<Presence> & presence){
+
+    if (req->is_download()) {
+        for (unsigned int i = 0; i < num_servers; i++){
+            if (replies[i].len == 0) continue;
+            int err = req->download_feed(replies[i].buf, replies[i].len);
+            if (err) return err;
+            return req->download_finish(presence);
+        }
+        // Did not find a single download reply
+        return 0x16;
+    }
+
+    vector<string> msgStoCpir(num_servers);
+    for (unsigned int i = 0; i < num_servers; i++){
+        if (replies[i].len > 0){
+            msgStoCpir[i].assign(replies[i].buf, replies[i].len);
+        }
+    }
+
+    return req->lookup_reply(presence, msgStoCpir);
+}
+
 DP5CombinedLookupClient * LookupClientCB_alloc(){
     return new DP5CombinedLookupClient();
 }
@@ -312,20 +343,8 @@ int LookupRequestCB_reply(
     void processprez(char*, bool, size_t, const void*)
     ){
 
-    vector<string> msgStoCpir;
-    for (unsigned int i = 0; i < num_servers; i++){
-        string msg;
-        if (replies[i].len > 0){
-            msg.append(replies[i].buf, replies[i].len);
-        }
-        else {
-            msg = "";
-        }
-        msgStoCpir.push_back(msg);
-    }
-
     vector<typename DP5CombinedLookupClient::Presence> presence;
-    int err4 = req->lookup_reply(presence, msgStoCpir);
+    int err4 = request_reply(req, num_servers, replies, presence);
     if (err4) return err4;
 
 
@@ -420,20 +439,8 @@ int LookupRequest_reply(
     void processprez(char*, bool, size_t, const void*)
     ){
 
-    vector<string> msgStoCpir;
-    for (unsigned int i = 0; i < num_servers; i++){
-        string msg;
-        if (replies[i].len >0){
-            msg.append(replies[i].buf, replies[i].len);
-        }
-        else {
-            msg = "";
-        }
-        msgStoCpir.push_back(msg);
-    }
-
     vector<typename DP5LookupClient::Presence> presence;
-    int err4 = req->lookup_reply(presence, msgStoCpir);
+    int err4 = request_reply(req, num_servers, replies, presence);
     if (err4) return err4;
 
 
@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include "dp5combregclient.h"
+#include "dp5pairing.h"
 
 namespace dp5 {
 
@@ -18,6 +19,7 @@ DP5CombinedRegClient::DP5CombinedRegClient(
         BLSPrivKey privkey)
 {
     _bls_privkey.fromBin((const char *) (const byte *)privkey);
+    getpubkey(_bls_pubkey, _bls_privkey);
 }
 
 int DP5CombinedRegClient::start_reg(string &msgtosend, unsigned int next_epoch,
@@ -31,7 +33,7 @@ int DP5CombinedRegClient::start_reg(string &msgtosend, unsigned int next_epoch,
     msgtosend.assign((char *) epoch_bytes, EPOCH_BYTES);
 
     // Generate signature on the epoch
-    G2 epoch_hash(_pairing, epoch_bytes, EPOCH_BYTES);
+    G2 epoch_hash = PairingContext::get().epoch_hash(next_epoch);
 
     G2 epoch_sig = epoch_hash ^ _bls_privkey; // h(e)^\sigma
 
@@ -40,16 +42,13 @@ int DP5CombinedRegClient::start_reg(string &msgtosend, unsigned int next_epoch,
 
     msgtosend.append(epoch_sig_bytes, EPOCH_SIG_BYTES);
 
-    BLSPubKey blspk;
-    getpubkey(blspk, _bls_privkey);
-
     // Generate the encryption key
     unsigned char data_key[DATAKEY_BYTES];
-    H5(data_key, next_epoch, blspk);
+    H5(data_key, next_epoch, _bls_pubkey);
 
     // Encrypt associated data
     string ad((char *) epoch_bytes, sizeof(epoch_bytes));
-    ad.append(blspk);
+    ad.append(_bls_pubkey);
 
     msgtosend += Enc(data_key, data, ad);
 
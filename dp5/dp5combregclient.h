@@ -28,7 +28,7 @@ public:
 
 private:
     Zr _bls_privkey;
-    const Pairing _pairing;   // FIXME: should be static, no?
+    BLSPubKey _bls_pubkey;
 };
 
 }
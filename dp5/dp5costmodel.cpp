@@ -0,0 +1,137 @@
+#include <algorithm>
+
+#include "dp5costmodel.h"
+
+using namespace std;
+
+namespace dp5 {
+
+const double LookupCostModel::MIN_GAIN = 0.1;
+
+unsigned int LookupCostModel::choose(const vector<LookupPlan> &plans) const
+{
+    unsigned int best = 0;
+    double best_seconds = 0;
+    for (unsigned int i = 0; i < plans.size(); ++i) {
+        double seconds = expected_seconds(plans[i]);
+        if (i == 0 || seconds < best_seconds * (1 - MIN_GAIN)) {
+            best = i;
+            best_seconds = seconds;
+        }
+    }
+    return best;
+}
+
+// The priors are for a client reaching the servers over Tor, and
+// servers doing the GF(2^8) arithmetic of a Percy++ query
+const double MeasuredCostModel::PRIOR_ROUND_TRIP = 0.5;
+const double MeasuredCostModel::PRIOR_THROUGHPUT = 1e6;
+const double MeasuredCostModel::PRIOR_SCAN_RATE = 2e8;
+const double MeasuredCostModel::PRIOR_DECODE_RATE = 5e7;
+const double MeasuredCostModel::WEIGHT = 0.25;
+const uint64_t MeasuredCostModel::MIN_THROUGHPUT_SAMPLE;
+
+void MeasuredCostModel::Estimate::update(double sample)
+{
+    if (observed) {
+        value += WEIGHT * (sample - value);
+    } else {
+        value = sample;
+        observed = true;
+    }
+}
+
+MeasuredCostModel::MeasuredCostModel() : _decode_rate(PRIOR_DECODE_RATE)
+{
+}
+
+MeasuredCostModel::ServerEstimates &MeasuredCostModel::server_estimates(
+    unsigned int server)
+{
+    if (server >= _servers.size()) {
+        _servers.resize(server + 1);
+    }
+    return _servers[server];
+}
+
+double MeasuredCostModel::round_trip(unsigned int server) const
+{
+    return server < _servers.size() ?
+        _servers[server].round_trip.value : PRIOR_ROUND_TRIP;
+}
+
+double MeasuredCostModel::throughput(unsigned int server) const
+{
+    return server < _servers.size() ?
+        _servers[server].throughput.value : PRIOR_THROUGHPUT;
+}
+
+double MeasuredCostModel::scan_rate(unsigned int server) const
+{
+    return server < _servers.size() ?
+        _servers[server].scan_rate.value : PRIOR_SCAN_RATE;
+}
+
+double MeasuredCostModel::expected_seconds(const LookupPlan &plan) const
+{
+    // How long each server that is sent a request takes to reply
+    vector<double> reply_seconds;
+    for (unsigned int s = 0; s < plan.sent_bytes.size(); ++s) {
+        if (plan.sent_bytes[s] == 0) continue;
+        uint64_t bytes = plan.sent_bytes[s] + plan.received_bytes[s];
+        reply_seconds.push_back(round_trip(s) + bytes / throughput(s) +
+            plan.server_work[s] / scan_rate(s));
+    }
+    if (plan.replies_needed == 0 ||
+            plan.replies_needed > reply_seconds.size()) {
+        // Can never complete
+        return 1e30;
+    }
+    sort(reply_seconds.begin(), reply_seconds.end());
+
+    return reply_seconds[plan.replies_needed - 1] +
+        plan.client_work / decode_rate();
+}
+
+// Attribute whatever of the time the current estimates do not account
+// for to the part of the reply they know least about: the throughput
+// for a transfer, or the scan rate for a PIR reply
+void MeasuredCostModel::observe_reply(const LookupPlan &plan,
+    unsigned int server, double seconds)
+{
+    if (server >= plan.sent_bytes.size() || plan.sent_bytes[server] == 0) {
+        return;
+    }
+    ServerEstimates &est = server_estimates(server);
+    uint64_t bytes = plan.sent_bytes[server] + plan.received_bytes[server];
+    uint64_t work = plan.server_work[server];
+
+    double remaining = seconds - est.round_trip.value;
+    if (work == 0) {
+        if (bytes >= MIN_THROUGHPUT_SAMPLE && remaining > 0) {
+            est.throughput.update(bytes / remaining);
+        }
+    } else {
+        remaining -= bytes / est.throughput.value;
+        if (remaining > 0) {
+            est.scan_rate.update(work / remaining);
+        }
+    }
+}
+
+void MeasuredCostModel::observe_round_trip(unsigned int server,
+    double seconds)
+{
+    if (seconds > 0) {
+        server_estimates(server).round_trip.update(seconds);
+    }
+}
+
+void MeasuredCostModel::observe_decode(uint64_t work, double seconds)
+{
+    if (work > 0 && seconds > 0) {
+        _decode_rate.update(work / seconds);
+    }
+}
+
+}
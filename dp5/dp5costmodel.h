@@ -0,0 +1,147 @@
+#ifndef __DP5COSTMODEL_H__
+#define __DP5COSTMODEL_H__
+
+#include <vector>
+#include <stdint.h>
+
+namespace dp5 {
+
+    // One way a lookup client could carry out a lookup, and what it
+    // would cost each lookup server and the client
+    struct LookupPlan {
+        enum Method {
+            // Download the whole database from one server
+            DOWNLOAD,
+            // Download it in contiguous stripes, one from each server
+            RANGED_DOWNLOAD,
+            // Make a PIR query of each server
+            PIR
+        };
+
+        Method method;
+
+        // For PIR, the depth of the recursive query to make, or 1 for
+        // an ordinary one
+        unsigned int pir_depth;
+
+        // For each lookup server: the bytes of the request sent to it,
+        // the bytes of its reply, and the bytes of database it must
+        // process to compute that reply (0 if it just sends them)
+        std::vector<uint64_t> sent_bytes;
+        std::vector<uint64_t> received_bytes;
+        std::vector<uint64_t> server_work;
+
+        // How many of the servers' replies the client must wait for
+        unsigned int replies_needed;
+
+        // The bytes the client must process to decode the replies
+        uint64_t client_work;
+
+        LookupPlan() : method(DOWNLOAD), pir_depth(1), replies_needed(0),
+            client_work(0) {}
+    };
+
+    // Estimates how long lookup plans will take, so that a lookup
+    // client can pick the quickest.  Subclass it, and pass an instance
+    // to the lookup client's set_cost_model, to change how the client
+    // chooses.  The observe methods are handed timings of past
+    // lookups, for models that learn from them.
+    class LookupCostModel {
+    public:
+        virtual ~LookupCostModel() {}
+
+        // The expected time, in seconds, for plan to complete
+        virtual double expected_seconds(const LookupPlan &plan) const = 0;
+
+        // The index into plans of the plan to use.  By default, the
+        // one expected to be quickest, except that a plan is only
+        // preferred to an earlier one if it is expected to be at least
+        // MIN_GAIN quicker, so that near-ties go to the earlier one.
+        virtual unsigned int choose(const std::vector<LookupPlan> &plans)
+            const;
+
+        // The reply from server to a request made under plan arrived
+        // seconds after the request was sent
+        virtual void observe_reply(const LookupPlan &plan,
+            unsigned int server, double seconds) {}
+
+        // A request with (almost) no request or reply body, such as a
+        // metadata request, took seconds to server and back
+        virtual void observe_round_trip(unsigned int server,
+            double seconds) {}
+
+        // The client took seconds to decode work bytes of replies
+        virtual void observe_decode(uint64_t work, double seconds) {}
+
+        // How much quicker (as a fraction) a later plan must be
+        // expected to be than an earlier one to be chosen instead
+        static const double MIN_GAIN;
+    };
+
+    // The default cost model.  It keeps a rolling estimate (an
+    // exponentially weighted moving average) of the round-trip time,
+    // the throughput, and the rate at which it processes the database
+    // for PIR queries, of each server, and of the rate at which the
+    // client decodes replies.  The first observation of each replaces
+    // its prior.  A plan is expected to take as long as the slowest of
+    // the quickest replies_needed servers, and then the decoding.
+    class MeasuredCostModel : public LookupCostModel {
+    public:
+        MeasuredCostModel();
+
+        virtual double expected_seconds(const LookupPlan &plan) const;
+
+        virtual void observe_reply(const LookupPlan &plan,
+            unsigned int server, double seconds);
+        virtual void observe_round_trip(unsigned int server,
+            double seconds);
+        virtual void observe_decode(uint64_t work, double seconds);
+
+        // The current estimates: seconds, bytes per second, and bytes
+        // of database (or of replies, for the client) per second
+        double round_trip(unsigned int server) const;
+        double throughput(unsigned int server) const;
+        double scan_rate(unsigned int server) const;
+        double decode_rate() const { return _decode_rate.value; }
+
+        // The priors, used until there is an observation
+        static const double PRIOR_ROUND_TRIP;
+        static const double PRIOR_THROUGHPUT;
+        static const double PRIOR_SCAN_RATE;
+        static const double PRIOR_DECODE_RATE;
+
+        // The weight of each new observation
+        static const double WEIGHT;
+
+        // Transfers smaller than this are dominated by the round trip,
+        // and say little about throughput
+        static const uint64_t MIN_THROUGHPUT_SAMPLE = 16384;
+
+    private:
+        struct Estimate {
+            double value;
+            bool observed;
+
+            Estimate(double prior = 0) : value(prior), observed(false) {}
+            void update(double sample);
+        };
+
+        struct ServerEstimates {
+            Estimate round_trip;
+            Estimate throughput;
+            Estimate scan_rate;
+
+            ServerEstimates() : round_trip(PRIOR_ROUND_TRIP),
+                throughput(PRIOR_THROUGHPUT), scan_rate(PRIOR_SCAN_RATE) {}
+        };
+
+        // The estimates for server, which are created if need be
+        ServerEstimates &server_estimates(unsigned int server);
+
+        std::vector<ServerEstimates> _servers;
+        Estimate _decode_rate;
+    };
+
+}
+
+#endif
@@ -0,0 +1,275 @@
+#include <string.h>
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include "dp5params.h"
+#include "dp5dpf.h"
+
+using namespace std;
+
+namespace dp5 {
+namespace internal {
+
+// The size of a seed, and of an AES block
+static const size_t SEED_BYTES = 16;
+
+// Each leaf of the tree covers this many points, one bit each
+static const unsigned int LEAF_POINTS = SEED_BYTES * 8;
+
+// The fixed AES keys for the pseudorandom generator: keys 0 and 1 make
+// the left and right children of a seed, and key 2 the output bits at
+// a leaf.  Any distinct constants would do.
+static const unsigned char FIXED_KEYS[3][16] = {
+    { 0x44, 0x50, 0x35, 0x20, 0x44, 0x50, 0x46, 0x20,
+      0x6c, 0x65, 0x66, 0x74, 0x00, 0x00, 0x00, 0x00 },
+    { 0x44, 0x50, 0x35, 0x20, 0x44, 0x50, 0x46, 0x20,
+      0x72, 0x69, 0x67, 0x68, 0x74, 0x00, 0x00, 0x00 },
+    { 0x44, 0x50, 0x35, 0x20, 0x44, 0x50, 0x46, 0x20,
+      0x6f, 0x75, 0x74, 0x70, 0x75, 0x74, 0x00, 0x00 },
+};
+
+// AES under the three fixed keys, in Matyas-Meyer-Oseas mode so that
+// it is not invertible: out = AES_k(in) XOR in, a block at a time
+class FixedKeyAES {
+public:
+    FixedKeyAES() : _ok(true) {
+        for (int k = 0; k < 3; ++k) {
+            _ctx[k] = EVP_CIPHER_CTX_new();
+            if (!_ctx[k] || EVP_EncryptInit_ex(_ctx[k], EVP_aes_128_ecb(),
+                    NULL, FIXED_KEYS[k], NULL) != 1) {
+                _ok = false;
+            } else {
+                EVP_CIPHER_CTX_set_padding(_ctx[k], 0);
+            }
+        }
+    }
+
+    ~FixedKeyAES() {
+        for (int k = 0; k < 3; ++k) {
+            EVP_CIPHER_CTX_free(_ctx[k]);
+        }
+    }
+
+    bool ok() const { return _ok; }
+
+    // Hash nblocks blocks from in to out under key k.  Return 0 on
+    // success, non-0 on failure.
+    int mmo(int k, unsigned char *out, const unsigned char *in,
+            size_t nblocks) {
+        // EVP_EncryptUpdate takes an int length
+        static const size_t CHUNK_BLOCKS = 1 << 16;
+        for (size_t b = 0; b < nblocks; b += CHUNK_BLOCKS) {
+            size_t n = nblocks - b < CHUNK_BLOCKS ? nblocks - b :
+                CHUNK_BLOCKS;
+            int len;
+            if (EVP_EncryptUpdate(_ctx[k], out + b * SEED_BYTES, &len,
+                    in + b * SEED_BYTES, (int) (n * SEED_BYTES)) != 1 ||
+                    len != (int) (n * SEED_BYTES)) {
+                return -1;
+            }
+        }
+        for (size_t i = 0; i < nblocks * SEED_BYTES; ++i) {
+            out[i] ^= in[i];
+        }
+        return 0;
+    }
+
+private:
+    // Not copyable
+    FixedKeyAES(const FixedKeyAES &);
+    FixedKeyAES& operator=(const FixedKeyAES &);
+
+    EVP_CIPHER_CTX *_ctx[3];
+    bool _ok;
+};
+
+static void xor_block(unsigned char *out, const unsigned char *in)
+{
+    for (size_t i = 0; i < SEED_BYTES; ++i) {
+        out[i] ^= in[i];
+    }
+}
+
+// The number of levels of the tree above the leaves
+unsigned int DPF::depth(unsigned int num_points)
+{
+    unsigned int leaves = (num_points + LEAF_POINTS - 1) / LEAF_POINTS;
+    unsigned int d = 0;
+    while (d < 32 && (1u << d) < leaves) {
+        ++d;
+    }
+    return d;
+}
+
+// A key is the root seed and its control bit, then for each level a
+// correction word of a seed and two control bits (in one byte), then
+// the correction word for the leaves.
+size_t DPF::key_bytes(unsigned int num_points)
+{
+    return SEED_BYTES + 1 + depth(num_points) * (SEED_BYTES + 1) +
+        SEED_BYTES;
+}
+
+// Fill in key0 and key1, each of key_bytes(num_points) bytes, with the
+// two keys for the point function at point.  Return 0 on success,
+// non-0 on failure.
+int DPF::gen(unsigned char *key0, unsigned char *key1,
+    unsigned int num_points, unsigned int point)
+{
+    if (point >= num_points) {
+        return -1;
+    }
+    FixedKeyAES aes;
+    if (!aes.ok()) {
+        return -1;
+    }
+
+    unsigned int d = depth(num_points);
+    unsigned int leaf = point / LEAF_POINTS;
+
+    // The two parties' seeds and control bits on the path to the leaf
+    unsigned char s[2][SEED_BYTES];
+    unsigned char t[2] = { 0, 1 };
+    random_bytes(s[0], SEED_BYTES);
+    random_bytes(s[1], SEED_BYTES);
+    unsigned char *keys[2] = { key0, key1 };
+    for (int b = 0; b < 2; ++b) {
+        memmove(keys[b], s[b], SEED_BYTES);
+        keys[b][SEED_BYTES] = t[b];
+    }
+
+    size_t off = SEED_BYTES + 1;
+    for (unsigned int level = 0; level < d; ++level) {
+        unsigned int bit = (leaf >> (d - 1 - level)) & 1;
+
+        // Expand both parties' seeds
+        unsigned char children[2][2][SEED_BYTES];
+        unsigned char tchild[2][2];
+        for (int b = 0; b < 2; ++b) {
+            for (int side = 0; side < 2; ++side) {
+                if (aes.mmo(side, children[b][side], s[b], 1)) {
+                    return -1;
+                }
+                tchild[b][side] = children[b][side][0] & 1;
+                children[b][side][0] &= 0xfe;
+            }
+        }
+
+        // The correction word makes the parties' seeds off the path
+        // equal, and their control bits on the path differ
+        unsigned char scw[SEED_BYTES];
+        memmove(scw, children[0][1-bit], SEED_BYTES);
+        xor_block(scw, children[1][1-bit]);
+        unsigned char tcw[2];
+        tcw[0] = tchild[0][0] ^ tchild[1][0] ^ bit ^ 1;
+        tcw[1] = tchild[0][1] ^ tchild[1][1] ^ bit;
+        for (int b = 0; b < 2; ++b) {
+            memmove(keys[b] + off, scw, SEED_BYTES);
+            keys[b][off + SEED_BYTES] = tcw[0] | (tcw[1] << 1);
+        }
+        off += SEED_BYTES + 1;
+
+        // Follow the path
+        for (int b = 0; b < 2; ++b) {
+            memmove(s[b], children[b][bit], SEED_BYTES);
+            if (t[b]) {
+                xor_block(s[b], scw);
+            }
+            t[b] = tchild[b][bit] ^ (t[b] & tcw[bit]);
+        }
+    }
+
+    // The leaf correction word makes the parties' outputs at the leaf
+    // on the path XOR to the unit vector for the point
+    unsigned char cw[SEED_BYTES];
+    memset(cw, 0, SEED_BYTES);
+    unsigned int pos = point % LEAF_POINTS;
+    cw[pos >> 3] = 1 << (pos & 7);
+    for (int b = 0; b < 2; ++b) {
+        unsigned char conv[SEED_BYTES];
+        if (aes.mmo(2, conv, s[b], 1)) {
+            return -1;
+        }
+        xor_block(cw, conv);
+    }
+    memmove(key0 + off, cw, SEED_BYTES);
+    memmove(key1 + off, cw, SEED_BYTES);
+    return 0;
+}
+
+// Evaluate key at every point of the domain.  Bit (x & 7) of out[x >>
+// 3] is set to the key's share of the value at x; out must have room
+// for eval_bytes(num_points) bytes.  Return 0 on success, non-0 on
+// failure.
+int DPF::eval_all(unsigned char *out, const unsigned char *key,
+    unsigned int num_points)
+{
+    if (num_points == 0) {
+        return 0;
+    }
+    FixedKeyAES aes;
+    if (!aes.ok()) {
+        return -1;
+    }
+
+    unsigned int d = depth(num_points);
+    size_t num_leaves = (num_points + LEAF_POINTS - 1) / LEAF_POINTS;
+
+    // The seeds and control bits of one level of the tree, expanded a
+    // level at a time, keeping only the nodes with leaves we need
+    vector<unsigned char> seeds(key, key + SEED_BYTES);
+    vector<unsigned char> tbits(1, key[SEED_BYTES] & 1);
+    vector<unsigned char> left, right;
+
+    size_t off = SEED_BYTES + 1;
+    for (unsigned int level = 0; level < d; ++level) {
+        const unsigned char *scw = key + off;
+        unsigned char tcw = key[off + SEED_BYTES];
+        off += SEED_BYTES + 1;
+
+        size_t n = tbits.size();
+        left.resize(n * SEED_BYTES);
+        right.resize(n * SEED_BYTES);
+        if (aes.mmo(0, &left[0], &seeds[0], n) ||
+                aes.mmo(1, &right[0], &seeds[0], n)) {
+            return -1;
+        }
+
+        unsigned int shift = d - 1 - level;
+        size_t next_n = (num_leaves + (1 << shift) - 1) >> shift;
+        seeds.resize(next_n * SEED_BYTES);
+        vector<unsigned char> next_tbits(next_n);
+        for (size_t j = 0; j < next_n; ++j) {
+            size_t parent = j >> 1;
+            unsigned char *child = (j & 1) ? &right[parent * SEED_BYTES] :
+                &left[parent * SEED_BYTES];
+            unsigned char t = child[0] & 1;
+            child[0] &= 0xfe;
+            if (tbits[parent]) {
+                xor_block(child, scw);
+                t ^= (tcw >> (j & 1)) & 1;
+            }
+            memmove(&seeds[j * SEED_BYTES], child, SEED_BYTES);
+            next_tbits[j] = t;
+        }
+        tbits.swap(next_tbits);
+    }
+
+    // The output bits at the leaves
+    const unsigned char *cw = key + off;
+    vector<unsigned char> leaves(num_leaves * SEED_BYTES);
+    if (aes.mmo(2, &leaves[0], &seeds[0], num_leaves)) {
+        return -1;
+    }
+    for (size_t j = 0; j < num_leaves; ++j) {
+        if (tbits[j]) {
+            xor_block(&leaves[j * SEED_BYTES], cw);
+        }
+    }
+    memmove(out, &leaves[0], eval_bytes(num_points));
+    return 0;
+}
+
+} // namespace dp5::internal
+} // namespace dp5
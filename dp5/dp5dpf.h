@@ -0,0 +1,55 @@
+#ifndef __DP5DPF_H__
+#define __DP5DPF_H__
+
+#include <stddef.h>
+
+namespace dp5 {
+
+namespace internal {
+
+    // A two-party distributed point function (Boyle, Gilboa and Ishai,
+    // "Function Secret Sharing: Improvements and Extensions", 2016) on
+    // the domain {0, 1, ..., num_points-1}, with one-bit outputs.  gen
+    // splits the function that is 1 at one point and 0 everywhere
+    // else into two keys, each of which on its own reveals nothing
+    // about the point; evaluating both keys at x and XORing the results
+    // gives the function's value at x.  Keys are O(log num_points)
+    // bytes long.
+    //
+    // Each key describes a binary tree of 128-bit seeds, expanded with
+    // fixed-key AES (which OpenSSL runs on AES-NI where the CPU has it);
+    // each leaf covers 128 consecutive points.  Thread-safe.
+    class DPF {
+    public:
+        // The size in bytes of each key for a domain of num_points
+        static size_t key_bytes(unsigned int num_points);
+
+        // The size in bytes of the output of eval_all for a domain of
+        // num_points
+        static size_t eval_bytes(unsigned int num_points) {
+            return (num_points + 7) / 8;
+        }
+
+        // Fill in key0 and key1, each of key_bytes(num_points) bytes,
+        // with the two keys for the point function at point.  Return 0
+        // on success, non-0 on failure.
+        static int gen(unsigned char *key0, unsigned char *key1,
+            unsigned int num_points, unsigned int point);
+
+        // Evaluate key at every point of the domain.  Bit (x & 7) of
+        // out[x >> 3] is set to the key's share of the value at x; out
+        // must have room for eval_bytes(num_points) bytes.  Return 0 on
+        // success, non-0 on failure.
+        static int eval_all(unsigned char *out, const unsigned char *key,
+            unsigned int num_points);
+
+    private:
+        // The number of levels of the tree above the leaves
+        static unsigned int depth(unsigned int num_points);
+    };
+
+}  // namespace dp5::internal
+
+}  // namespace dp5
+
+#endif
@@ -0,0 +1,162 @@
+#include <pthread.h>
+
+#include "dp5gf28.h"
+
+// Where the compiler can target SSSE3 and AVX2 on a per-function
+// basis, mul_add and add use them if the CPU turns out to have them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DP5_GF28_SSSE3
+#include <immintrin.h>
+#endif
+
+namespace dp5 {
+namespace internal {
+
+unsigned char GF28::_exp[510];
+unsigned char GF28::_log[256];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+#ifdef DP5_GF28_SSSE3
+static bool have_ssse3 = false;
+static bool have_avx2 = false;
+
+// out[i] ^= in[i], thirty-two bytes at a time
+__attribute__((target("avx2")))
+static size_t add_avx2(unsigned char *out, const unsigned char *in,
+    size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (in + i));
+        __m256i o = _mm256_loadu_si256((const __m256i *) (out + i));
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_xor_si256(o, x));
+    }
+    return i;
+}
+
+// out[i] ^= lo[in[i] & 0xf] ^ hi[in[i] >> 4], sixteen bytes at a time
+__attribute__((target("ssse3")))
+static size_t mul_add_ssse3(unsigned char *out, const unsigned char *in,
+    size_t len, const unsigned char lo[16], const unsigned char hi[16])
+{
+    __m128i tlo = _mm_loadu_si128((const __m128i *) lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *) hi);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i xlo = _mm_and_si128(x, nibble);
+        __m128i xhi = _mm_and_si128(_mm_srli_epi64(x, 4), nibble);
+        __m128i prod = _mm_xor_si128(_mm_shuffle_epi8(tlo, xlo),
+            _mm_shuffle_epi8(thi, xhi));
+        __m128i o = _mm_loadu_si128((const __m128i *) (out + i));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(o, prod));
+    }
+    return i;
+}
+#endif
+
+// 3 generates the multiplicative group modulo the AES polynomial
+void GF28::init_tables()
+{
+    unsigned char x = 1;
+    for (unsigned int i = 0; i < 255; ++i) {
+        _exp[i] = x;
+        _exp[i + 255] = x;
+        _log[x] = i;
+        // x *= 3
+        unsigned char x2 = (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+        x ^= x2;
+    }
+    _log[0] = 0;
+
+#ifdef DP5_GF28_SSSE3
+    __builtin_cpu_init();
+    have_ssse3 = __builtin_cpu_supports("ssse3");
+    have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+unsigned char GF28::mul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    pthread_once(&tables_once, init_tables);
+    return _exp[_log[a] + _log[b]];
+}
+
+// The multiplicative inverse of a, which must not be 0
+unsigned char GF28::inv(unsigned char a)
+{
+    pthread_once(&tables_once, init_tables);
+    return _exp[255 - _log[a]];
+}
+
+// out[i] ^= in[i] for each i < len
+void GF28::add(unsigned char *out, const unsigned char *in, size_t len)
+{
+    size_t i = 0;
+#ifdef DP5_GF28_SSSE3
+    pthread_once(&tables_once, init_tables);
+    if (have_avx2) {
+        i = add_avx2(out, in, len);
+    }
+#endif
+    for (; i < len; ++i) {
+        out[i] ^= in[i];
+    }
+}
+
+// out[i] ^= c * in[i] for each i < len
+void GF28::mul_add(unsigned char *out, const unsigned char *in,
+    size_t len, unsigned char c)
+{
+    if (c == 0) {
+        return;
+    }
+    if (c == 1) {
+        add(out, in, len);
+        return;
+    }
+
+    // c * x = c * (x & 0xf) + c * (x & 0xf0), so two 16-entry tables
+    // cover every x
+    unsigned char lo[16], hi[16];
+    for (unsigned int v = 0; v < 16; ++v) {
+        lo[v] = mul(c, v);
+        hi[v] = mul(c, v << 4);
+    }
+
+    size_t i = 0;
+#ifdef DP5_GF28_SSSE3
+    pthread_once(&tables_once, init_tables);
+    if (have_ssse3) {
+        i = mul_add_ssse3(out, in, len, lo, hi);
+    }
+#endif
+    for (; i < len; ++i) {
+        out[i] ^= lo[in[i] & 0x0f] ^ hi[in[i] >> 4];
+    }
+}
+
+// Fill in coeffs[0..n-1] with the Lagrange coefficients for evaluating
+// at x a polynomial of degree less than n from its values at the n
+// distinct points alphas[0..n-1]
+void GF28::lagrange(unsigned char *coeffs, const unsigned char *alphas,
+    unsigned int n, unsigned char x)
+{
+    for (unsigned int j = 0; j < n; ++j) {
+        unsigned char num = 1, den = 1;
+        for (unsigned int m = 0; m < n; ++m) {
+            if (m == j) continue;
+            num = mul(num, x ^ alphas[m]);
+            den = mul(den, alphas[j] ^ alphas[m]);
+        }
+        coeffs[j] = mul(num, inv(den));
+    }
+}
+
+} // namespace dp5::internal
+} // namespace dp5
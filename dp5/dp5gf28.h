@@ -0,0 +1,50 @@
+#ifndef __DP5GF28_H__
+#define __DP5GF28_H__
+
+#include <stddef.h>
+
+namespace dp5 {
+
+namespace internal {
+
+    // Arithmetic in GF(2^8), the field of Percy++'s 8-bit words, with
+    // the same reduction polynomial, x^8 + x^4 + x^3 + x + 1.  Addition
+    // is XOR.  Thread-safe.
+    class GF28 {
+    public:
+        static unsigned char mul(unsigned char a, unsigned char b);
+
+        // The multiplicative inverse of a, which must not be 0
+        static unsigned char inv(unsigned char a);
+
+        // out[i] ^= in[i] for each i < len, thirty-two bytes at a time
+        // on CPUs with AVX2
+        static void add(unsigned char *out, const unsigned char *in,
+            size_t len);
+
+        // out[i] ^= c * in[i] for each i < len, sixteen bytes at a time
+        // on CPUs with SSSE3
+        static void mul_add(unsigned char *out, const unsigned char *in,
+            size_t len, unsigned char c);
+
+        // Fill in coeffs[0..n-1] with the Lagrange coefficients for
+        // evaluating at x a polynomial of degree less than n from its
+        // values at the n distinct points alphas[0..n-1]: f(x) is the
+        // sum of coeffs[j] * f(alphas[j]).
+        static void lagrange(unsigned char *coeffs,
+            const unsigned char *alphas, unsigned int n, unsigned char x);
+
+    private:
+        static void init_tables();
+
+        // exp[i] = 3^i, doubled up so that exp[log[a] + log[b]] needs
+        // no reduction mod 255; log[0] is unused
+        static unsigned char _exp[510];
+        static unsigned char _log[256];
+    };
+
+}  // namespace dp5::internal
+
+}  // namespace dp5
+
+#endif
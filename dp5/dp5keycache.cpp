@@ -0,0 +1,427 @@
+#include "dp5keycache.h"
+#include "dp5threadpool.h"
+
+using namespace std;
+
+namespace dp5 {
+namespace internal {
+
+// Derive one epoch's keys for a list of buddies into a BuddyKeyCache
+class PrecomputeTask : public Task {
+public:
+    PrecomputeTask(BuddyKeyCache &cache, Epoch epoch,
+        const vector<PubKey> &buddies) :
+        _cache(cache), _epoch(epoch), _buddies(buddies) {}
+
+    virtual void run() {
+        BuddyKeyCache::EpochKeys keys;
+        for (size_t i = 0; i < _buddies.size(); ++i) {
+            _cache.epoch_keys(keys, _epoch, _buddies[i]);
+        }
+    }
+
+private:
+    BuddyKeyCache &_cache;
+    Epoch _epoch;
+    vector<PubKey> _buddies;
+};
+
+BuddyKeyCache::BuddyKeyCache(const PrivKey &privkey, Role role) :
+    _privkey(privkey), _role(role), _pool(NULL)
+{
+    getpubkey(_pubkey, _privkey);
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+BuddyKeyCache::BuddyKeyCache(const BuddyKeyCache &other) :
+    _privkey(other._privkey), _pubkey(other._pubkey), _role(other._role),
+    _pool(NULL)
+{
+    pthread_mutex_lock(&other._mutex);
+    _long_term = other._long_term;
+    _epochs = other._epochs;
+    pthread_mutex_unlock(&other._mutex);
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+BuddyKeyCache& BuddyKeyCache::operator=(const BuddyKeyCache &other)
+{
+    if (this == &other) {
+        return *this;
+    }
+
+    // Let any of our own precomputation finish before replacing
+    // everything underneath it
+    wait();
+
+    pthread_mutex_lock(&other._mutex);
+    map<PubKey, LongTermSecret> long_term = other._long_term;
+    map<Epoch, EpochKeyMap> epochs = other._epochs;
+    pthread_mutex_unlock(&other._mutex);
+
+    pthread_mutex_lock(&_mutex);
+    _privkey = other._privkey;
+    _pubkey = other._pubkey;
+    _role = other._role;
+    _long_term.swap(long_term);
+    _epochs.swap(epochs);
+    pthread_mutex_unlock(&_mutex);
+
+    return *this;
+}
+
+// Waits for any background precomputation to finish
+BuddyKeyCache::~BuddyKeyCache()
+{
+    delete _pool;
+    pthread_mutex_destroy(&_mutex);
+}
+
+// Compute (or look up) the long-term DH output shared with buddy
+void BuddyKeyCache::long_term_secret(DHOutput dh_output, const PubKey &buddy)
+{
+    pthread_mutex_lock(&_mutex);
+    map<PubKey, LongTermSecret>::const_iterator it = _long_term.find(buddy);
+    if (it != _long_term.end()) {
+        memmove(dh_output, it->second.dh_output, sizeof(DHOutput));
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    // Compute outside the lock; if two threads race here they will just
+    // compute the same value.
+    LongTermSecret secret;
+    diffie_hellman(secret.dh_output, _privkey, buddy);
+    memmove(dh_output, secret.dh_output, sizeof(DHOutput));
+
+    pthread_mutex_lock(&_mutex);
+    if (_long_term.size() >= LONG_TERM_CACHE_SIZE) {
+        _long_term.clear();
+    }
+    _long_term[buddy] = secret;
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Fill in keys with the keys shared with buddy in epoch
+void BuddyKeyCache::epoch_keys(EpochKeys &keys, Epoch epoch,
+    const PubKey &buddy)
+{
+    pthread_mutex_lock(&_mutex);
+    map<Epoch, EpochKeyMap>::const_iterator eit = _epochs.find(epoch);
+    if (eit != _epochs.end()) {
+        EpochKeyMap::const_iterator kit = eit->second.find(buddy);
+        if (kit != eit->second.end()) {
+            keys = kit->second;
+            pthread_mutex_unlock(&_mutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    DHOutput dh_output;
+    long_term_secret(dh_output, buddy);
+    H1H2(keys.shared_key, keys.data_key, epoch,
+        _role == REGISTER ? _pubkey : buddy, dh_output);
+    H3(keys.hash_key, epoch, keys.shared_key);
+
+    pthread_mutex_lock(&_mutex);
+    _epochs[epoch][buddy] = keys;
+    if (_epochs.size() > EPOCH_CACHE_SIZE) {
+        // Forget the oldest epoch
+        _epochs.erase(_epochs.begin());
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Start deriving, in the background, the keys shared with each of
+// buddies in epoch
+void BuddyKeyCache::precompute(Epoch epoch, const vector<PubKey> &buddies)
+{
+    if (buddies.empty()) {
+        return;
+    }
+    // Once created, the pool lives as long as we do, so it can be used
+    // outside the lock
+    pthread_mutex_lock(&_mutex);
+    if (!_pool) {
+        _pool = new ThreadPool(1);
+    }
+    ThreadPool *pool = _pool;
+    pthread_mutex_unlock(&_mutex);
+
+    pool->submit(new PrecomputeTask(*this, epoch, buddies));
+}
+
+// Block until all background precomputation has finished
+void BuddyKeyCache::wait()
+{
+    pthread_mutex_lock(&_mutex);
+    ThreadPool *pool = _pool;
+    pthread_mutex_unlock(&_mutex);
+
+    if (pool) {
+        pool->wait();
+    }
+}
+
+// Derive one epoch's combined-mode keys for a range of buddies.  The
+// results go into out (if not NULL) and into the cache.
+class CombinedKeyTask : public Task {
+public:
+    CombinedKeyTask(CombinedKeyCache &cache, TaskGroup &group, Epoch epoch,
+        const vector<BLSPubKey> &buddies, size_t begin, size_t end,
+        CombinedKeyCache::EpochKeys *out, int *errors) :
+        _cache(cache), _group(group), _epoch(epoch),
+        _buddies(buddies.begin() + begin, buddies.begin() + end),
+        _out(out), _errors(errors) {}
+
+    virtual void run() {
+        for (size_t i = 0; i < _buddies.size(); ++i) {
+            CombinedKeyCache::EpochKeys keys;
+            int err = hash_key_from_pk(keys.hash_key, _buddies[i], _epoch);
+            if (err == 0) {
+                H5(keys.data_key, _epoch, _buddies[i]);
+                _cache.insert(_epoch, _buddies[i], keys);
+                if (_out) {
+                    _out[i] = keys;
+                }
+            }
+            if (_errors) {
+                _errors[i] = err;
+            }
+        }
+        // Must come last; the group's owner may be waiting to free it
+        _group.done();
+    }
+
+private:
+    CombinedKeyCache &_cache;
+    TaskGroup &_group;
+    Epoch _epoch;
+    vector<BLSPubKey> _buddies;
+    CombinedKeyCache::EpochKeys *_out;
+    int *_errors;
+};
+
+CombinedKeyCache::CombinedKeyCache()
+{
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+CombinedKeyCache::CombinedKeyCache(const CombinedKeyCache &other)
+{
+    pthread_mutex_lock(&other._mutex);
+    _epochs = other._epochs;
+    pthread_mutex_unlock(&other._mutex);
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+CombinedKeyCache& CombinedKeyCache::operator=(const CombinedKeyCache &other)
+{
+    if (this == &other) {
+        return *this;
+    }
+
+    wait();
+
+    pthread_mutex_lock(&other._mutex);
+    map<Epoch, EpochKeyMap> epochs = other._epochs;
+    pthread_mutex_unlock(&other._mutex);
+
+    pthread_mutex_lock(&_mutex);
+    _epochs.swap(epochs);
+    pthread_mutex_unlock(&_mutex);
+
+    return *this;
+}
+
+// Waits for any background precomputation to finish
+CombinedKeyCache::~CombinedKeyCache()
+{
+    // Deleting a TaskGroup waits for its tasks
+    map<Epoch, Pending>::iterator it;
+    for (it = _background.begin(); it != _background.end(); ++it) {
+        delete it->second.group;
+    }
+    pthread_mutex_destroy(&_mutex);
+}
+
+// Remember keys for buddy in epoch
+void CombinedKeyCache::insert(Epoch epoch, const BLSPubKey &buddy,
+    const EpochKeys &keys)
+{
+    pthread_mutex_lock(&_mutex);
+    _epochs[epoch][buddy] = keys;
+    if (_epochs.size() > EPOCH_CACHE_SIZE) {
+        // Forget the oldest epoch
+        _epochs.erase(_epochs.begin());
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Fill in keys[i] with the keys for buddies[i] in epoch, deriving those
+// not already cached in parallel.  Return 0 on success, non-0 if some
+// buddy's key could not be derived.
+int CombinedKeyCache::epoch_keys(vector<EpochKeys> &keys, Epoch epoch,
+    const vector<BLSPubKey> &buddies)
+{
+    // If we are still precomputing this epoch, finishing that is
+    // cheaper than starting over.  Precomputation of other epochs
+    // (usually the next one) carries on in the background.
+    TaskGroup *pending = NULL;
+    pthread_mutex_lock(&_mutex);
+    map<Epoch, Pending>::iterator pit = _background.find(epoch);
+    if (pit != _background.end()) {
+        pending = pit->second.group;
+        ++pit->second.waiters;
+    }
+    pthread_mutex_unlock(&_mutex);
+    if (pending) {
+        pending->wait();
+        // The entry is not pruned while it has waiters
+        pthread_mutex_lock(&_mutex);
+        --_background[epoch].waiters;
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    keys.resize(buddies.size());
+
+    // Find which ones we still need
+    vector<BLSPubKey> missing;
+    vector<size_t> missing_idx;
+    pthread_mutex_lock(&_mutex);
+    map<Epoch, EpochKeyMap>::const_iterator eit = _epochs.find(epoch);
+    for (size_t i = 0; i < buddies.size(); ++i) {
+        if (eit != _epochs.end()) {
+            EpochKeyMap::const_iterator kit = eit->second.find(buddies[i]);
+            if (kit != eit->second.end()) {
+                keys[i] = kit->second;
+                continue;
+            }
+        }
+        missing.push_back(buddies[i]);
+        missing_idx.push_back(i);
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    if (missing.empty()) {
+        return 0;
+    }
+
+    vector<EpochKeys> derived(missing.size());
+    vector<int> errors(missing.size(), 0);
+    if (missing.size() == 1) {
+        // Not worth a trip through the pool
+        TaskGroup group;
+        group.add();
+        CombinedKeyTask(*this, group, epoch, missing, 0, 1, &derived[0],
+            &errors[0]).run();
+    } else {
+        TaskGroup group;
+        for (size_t begin = 0; begin < missing.size();
+                begin += TASK_BUDDIES) {
+            size_t end = begin + TASK_BUDDIES;
+            if (end > missing.size()) {
+                end = missing.size();
+            }
+            group.add();
+            ThreadPool::shared().submit(new CombinedKeyTask(*this, group,
+                epoch, missing, begin, end, &derived[begin],
+                &errors[begin]));
+        }
+        group.wait();
+    }
+
+    int ret = 0;
+    for (size_t j = 0; j < missing.size(); ++j) {
+        if (errors[j] != 0) {
+            ret = errors[j];
+        } else {
+            keys[missing_idx[j]] = derived[j];
+        }
+    }
+    return ret;
+}
+
+// Start deriving, in the background, the keys for each of buddies in
+// epoch
+void CombinedKeyCache::precompute(Epoch epoch,
+    const vector<BLSPubKey> &buddies)
+{
+    if (buddies.empty()) {
+        return;
+    }
+
+    size_t num_tasks = (buddies.size() + TASK_BUDDIES - 1) / TASK_BUDDIES;
+    vector<TaskGroup *> stale;
+
+    pthread_mutex_lock(&_mutex);
+    Pending &pending = _background[epoch];
+    if (!pending.group) {
+        pending.group = new TaskGroup();
+    }
+    TaskGroup *group = pending.group;
+    // Count the tasks while we hold the lock, so the group cannot be
+    // deleted before they are submitted
+    for (size_t t = 0; t < num_tasks; ++t) {
+        group->add();
+    }
+
+    // Forget the groups for epochs too old to be cached, unless some
+    // thread is still waiting for them
+    map<Epoch, Pending>::iterator it = _background.begin();
+    while (it != _background.end() &&
+            it->first + EPOCH_CACHE_SIZE <= epoch) {
+        if (it->second.waiters == 0) {
+            stale.push_back(it->second.group);
+            _background.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    // Their tasks finished long ago, so this does not block
+    for (size_t i = 0; i < stale.size(); ++i) {
+        delete stale[i];
+    }
+
+    for (size_t begin = 0; begin < buddies.size(); begin += TASK_BUDDIES) {
+        size_t end = begin + TASK_BUDDIES;
+        if (end > buddies.size()) {
+            end = buddies.size();
+        }
+        ThreadPool::shared().submit(new CombinedKeyTask(*this,
+            *group, epoch, buddies, begin, end, NULL, NULL));
+    }
+}
+
+// Block until all background precomputation, for every epoch, has
+// finished
+void CombinedKeyCache::wait()
+{
+    vector<Epoch> epochs;
+    vector<TaskGroup *> groups;
+    pthread_mutex_lock(&_mutex);
+    map<Epoch, Pending>::iterator it;
+    for (it = _background.begin(); it != _background.end(); ++it) {
+        epochs.push_back(it->first);
+        groups.push_back(it->second.group);
+        ++it->second.waiters;
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    for (size_t i = 0; i < groups.size(); ++i) {
+        groups[i]->wait();
+    }
+
+    pthread_mutex_lock(&_mutex);
+    for (size_t i = 0; i < epochs.size(); ++i) {
+        --_background[epochs[i]].waiters;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+} // namespace dp5::internal
+} // namespace dp5
@@ -0,0 +1,162 @@
+#ifndef __DP5KEYCACHE_H__
+#define __DP5KEYCACHE_H__
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+#include "dp5params.h"
+
+namespace dp5 {
+
+namespace internal {
+
+    class ThreadPool;
+    class TaskGroup;
+
+    // A client's cache of the keys it shares with its buddies.  The
+    // long-term Diffie-Hellman output with each buddy depends only on
+    // the two key pairs, so it is computed once per buddy; the per-epoch
+    // keys derived from it are kept for the last few epochs, and the
+    // next epoch's can be derived in the background ahead of time.
+    // Thread-safe.
+    class BuddyKeyCache {
+    public:
+        // Which end of the link the keys are for.  H1H2 mixes in the
+        // registering client's public key: our own when we register,
+        // the buddy's when we look them up.
+        enum Role { REGISTER, LOOKUP };
+
+        // The keys shared with one buddy in one epoch
+        struct EpochKeys {
+            SharedKey shared_key;
+            DataKey data_key;
+            HashKey hash_key;
+        };
+
+        BuddyKeyCache(const PrivKey &privkey, Role role);
+        BuddyKeyCache(const BuddyKeyCache &other);
+        BuddyKeyCache& operator=(const BuddyKeyCache &other);
+
+        // Waits for any background precomputation to finish
+        ~BuddyKeyCache();
+
+        // Our own public key
+        const PubKey &pubkey() const { return _pubkey; }
+
+        // Fill in keys with the keys shared with buddy in epoch
+        void epoch_keys(EpochKeys &keys, Epoch epoch, const PubKey &buddy);
+
+        // Start deriving, in the background, the keys shared with each
+        // of buddies in epoch
+        void precompute(Epoch epoch, const std::vector<PubKey> &buddies);
+
+        // Block until all background precomputation, for every epoch,
+        // has finished
+        void wait();
+
+    private:
+        // Compute (or look up) the long-term DH output shared with buddy
+        void long_term_secret(DHOutput dh_output, const PubKey &buddy);
+
+        // The number of epochs for which to keep derived keys: the
+        // previous, current, and next.
+        static const unsigned int EPOCH_CACHE_SIZE = 3;
+
+        // Forget all the long-term secrets once we have this many, so
+        // that a client that cycles through many buddies does not grow
+        // without bound.
+        static const unsigned int LONG_TERM_CACHE_SIZE = 4 * MAX_BUDDIES;
+
+        struct LongTermSecret {
+            DHOutput dh_output;
+        };
+
+        typedef std::map<PubKey, EpochKeys> EpochKeyMap;
+
+        PrivKey _privkey;
+        PubKey _pubkey;
+        Role _role;
+
+        std::map<PubKey, LongTermSecret> _long_term;
+        std::map<Epoch, EpochKeyMap> _epochs;
+
+        // Created, under _mutex, the first time precompute() is
+        // called; not copied
+        ThreadPool *_pool;
+
+        mutable pthread_mutex_t _mutex;
+    };
+
+    // The combined-mode counterpart of BuddyKeyCache.  Deriving a
+    // buddy's hash key takes a pairing, so the keys for a lookup are
+    // derived in parallel on ThreadPool::shared(), and kept for the last
+    // few epochs; the next epoch's can be derived in the background
+    // ahead of time.  Thread-safe.
+    class CombinedKeyCache {
+    public:
+        // The keys for one buddy in one epoch
+        struct EpochKeys {
+            DataKey data_key;
+            HashKey hash_key;
+        };
+
+        CombinedKeyCache();
+        CombinedKeyCache(const CombinedKeyCache &other);
+        CombinedKeyCache& operator=(const CombinedKeyCache &other);
+
+        // Waits for any background precomputation to finish
+        ~CombinedKeyCache();
+
+        // Fill in keys[i] with the keys for buddies[i] in epoch,
+        // deriving those not already cached in parallel.  Return 0 on
+        // success, non-0 if some buddy's key could not be derived (for
+        // example, if it is not a valid public key).
+        int epoch_keys(std::vector<EpochKeys> &keys, Epoch epoch,
+            const std::vector<BLSPubKey> &buddies);
+
+        // Start deriving, in the background, the keys for each of
+        // buddies in epoch
+        void precompute(Epoch epoch, const std::vector<BLSPubKey> &buddies);
+
+        // Block until all background precomputation, for every epoch,
+        // has finished
+        void wait();
+
+    private:
+        friend class CombinedKeyTask;
+
+        // Remember keys for buddy in epoch
+        void insert(Epoch epoch, const BLSPubKey &buddy,
+            const EpochKeys &keys);
+
+        // The number of epochs for which to keep derived keys: the
+        // previous, current, and next.
+        static const unsigned int EPOCH_CACHE_SIZE = 3;
+
+        // Each task derives the keys for at most this many buddies
+        static const unsigned int TASK_BUDDIES = 8;
+
+        typedef std::map<BLSPubKey, EpochKeys> EpochKeyMap;
+
+        std::map<Epoch, EpochKeyMap> _epochs;
+
+        // The background precomputation for one epoch, and how many
+        // threads are waiting for it to finish
+        struct Pending {
+            Pending() : group(NULL), waiters(0) {}
+            TaskGroup *group;
+            unsigned int waiters;
+        };
+
+        // The background precomputation in flight, by epoch; not copied
+        std::map<Epoch, Pending> _background;
+
+        mutable pthread_mutex_t _mutex;
+    };
+
+}  // namespace dp5::internal
+
+}  // namespace dp5
+
+#endif
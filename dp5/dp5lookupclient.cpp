@@ -1,63 +1,529 @@
 #include <sstream>
+#include <algorithm>
+#include <iterator>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <stdexcept>
+#include <sys/time.h>
 
 #include "dp5params.h"
 #include "dp5metadata.h"
 #include "dp5lookupclient.h"
-#include "percyclient.h"
+#include "dp5gf28.h"
+#include "dp5dpf.h"
+#include "dp5batchcode.h"
 
 using namespace std;
 
 namespace dp5 {
 namespace internal {
-// The array of valid numbers of buddies a client can send at lookup time
-unsigned int QUERY_SIZES[] =
-    { 1, MAX_BUDDIES };
 
+// The time of day, in seconds
+static double wall_seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+PIREngine::PIREngine(const Metadata &metadata, unsigned int record_size) :
+    _metadata(metadata), _record_size(record_size), _batched(false)
+{
+    if (metadata.batch_pir && metadata.pir_backend == PIR_BACKEND_PERCY &&
+	    metadata.num_buckets > 0) {
+	BatchCode code(metadata.num_buckets,
+	    BatchCode::num_partitions_for(MAX_BUDDIES), metadata.prfkey);
+	_batch_code.swap(code);
+	_batched = true;
+    }
+}
+
+PIREngineRef::PIREngineRef(PIREngine *engine) : _shared(new Shared)
+{
+    _shared->engine = engine;
+    _shared->refs = 1;
+    pthread_mutex_init(&_shared->refs_lock, NULL);
+}
+
+PIREngineRef::PIREngineRef(const PIREngineRef &other) :
+    _shared(other._shared)
+{
+    if (_shared) {
+	pthread_mutex_lock(&_shared->refs_lock);
+	++_shared->refs;
+	pthread_mutex_unlock(&_shared->refs_lock);
+    }
+}
 
+PIREngineRef& PIREngineRef::operator=(const PIREngineRef &other)
+{
+    if (_shared != other._shared) {
+	PIREngineRef tmp(other);
+	release();
+	_shared = tmp._shared;
+	tmp._shared = NULL;
+    }
+    return *this;
+}
+
+PIREngineRef::~PIREngineRef()
+{
+    release();
+}
+
+// Drop this reference, and the engine with the last one
+void PIREngineRef::release()
+{
+    if (!_shared) {
+	return;
+    }
+    pthread_mutex_lock(&_shared->refs_lock);
+    bool last = (--_shared->refs == 0);
+    pthread_mutex_unlock(&_shared->refs_lock);
+    if (last) {
+	delete _shared->engine;
+	pthread_mutex_destroy(&_shared->refs_lock);
+	delete _shared;
+    }
+    _shared = NULL;
+}
 
 // The glue API to the PIR layer.  Pass a vector of the bucket
-// numbers to look up.  This should already be padded to one of
-// the valid sizes listed in QUERY_SIZES.  Place the querys to
-// send to the servers into requeststrs.  Return 0 on success,
-// non-0 on failure.
+// numbers to look up.  This should already be padded to one of the
+// rungs of the metadata's query-size ladder.  Place the querys to
+// send to the servers into requeststrs.  If seeded is not NULL, up to
+// privacy_level of the servers, chosen at random, are sent just a seed
+// from which they expand their query themselves: (*seeded)[j] is set
+// to whether server j is one of them, and so whether requeststrs[j] is
+// a seeded query.  Return 0 on success, non-0 on failure.
+//
+// The queries are in Percy++'s format for 8-bit words: a
+// little-endian count of the buckets asked for, then for each one,
+// a byte per bucket in the database.  Those bytes are the server's
+// Shamir shares, at the point j+1 for server j, of the unit vector
+// picking out the bucket; that is, for bucket b they are the values
+// at j+1 of
+//
+//     e_b + C_1 x + C_2 x^2 + ... + C_t x^t
+//
+// where t is the privacy level and the C_k are uniformly random
+// vectors.  So each server's query is a sum of t scalar multiples of
+// the C_k, which is what GF28::mul_add does quickly, and the random
+// coefficients come from the generator in bulk.
 int PIRRequest::pir_query(vector<string> &requeststrs,
+		const vector<unsigned int> &bucketnums, vector<bool> *seeded)
+{
+    size_t numqs = bucketnums.size();
+    size_t num_buckets = _metadata_current.num_buckets;
+    requeststrs.clear();
+    _batched = false;
+    _depth = 1;
+    if (seeded) {
+	seeded->assign(_num_servers, false);
+    }
+    if (numqs > 0xffff || num_buckets == 0 ||
+	    _num_servers == 0 || _num_servers > 255) {
+	return -1;
+    }
+    for (size_t i=0; i<numqs; ++i) {
+	if (bucketnums[i] >= num_buckets) {
+	    return -1;
+	}
+    }
+
+    requeststrs.resize(_num_servers);
+    for (unsigned int j=0; j<_num_servers; ++j) {
+	string &req = requeststrs[j];
+	req.resize(2);
+	req[0] = (char)(numqs & 0xff);
+	req[1] = (char)(numqs >> 8);
+    }
+
+    if (_metadata_current.pir_backend != PIR_BACKEND_PERCY) {
+	int err = _metadata_current.pir_backend == PIR_BACKEND_DPF ?
+	    dpf_query(requeststrs, bucketnums) :
+	    chor_query(requeststrs, bucketnums);
+	if (err) {
+	    requeststrs.clear();
+	    return -1;
+	}
+	_num_queries = numqs;
+	return 0;
+    }
+
+    if (seeded && _privacy_level > 0 && _privacy_level < _num_servers) {
+	if (seeded_query(requeststrs, bucketnums, *seeded)) {
+	    requeststrs.clear();
+	    return -1;
+	}
+	_num_queries = numqs;
+	return 0;
+    }
+
+    for (unsigned int j=0; j<_num_servers; ++j) {
+	requeststrs[j].resize(2 + numqs * num_buckets);
+    }
+
+    vector<unsigned char> coeffs(_privacy_level * num_buckets);
+    for (size_t q=0; q<numqs; ++q) {
+	share_unit_vector(requeststrs, 2 + q * num_buckets, num_buckets,
+	    bucketnums[q], coeffs);
+    }
+
+    _num_queries = numqs;
+    return 0;
+}
+
+// Write each server's share of the unit vector of length len picking
+// out index into its query at offset.  coeffs is scratch space.
+void PIRRequest::share_unit_vector(vector<string> &requeststrs,
+		size_t offset, size_t len, unsigned int index,
+		vector<unsigned char> &coeffs) const
+{
+    if (len == 0) {
+	return;
+    }
+    coeffs.resize(_privacy_level * len);
+    if (!coeffs.empty()) {
+	random_bytes(&coeffs[0], coeffs.size());
+    }
+    for (unsigned int j=0; j<_num_servers; ++j) {
+	unsigned char *share = (unsigned char *) &requeststrs[j][offset];
+	memset(share, 0, len);
+	unsigned char alpha = (unsigned char)(j+1);
+	unsigned char alpha_k = alpha;
+	for (unsigned int k=0; k<_privacy_level; ++k) {
+	    GF28::mul_add(share, &coeffs[k * len], len, alpha_k);
+	    alpha_k = GF28::mul(alpha_k, alpha);
+	}
+	share[index] ^= 1;
+    }
+}
+
+// The batch version of pir_query, for the Percy backend when the
+// metadata allows batch queries.  Pass a vector of the bucket numbers
+// to look up, which may contain repeats, and at most
+// BatchCode::num_partitions_for(MAX_BUDDIES) of which are distinct.
+// Place the queries to send to the servers into requeststrs.  Return 0
+// on success, non-0 on failure, in which case pir_query should be
+// used instead.
+//
+// Each distinct bucket is assigned its own partition of the batch code
+// (see dp5batchcode.h), and each partition gets an ordinary query for
+// the bucket assigned to it, or for its first bucket if none is, as if
+// the partition were the whole database.  Which partitions are asked
+// for something real is hidden by the shares, just as which bucket is.
+int PIRRequest::batch_query(vector<string> &requeststrs,
 		const vector<unsigned int> &bucketnums)
 {
-    int err = -1;
+    requeststrs.clear();
+    _batched = false;
+    _depth = 1;
+    unsigned int num_buckets = _metadata_current.num_buckets;
+    if (_metadata_current.pir_backend != PIR_BACKEND_PERCY ||
+	    !_metadata_current.batch_pir || num_buckets == 0 ||
+	    _num_servers == 0 || _num_servers > 255) {
+	return -1;
+    }
+
+    // The distinct buckets, and where each of bucketnums is among them
+    vector<unsigned int> distinct;
+    vector<unsigned int> which(bucketnums.size());
+    map<unsigned int, unsigned int> seen;
+    for (size_t i=0; i<bucketnums.size(); ++i) {
+	if (bucketnums[i] >= num_buckets) {
+	    return -1;
+	}
+	map<unsigned int, unsigned int>::iterator it =
+	    seen.find(bucketnums[i]);
+	if (it == seen.end()) {
+	    it = seen.insert(make_pair(bucketnums[i],
+		(unsigned int) distinct.size())).first;
+	    distinct.push_back(bucketnums[i]);
+	}
+	which[i] = it->second;
+    }
+
+    // The engine lays out the batch code once for the epoch
+    const BatchCode *code = _engine.get() ? _engine->batch_code() : NULL;
+    if (!code) {
+	return -1;
+    }
+    vector<unsigned int> assignment;
+    if (code->schedule(assignment, distinct)) {
+	return -1;
+    }
+
+    unsigned int num_partitions = code->num_partitions();
+    vector<unsigned int> wanted(num_partitions, 0);
+    for (size_t d=0; d<distinct.size(); ++d) {
+	wanted[assignment[d]] = code->position(assignment[d], distinct[d]);
+    }
+
+    requeststrs.resize(_num_servers);
+    for (unsigned int j=0; j<_num_servers; ++j) {
+	string &req = requeststrs[j];
+	req.resize(2 + code->total_size());
+	req[0] = (char)(num_partitions & 0xff);
+	req[1] = (char)(num_partitions >> 8);
+    }
+    vector<unsigned char> coeffs;
+    size_t offset = 2;
+    for (unsigned int p=0; p<num_partitions; ++p) {
+	size_t len = code->partition(p).size();
+	share_unit_vector(requeststrs, offset, len, wanted[p], coeffs);
+	offset += len;
+    }
 
-    // Convert the bucketnums to the right type
-    vector<dbsize_t> pir_bucketnums;
+    _batch_slots.resize(bucketnums.size());
+    for (size_t i=0; i<bucketnums.size(); ++i) {
+	_batch_slots[i] = assignment[which[i]];
+    }
+    _num_queries = num_partitions;
+    _batched = true;
+    return 0;
+}
+
+// The recursive version of pir_query, for the Percy backend when the
+// metadata allows queries of the given depth.  Pass a vector of the
+// bucket numbers to look up.  Place the queries to send to the servers
+// into requeststrs.  Return 0 on success, non-0 on failure.
+//
+// The buckets are laid out in a cube of depth dimensions, each of side
+// s = pir_cube_side(num_buckets, depth), so that bucket b is at the
+// coordinates given by its digits in base s, most significant first.
+// The query for b is a share of the unit vector of length s picking
+// out each of its coordinates in turn.  A server uses the first to add
+// up the slices of the cube along the first dimension, leaving a cube
+// of one less dimension whose contents are shares of degree
+// privacy_level of the slice b is in; the second does the same to
+// that, and so on.  What is left is a share of degree depth *
+// privacy_level of bucket b: the degrees add because each server
+// multiplies its shares together, at its own point j+1.  Any
+// privacy_level servers still see only uniformly random shares.
+int PIRRequest::recursive_query(vector<string> &requeststrs,
+		const vector<unsigned int> &bucketnums, unsigned int depth)
+{
     size_t numqs = bucketnums.size();
+    unsigned int num_buckets = _metadata_current.num_buckets;
+    requeststrs.clear();
+    _batched = false;
+    _depth = 1;
+    if (_metadata_current.pir_backend != PIR_BACKEND_PERCY ||
+	    depth < 1 || depth > _metadata_current.pir_depth ||
+	    depth * _privacy_level >= _num_servers ||
+	    numqs > 0xffff || num_buckets == 0 || _num_servers > 255) {
+	return -1;
+    }
     for (size_t i=0; i<numqs; ++i) {
-	pir_bucketnums.push_back((dbsize_t)bucketnums[i]);
+	if (bucketnums[i] >= num_buckets) {
+	    return -1;
+	}
     }
 
-    // Create the ostreams to hold the output
-    vector<ostream*> osvec;
+    unsigned int side = pir_cube_side(num_buckets, depth);
+    size_t query_len = depth * side;
+    requeststrs.resize(_num_servers);
     for (unsigned int j=0; j<_num_servers; ++j) {
-	osvec.push_back(new stringstream());
+	string &req = requeststrs[j];
+	req.resize(3 + numqs * query_len);
+	req[0] = (char)(numqs & 0xff);
+	req[1] = (char)(numqs >> 8);
+	req[2] = (char) depth;
     }
 
-    nqueries_t queryblocksize = 1;
-    _request_identifier = _pirclient->encode_request(
-	    pir_bucketnums, queryblocksize);
-    dbsize_t ret = _pirclient->send_request(_request_identifier, osvec);
-    if (ret) {
-	err = 0;
+    vector<unsigned char> coeffs;
+    for (size_t q=0; q<numqs; ++q) {
+	unsigned int rest = bucketnums[q];
+	for (unsigned int k=depth; k-- > 0; ) {
+	    share_unit_vector(requeststrs, 3 + q * query_len + k * side,
+		side, rest % side, coeffs);
+	    rest /= side;
+	}
     }
 
-    requeststrs.clear();
+    _num_queries = numqs;
+    _depth = depth;
+    return 0;
+}
+
+// The seeded version of pir_query.  requeststrs already holds the
+// count of queries for each server.  Return 0 on success, non-0 on
+// failure.
+//
+// Fixing the shares of privacy_level servers, as well as the value at
+// 0, determines the polynomial for each query, so those servers' shares
+// can be anything at all that looks random to them; we let them be the
+// output of the PRG on a seed each server is sent in place of its
+// share (stream q of the PRG for query q), and interpolate the other
+// servers' shares from them.  Any privacy_level servers still see
+// uniformly random shares, as any privacy_level shares of a random
+// polynomial are.
+int PIRRequest::seeded_query(vector<string> &requeststrs,
+		const vector<unsigned int> &bucketnums, vector<bool> &seeded)
+{
+    size_t numqs = bucketnums.size();
+    size_t num_buckets = _metadata_current.num_buckets;
+    unsigned int num_seeded = _privacy_level;
+
+    // Choose which servers get seeds, at random, so that no one server
+    // always does the expansion
+    vector<unsigned int> order(_num_servers);
+    for (unsigned int j=0; j<_num_servers; ++j) order[j] = j;
+    for (unsigned int i=0; i<num_seeded; ++i) {
+	unsigned int r;
+	random_bytes((unsigned char *) &r, sizeof(r));
+	unsigned int pick = i + r % (_num_servers - i);
+	unsigned int tmp = order[i];
+	order[i] = order[pick];
+	order[pick] = tmp;
+    }
+
+    // The points the polynomials are fixed at: 0, and the seeded
+    // servers'
+    vector<unsigned char> points(num_seeded + 1, 0);
+    vector<unsigned char> seeds(num_seeded * PIRSEED_BYTES);
+    random_bytes(&seeds[0], seeds.size());
+    for (unsigned int i=0; i<num_seeded; ++i) {
+	unsigned int j = order[i];
+	seeded[j] = true;
+	points[i+1] = (unsigned char)(j+1);
+	requeststrs[j].append((const char *) &seeds[i * PIRSEED_BYTES],
+	    PIRSEED_BYTES);
+    }
+
+    // The Lagrange coefficients for each of the other servers' points
+    unsigned int num_full = _num_servers - num_seeded;
+    vector<unsigned char> coeffs(num_full * (num_seeded + 1));
+    for (unsigned int f=0; f<num_full; ++f) {
+	unsigned int j = order[num_seeded + f];
+	GF28::lagrange(&coeffs[f * (num_seeded + 1)], &points[0],
+	    num_seeded + 1, (unsigned char)(j+1));
+	requeststrs[j].resize(2 + numqs * num_buckets);
+    }
+
+    vector<unsigned char> expanded(num_seeded * num_buckets);
+    for (size_t q=0; q<numqs; ++q) {
+	for (unsigned int i=0; i<num_seeded; ++i) {
+	    if (PRG(&expanded[i * num_buckets], num_buckets,
+		    &seeds[i * PIRSEED_BYTES], q)) {
+		return -1;
+	    }
+	}
+	for (unsigned int f=0; f<num_full; ++f) {
+	    unsigned int j = order[num_seeded + f];
+	    const unsigned char *c = &coeffs[f * (num_seeded + 1)];
+	    unsigned char *share =
+		(unsigned char *) &requeststrs[j][2 + q * num_buckets];
+	    memset(share, 0, num_buckets);
+	    for (unsigned int i=0; i<num_seeded; ++i) {
+		GF28::mul_add(share, &expanded[i * num_buckets], num_buckets,
+		    c[i+1]);
+	    }
+	    share[bucketnums[q]] ^= c[0];
+	}
+    }
+    return 0;
+}
+
+// The DPF version of pir_query.  requeststrs already holds the count
+// of queries for each of the two servers.  Return 0 on success, non-0
+// on failure.
+//
+// Each query is a pair of DPF keys for the point function at the
+// bucket wanted, one key for each server.  Each server evaluates its
+// key at every bucket and replies with the XOR of the buckets where
+// the result is 1; the two results differ only at the bucket wanted,
+// so the XOR of the two replies is that bucket.
+int PIRRequest::dpf_query(vector<string> &requeststrs,
+		const vector<unsigned int> &bucketnums)
+{
+    if (_num_servers != 2) {
+	return -1;
+    }
+    size_t numqs = bucketnums.size();
+    unsigned int num_buckets = _metadata_current.num_buckets;
+    size_t keylen = DPF::key_bytes(num_buckets);
+    requeststrs[0].resize(2 + numqs * keylen);
+    requeststrs[1].resize(2 + numqs * keylen);
+    for (size_t q=0; q<numqs; ++q) {
+	if (DPF::gen((unsigned char *) &requeststrs[0][2 + q * keylen],
+		(unsigned char *) &requeststrs[1][2 + q * keylen],
+		num_buckets, bucketnums[q])) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+// The Chor version of pir_query.  requeststrs already holds the count
+// of queries for each server.  Return 0 on success, non-0 on failure.
+//
+// Each query is a bit vector with a bit per bucket for each server.
+// All but the last server's are uniformly random, and the last
+// server's is chosen so that the XOR of them all is the unit vector
+// picking out the bucket wanted.  Each server replies with the XOR of
+// the buckets whose bits are set, so the XOR of all the replies is
+// that bucket; any num_servers-1 of the servers together learn
+// nothing about it.
+int PIRRequest::chor_query(vector<string> &requeststrs,
+		const vector<unsigned int> &bucketnums)
+{
+    if (_num_servers < 2) {
+	return -1;
+    }
+    size_t numqs = bucketnums.size();
+    size_t bitslen = (_metadata_current.num_buckets + 7) / 8;
+    unsigned int last = _num_servers - 1;
+    for (unsigned int j=0; j<_num_servers; ++j) {
+	requeststrs[j].resize(2 + numqs * bitslen);
+    }
+    if (numqs == 0) {
+	return 0;
+    }
+    unsigned char *lastbits = (unsigned char *) &requeststrs[last][2];
+    memset(lastbits, 0, numqs * bitslen);
+    for (unsigned int j=0; j<last; ++j) {
+	unsigned char *bits = (unsigned char *) &requeststrs[j][2];
+	random_bytes(bits, numqs * bitslen);
+	GF28::add(lastbits, bits, numqs * bitslen);
+    }
+    for (size_t q=0; q<numqs; ++q) {
+	lastbits[q * bitslen + (bucketnums[q] >> 3)] ^=
+	    1 << (bucketnums[q] & 7);
+    }
+    return 0;
+}
+
+// The DPF and Chor versions of pir_response: the buckets are the XOR
+// of all the servers' responses.  There is no redundancy to correct
+// errors with: every server must answer, and honestly.  Return 0 on
+// success, non-0 on failure.
+int PIRRequest::xor_response(vector<string> &buckets,
+		const vector<string> &responses) const
+{
+    size_t block_size = _metadata_current.bucket_size * _record_size;
+    size_t reply_size = _num_queries * block_size;
+    if (reply_size == 0) {
+	return -1;
+    }
     for (unsigned int j=0; j<_num_servers; ++j) {
-	if (!err) {
-	    requeststrs.push_back(((stringstream*)(osvec[j]))->str());
+	if (responses[j].length() != reply_size) {
+	    return -1;
 	}
-	delete osvec[j];
-	osvec[j] = NULL;
     }
 
-    return err;
+    string sum(responses[0]);
+    for (unsigned int j=1; j<_num_servers; ++j) {
+	GF28::add((unsigned char *) &sum[0],
+	    (const unsigned char *) responses[j].data(), reply_size);
+    }
+    buckets.resize(_num_queries);
+    for (unsigned int q=0; q<_num_queries; ++q) {
+	buckets[q].assign(sum, q * block_size, block_size);
+    }
+    return 0;
 }
 
 // The glue API to the PIR layer.  Pass the responses from the
@@ -65,7 +531,7 @@ int PIRRequest::pir_query(vector<string> &requeststrs,
 // contents of the buckets indexed by bucketnums.  Return 0 on
 // success, non-0 on failure.
 int PIRRequest::pir_response(vector<string> &buckets,
-		const vector<string> &responses)
+		const vector<string> &responses) const
 {
     int err = -1;
 
@@ -87,38 +553,359 @@ int PIRRequest::pir_response(vector<string> &buckets,
 	return 0;
     }
 
-    // Receive the replies
-    vector<istream *> isvec;
-    for (unsigned int i=0; i<_num_servers;++i) {
-	isvec.push_back(new stringstream(responses[i]));
+    if (_metadata_current.pir_backend != PIR_BACKEND_PERCY) {
+	return xor_response(buckets, responses);
     }
 
-    unsigned int num_replies = _pirclient->receive_replies(
-				    _request_identifier, isvec);
+    // In the usual case, where every server answered honestly, the
+    // replies are all points on one polynomial of degree
+    // privacy_level, and there is nothing to correct.
+    if (!_fast_decode || fast_response(buckets, responses) != 0) {
+	err = robust_response(buckets, responses);
+	if (err) {
+	    return err;
+	}
+    }
 
-    for (unsigned int i=0; i<_num_servers;++i) {
-	delete isvec[i];
-	isvec[i] = NULL;
+    // A batch query fetched one bucket per partition; pick out the ones
+    // asked for, in the order they were asked for
+    if (_batched) {
+	vector<string> parts;
+	parts.swap(buckets);
+	buckets.resize(_batch_slots.size());
+	for (size_t i=0; i<_batch_slots.size(); ++i) {
+	    buckets[i] = parts[_batch_slots[i]];
+	}
     }
-    isvec.clear();
+    return 0;
+}
 
-    // The minimum number of servers that must be honest for us to
-    // recover the data.  Let's just do the simplest thing for now.
-    unsigned int min_honest = (num_replies + _privacy_level) / 2 + 1;
+// The servers whose responses are the right length for the current
+// request
+static void well_formed_servers(vector<unsigned int> &servers,
+    vector<unsigned char> &alphas, const vector<string> &responses,
+    size_t reply_size)
+{
+    servers.clear();
+    alphas.clear();
+    for (unsigned int j=0; j<responses.size(); ++j) {
+	if (responses[j].length() == reply_size) {
+	    servers.push_back(j);
+	    alphas.push_back((unsigned char)(j+1));
+	}
+    }
+}
 
-    // Process the replies.
-    vector<PercyBlockResults> pirres;
-    _pirclient->process_replies(min_honest);
-    _pirclient->get_result(_request_identifier, pirres);
+// Try to recover the buckets by interpolating the first
+// reply_degree()+1 well-formed responses, and checking the rest against
+// the result.  Return 0 on success, non-0 if there are too few
+// responses or they do not all agree, in which case robust_response
+// must do the decoding.
+//
+// The reply from server j to the query for bucket b is, word by word,
+// the value at j+1 of a polynomial of degree reply_degree() whose
+// value at 0 is the contents of bucket b.  Any reply_degree()+1 replies
+// determine that polynomial, so if all the others lie on it too,
+// there is nothing for an error-correcting decoder to do.
+int PIRRequest::fast_response(vector<string> &buckets,
+		const vector<string> &responses) const
+{
+    size_t block_size = _metadata_current.bucket_size * _record_size;
+    size_t reply_size = _num_queries * block_size;
+    if (reply_size == 0) {
+	return -1;
+    }
 
-    err = 0;
-    buckets.clear();
-    size_t num_res = pirres.size();
-    for (size_t r=0; r<num_res; ++r) {
-	if (pirres[r].results.size() == 1) {
-	    buckets.push_back(pirres[r].results[0].sigma);
+    // The servers that answered, and the points at which they did
+    vector<unsigned int> servers;
+    vector<unsigned char> alphas;
+    well_formed_servers(servers, alphas, responses, reply_size);
+    unsigned int needed = reply_degree() + 1;
+    if (servers.size() < needed) {
+	return -1;
+    }
+
+    // Check each of the other replies against the interpolation of the
+    // first needed of them
+    vector<unsigned char> coeffs(needed);
+    string expected(reply_size, '\0');
+    for (size_t k=needed; k<servers.size(); ++k) {
+	GF28::lagrange(&coeffs[0], &alphas[0], needed, alphas[k]);
+	memset(&expected[0], 0, reply_size);
+	for (unsigned int j=0; j<needed; ++j) {
+	    GF28::mul_add((unsigned char *) &expected[0],
+		(const unsigned char *) responses[servers[j]].data(),
+		reply_size, coeffs[j]);
+	}
+	if (expected != responses[servers[k]]) {
+	    return -1;
+	}
+    }
+
+    // They agree; the buckets are the values at 0
+    GF28::lagrange(&coeffs[0], &alphas[0], needed, 0);
+    buckets.assign(_num_queries, string(block_size, '\0'));
+    for (unsigned int q=0; q<_num_queries; ++q) {
+	unsigned char *out = (unsigned char *) &buckets[q][0];
+	for (unsigned int j=0; j<needed; ++j) {
+	    GF28::mul_add(out, (const unsigned char *)
+		responses[servers[j]].data() + q * block_size,
+		block_size, coeffs[j]);
+	}
+    }
+    return 0;
+}
+
+// Decode one word of the servers' replies with the Berlekamp-Welch
+// decoder.  received[k] is the value at alphas[k] of a polynomial of
+// the given degree, for all but at most max_errors of the n values of
+// k.  Put the polynomial's value at each alphas[k] into values[k].
+// Return 0 on success, non-0 if there are more than max_errors errors.
+//
+// With e = max_errors, we solve for an error locator E, monic of
+// degree e, and a polynomial Q of degree at most e + degree, with
+// Q(alphas[k]) = received[k] * E(alphas[k]) for every k.  As long as
+// there are at most e errors, any solution has Q = P * E for the
+// polynomial P we are after.
+static int berlekamp_welch(unsigned char *values,
+    const unsigned char *alphas, const unsigned char *received,
+    unsigned int n, unsigned int degree, unsigned int max_errors)
+{
+    unsigned int e = max_errors;
+    unsigned int qlen = e + degree + 1;
+    // The unknowns: Q's coefficients, then E's below x^e
+    unsigned int cols = qlen + e;
+    if (n < cols) {
+	return -1;
+    }
+
+    // One equation per server, with the right-hand side
+    // received[k] * alphas[k]^e in the last column
+    vector<vector<unsigned char> > rows(n,
+	vector<unsigned char>(cols + 1));
+    for (unsigned int k=0; k<n; ++k) {
+	unsigned char xpow = 1;
+	for (unsigned int i=0; i<qlen; ++i) {
+	    rows[k][i] = xpow;
+	    if (i < e) {
+		rows[k][qlen + i] = GF28::mul(received[k], xpow);
+	    } else if (i == e) {
+		rows[k][cols] = GF28::mul(received[k], xpow);
+	    }
+	    xpow = GF28::mul(xpow, alphas[k]);
+	}
+    }
+
+    // Gauss-Jordan elimination; unknowns without a pivot are left 0
+    vector<int> pivot_row(cols, -1);
+    unsigned int r = 0;
+    for (unsigned int c=0; c<cols && r<n; ++c) {
+	unsigned int p = r;
+	while (p < n && rows[p][c] == 0) ++p;
+	if (p == n) continue;
+	rows[p].swap(rows[r]);
+	unsigned char inv = GF28::inv(rows[r][c]);
+	for (unsigned int j=c; j<=cols; ++j) {
+	    rows[r][j] = GF28::mul(rows[r][j], inv);
+	}
+	for (unsigned int i=0; i<n; ++i) {
+	    if (i != r && rows[i][c] != 0) {
+		GF28::mul_add(&rows[i][c], &rows[r][c], cols + 1 - c,
+		    rows[i][c]);
+	    }
+	}
+	pivot_row[c] = r++;
+    }
+    for (unsigned int i=r; i<n; ++i) {
+	if (rows[i][cols] != 0) {
+	    // No solution: too many errors
+	    return -1;
+	}
+    }
+    vector<unsigned char> q(qlen, 0), locator(e + 1, 0);
+    for (unsigned int c=0; c<cols; ++c) {
+	unsigned char v = pivot_row[c] >= 0 ? rows[pivot_row[c]][cols] : 0;
+	if (c < qlen) {
+	    q[c] = v;
 	} else {
-	    buckets.push_back(string());
+	    locator[c - qlen] = v;
+	}
+    }
+    locator[e] = 1;
+
+    // P = Q / E, which must leave no remainder
+    vector<unsigned char> poly(degree + 1, 0);
+    for (int i=qlen-1; i>=(int) e; --i) {
+	unsigned char coeff = q[i];
+	poly[i - e] = coeff;
+	if (coeff != 0) {
+	    for (unsigned int j=0; j<=e; ++j) {
+		q[i - e + j] ^= GF28::mul(coeff, locator[j]);
+	    }
+	}
+    }
+    for (unsigned int i=0; i<e; ++i) {
+	if (q[i] != 0) {
+	    return -1;
+	}
+    }
+
+    unsigned int errors = 0;
+    for (unsigned int k=0; k<n; ++k) {
+	unsigned char v = 0;
+	for (int i=degree; i>=0; --i) {
+	    v = GF28::mul(v, alphas[k]) ^ poly[i];
+	}
+	values[k] = v;
+	if (v != received[k]) {
+	    ++errors;
+	}
+    }
+    return errors > e ? -1 : 0;
+}
+
+// Recover the buckets from responses of which at most
+// (num_replies - reply_degree() - 1) / 2 are wrong.  Return 0 on
+// success, non-0 on failure.
+//
+// An honest server's whole reply to a query lies on the polynomial
+// whose value at 0 is the bucket.  Query by query, we interpolate from
+// reply_degree()+1 servers, trying first those whose replies to the
+// previous query were right, and accept the result if the replies of
+// at least min_honest servers agree with it: any two polynomials of
+// degree reply_degree() with that much support share reply_degree()+1
+// points, so they are the same, and the answer is unique.  Otherwise
+// there is a word of the reply that fewer than min_honest servers
+// agree on; Berlekamp-Welch decoding of just that word shows which
+// servers have it wrong, at least one of which we interpolated from,
+// and we try again without them.  So there are at most
+// (num_replies - reply_degree() + 1) / 2 tries per query.
+int PIRRequest::robust_response(vector<string> &buckets,
+		const vector<string> &responses) const
+{
+    size_t block_size = _metadata_current.bucket_size * _record_size;
+    size_t reply_size = _num_queries * block_size;
+    if (reply_size == 0) {
+	return -1;
+    }
+
+    vector<unsigned int> servers;
+    vector<unsigned char> alphas;
+    well_formed_servers(servers, alphas, responses, reply_size);
+    unsigned int num_replies = servers.size();
+    unsigned int degree = reply_degree();
+    unsigned int needed = degree + 1;
+    if (num_replies < needed) {
+	return -1;
+    }
+
+    // The minimum number of servers that must be honest for us to
+    // recover the data.  Let's just do the simplest thing for now.
+    unsigned int min_honest = (num_replies + degree) / 2 + 1;
+    if (min_honest > num_replies) {
+	return -1;
+    }
+
+    // Indices into servers, in the order to try interpolating from them
+    vector<unsigned int> order(num_replies);
+    for (unsigned int k=0; k<num_replies; ++k) order[k] = k;
+
+    int err = 0;
+    buckets.assign(_num_queries, string());
+    vector<unsigned char> coeffs(needed);
+    vector<unsigned int> subset(needed);
+    vector<unsigned char> subset_alphas(needed);
+    string expected(block_size, '\0');
+    vector<unsigned int> word_agree(block_size);
+    vector<bool> agrees(num_replies), ruled_out(num_replies);
+    vector<unsigned char> word(num_replies), decoded(num_replies);
+    for (unsigned int q=0; q<_num_queries; ++q) {
+	size_t offset = q * block_size;
+	ruled_out.assign(num_replies, false);
+	bool found = false;
+	for (;;) {
+	    unsigned int chosen = 0;
+	    for (unsigned int i=0; i<num_replies && chosen<needed; ++i) {
+		if (!ruled_out[order[i]]) {
+		    subset[chosen++] = order[i];
+		}
+	    }
+	    if (chosen < needed) break;
+	    for (unsigned int i=0; i<needed; ++i) {
+		subset_alphas[i] = alphas[subset[i]];
+	    }
+
+	    // Count the replies that agree with this subset's
+	    // interpolation, in full and word by word
+	    unsigned int agree = 0;
+	    word_agree.assign(block_size, 0);
+	    for (unsigned int k=0; k<num_replies; ++k) {
+		GF28::lagrange(&coeffs[0], &subset_alphas[0], needed,
+		    alphas[k]);
+		memset(&expected[0], 0, block_size);
+		for (unsigned int i=0; i<needed; ++i) {
+		    GF28::mul_add((unsigned char *) &expected[0],
+			(const unsigned char *)
+			responses[servers[subset[i]]].data() + offset,
+			block_size, coeffs[i]);
+		}
+		const char *reply = responses[servers[k]].data() + offset;
+		agrees[k] = true;
+		for (size_t b=0; b<block_size; ++b) {
+		    if (reply[b] == expected[b]) {
+			++word_agree[b];
+		    } else {
+			agrees[k] = false;
+		    }
+		}
+		if (agrees[k]) ++agree;
+	    }
+
+	    if (agree >= min_honest) {
+		GF28::lagrange(&coeffs[0], &subset_alphas[0], needed, 0);
+		buckets[q].assign(block_size, '\0');
+		for (unsigned int i=0; i<needed; ++i) {
+		    GF28::mul_add((unsigned char *) &buckets[q][0],
+			(const unsigned char *)
+			responses[servers[subset[i]]].data() + offset,
+			block_size, coeffs[i]);
+		}
+		found = true;
+
+		// Start the next query with the servers that were right
+		vector<unsigned int> next;
+		for (unsigned int i=0; i<num_replies; ++i) {
+		    if (agrees[order[i]]) next.push_back(order[i]);
+		}
+		for (unsigned int i=0; i<num_replies; ++i) {
+		    if (!agrees[order[i]]) next.push_back(order[i]);
+		}
+		order.swap(next);
+		break;
+	    }
+
+	    // Decode a word too few replies agree on, and rule out the
+	    // servers that have it wrong
+	    size_t b = 0;
+	    while (b < block_size && word_agree[b] >= min_honest) ++b;
+	    if (b == block_size) break;
+	    for (unsigned int k=0; k<num_replies; ++k) {
+		word[k] = responses[servers[k]][offset + b];
+	    }
+	    if (berlekamp_welch(&decoded[0], &alphas[0], &word[0],
+		    num_replies, degree, num_replies - min_honest) != 0) {
+		break;
+	    }
+	    bool progress = false;
+	    for (unsigned int k=0; k<num_replies; ++k) {
+		if (word[k] != decoded[k] && !ruled_out[k]) {
+		    ruled_out[k] = true;
+		    progress = true;
+		}
+	    }
+	    if (!progress) break;
+	}
+	if (!found) {
 	    err = -1;
 	}
     }
@@ -132,8 +919,12 @@ void GenericLookupClient<BuddyKey,MyPrivKey>::metadata_request(string &msgtosend
     metadata_request_message[0] = 0xff;
     epoch_num_to_bytes(metadata_request_message+1, epoch);
 
-    // Keep track of the current metadata request epoch
-    _metadata_request_epoch = epoch;
+    // Keep track of the outstanding metadata request epochs, forgetting
+    // the oldest of any whose replies never came
+    _metadata_request_epochs.insert(epoch);
+    while (_metadata_request_epochs.size() > METADATA_CACHE_EPOCHS) {
+        _metadata_request_epochs.erase(_metadata_request_epochs.begin());
+    }
 
     // Output this message
     msgtosend.assign((char *)metadata_request_message, 1+EPOCH_BYTES);
@@ -143,32 +934,76 @@ void GenericLookupClient<BuddyKey,MyPrivKey>::metadata_request(string &msgtosend
 // non-0 on failure.
 template<typename BuddyKey, typename MyPrivKey>
 int GenericLookupClient<BuddyKey,MyPrivKey>::metadata_reply(const string &metadata){
-    // were we expecting a response at all?
-    if (_metadata_request_epoch == 0) return 0x04;
+    Metadata md;
+    int err = parse_metadata(md, metadata);
+    if (err != 0x00) return err;
+
+    // Keep the PIR engine if the metadata is unchanged
+    if (md.toString() != _metadata.toString()) {
+        _metadata = md;
+        _pir_engine = PIREngineRef();
+    }
+    return 0x00;
+}
 
-    const unsigned char* msgdata = (const unsigned char*) metadata.data();
+// Consume the reply to a metadata request made ahead of time, caching
+// it without making it current
+template<typename BuddyKey, typename MyPrivKey>
+int GenericLookupClient<BuddyKey,MyPrivKey>::metadata_prefetch(
+    const string &metadata)
+{
+    Metadata md;
+    return parse_metadata(md, metadata);
+}
+
+// If validated metadata for epoch is cached, make it current
+template<typename BuddyKey, typename MyPrivKey>
+bool GenericLookupClient<BuddyKey,MyPrivKey>::use_cached_metadata(
+    Epoch epoch)
+{
+    typename map<Epoch, Metadata>::const_iterator it =
+        _metadata_cache.find(epoch);
+    if (it == _metadata_cache.end()) return false;
 
+    if (it->second.toString() != _metadata.toString()) {
+        _metadata = it->second;
+        _pir_engine = PIREngineRef();
+    }
+    return true;
+}
+
+// Parse, check and cache the reply to a metadata request
+template<typename BuddyKey, typename MyPrivKey>
+int GenericLookupClient<BuddyKey,MyPrivKey>::parse_metadata(
+    Metadata &md, const string &metadata)
+{
+    // were we expecting a response at all?
+    if (_metadata_request_epochs.empty()) return 0x04;
 
     // Check input: The server returned an error.
-    if (msgdata[0] == 0x00) return 0x01;
+    if (metadata.empty() || metadata[0] == 0x00) return 0x01;
 
-    if (_metadata.fromString(metadata) != 0) {
+    if (md.fromString(metadata) != 0) {
         return 0x02; // malformed message
     }
 
-    int err = _metadata.valid();
+    int err = md.valid();
     if (!err) {
         cout << "Metadata error " << err << "\n";
         return 0x03;
     }
 
 
-    // Check epoch: not the epoch we expected strangely
+    // Check epoch: not an epoch we asked for, strangely
     // TODO: should we somehow tell the client that they need to sync?
-    if (_metadata.epoch != _metadata_request_epoch) return 0x05;
+    if (_metadata_request_epochs.erase(md.epoch) == 0) return 0x05;
 
-    // Reset the state
-    _metadata_request_epoch = 0;
+    // Keep it for later lookups in the same epoch, dropping the
+    // oldest
+    _metadata_cache[md.epoch] = md;
+    while (_metadata_cache.size() > METADATA_CACHE_EPOCHS) {
+        _metadata_cache.erase(_metadata_cache.begin());
+    }
 
     return 0x00;
 }
@@ -177,29 +1012,171 @@ int GenericLookupClient<BuddyKey,MyPrivKey>::metadata_reply(const string &metada
 
 // Specialized for the link-based lookup client
 template<>
-int GenericLookupClient<PubKey,PrivKey>::buddy_hash_key(HashKey hashkey,
-    const PubKey & pubkey)
+int GenericLookupClient<PubKey,PrivKey>::buddy_keys(
+    vector<Request::BuddyState> & states)
 {
-    // Get the long terms shared DH key
-    unsigned char shared_dh_secret[PUBKEY_BYTES];
-    diffie_hellman(shared_dh_secret, _privkey,
-            pubkey);
+    byte epoch_bytes[EPOCH_BYTES];
+    epoch_num_to_bytes(epoch_bytes, _metadata.epoch);
+    const byte *mypub = _key_cache.pubkey();
+
+    for (size_t i = 0; i < states.size(); i++) {
+        Request::BuddyState & state = states[i];
 
-    // Derive the epoch keys
-    DataKey data_key;
-    SharedKey shared_key;
-    H1H2(shared_key, data_key, _metadata.epoch,
-            pubkey, shared_dh_secret);
+        // The epoch keys, derived from the long-term shared DH key (both
+        // usually already computed)
+        BuddyKeyCache::EpochKeys keys;
+        _key_cache.epoch_keys(keys, _metadata.epoch, state.pubkey);
 
-    H3(hashkey, _metadata.epoch, shared_key);
+        memmove(state.key, keys.hash_key, HASHKEY_BYTES);
+        memmove(state.data_key, keys.data_key, DATAKEY_BYTES);
+
+        state.ad.reserve(sizeof(epoch_bytes) + PUBKEY_BYTES +
+            SHAREDKEY_BYTES);
+        state.ad.assign((char *) epoch_bytes, sizeof(epoch_bytes));
+        state.ad.append((const char *) mypub, PUBKEY_BYTES);
+        state.ad.append((char *) keys.shared_key, SHAREDKEY_BYTES);
+    }
 
     return 0;
 }
 
 template<>
-int GenericLookupClient<BLSPubKey,Empty>::buddy_hash_key(HashKey hashkey,
-    const BLSPubKey & pubkey) {
-    return hash_key_from_pk(hashkey, pubkey, _metadata.epoch);
+int GenericLookupClient<BLSPubKey,Empty>::buddy_keys(
+    vector<Request::BuddyState> & states)
+{
+    byte epoch_bytes[EPOCH_BYTES];
+    epoch_num_to_bytes(epoch_bytes, _metadata.epoch);
+
+    // Each hash key takes a pairing, so get them all at once
+    vector<BLSPubKey> pubkeys(states.size());
+    for (size_t i = 0; i < states.size(); i++) {
+        pubkeys[i] = states[i].pubkey;
+    }
+    vector<CombinedKeyCache::EpochKeys> keys;
+    if (_key_cache.epoch_keys(keys, _metadata.epoch, pubkeys) != 0)
+        return -1;
+
+    for (size_t i = 0; i < states.size(); i++) {
+        Request::BuddyState & state = states[i];
+
+        memmove(state.key, keys[i].hash_key, HASHKEY_BYTES);
+        memmove(state.data_key, keys[i].data_key, DATAKEY_BYTES);
+
+        state.ad.reserve(sizeof(epoch_bytes) + BLSPubKey::size);
+        state.ad.assign((char *) epoch_bytes, sizeof(epoch_bytes));
+        state.ad.append((const char *) (const byte *) state.pubkey,
+            BLSPubKey::size);
+    }
+
+    return 0;
+}
+
+// Fill in plans with the ways of carrying out a lookup of
+// buckets_to_query buckets with the current metadata.  The byte
+// counts are 64-bit, as the database of a large epoch can be bigger
+// than 4 GB.
+template<typename BuddyKey, typename MyPrivKey>
+void GenericLookupClient<BuddyKey,MyPrivKey>::lookup_plans(
+    vector<LookupPlan> &plans, unsigned int buckets_to_query,
+    unsigned int num_servers, unsigned int privacy_level) const
+{
+    const uint64_t header_bytes = 1 + EPOCH_BYTES;
+    const uint64_t block_bytes = (uint64_t) _metadata.bucket_size *
+        (HASHKEY_BYTES + _metadata.dataenc_bytes);
+    const uint64_t database_bytes = _metadata.num_buckets * block_bytes;
+    const uint64_t num_buckets = _metadata.num_buckets;
+    const uint64_t q = buckets_to_query;
+    unsigned int words_per_byte = pir_words_per_byte(_metadata.pir_backend);
+
+    plans.clear();
+    plans.reserve(3 + _metadata.pir_depth);
+    LookupPlan plan;
+    plan.sent_bytes.assign(num_servers, 0);
+    plan.received_bytes.assign(num_servers, 0);
+    plan.server_work.assign(num_servers, 0);
+    plan.client_work = q * block_bytes;
+
+    // The whole database from a server chosen at random
+    unsigned int rand;
+    random_bytes((unsigned char *) &rand, sizeof(rand));
+    unsigned int target = rand % num_servers;
+    plan.method = LookupPlan::DOWNLOAD;
+    plan.sent_bytes[target] = header_bytes;
+    plan.received_bytes[target] = header_bytes + database_bytes;
+    plan.replies_needed = 1;
+    plans.push_back(plan);
+
+    // An equal stripe of it from each server
+    if (num_servers > 1) {
+        plan.method = LookupPlan::RANGED_DOWNLOAD;
+        for (unsigned int j = 0; j < num_servers; j++) {
+            uint64_t stripe = num_buckets * (j + 1) / num_servers -
+                num_buckets * j / num_servers;
+            plan.sent_bytes[j] = header_bytes + 2 * UINT_BYTES;
+            plan.received_bytes[j] = header_bytes + stripe * block_bytes;
+        }
+        plan.replies_needed = num_servers;
+        plans.push_back(plan);
+    }
+
+    // PIR queries; every server's reply holds a block per query
+    plan.method = LookupPlan::PIR;
+    plan.server_work.assign(num_servers, q * database_bytes);
+    plan.received_bytes.assign(num_servers, header_bytes + q * block_bytes);
+    if (_metadata.pir_backend == PIR_BACKEND_DPF) {
+        // Each of the two servers is sent a short key per bucket
+        if (num_servers != 2) return;
+        plan.sent_bytes.assign(num_servers, header_bytes + 2 +
+            q * DPF::key_bytes(_metadata.num_buckets));
+        plan.replies_needed = num_servers;
+    } else if (_metadata.pir_backend == PIR_BACKEND_CHOR) {
+        // Every server is sent a bit per bucket
+        if (num_servers < 2) return;
+        plan.sent_bytes.assign(num_servers, header_bytes + 2 +
+            q * ((num_buckets + words_per_byte - 1) / words_per_byte));
+        plan.replies_needed = num_servers;
+    } else if (_metadata.batch_pir && buckets_to_query == MAX_BUDDIES) {
+        // A full-size batch query asks each partition of the batch code
+        // for a bucket, and the partitions together hold each bucket
+        // NUM_HASHES times
+        uint64_t partitions = BatchCode::num_partitions_for(MAX_BUDDIES);
+        plan.sent_bytes.assign(num_servers, header_bytes + 2 +
+            BatchCode::NUM_HASHES * num_buckets);
+        plan.received_bytes.assign(num_servers,
+            header_bytes + partitions * block_bytes);
+        plan.server_work.assign(num_servers,
+            BatchCode::NUM_HASHES * database_bytes);
+        plan.replies_needed = privacy_level + 1;
+    } else {
+        // privacy_level of the servers are sent just a seed in place of
+        // their query; which ones is chosen at random, so share the
+        // cost out evenly
+        uint64_t full_queries = num_servers;
+        if (privacy_level < num_servers) full_queries -= privacy_level;
+        plan.sent_bytes.assign(num_servers, header_bytes + 2 +
+            (full_queries * q * (num_buckets / words_per_byte) +
+             (num_servers - full_queries) * PIRSEED_BYTES) / num_servers);
+        plan.replies_needed = privacy_level + 1;
+    }
+    plan.client_work = plan.replies_needed *
+        (plan.received_bytes[0] - header_bytes);
+    plans.push_back(plan);
+
+    // A recursive query of depth d is d sides of a d-dimensional
+    // cube of buckets long, but needs d * privacy_level + 1
+    // servers to answer it
+    if (_metadata.pir_backend != PIR_BACKEND_PERCY) return;
+    plan.server_work.assign(num_servers, q * database_bytes);
+    plan.received_bytes.assign(num_servers, header_bytes + q * block_bytes);
+    for (unsigned int d = 2; d <= _metadata.pir_depth &&
+            d * privacy_level < num_servers; ++d) {
+        plan.pir_depth = d;
+        plan.sent_bytes.assign(num_servers, header_bytes + 3 +
+            q * d * pir_cube_side(_metadata.num_buckets, d));
+        plan.replies_needed = d * privacy_level + 1;
+        plan.client_work = plan.replies_needed * q * block_bytes;
+        plans.push_back(plan);
+    }
 }
 
 // Look up some number of buddies.  Pass in the vector of buddies'
@@ -224,93 +1201,257 @@ int GenericLookupClient<BuddyKey,MyPrivKey>::lookup_request(
     if (!_metadata.valid())
         return 0x02; // No up to date metadata!.
 
-    // Placeholder for the output message
-    vector<string> labels;
+    vector<typename Request::BuddyState> buddy_states;
+    vector<unsigned int> BIs;
+    if (buddy_states_for(buddy_states, BIs, buddies) != 0)
+        return 0x03;    // error computing hash key
 
-    PRF bucket_mapping(_metadata.prfkey, _metadata.num_buckets);
-    std::set<unsigned int> BIs;
-    vector<typename LookupRequest<BuddyKey,MyPrivKey>::BuddyState>
-        buddy_states(buddies.size());
+    int err = init_request(req, buddy_states, BIs.size(), num_servers,
+        privacy_level);
+    if (err != 0x00) return err;
 
-    // For each real buddy
-    for(unsigned int i = 0; i < buddies.size(); i++)
-    {
-        buddy_states[i].pubkey = buddies[i];
-        if (buddy_hash_key(buddy_states[i].key, buddies[i]) != 0)
+    // Clients typically look up the same buddies every epoch
+    _key_cache.precompute(_metadata.epoch + 1, buddies);
+    return 0x00;
+}
+
+// Look up the buddies of several identities at once.  Identities are
+// added to a request, in order, until the next one's buckets would
+// take it past MAX_BUDDIES distinct buckets; that identity starts the
+// next request.  Return 0 on success, non-0 on failure.
+template<typename BuddyKey, typename MyPrivKey>
+int GenericLookupClient<BuddyKey,MyPrivKey>::multi_lookup_request(
+    MultiRequest & req, const vector<GenericLookupClient *> & clients,
+    const vector<vector<BuddyKey> > & buddies,
+    unsigned int num_servers, unsigned int privacy_level)
+{
+    // Check inputs
+    if (clients.empty() || clients.size() != buddies.size())
+        return 0x05; // Not one buddy list per client
+
+    GenericLookupClient &lead = *clients[0];
+    if (!lead._metadata.valid())
+        return 0x02; // No up to date metadata!.
+    string lead_metadata = lead._metadata.toString();
+    for (unsigned int k = 0; k < clients.size(); k++) {
+        if (buddies[k].size() > MAX_BUDDIES)
+            return 0x01; // Number of buddies exceeds maximum.
+        if (clients[k]->_metadata.toString() != lead_metadata)
+            return 0x02; // Clients disagree on the metadata
+    }
+
+    req._requests.clear();
+    req._identity_request.clear();
+    req._identity_offset.clear();
+    req._identity_count.clear();
+
+    vector<typename Request::BuddyState> group_states;
+    vector<unsigned int> group_buckets;
+    for (unsigned int k = 0; k < clients.size(); k++) {
+        vector<typename Request::BuddyState> states;
+        vector<unsigned int> buckets;
+        if (clients[k]->buddy_states_for(states, buckets, buddies[k]) != 0)
             return 0x03;    // error computing hash key
-        buddy_states[i].bucket = bucket_mapping.M(buddy_states[i].key);
-        BIs.insert(buddy_states[i].bucket);
+
+        vector<unsigned int> merged;
+        set_union(group_buckets.begin(), group_buckets.end(),
+            buckets.begin(), buckets.end(), back_inserter(merged));
+        if (merged.size() > MAX_BUDDIES) {
+            // Too many to add to this request; start another
+            req._requests.push_back(Request());
+            int err = lead.init_request(req._requests.back(), group_states,
+                group_buckets.size(), num_servers, privacy_level);
+            if (err != 0x00) return err;
+            group_states.clear();
+            merged.swap(buckets);
+        }
+        req._identity_request.push_back(req._requests.size());
+        req._identity_offset.push_back(group_states.size());
+        req._identity_count.push_back(states.size());
+        group_states.insert(group_states.end(), states.begin(),
+            states.end());
+        group_buckets.swap(merged);
+    }
+    req._requests.push_back(Request());
+    int err = lead.init_request(req._requests.back(), group_states,
+        group_buckets.size(), num_servers, privacy_level);
+    if (err != 0x00) return err;
+
+    for (unsigned int k = 0; k < clients.size(); k++) {
+        clients[k]->_key_cache.precompute(lead._metadata.epoch + 1,
+            buddies[k]);
     }
+    return 0x00;
+}
 
-    // FIXME: this should check the valid queries variable
-    unsigned int buckets_to_query = MAX_BUDDIES;
-    if (BIs.size() <= 1) buckets_to_query = 1;
+// Fill in states with the keys and bucket of each of buddies in the
+// current epoch, and set buckets to their distinct buckets, in order
+template<typename BuddyKey, typename MyPrivKey>
+int GenericLookupClient<BuddyKey,MyPrivKey>::buddy_states_for(
+    vector<typename Request::BuddyState> & states,
+    vector<unsigned int> & buckets, const vector<BuddyKey> & buddies)
+{
+    states.resize(buddies.size());
+    buckets.clear();
+    buckets.reserve(buddies.size());
+    for(unsigned int i = 0; i < buddies.size(); i++)
+        states[i].pubkey = buddies[i];
+    if (buddy_keys(states) != 0)
+        return -1;
 
-    unsigned int pir_bytes = num_servers * (
-        (_metadata.num_buckets / PIR_WORDS_PER_BYTE) +
-        (_metadata.bucket_size * (HASHKEY_BYTES + _metadata.dataenc_bytes)))
-        * buckets_to_query;
-    unsigned int download_bytes = _metadata.num_buckets *
-        _metadata.bucket_size * (HASHKEY_BYTES + _metadata.dataenc_bytes);
+    PRF bucket_mapping(_metadata.prfkey, _metadata.num_buckets);
+    for(unsigned int i = 0; i < buddies.size(); i++)
+    {
+        states[i].bucket = bucket_mapping.M(states[i].key);
+        buckets.push_back(states[i].bucket);
+    }
+    sort(buckets.begin(), buckets.end());
+    buckets.erase(unique(buckets.begin(), buckets.end()), buckets.end());
+    return 0;
+}
 
-    // Decide if PIR is worth it
-    bool do_PIR = pir_bytes < download_bytes;
-    // printf("Size: pir %i bytes vs. %i bytes", pir_bytes, download_bytes);
+// Choose how to look up the buddies in states, and initialize req to
+// do so
+template<typename BuddyKey, typename MyPrivKey>
+int GenericLookupClient<BuddyKey,MyPrivKey>::init_request(Request & req,
+    vector<typename Request::BuddyState> & states,
+    unsigned int num_buckets, unsigned int num_servers,
+    unsigned int privacy_level)
+{
+    // Pad to the smallest rung of the query-size ladder that fits
+    unsigned int buckets_to_query = _metadata.query_size_for(num_buckets);
+
+    // Let the cost model choose how to do the lookup
+    vector<LookupPlan> plans;
+    lookup_plans(plans, buckets_to_query, num_servers, privacy_level);
+    unsigned int choice = cost_model().choose(plans);
+    if (choice >= plans.size())
+        return 0x04;    // no such plan
+
+    // PIR lookups in the same epoch share an engine
+    if (plans[choice].method == LookupPlan::PIR && !_pir_engine.get()) {
+        _pir_engine = PIREngineRef(new PIREngine(_metadata,
+            HASHKEY_BYTES + _metadata.dataenc_bytes));
+    }
 
     // Seed the request with all necessary keys and information to determine
     // the messages to be sent.
-    req.init(num_servers, privacy_level, _metadata, buddy_states, do_PIR,
-         _privkey);
+    req.init(num_servers, privacy_level, _metadata, states,
+        plans[choice], _privkey, _pir_engine);
     return 0x00;
 }
 
+// Tell the cost model how long each server's reply to req took, and
+// how long req took to decode them
+template<typename BuddyKey, typename MyPrivKey>
+void GenericLookupClient<BuddyKey,MyPrivKey>::observe_lookup(
+    const Request &req, const vector<double> &reply_seconds)
+{
+    LookupCostModel &model = cost_model();
+    const LookupPlan &plan = req.plan();
+    for (unsigned int s = 0; s < reply_seconds.size(); s++) {
+        if (reply_seconds[s] >= 0) {
+            model.observe_reply(plan, s, reply_seconds[s]);
+        }
+    }
+    if (req.decode_seconds() > 0) {
+        model.observe_decode(plan.client_work, req.decode_seconds());
+    }
+}
+
 template<typename BuddyKey, typename MyPrivKey>
 vector<string> LookupRequest<BuddyKey,MyPrivKey>::get_msgs()
 {
-    // Make a sequence of unique buckets
-    map<unsigned int,unsigned int> bucket_map;
+    // Make a sorted sequence of unique buckets; each buddy's position
+    // is its bucket's index in it
     vector<unsigned int> buckets;
+    buckets.reserve(MAX_BUDDIES);
     for(unsigned int i = 0; i < _buddy_states.size(); i++){
-        if (bucket_map.find(_buddy_states[i].bucket) == bucket_map.end()){
-            bucket_map[_buddy_states[i].bucket] = buckets.size();
-            buckets.push_back(_buddy_states[i].bucket);
-        }
-        _buddy_states[i].position = bucket_map[_buddy_states[i].bucket];
+        buckets.push_back(_buddy_states[i].bucket);
+    }
+    sort(buckets.begin(), buckets.end());
+    buckets.erase(unique(buckets.begin(), buckets.end()), buckets.end());
+    for(unsigned int i = 0; i < _buddy_states.size(); i++){
+        _buddy_states[i].position = lower_bound(buckets.begin(),
+            buckets.end(), _buddy_states[i].bucket) - buckets.begin();
     }
 
-    // Determine the number of buckets
-    unsigned int buckets_to_query = MAX_BUDDIES;
-    if (bucket_map.size() <= 1) buckets_to_query = 1;
+    // Determine the number of buckets: the smallest rung of the
+    // query-size ladder that fits
+    unsigned int buckets_to_query = _metadata.query_size_for(buckets.size());
 
     // Pad to the right number of buckets
-    for(unsigned int j = buckets.size(); j < buckets_to_query; j++)
-        buckets.push_back(0);
+    buckets.resize(buckets_to_query, 0);
 
     unsigned char request_header[1+EPOCH_BYTES];
-    if (_do_PIR) { request_header[0] = 0xfe; }
-           else { request_header[0] = 0xfd; }
+    if (_do_PIR) {
+        switch (_metadata.pir_backend) {
+        case PIR_BACKEND_DPF: request_header[0] = 0xfb; break;
+        case PIR_BACKEND_CHOR: request_header[0] = 0xfa; break;
+        default: request_header[0] = 0xfe; break;
+        }
+    } else if (_ranged) {
+        request_header[0] = 0xf7;
+    } else {
+        request_header[0] = 0xfd;
+    }
     epoch_num_to_bytes(request_header+1, _metadata.epoch);
     string header((char *) request_header, 1+EPOCH_BYTES);
 
     // Build the request depending on whether we do PIR or not
     vector<string> requests;
-    if(_do_PIR){
+    if(_do_PIR && _pir_depth > 1) {
 
-        // Get the PIR requests and stick a header on them
-        int err = pir_request.pir_query(requests,buckets);
+        // A recursive query, where that is smallest
+        header[0] = (char) 0xf8;
+        int err = pir_request.recursive_query(requests, buckets, _pir_depth);
         if (err != 0x00) return requests;
-
         for (unsigned int j = 0; j < requests.size(); j++){
             requests[j] = header + requests[j];
         }
-    } else {
+    } else if(_do_PIR && buckets_to_query == MAX_BUDDIES &&
+            _metadata.batch_pir &&
+            _metadata.pir_backend == PIR_BACKEND_PERCY &&
+            pir_request.batch_query(requests, buckets) == 0) {
+
+        // A full-size lookup is a batch query where the servers allow
+        // it (and the buckets fit the batch code, as they all but
+        // always do)
+        header[0] = (char) 0xf9;
+        for (unsigned int j = 0; j < requests.size(); j++){
+            requests[j] = header + requests[j];
+        }
+    } else if(_do_PIR){
+
+        // Get the PIR requests and stick a header on them; the servers
+        // sent just a seed get a different request type
+        vector<bool> seeded;
+        int err = pir_request.pir_query(requests,buckets,&seeded);
+        if (err != 0x00) return requests;
 
-        // Asign the trivial download to a PIR server at random
-        unsigned int rand;
-        random_bytes((unsigned char *) &rand, sizeof(rand));
+        string seeded_header(header);
+        seeded_header[0] = (char) 0xfc;
+        for (unsigned int j = 0; j < requests.size(); j++){
+            requests[j] = (seeded[j] ? seeded_header : header) +
+                requests[j];
+        }
+    } else if (_ranged) {
 
+        // Ask each server for its stripe of the database
         for (unsigned int j = 0; j < _num_servers; j++){
-            if (rand % _num_servers == j){
+            unsigned char range[2*UINT_BYTES];
+            uint_num_to_bytes(range, _stripe_starts[j]);
+            uint_num_to_bytes(range + UINT_BYTES,
+                _stripe_starts[j+1] - _stripe_starts[j]);
+            requests.push_back(header +
+                string((char *) range, sizeof(range)));
+        }
+    } else {
+
+        // Asign the trivial download to the PIR server the plan chose
+        // at random
+        for (unsigned int j = 0; j < _num_servers; j++){
+            if (_plan.sent_bytes[j] > 0){
                 requests.push_back(header);
             }
             else {
@@ -322,6 +1463,31 @@ vector<string> LookupRequest<BuddyKey,MyPrivKey>::get_msgs()
     return requests;
 }
 
+// The index of the first record in bucket whose hash key could be
+// key.  If the buckets are sorted, this is the first record whose hash
+// key is not less than key, found by binary search; otherwise every
+// record must be checked, starting from the first.
+template<typename BuddyKey, typename MyPrivKey>
+unsigned int LookupRequest<BuddyKey,MyPrivKey>::find_record(
+    const char *bucket, const HashKey key) const
+{
+    if (!_metadata.sorted_buckets) {
+        return 0;
+    }
+
+    size_t record_bytes = HASHKEY_BYTES + _metadata.dataenc_bytes;
+    unsigned int lo = 0, hi = _metadata.bucket_size;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (memcmp(bucket + mid * record_bytes, key, HASHKEY_BYTES) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 template<typename BuddyKey, typename MyPrivKey>
 int LookupRequest<BuddyKey,MyPrivKey>::lookup_reply(
         vector<BuddyPresence<BuddyKey> > &presence,
@@ -330,118 +1496,305 @@ int LookupRequest<BuddyKey,MyPrivKey>::lookup_reply(
     // (Or empty strings at least)
     if (replies.size() != _num_servers) return 0x01;
 
-    unsigned int number_of_valid_msg = 0;
+    for (unsigned int s = 0; s < _num_servers; s++){
+        // Process a non reply
+        if (replies[s] == "") continue;
+
+        int err = add_reply(s, replies[s]);
+        if (err != 0) return err;
+    }
+
+    if (!can_decode()) {
+        // Did not find a single valid download reply
+        if (!_do_PIR) return 0x16;
+        // Do we have the right number of replies?
+        return 0x05;
+    }
+
+    return decode(presence);
+}
+
+// Add the reply from one server
+template<typename BuddyKey, typename MyPrivKey>
+int LookupRequest<BuddyKey,MyPrivKey>::add_reply(unsigned int server,
+    const string &reply)
+{
+    if (server >= _num_servers) return 0x01;
+
+    if (_ranged) {
+        return add_stripe(server, reply);
+    }
+
+    if (!_do_PIR) {
+        // Only the first download reply counts
+        if (_download_offset > 0) return 0x00;
+        return download_feed(reply.data(), reply.length());
+    }
+
+    // Message should be long-ish
+    if (reply.length() < 1 + EPOCH_BYTES) return 0x02;
+
+    byte status = reply[0];
+    // Expected a PIR request but got a download.
+    if (status != 0x81) return 0x03;
+
+    unsigned int server_epoch = epoch_bytes_to_num(
+        (const unsigned char *) reply.data() + 1);
+    // Expect to get a reply for the current epoch
+    if (server_epoch != _metadata.epoch) return 0x04;
+
+    if (_pir_replies[server] == "") {
+        _num_pir_replies ++;
+    }
+    _pir_replies[server].assign(reply.data() + (1 + EPOCH_BYTES),
+        reply.length() - (1 + EPOCH_BYTES));
+
+    return 0x00;
+}
+
+// Have enough replies been added to decode?
+template<typename BuddyKey, typename MyPrivKey>
+bool LookupRequest<BuddyKey,MyPrivKey>::can_decode() const
+{
+    if (_do_PIR) {
+        // DPF and Chor lookups need every server's reply
+        if (_metadata.pir_backend != PIR_BACKEND_PERCY) {
+            return _num_pir_replies >= _num_servers;
+        }
+        return _num_pir_replies >= pir_request.reply_degree() + 1;
+    }
+    if (_ranged) {
+        return _num_stripes_received == _num_servers;
+    }
+    return _download_offset > 0;
+}
+
+// Decode using the replies added so far
+template<typename BuddyKey, typename MyPrivKey>
+int LookupRequest<BuddyKey,MyPrivKey>::decode(
+    vector<BuddyPresence<BuddyKey> > &presence)
+{
+    if (_ranged) {
+        if (!can_decode()) return 0x16;
+        return finish_download(presence);
+    }
+
+    if (!_do_PIR) {
+        if (_download_offset == 0) return 0x16;
+        return download_finish(presence);
+    }
+
+    // Do we have the right number of replies?
+    if (_num_pir_replies < pir_request.reply_degree() + 1) return 0x05;
+
+    // Process the responses using the PIR library.  This leaves the
+    // request able to decode again if more replies arrive.
+    double start = wall_seconds();
     vector<string> buckets(MAX_BUDDIES);
+    int err = pir_request.pir_response(buckets, _pir_replies);
+    if (err != 0) return err;
 
-    if (_do_PIR){
-        vector<string> pir_replies;
-        for (unsigned int s = 0; s < _num_servers; s++){
-            // Process a non reply
-            if (replies[s] == ""){
-                pir_replies.push_back("");
-                continue;
-            }
+    err = process_buckets(presence, buckets);
+    _decode_seconds = wall_seconds() - start;
+    return err;
+}
+
+// Add a server's stripe of a ranged download
+template<typename BuddyKey, typename MyPrivKey>
+int LookupRequest<BuddyKey,MyPrivKey>::add_stripe(unsigned int server,
+    const string &reply)
+{
+    const size_t header_bytes = 1 + EPOCH_BYTES;
+    const uint64_t bucket_bytes = _metadata.bucket_size *
+        (HASHKEY_BYTES + _metadata.dataenc_bytes);
+
+    // Message should be long-ish
+    if (reply.length() < header_bytes) return 0x12;
+
+    byte status = reply[0];
+    // Expected a download request but got a PIR?
+    if (status != 0x82) return 0x13;
+
+    unsigned int server_epoch = epoch_bytes_to_num(
+        (const unsigned char *) reply.data() + 1);
+    // Expect to get a reply for the current epoch
+    if (server_epoch != _metadata.epoch) return 0x14;
+
+    // Is it the whole stripe?
+    uint64_t stripe_start = _stripe_starts[server] * bucket_bytes;
+    uint64_t stripe_bytes =
+        (_stripe_starts[server+1] - _stripe_starts[server]) * bucket_bytes;
+    if (reply.length() - header_bytes != stripe_bytes) return 0x15;
+
+    if (_stripes_received[server]) return 0x00;
+    if (_num_stripes_received == 0) {
+        start_download();
+    }
+    keep_buckets(stripe_start, reply.data() + header_bytes, stripe_bytes);
+    _stripes_received[server] = true;
+    _num_stripes_received++;
+
+    return 0x00;
+}
+
+// Get ready to keep the buckets we want from a download-mode reply
+template<typename BuddyKey, typename MyPrivKey>
+void LookupRequest<BuddyKey,MyPrivKey>::start_download()
+{
+    // Which bucket goes in each position
+    _download_bucket_nums.clear();
+    for (unsigned int f = 0; f < _buddy_states.size(); f++) {
+        const BuddyState & buddy = _buddy_states[f];
+        if (buddy.position >= _download_bucket_nums.size()) {
+            _download_bucket_nums.resize(buddy.position + 1);
+        }
+        _download_bucket_nums[buddy.position] = buddy.bucket;
+    }
+    _download_buckets.assign(_download_bucket_nums.size(), string());
+}
+
+// Keep the parts of len bytes of download-mode reply body, starting at
+// byte offset of the database, that fall within our buckets
+template<typename BuddyKey, typename MyPrivKey>
+void LookupRequest<BuddyKey,MyPrivKey>::keep_buckets(uint64_t offset,
+    const char *data, size_t len)
+{
+    const size_t bucket_bytes = _metadata.bucket_size *
+        (HASHKEY_BYTES + _metadata.dataenc_bytes);
+
+    uint64_t chunk_start = offset;
+    uint64_t chunk_end = chunk_start + len;
+    for (size_t p = 0; p < _download_bucket_nums.size(); p++) {
+        uint64_t bucket_start =
+            (uint64_t) _download_bucket_nums[p] * bucket_bytes;
+        uint64_t bucket_end = bucket_start + bucket_bytes;
+        uint64_t from = bucket_start > chunk_start ? bucket_start : chunk_start;
+        uint64_t to = bucket_end < chunk_end ? bucket_end : chunk_end;
+        if (from < to) {
+            _download_buckets[p].append(data + (from - chunk_start),
+                to - from);
+        }
+    }
+}
+
+// Consume the next len bytes of a download-mode reply
+template<typename BuddyKey, typename MyPrivKey>
+int LookupRequest<BuddyKey,MyPrivKey>::download_feed(const char *data,
+    size_t len)
+{
+    if (_do_PIR || _ranged) return 0x13;
+
+    const size_t header_bytes = 1 + EPOCH_BYTES;
 
-            // Message should be long-ish
-            if ( replies[s].length() < 1 + EPOCH_BYTES) return 0x02;
+    if (_download_offset == 0) {
+        start_download();
+    }
+
+    // The header
+    if (_download_offset < header_bytes) {
+        size_t n = header_bytes - _download_offset;
+        if (n > len) n = len;
+        _download_header.append(data, n);
+        _download_offset += n;
+        data += n;
+        len -= n;
 
-            byte status = replies[s][0];
-            // Expected a PIR request but got a download.
-            if (status != 0x81) return 0x03;
+        if (_download_offset == header_bytes) {
+            byte status = _download_header[0];
+            // Expected a download request but got a PIR?
+            if (status != 0x82) return 0x13;
 
             unsigned int server_epoch = epoch_bytes_to_num(
-                (const unsigned char *) replies[s].data() + 1);
+                (const unsigned char *) _download_header.data() + 1);
             // Expect to get a reply for the current epoch
-            if (server_epoch != _metadata.epoch) return 0x04;
+            if (server_epoch != _metadata.epoch) return 0x14;
+        }
+    }
+    if (len == 0) return 0x00;
 
-            string q;
-            q.assign(replies[s].data() + (1 + EPOCH_BYTES),
-                replies[s].length() - (1 + EPOCH_BYTES));
+    // Keep the parts of this chunk that fall within our buckets
+    keep_buckets(_download_offset - header_bytes, data, len);
+    _download_offset += len;
 
-            pir_replies.push_back(q);
-            number_of_valid_msg ++;
-        }
+    return 0x00;
+}
 
-        // Do we have the right number of replies?
-        if (number_of_valid_msg < _privacy_level +1) return 0x05;
+// Finish a streamed download-mode reply
+template<typename BuddyKey, typename MyPrivKey>
+int LookupRequest<BuddyKey,MyPrivKey>::download_finish(
+    vector<BuddyPresence<BuddyKey> > &presence)
+{
+    if (_do_PIR || _ranged) return 0x13;
 
-        // Process the responses using the PIR library
-        int err = pir_request.pir_response(buckets, pir_replies);
-        if (err != 0) return err;
+    const size_t header_bytes = 1 + EPOCH_BYTES;
+    const size_t record_bytes = HASHKEY_BYTES + _metadata.dataenc_bytes;
+
+    // Message should be long-ish
+    if (_download_offset < header_bytes) return 0x12;
 
+    uint64_t database_size = _download_offset - header_bytes;
+    if (database_size == 0){
+        // An empty database means no answer.
+        return 0x18;
     }
-    else {
-        for (unsigned int s = 0; s < _num_servers; s++) {
-            // Process a non reply
-            if (replies[s] != ""){
-
-                // Message should be long-ish
-                if ( replies[s].length() < 1 + EPOCH_BYTES) return 0x12;
-
-                byte status = replies[s][0];
-                // Expected a download request but got a PIR?
-                if (status != 0x82) return 0x13;
-
-                unsigned int server_epoch = epoch_bytes_to_num(
-                    (const unsigned char *) replies[s].data() + 1);
-                // Expect to get a reply for the current epoch
-                if (server_epoch != _metadata.epoch) return 0x14;
-
-                const char * database =
-                    ((char *) replies[s].data()) + (1 + EPOCH_BYTES);
-                unsigned int database_size = replies[s].length() - (1 + EPOCH_BYTES);
-
-                if (database_size == 0){
-                    // An empty database means no answer.
-                    return 0x18;
-                }
-
-                // Check it is a multiple of HASHKEY_BYTES + DATAENC_BYTES
-                if (database_size % (HASHKEY_BYTES + _metadata.dataenc_bytes) != 0)
-                    return 0x15;
-
-                // Extract the buckets
-                for (unsigned int f = 0; f < _buddy_states.size(); f++) {
-                    BuddyState & buddy = _buddy_states[f];
-                    if (buckets[buddy.position] == ""){
-                        size_t idx =
-                            buddy.bucket * _metadata.bucket_size
-                            * (HASHKEY_BYTES + _metadata.dataenc_bytes);
-
-                        // Is this still within bounds?
-                        if (idx + HASHKEY_BYTES + _metadata.dataenc_bytes > database_size){
-                            cout << "DB out of bounds" << idx + HASHKEY_BYTES + _metadata.dataenc_bytes << " > " << database_size << "\n";
-                            return 0x17;
-                        }
-
-                        buckets[buddy.position].assign(database + idx,
-                            _metadata.bucket_size  * (HASHKEY_BYTES + _metadata.dataenc_bytes));
-                    }
-                }
-
-                number_of_valid_msg ++;
-                break;
-            }
 
+    // Check it is a multiple of HASHKEY_BYTES + DATAENC_BYTES
+    if (database_size % record_bytes != 0)
+        return 0x15;
+
+    return finish_download(presence);
+}
+
+// Check that all of each bucket we need has been downloaded, and find
+// the buddies in them
+template<typename BuddyKey, typename MyPrivKey>
+int LookupRequest<BuddyKey,MyPrivKey>::finish_download(
+    vector<BuddyPresence<BuddyKey> > &presence)
+{
+    const size_t record_bytes = HASHKEY_BYTES + _metadata.dataenc_bytes;
+
+    // An empty database means no answer.
+    if (_ranged && _stripe_starts.back() == 0) return 0x18;
+
+    // Did we get all of each of our buckets?
+    for (size_t p = 0; p < _download_buckets.size(); p++) {
+        if (_download_buckets[p].size() !=
+                _metadata.bucket_size * record_bytes) {
+            cout << "DB out of bounds: bucket " << _download_bucket_nums[p]
+                << "\n";
+            return 0x17;
         }
-        // Did not find a single valid download reply
-        if (number_of_valid_msg == 0)
-            return 0x16;
     }
 
+    double start = wall_seconds();
+    vector<string> buckets(MAX_BUDDIES);
+    for (size_t p = 0; p < _download_buckets.size(); p++) {
+        buckets[p] = _download_buckets[p];
+    }
+    int err = process_buckets(presence, buckets);
+    _decode_seconds = wall_seconds() - start;
+    return err;
+}
 
-    // Since we have made it so far, it means we have a bunch
-    // of buckets, and should use them to extract the (HK,D) for
-    // each friend.
-    // TODO: We could use a binary search algorithm, but I am
-    // just going to use linear search for the moment. Its not like
-    // we are going to be doing this very often, and it is not on
-    // the critical path to enable other ops. Optimize later.
-
+// Find each buddy in its bucket and decrypt its data
+template<typename BuddyKey, typename MyPrivKey>
+int LookupRequest<BuddyKey,MyPrivKey>::process_buckets(
+    vector<BuddyPresence<BuddyKey> > &presence,
+    const vector<string> &buckets)
+{
+    // Use the buckets to extract the (HK,D) for each friend.
     presence.clear();
 
+    // The records we found, to be decrypted in one batch once the
+    // search is done
+    size_t record_bytes = HASHKEY_BYTES + _metadata.dataenc_bytes;
+    string found_ciphertexts;
+    vector<unsigned char> found_key_bytes;
+    vector<string> found_ads;
+    vector<size_t> found_presence;
+
     for (unsigned int f = 0; f < _buddy_states.size(); f++) {
-        BuddyState & buddy = _buddy_states[f];
+        const BuddyState & buddy = _buddy_states[f];
         // We asked for this bucket, but it is empty!
         if (buckets[buddy.position] == "") return 0x08;
 
@@ -450,65 +1803,114 @@ int LookupRequest<BuddyKey,MyPrivKey>::lookup_reply(
         output_record.pubkey = buddy.pubkey;
         output_record.is_online = false;
 
-        // Linear search through the bucket to find the hash
-        for(unsigned int i = 0; i < _metadata.bucket_size; i++){
-            const char * p = friend_bucket + i*(HASHKEY_BYTES + _metadata.dataenc_bytes);
-            if (memcmp(p, buddy.key, HASHKEY_BYTES) == 0)
+        // Find the hash in the bucket
+        for(unsigned int i = find_record(friend_bucket, buddy.key);
+                i < _metadata.bucket_size; i++){
+            const char * p = friend_bucket + i*record_bytes;
+            int cmp = memcmp(p, buddy.key, HASHKEY_BYTES);
+            if (_metadata.sorted_buckets && cmp != 0) {
+                // Past the last match
+                break;
+            }
+            if (cmp == 0)
             {
                 // Found it!
                 output_record.is_online = true;
 
-                if (get_data(output_record.data, buddy,
-                    string(p + HASHKEY_BYTES, _metadata.dataenc_bytes)) != 0)
-                    return 0x09;
+                found_ciphertexts.append(p + HASHKEY_BYTES,
+                    _metadata.dataenc_bytes);
+                found_key_bytes.insert(found_key_bytes.end(),
+                    buddy.data_key, buddy.data_key + DATAKEY_BYTES);
+                found_ads.push_back(buddy.ad);
+                found_presence.push_back(presence.size());
             }
         }
 
         presence.push_back(output_record);
     }
+
+    size_t num_found = found_presence.size();
+    if (num_found > 0) {
+        if (_metadata.dataenc_bytes < ENCRYPTION_OVERHEAD) return 0x09;
+        size_t plain_bytes = _metadata.dataenc_bytes - ENCRYPTION_OVERHEAD;
+        // One spare byte so that &plaintexts[0] is valid even if
+        // plain_bytes is 0
+        string plaintexts(num_found * plain_bytes + 1, '\0');
+        if (DecBatch((unsigned char *) &plaintexts[0],
+                (const DataKey *) &found_key_bytes[0],
+                (const unsigned char *) found_ciphertexts.data(),
+                _metadata.dataenc_bytes, num_found, &found_ads[0]) != 0)
+            return 0x09;
+        for (size_t i = 0; i < num_found; i++) {
+            presence[found_presence[i]].data.assign(plaintexts,
+                i * plain_bytes, plain_bytes);
+        }
+    }
     return 0x00;
 
 }
-template<>
-int LookupRequest<PubKey,PrivKey>::get_data(string & data,
-    const LookupRequest<PubKey,PrivKey>::BuddyState & buddy,
-    const string & ciphertext) {
-    DHOutput shared_dh_secret;
-    diffie_hellman(shared_dh_secret, _privkey, buddy.pubkey);
-    SharedKey shared_key;
-    DataKey data_key;
-    H1H2(shared_key, data_key, _metadata.epoch, buddy.pubkey, shared_dh_secret);
-    byte epoch_bytes[EPOCH_BYTES];
-    epoch_num_to_bytes(epoch_bytes, _metadata.epoch);
-    string ad((char *) epoch_bytes, sizeof(epoch_bytes));
-    PubKey mypubkey;
-    // FIXME we probably shouldn't do this calculation for every presence entry
-    getpubkey(mypubkey, _privkey);
-    ad.append(mypubkey);
-    ad.append((char *) shared_key, sizeof(shared_key));
-    return Dec(data, data_key, ciphertext, ad);
+template<typename BuddyKey, typename MyPrivKey>
+vector<vector<string> > MultiLookupRequest<BuddyKey,MyPrivKey>::get_msgs()
+{
+    vector<vector<string> > msgs(_requests.size());
+    for (unsigned int i = 0; i < _requests.size(); i++) {
+        msgs[i] = _requests[i].get_msgs();
+    }
+    return msgs;
 }
 
-template<>
-int LookupRequest<BLSPubKey,Empty>::get_data(string & data,
-    const LookupRequest<BLSPubKey,Empty>::BuddyState & buddy,
-    const string & ciphertext) {
-    DataKey data_key;
+template<typename BuddyKey, typename MyPrivKey>
+int MultiLookupRequest<BuddyKey,MyPrivKey>::lookup_reply(
+    vector<vector<Presence> > &presence,
+    const vector<vector<string> > &replies)
+{
+    if (replies.size() != _requests.size()) return 0x01;
 
-    H5(data_key, _metadata.epoch, buddy.pubkey);
-    byte epoch_bytes[EPOCH_BYTES];
-    epoch_num_to_bytes(epoch_bytes, _metadata.epoch);
-    string ad((char *) epoch_bytes, sizeof(epoch_bytes));
-    ad.append(buddy.pubkey);
+    vector<vector<Presence> > request_presence(_requests.size());
+    for (unsigned int i = 0; i < _requests.size(); i++) {
+        int err = _requests[i].lookup_reply(request_presence[i],
+            replies[i]);
+        if (err != 0x00) return err;
+    }
+    split_presence(presence, request_presence);
+    return 0x00;
+}
 
-    int err = Dec(data, data_key, ciphertext, ad);
+template<typename BuddyKey, typename MyPrivKey>
+int MultiLookupRequest<BuddyKey,MyPrivKey>::decode(
+    vector<vector<Presence> > &presence)
+{
+    vector<vector<Presence> > request_presence(_requests.size());
+    for (unsigned int i = 0; i < _requests.size(); i++) {
+        if (!_requests[i].can_decode()) return 0x05;
+        int err = _requests[i].decode(request_presence[i]);
+        if (err != 0x00) return err;
+    }
+    split_presence(presence, request_presence);
+    return 0x00;
+}
 
-    return err;
+// Each request's presence information is that of its identities'
+// buddies, one identity after another
+template<typename BuddyKey, typename MyPrivKey>
+void MultiLookupRequest<BuddyKey,MyPrivKey>::split_presence(
+    vector<vector<Presence> > &presence,
+    const vector<vector<Presence> > &request_presence) const
+{
+    presence.resize(_identity_request.size());
+    for (unsigned int k = 0; k < _identity_request.size(); k++) {
+        typename vector<Presence>::const_iterator first =
+            request_presence[_identity_request[k]].begin() +
+            _identity_offset[k];
+        presence[k].assign(first, first + _identity_count[k]);
+    }
 }
 
 template class LookupRequest<PubKey,PrivKey>;
+template class MultiLookupRequest<PubKey,PrivKey>;
 template class GenericLookupClient<PubKey,PrivKey>;
 template class LookupRequest<BLSPubKey,Empty>;
+template class MultiLookupRequest<BLSPubKey,Empty>;
 template class GenericLookupClient<BLSPubKey,Empty>;
 
 } // namespace internal
@@ -537,7 +1939,9 @@ void test_reqcd(DP5LookupClient::Request &a)
     DP5LookupClient::Request b;
     PrivKey key;
     vector<DP5LookupClient::Request::BuddyState> fs;
-    a.init(5, 2, meta, fs, true, key);
+    LookupPlan plan;
+    plan.method = LookupPlan::PIR;
+    a.init(5, 2, meta, fs, plan, key);
     b = a;
     DP5LookupClient::Request c(b);
     DP5LookupClient::Request d = c;
@@ -553,11 +1957,223 @@ void test_reqcd(DP5LookupClient::Request &a)
 int main()
 {
     DP5LookupClient::Request a;
-    ZZ_p::init(to_ZZ(256));
-
     test_reqcd(a);
 
     return 0;
 }
 
 #endif // TEST_REQCD
+
+#ifdef TEST_LOOKUPBENCH
+// Time combined-mode lookup requests for a full buddy list: the
+// one-pairing-at-a-time derivation, a cold request, and a request for
+// an epoch whose keys were precomputed after the previous lookup.
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <Pairing.h>
+#include "dp5threadpool.h"
+
+using namespace dp5;
+using namespace dp5::internal;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int set_epoch(DP5CombinedLookupClient &client, Metadata &meta,
+    Epoch epoch)
+{
+    string msg;
+    meta.epoch = epoch;
+    client.metadata_request(msg, epoch);
+    return client.metadata_reply(meta.toString());
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int num_buddies = argc > 1 ? atoi(argv[1]) : MAX_BUDDIES;
+    if (num_buddies > MAX_BUDDIES) num_buddies = MAX_BUDDIES;
+
+    initPairing();
+
+    Metadata meta;
+    meta.epoch_len = 30;
+    meta.dataenc_bytes = 32;
+    meta.combined = true;
+    random_bytes((unsigned char*) meta.prfkey, PRFKEY_BYTES);
+    meta.num_buckets = 1000;
+    meta.bucket_size = 50;
+    Epoch epoch = meta.current_epoch();
+
+    vector<BLSPubKey> buddies(num_buddies);
+    for (unsigned int i = 0; i < num_buddies; ++i) {
+        BLSPrivKey priv;
+        genkeypair(buddies[i], priv);
+    }
+
+    double start = now();
+    for (unsigned int i = 0; i < num_buddies; ++i) {
+        HashKey key;
+        hash_key_from_pk(key, buddies[i], epoch);
+    }
+    double serial = now() - start;
+
+    DP5CombinedLookupClient client;
+    DP5CombinedLookupClient::Request req;
+    if (set_epoch(client, meta, epoch) != 0) {
+        printf("Metadata False\n");
+        return 1;
+    }
+    start = now();
+    int err = client.lookup_request(req, buddies, 5, 2);
+    double cold = now() - start;
+
+    // The request above started on the next epoch's keys; give that a
+    // chance to finish, as it would over the course of an epoch
+    sleep(1 + (unsigned int) (serial * 2));
+
+    set_epoch(client, meta, epoch + 1);
+    start = now();
+    err |= client.lookup_request(req, buddies, 5, 2);
+    double warm = now() - start;
+
+    printf("%u buddies, %u threads\n", num_buddies,
+        ThreadPool::default_num_threads());
+    printf("serial hash keys:        %.3f ms\n", serial * 1000);
+    printf("lookup_request (cold):   %.3f ms\n", cold * 1000);
+    printf("lookup_request (warm):   %.3f ms\n", warm * 1000);
+    printf("Requests ok: %s\n", err == 0 ? "True" : "False");
+
+    return 0;
+}
+#endif // TEST_LOOKUPBENCH
+
+#ifdef TEST_ALLOCBENCH
+// Count the heap allocations a PIR lookup of a full buddy list makes,
+// step by step: making the request, copying it (as a binding that
+// hands requests around by value would), building the messages, and
+// decoding the replies.
+#include <stdlib.h>
+#include <new>
+
+using namespace dp5;
+using namespace dp5::internal;
+
+static unsigned long num_allocs = 0;
+
+void *operator new(size_t size)
+{
+    ++num_allocs;
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) throw()
+{
+    free(p);
+}
+
+// Always choose PIR, so that every lookup takes the same path
+class PIRCostModel : public LookupCostModel {
+public:
+    virtual double expected_seconds(const LookupPlan &plan) const {
+        return plan.method == LookupPlan::PIR && plan.pir_depth == 1 ?
+            0 : 1;
+    }
+};
+
+int main()
+{
+    const unsigned int num_servers = 5, privacy_level = 2;
+    const unsigned int num_lookups = 10;
+
+    PubKey mypub;
+    PrivKey mypriv;
+    genkeypair(mypub, mypriv);
+
+    Metadata meta;
+    meta.epoch_len = 1800;
+    meta.epoch = 0x2323;
+    meta.dataenc_bytes = 32;
+    meta.num_buckets = 1000;
+    meta.bucket_size = 10;
+    random_bytes((unsigned char*) meta.prfkey, PRFKEY_BYTES);
+    size_t bucket_bytes = meta.bucket_size *
+        (HASHKEY_BYTES + meta.dataenc_bytes);
+
+    vector<PubKey> buddies(MAX_BUDDIES);
+    for (unsigned int i = 0; i < buddies.size(); ++i) {
+        PrivKey priv;
+        genkeypair(buddies[i], priv);
+    }
+
+    DP5LookupClient client(mypriv);
+    PIRCostModel pir;
+    client.set_cost_model(&pir);
+    string msg;
+    client.metadata_request(msg, meta.epoch);
+    if (client.metadata_reply(meta.toString()) != 0) {
+        printf("Metadata False\n");
+        return 1;
+    }
+
+    // Replies from just enough servers to decode
+    byte epoch_bytes[EPOCH_BYTES];
+    epoch_num_to_bytes(epoch_bytes, meta.epoch);
+    vector<string> replies(num_servers);
+    for (unsigned int j = 0; j <= privacy_level; ++j) {
+        replies[j].assign("\x81");
+        replies[j].append((char *) epoch_bytes, EPOCH_BYTES);
+        replies[j].append(MAX_BUDDIES * bucket_bytes, '\0');
+        random_bytes((unsigned char *) &replies[j][1 + EPOCH_BYTES],
+            MAX_BUDDIES * bucket_bytes);
+    }
+
+    // Once to warm the key cache
+    int err = 0;
+    {
+        DP5LookupClient::Request req;
+        err |= client.lookup_request(req, buddies, num_servers,
+            privacy_level);
+    }
+
+    unsigned long request = 0, copy = 0, msgs = 0, decode = 0;
+    for (unsigned int i = 0; i < num_lookups; ++i) {
+        DP5LookupClient::Request req;
+        unsigned long start = num_allocs;
+        err |= client.lookup_request(req, buddies, num_servers,
+            privacy_level);
+        request += num_allocs - start;
+
+        start = num_allocs;
+        DP5LookupClient::Request copied(req);
+        copy += num_allocs - start;
+
+        start = num_allocs;
+        vector<string> msgs_out = req.get_msgs();
+        msgs += num_allocs - start;
+
+        start = num_allocs;
+        vector<DP5LookupClient::Presence> presence;
+        err |= req.lookup_reply(presence, replies);
+        decode += num_allocs - start;
+    }
+
+    printf("%u buddies, %u servers, privacy level %u\n", MAX_BUDDIES,
+        num_servers, privacy_level);
+    printf("allocations per lookup:\n");
+    printf("  lookup_request:  %lu\n", request / num_lookups);
+    printf("  request copy:    %lu\n", copy / num_lookups);
+    printf("  get_msgs:        %lu\n", msgs / num_lookups);
+    printf("  lookup_reply:    %lu\n", decode / num_lookups);
+    printf("Lookups ok: %s\n", err == 0 ? "True" : "False");
+
+    return 0;
+}
+#endif // TEST_ALLOCBENCH
@@ -7,109 +7,215 @@
 #include <map>
 #include <stdexcept>
 #include <sstream>
+#include <pthread.h>
 #include "dp5params.h"
 #include "dp5metadata.h"
-#include "itclient.h"
-#include "itparams.h"
-#include "percyclient.h"
+#include "dp5keycache.h"
+#include "dp5costmodel.h"
+#include "dp5batchcode.h"
 
 namespace dp5 {
 
     namespace internal {
 
-                // A class representing an in-progress lookup request
-        class PIRRequest {
+        // What the PIR glue needs for every request of an epoch that
+        // depends only on the epoch's metadata, such as the layout of
+        // the batch code.  A lookup client builds one per epoch, the
+        // first time it makes a PIR query, and shares it among that
+        // epoch's requests, so that they need not each build it.
+        // Thread-safe once constructed.
+        class PIREngine {
+        public:
+            PIREngine(const Metadata &metadata, unsigned int record_size);
+
+            const Metadata &metadata() const { return _metadata; }
+            unsigned int record_size() const { return _record_size; }
+
+            // The batch code, or NULL if the metadata does not allow
+            // batch queries
+            const BatchCode *batch_code() const {
+                return _batched ? &_batch_code : NULL;
+            }
+
         private:
-            typedef PercyClient_GF2E<GF28_Element> PercyClientGF28;
+            Metadata _metadata;
+            unsigned int _record_size;
+            bool _batched;
+            BatchCode _batch_code;
+        };
 
+        // A counted reference to a PIREngine, which is deleted along
+        // with the last reference to it.  References may be copied and
+        // dropped from any thread.
+        class PIREngineRef {
         public:
-            PIRRequest(): _pirparams(NULL), _pircparams(NULL),
-	    _pirclient(NULL) {}
+            PIREngineRef() : _shared(NULL) {}
 
-            ~PIRRequest() {
-               delete _pircparams;
-               delete _pirparams;
-               delete _pirclient;
-            }
+            // Take ownership of engine
+            explicit PIREngineRef(PIREngine *engine);
 
-            PIRRequest(const PIRRequest &other) :
-                _num_servers(other._num_servers),
-                _privacy_level(other._privacy_level),
-                _record_size(other._record_size),
-                _pirparams(NULL), _pircparams(NULL), _pirclient(NULL),
-		_request_identifier(other._request_identifier),
-                _metadata_current(other._metadata_current)
-            {
-                if (other._pirparams) {
-                    _pirparams = new GF2EParams(*other._pirparams);
-                }
-                if (other._pircparams) {
-                    _pircparams = new PercyClientParams(*other._pircparams);
-                }
-                if (other._pirclient) {
-                    _pirclient = new PercyClientGF28(*other._pirclient);
-                }
-            }
+            PIREngineRef(const PIREngineRef &other);
+            PIREngineRef& operator=(const PIREngineRef &other);
+            ~PIREngineRef();
 
-            PIRRequest& operator=(PIRRequest other) {
-                // Swap the fields of the temporary "other" with ours
-                // so things get properly freed
-
-                GF2EParams *tmpp = other._pirparams;
-                other._pirparams = _pirparams;
-                _pirparams = tmpp;
-
-                PercyClientParams *tmpc = other._pircparams;
-                other._pircparams = _pircparams;
-                _pircparams = tmpc;
-
-                PercyClientGF28 *tmpcl = other._pirclient;
-                other._pirclient = _pirclient;
-                _pirclient = tmpcl;
-
-                // The non-dynamic members can be just copied
-                _num_servers = other._num_servers;
-                _privacy_level = other._privacy_level;
-                _metadata_current = other._metadata_current;
-                _record_size = other._record_size;
-                _request_identifier = other._request_identifier;
-                return *this;
+            // The engine, or NULL if there is none
+            const PIREngine *get() const {
+                return _shared ? _shared->engine : NULL;
             }
+            const PIREngine *operator->() const { return get(); }
 
-            // Initialize the Request object
+        private:
+            struct Shared {
+                PIREngine *engine;
+                // The number of references, protected by refs_lock
+                unsigned long refs;
+                pthread_mutex_t refs_lock;
+            };
+
+            // Drop this reference
+            void release();
+
+            Shared *_shared;
+        };
+
+                // A class representing an in-progress lookup request
+        class PIRRequest {
+        public:
+            PIRRequest(): _num_servers(0), _privacy_level(0),
+                _record_size(0), _num_queries(0), _depth(1),
+                _fast_decode(true), _batched(false) {}
+
+            // Initialize the Request object, with an engine of its own
             void init(unsigned int num_servers, unsigned int privacy_level,
                 const Metadata &metadata, unsigned int record_size) {
+                init(num_servers, privacy_level,
+                    PIREngineRef(new PIREngine(metadata, record_size)));
+            }
+
+            // Initialize the Request object, sharing engine with the
+            // other requests of its epoch
+            void init(unsigned int num_servers, unsigned int privacy_level,
+                const PIREngineRef &engine) {
                 _num_servers = num_servers;
                 _privacy_level = privacy_level;
-                _metadata_current = metadata;
-                _record_size = record_size;
-		_request_identifier = 0;
-                _pirparams = new GF2EParams(
-                  _metadata_current.num_buckets,
-                  _metadata_current.bucket_size * _record_size, 8, 0);
-		_pircparams = new PercyClientParams(_pirparams, _num_servers);
-
-                _pirclient = (PercyClientGF28*)PercyClient::make_client(
-                   _pircparams, _num_servers, _privacy_level);
+                _engine = engine;
+                _metadata_current = engine->metadata();
+                _record_size = engine->record_size();
+                _num_queries = 0;
+                _depth = 1;
+                _batched = false;
             }
 
+            // The engine this request uses
+            const PIREngine *engine() const { return _engine.get(); }
+
 
             // The glue API to the PIR layer.  Pass a vector of the bucket
             // numbers to look up.  This should already be padded to one of
-            // the valid sizes listed in QUERY_SIZES.  Place the querys to
-            // send to the servers into requeststrs.  Return 0 on success,
+            // the rungs of the metadata's query-size ladder.  Place the
+            // querys to send to the servers into requeststrs.  If seeded
+            // is not NULL, up to privacy_level of the servers, chosen at
+            // random, are sent just a seed from which they expand their
+            // query themselves: (*seeded)[j] is set to whether server j is one
+            // of them, and so whether requeststrs[j] is a seeded query.
+            // If the metadata selects the DPF backend, there must be
+            // exactly two servers; with the Chor backend, at least two.
+            // With either, no server is seeded.  Return 0 on success,
             // non-0 on failure.
             int pir_query(std::vector<std::string> &requeststrs,
+                const std::vector<unsigned int> &bucketnums,
+                std::vector<bool> *seeded = NULL);
+
+            // The batch version of pir_query, for the Percy backend when
+            // the metadata allows batch queries.  Pass a vector of the
+            // bucket numbers to look up; repeats are fine.  Place the
+            // queries to send to the servers into requeststrs; each has
+            // a query for every partition of the batch code, rather than
+            // for every bucket.  Return 0 on success, non-0 on failure
+            // (which can happen by chance), in which case use pir_query
+            // instead.
+            int batch_query(std::vector<std::string> &requeststrs,
                 const std::vector<unsigned int> &bucketnums);
 
+            // The recursive version of pir_query, for the Percy backend
+            // when the metadata allows queries of the given depth (at
+            // least 1, and at most the metadata's pir_depth).  Each
+            // query treats the database as a cube of that many
+            // dimensions, and is depth times the side of the cube long,
+            // rather than the number of buckets.  The replies lie on
+            // polynomials of degree depth * privacy_level, so at least
+            // that many servers plus one must answer.  Return 0 on
+            // success, non-0 on failure.
+            int recursive_query(std::vector<std::string> &requeststrs,
+                const std::vector<unsigned int> &bucketnums,
+                unsigned int depth);
+
             // The glue API to the PIR layer.  Pass the responses from the
             // servers into responsestrs.  buckets will be filled with the
             // contents of the buckets indexed by bucketnums.  Return 0 on
             // success, non-0 on failure.
             int pir_response(std::vector<std::string> &buckets,
-                const std::vector<std::string> &responses);
+                const std::vector<std::string> &responses) const;
+
+            // Whether pir_response may try plain interpolation before
+            // falling back to the error-correcting decoder (the
+            // default).  Turning it off is only useful for testing and
+            // benchmarking.
+            void set_fast_decode(bool fast_decode) {
+                _fast_decode = fast_decode;
+            }
+
+            // The degree of the polynomials the servers' replies to the
+            // current Percy backend request lie on, one less than the
+            // number of replies needed to decode: the privacy level,
+            // times the depth of a recursive query
+            unsigned int reply_degree() const {
+                return _privacy_level * _depth;
+            }
 
         private:
+            // Write each server's share of the unit vector of length len
+            // picking out index into its query at offset.  coeffs is
+            // scratch space.
+            void share_unit_vector(std::vector<std::string> &requeststrs,
+                size_t offset, size_t len, unsigned int index,
+                std::vector<unsigned char> &coeffs) const;
+
+            // The seeded version of pir_query.  requeststrs already
+            // holds the count of queries for each server.  Return 0 on
+            // success, non-0 on failure.
+            int seeded_query(std::vector<std::string> &requeststrs,
+                const std::vector<unsigned int> &bucketnums,
+                std::vector<bool> &seeded);
+
+            // The DPF and Chor versions of pir_query, used when the
+            // metadata selects those backends.  Return 0 on success,
+            // non-0 on failure.
+            int dpf_query(std::vector<std::string> &requeststrs,
+                const std::vector<unsigned int> &bucketnums);
+            int chor_query(std::vector<std::string> &requeststrs,
+                const std::vector<unsigned int> &bucketnums);
+
+            // The DPF and Chor version of pir_response: the buckets are
+            // the XOR of every server's response.  Return 0 on success,
+            // non-0 on failure.
+            int xor_response(std::vector<std::string> &buckets,
+                const std::vector<std::string> &responses) const;
+
+            // Try to recover the buckets by interpolating the first
+            // reply_degree()+1 well-formed responses, and checking the
+            // rest against the result.  Return 0 on success, non-0 if
+            // there are too few responses or they do not all agree, in
+            // which case robust_response must do the decoding.
+            int fast_response(std::vector<std::string> &buckets,
+                const std::vector<std::string> &responses) const;
+
+            // Recover the buckets from responses of which at most
+            // (num_replies - reply_degree() - 1) / 2 are wrong.  Return
+            // 0 on success, non-0 on failure.
+            int robust_response(std::vector<std::string> &buckets,
+                const std::vector<std::string> &responses) const;
+
             // The number of lookup servers
             unsigned int _num_servers;
 
@@ -119,17 +225,23 @@ namespace dp5 {
             // FIXME: should be derivable from metadata
             unsigned int _record_size;
 
-            // The PercyClientParams, constructed from the above pieces
-            GF2EParams *_pirparams;
-            PercyClientParams *_pircparams;
+            // The number of buckets asked for by the current request
+            unsigned int _num_queries;
 
-            // The PercyClient in use
-            PercyClientGF28 *_pirclient;
+            // The depth of the current request: 1 unless it is a
+            // recursive query
+            unsigned int _depth;
 
-	    // The current request number
-	    nqueries_t _request_identifier;
+            // See set_fast_decode
+            bool _fast_decode;
+
+            // Whether the current request is a batch query, and if so,
+            // the partition each of its bucket numbers is fetched from
+            bool _batched;
+            std::vector<unsigned int> _batch_slots;
 
             Metadata _metadata_current;
+            PIREngineRef _engine;
         };
 
         template<typename BuddyKey>
@@ -151,6 +263,10 @@ namespace dp5 {
             struct BuddyState {
                 BuddyKey pubkey;
                 HashKey key;
+                // The key and additional data with which buddy's
+                // record in this epoch is encrypted
+                DataKey data_key;
+                std::string ad;
                 unsigned int bucket;
                 unsigned int position;
             };
@@ -160,35 +276,92 @@ namespace dp5 {
             friend void test_reqcd(LookupRequest &a);
 #endif // TEST_REQCD
 
-            vector<BuddyState> _buddy_states;
+            std::vector<BuddyState> _buddy_states;
 
             PIRRequest pir_request;
+            // The plan chosen for this lookup, and what it comes to:
+            // whether to make PIR queries, of what depth (1 for
+            // ordinary ones), or to download in stripes
+            LookupPlan _plan;
             bool _do_PIR;
+            unsigned int _pir_depth;
+            bool _ranged;
             Metadata _metadata;
             unsigned int _num_servers;
             unsigned int _privacy_level;
             MyPrivKey _privkey;
 
-
-            // Initialize the Request object
+            // The replies added so far with add_reply: for PIR
+            // requests, the body of each server's reply (or the empty
+            // string), and how many there are
+            std::vector<std::string> _pir_replies;
+            unsigned int _num_pir_replies;
+
+            // The state of a streamed download-mode reply: the bytes of
+            // the reply consumed so far, its header, and the contents
+            // (so far) of each bucket we want, indexed by position
+            size_t _download_offset;
+            std::string _download_header;
+            std::vector<unsigned int> _download_bucket_nums;
+            std::vector<std::string> _download_buckets;
+
+            // For a ranged download, the first bucket of each server's
+            // stripe (and the number of buckets, at the end), and which
+            // servers' stripes have arrived, and how many
+            std::vector<unsigned int> _stripe_starts;
+            std::vector<bool> _stripes_received;
+            unsigned int _num_stripes_received;
+
+            // How long the last decode took, in seconds
+            double _decode_seconds;
+
+            // Initialize the Request object.  The buddy states are
+            // swapped in rather than copied, so buddy_states is left
+            // holding the request's old ones.
             void init(unsigned int num_servers, unsigned int privacy_level,
                 const Metadata &metadata,
-                const std::vector<BuddyState> & buddy_states, bool do_PIR,
-                const MyPrivKey & privkey) {
-                _do_PIR = do_PIR;
-                _buddy_states = buddy_states;
+                std::vector<BuddyState> & buddy_states,
+                const LookupPlan & plan, const MyPrivKey & privkey,
+                const PIREngineRef & engine = PIREngineRef()) {
+                _plan = plan;
+                _do_PIR = (plan.method == LookupPlan::PIR);
+                _pir_depth = plan.pir_depth;
+                _ranged = (plan.method == LookupPlan::RANGED_DOWNLOAD);
+                _buddy_states.swap(buddy_states);
                 _metadata = metadata;
                 _num_servers = num_servers;
                 _privacy_level = privacy_level;
                 _privkey = privkey;
-                if (_do_PIR) {
+                _pir_replies.assign(num_servers, std::string());
+                _num_pir_replies = 0;
+                _download_offset = 0;
+                _download_header.clear();
+                _download_bucket_nums.clear();
+                _download_buckets.clear();
+                _stripe_starts.clear();
+                if (_ranged) {
+                    // Equal stripes, in order
+                    for (unsigned int j = 0; j <= num_servers; j++) {
+                        _stripe_starts.push_back((unsigned int)
+                            ((uint64_t) metadata.num_buckets * j /
+                             num_servers));
+                    }
+                }
+                _stripes_received.assign(num_servers, false);
+                _num_stripes_received = 0;
+                _decode_seconds = 0;
+                if (_do_PIR && engine.get()) {
+                    pir_request.init(num_servers, privacy_level, engine);
+                } else if (_do_PIR) {
                     pir_request.init(num_servers, privacy_level,
                         metadata, HASHKEY_BYTES + metadata.dataenc_bytes);
                 }
             }
 
-            int get_data(string & data, const BuddyState & buddy,
-                const string & ciphertext);
+            // The index of the first record in bucket whose hash key
+            // could be key
+            unsigned int find_record(const char *bucket,
+                const HashKey key) const;
 
         public:
             // default constructors work for us
@@ -210,26 +383,233 @@ namespace dp5 {
             int lookup_reply(std::vector<BuddyPresence<BuddyKey> > &presence,
                 const std::vector<std::string> &replies);
 
+            // An incremental alternative to lookup_reply, so that a lookup
+            // need not wait for the slowest server.  Pass each server's
+            // reply to add_reply as it arrives, along with the index of
+            // the message from get_msgs() it answers.  Once can_decode()
+            // is true (privacy_level+1 PIR replies are in, or more for
+            // a recursive query, all of them with the DPF and Chor
+            // backends, the download reply is, or every stripe of a
+            // ranged download is),
+            // call decode() to obtain the
+            // BuddyPresence information.  Replies that arrive later can
+            // still be added, and decode() called again; the PIR layer
+            // then uses them to check, and if need be correct, the
+            // answer.  Return 0 on success, non-0 on error.
+            int add_reply(unsigned int server, const std::string &reply);
+            bool can_decode() const;
+            int decode(std::vector<BuddyPresence<BuddyKey> > &presence);
+
+            // Is this a download-mode (rather than PIR or ranged
+            // download) request?  If so, exactly one of the messages
+            // from get_msgs() is non-empty.
+            bool is_download() const { return !_do_PIR && !_ranged; }
+
+            // The plan the lookup client chose for this request
+            const LookupPlan &plan() const { return _plan; }
+
+            // The PIR engine this request shares with the lookup
+            // client's other PIR requests of its epoch, or NULL if it
+            // makes no PIR queries
+            const PIREngine *pir_engine() const {
+                return _do_PIR ? pir_request.engine() : NULL;
+            }
+
+            // How long the last call to decode(), lookup_reply() or
+            // download_finish() spent decoding, in seconds
+            double decode_seconds() const { return _decode_seconds; }
+
+            // A streaming alternative to lookup_reply for download-mode
+            // requests, so that the whole database never has to be held
+            // in memory.  After get_msgs(), pass the reply from the
+            // server that was sent the download request to
+            // download_feed() in order, in chunks of any size as they
+            // arrive, then call download_finish() to obtain the
+            // BuddyPresence information.  Only the buckets this request
+            // needs are kept.  Return 0 on success, non-0 on error.
+            int download_feed(const char *data, size_t len);
+            int download_finish(
+                std::vector<BuddyPresence<BuddyKey> > &presence);
+
+        private:
+            // Add a server's reply with its stripe of a ranged
+            // download.  Return 0 on success, non-0 on error.
+            int add_stripe(unsigned int server, const std::string &reply);
+
+            // Get ready to keep the buckets this request needs from a
+            // download-mode reply
+            void start_download();
+
+            // Keep the parts of len bytes of download-mode reply body,
+            // starting at byte offset of the database, that fall within
+            // the buckets this request needs
+            void keep_buckets(uint64_t offset, const char *data,
+                size_t len);
+
+            // Check that all of each bucket this request needs has
+            // been downloaded, and find the buddies in them.  Return 0
+            // on success, non-0 on error.
+            int finish_download(
+                std::vector<BuddyPresence<BuddyKey> > &presence);
+
+            // Find each buddy in its bucket and decrypt its data.
+            // Return 0 on success, non-0 on error.
+            int process_buckets(
+                std::vector<BuddyPresence<BuddyKey> > &presence,
+                const std::vector<std::string> &buckets);
+
         };
 
 
+        // A lookup of the buddies of several local identities (each
+        // with its own lookup client) at once, as a proxy serving many
+        // accounts makes.  The identities' buckets are pooled, so that
+        // a bucket two of them need is fetched once, and the lookup
+        // servers do one query's work for a group of identities rather
+        // than one per identity.  A query can ask for at most
+        // MAX_BUDDIES distinct buckets, so the identities are split
+        // into as few groups as fit; each group is an ordinary
+        // LookupRequest.
+        template<typename BuddyKey, typename MyPrivKey>
+        class MultiLookupRequest {
+        public:
+            typedef LookupRequest<BuddyKey,MyPrivKey> Request;
+            typedef BuddyPresence<BuddyKey> Presence;
+
+            // The number of requests the identities were grouped into
+            unsigned int num_requests() const {
+                return _requests.size();
+            }
+
+            // The ith request, to send and receive the replies to (with
+            // get_msgs, add_reply, download_feed and so on) as for an
+            // ordinary lookup
+            Request &request(unsigned int i) { return _requests[i]; }
+            const Request &request(unsigned int i) const {
+                return _requests[i];
+            }
+
+            // The messages for each request: send the jth entry of the
+            // ith vector to lookup server j, as for get_msgs
+            std::vector<std::vector<std::string> > get_msgs();
+
+            // Process the replies to every request, as lookup_reply
+            // does: replies[i] holds each server's reply to the
+            // messages of request i.  presence[k] is filled with the
+            // BuddyPresence information of identity k, in the order of
+            // its buddies.  Return 0 on success, non-0 on error.
+            int lookup_reply(
+                std::vector<std::vector<Presence> > &presence,
+                const std::vector<std::vector<std::string> > &replies);
+
+            // Decode every request, once each can_decode(), and fill in
+            // presence as lookup_reply does.  Return 0 on success, non-0
+            // on error.
+            int decode(std::vector<std::vector<Presence> > &presence);
+
+            // The request holding identity k's buddies
+            unsigned int request_of(unsigned int k) const {
+                return _identity_request[k];
+            }
+
+        private:
+            friend class GenericLookupClient<BuddyKey,MyPrivKey>;
+
+            // Split the presence information of each request, in
+            // request_presence, into that of each identity
+            void split_presence(
+                std::vector<std::vector<Presence> > &presence,
+                const std::vector<std::vector<Presence> >
+                    &request_presence) const;
+
+            std::vector<Request> _requests;
+
+            // For each identity, the request its buddies are in, where
+            // they start among that request's buddies, and how many
+            // there are
+            std::vector<unsigned int> _identity_request;
+            std::vector<unsigned int> _identity_offset;
+            std::vector<unsigned int> _identity_count;
+        };
+
+        // placeholder for private key
+        struct Empty {
+        };
+
+        // The kind of key cache each kind of lookup client keeps
+        template<typename BuddyKey, typename MyPrivKey>
+        struct LookupKeyCache;
+
+        template<>
+        struct LookupKeyCache<PubKey,PrivKey> {
+            typedef BuddyKeyCache type;
+            static type make(const PrivKey & privkey) {
+                return BuddyKeyCache(privkey, BuddyKeyCache::LOOKUP);
+            }
+        };
+
+        template<>
+        struct LookupKeyCache<BLSPubKey,Empty> {
+            typedef CombinedKeyCache type;
+            static type make(const Empty &) {
+                return CombinedKeyCache();
+            }
+        };
+
         template<typename BuddyKey, typename MyPrivKey>
         class GenericLookupClient {
         private:
-            unsigned int _metadata_request_epoch;
+            // The epochs of the metadata requests awaiting replies
+            std::set<Epoch> _metadata_request_epochs;
 
             Metadata _metadata;
+
+            // Validated metadata for the most recent epochs, so that
+            // repeated lookups in an epoch need no metadata round trip
+            std::map<Epoch, Metadata> _metadata_cache;
             MyPrivKey _privkey;
 
+            // The keys derived for each buddy in recent epochs
+            typename LookupKeyCache<BuddyKey,MyPrivKey>::type _key_cache;
+
+            // The PIR engine for the current metadata, built by the
+            // first PIR lookup that needs it
+            PIREngineRef _pir_engine;
+
+            // The cost model that chooses how to carry out lookups: the
+            // one passed to set_cost_model (not owned), or if none,
+            // _measured_cost_model
+            LookupCostModel *_cost_model;
+            MeasuredCostModel _measured_cost_model;
+
         public:
             GenericLookupClient(const MyPrivKey & privkey) :
-                _privkey(privkey) {}
+                _privkey(privkey),
+                _key_cache(LookupKeyCache<BuddyKey,MyPrivKey>::make(privkey)),
+                _cost_model(NULL)
+                {}
 
-            void metadata_request(string &msgtosend, Epoch epoch);
+            void metadata_request(std::string &msgtosend, Epoch epoch);
             // Consume the reply to a metadata request.  Return 0 on success,
             // non-0 on failure.
             int metadata_reply(const std::string &metadata);
 
+            // Consume the reply to a metadata request made ahead of
+            // time, such as for the next epoch as soon as the lookup
+            // servers publish it.  The metadata is cached, but the
+            // current metadata is unchanged.  Return 0 on success,
+            // non-0 on failure.
+            int metadata_prefetch(const std::string &metadata);
+
+            // If validated metadata for epoch is cached, from an
+            // earlier metadata_reply or metadata_prefetch, make it
+            // current and return true.  The metadata request can then
+            // be skipped.
+            bool use_cached_metadata(Epoch epoch);
+
+            // The number of epochs whose metadata is cached
+            static const unsigned int METADATA_CACHE_EPOCHS = 4;
+
             // Look up some number of buddies.  Pass in the vector of buddies'
             // public keys, the number of lookup servers there are, and the
             // privacy level to use (the privacy level is the maximum number of
@@ -246,14 +626,82 @@ namespace dp5 {
 
             typedef BuddyPresence<BuddyKey> Presence;
             typedef LookupRequest<BuddyKey,MyPrivKey> Request;
+            typedef MultiLookupRequest<BuddyKey,MyPrivKey> MultiRequest;
+
+            // Look up the buddies of several identities at once.
+            // buddies[k] holds the buddies of the identity whose lookup
+            // client is clients[k]; every client must have the same
+            // current metadata.  The first client's cost model chooses
+            // how to carry out each of the requests.  req will be
+            // filled in with the requests to make.  Return 0 on
+            // success, non-0 on failure.
+            static int multi_lookup_request(MultiRequest & req,
+                const std::vector<GenericLookupClient *> & clients,
+                const std::vector<std::vector<BuddyKey> > & buddies,
+                unsigned int num_servers, unsigned int privacy_level);
 
-        private:
-            int buddy_hash_key(HashKey hashkey, const BuddyKey & buddy_key);
+            // Use model, which must outlive this client, to choose
+            // between PIR, downloading the whole database from one
+            // server, and downloading it in stripes from all of them.
+            // Pass NULL to go back to the client's own MeasuredCostModel.
+            void set_cost_model(LookupCostModel *model) {
+                _cost_model = model;
+            }
+            LookupCostModel &cost_model() {
+                return _cost_model ? *_cost_model : _measured_cost_model;
+            }
 
-        };
+            // Tell the cost model how long the reply to a metadata
+            // request sent to server took, in seconds
+            void observe_metadata(unsigned int server, double seconds) {
+                cost_model().observe_round_trip(server, seconds);
+            }
+
+            // Tell the cost model how long each server's reply to the
+            // messages from req.get_msgs() took, in seconds (negative
+            // for servers that were sent nothing or did not reply),
+            // and how long req took to decode them.  Call it after
+            // lookup_reply or decode.
+            void observe_lookup(const Request &req,
+                const std::vector<double> &reply_seconds);
+
+        private:
+            // Parse, check and cache the reply to a metadata request,
+            // into metadata.  Return 0 on success, non-0 on failure.
+            int parse_metadata(Metadata &metadata,
+                const std::string &reply);
+
+            // Fill in plans with the ways of carrying out a lookup of
+            // buckets_to_query buckets with the current metadata: the
+            // download first, so that it wins near-ties
+            void lookup_plans(std::vector<LookupPlan> &plans,
+                unsigned int buckets_to_query, unsigned int num_servers,
+                unsigned int privacy_level) const;
+
+            // Fill in states with the keys and bucket of each of
+            // buddies in the current epoch, and set buckets to their
+            // distinct buckets, in increasing order.  Return 0 on
+            // success, non-0 on failure.
+            int buddy_states_for(
+                std::vector<typename Request::BuddyState> & states,
+                std::vector<unsigned int> & buckets,
+                const std::vector<BuddyKey> & buddies);
+
+            // Choose how to look up the buddies in states, which are in
+            // num_buckets distinct buckets, and initialize req to do
+            // so, swapping states into it.  Return 0 on success, non-0
+            // on failure.
+            int init_request(Request & req,
+                std::vector<typename Request::BuddyState> & states,
+                unsigned int num_buckets, unsigned int num_servers,
+                unsigned int privacy_level);
+
+            // Fill in the hash key, data key, and additional data for
+            // each of states[i].pubkey in the current epoch.  Return 0 on
+            // success, non-0 on failure.
+            int buddy_keys(
+                std::vector<typename Request::BuddyState> & states);
 
-        // placeholder for private key
-        struct Empty {
         };
 
     }   // namespace dp5::internal
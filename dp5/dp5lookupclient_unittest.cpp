@@ -1,11 +1,16 @@
 #include "dp5lookupclient.h"
+#include "dp5lookupserver.h"
 
+#include <unistd.h>
 
 #include "gtest/gtest.h"
 
 using namespace dp5;
 using namespace dp5::internal;
 
+using std::string;
+using std::vector;
+
 typedef PubKey BuddyKey;
 
 class LookupClientTest : public ::testing::Test {
@@ -19,7 +24,7 @@ protected:
 	virtual void SetUp() {
 		unsigned int len = 2 + EPOCH_BYTES + PRFKEY_BYTES + 4 * UINT_BYTES;
 		metadata.assign(len, 0x01);
-		metadata[0] = METADATA_VERSION;
+		metadata[0] = METADATA_VERSION_NO_LADDER;
 		unsigned char epoch_bytes[EPOCH_BYTES];
 		epoch = 0x2323;
 		epoch_num_to_bytes(epoch_bytes, epoch);
@@ -32,8 +37,6 @@ protected:
 		genkeypair(pubkey, privkey);
 		validbuddy.push_back(pubkey);
 
-		ZZ_p::init(to_ZZ(256));
-
 		string buddy2;
 		buddy2.assign(PUBKEY_BYTES, 0x55);
 		randomPK.push_back(buddy2);
@@ -64,3 +67,554 @@ TEST_F(LookupClientTest, LookupRequest) {
 
 	ASSERT_EQ(client.lookup_request(request, randomPK, 2, 1), 0);
 }
+
+// The metadata for epoch, as a lookup server would send it
+static string metadata_for(const string &metadata, unsigned int epoch) {
+	unsigned char epoch_bytes[EPOCH_BYTES];
+	epoch_num_to_bytes(epoch_bytes, epoch);
+	return string(metadata).replace(2, 4, (char *) epoch_bytes, 4);
+}
+
+// The epoch a lookup request's messages are for
+static unsigned int request_epoch(DP5LookupClient::Request &request) {
+	vector<string> msgs = request.get_msgs();
+	for (size_t j = 0; j < msgs.size(); j++) {
+		if (msgs[j].size() >= 1 + EPOCH_BYTES) {
+			return epoch_bytes_to_num(
+				(const unsigned char *) msgs[j].data() + 1);
+		}
+	}
+	return 0;
+}
+
+TEST_F(LookupClientTest, MetadataCache) {
+	DP5LookupClient client(privkey);
+	string metadata_request;
+	DP5LookupClient::Request request;
+
+	// Nothing cached, and nothing asked for
+	EXPECT_FALSE(client.use_cached_metadata(epoch));
+	EXPECT_EQ(client.metadata_reply(metadata), 0x04);
+
+	client.metadata_request(metadata_request, epoch);
+	ASSERT_EQ(client.metadata_reply(metadata), 0);
+	EXPECT_TRUE(client.use_cached_metadata(epoch));
+
+	// Prefetching the next epoch's leaves the current metadata alone
+	client.metadata_request(metadata_request, epoch + 1);
+	ASSERT_EQ(client.metadata_prefetch(metadata_for(metadata, epoch + 1)),
+		0);
+	ASSERT_EQ(client.lookup_request(request, randomPK, 2, 1), 0);
+	EXPECT_EQ(request_epoch(request), epoch);
+
+	// Until it is used, with no further round trip
+	ASSERT_TRUE(client.use_cached_metadata(epoch + 1));
+	ASSERT_EQ(client.lookup_request(request, randomPK, 2, 1), 0);
+	EXPECT_EQ(request_epoch(request), epoch + 1);
+	ASSERT_TRUE(client.use_cached_metadata(epoch));
+	ASSERT_EQ(client.lookup_request(request, randomPK, 2, 1), 0);
+	EXPECT_EQ(request_epoch(request), epoch);
+
+	// Metadata for an epoch not asked for is refused, and not cached
+	client.metadata_request(metadata_request, epoch + 2);
+	EXPECT_EQ(client.metadata_reply(metadata_for(metadata, epoch + 3)),
+		0x05);
+	EXPECT_FALSE(client.use_cached_metadata(epoch + 3));
+
+	// Only the most recent epochs are kept
+	for (unsigned int e = epoch + 2;
+			e < epoch + 2 + DP5LookupClient::METADATA_CACHE_EPOCHS; e++) {
+		client.metadata_request(metadata_request, e);
+		ASSERT_EQ(client.metadata_reply(metadata_for(metadata, e)), 0);
+	}
+	EXPECT_FALSE(client.use_cached_metadata(epoch + 1));
+	EXPECT_TRUE(client.use_cached_metadata(epoch + 2));
+}
+
+// A database with the record of one buddy in it, and a download-mode
+// reply carrying it
+class LookupClientDownloadTest : public ::testing::Test {
+protected:
+	PubKey mypub, buddypub;
+	PrivKey mypriv, buddypriv;
+	Metadata md;
+	string db, data, reply;
+
+	void make_database(unsigned int num_buckets) {
+		genkeypair(mypub, mypriv);
+		genkeypair(buddypub, buddypriv);
+
+		md.epoch_len = 1800;
+		md.epoch = 0x2323;
+		md.dataenc_bytes = 32;
+		md.num_buckets = num_buckets;
+		md.bucket_size = 3;
+		random_bytes((unsigned char *) md.prfkey, PRFKEY_BYTES);
+		size_t record_bytes = HASHKEY_BYTES + md.dataenc_bytes;
+
+		// The database, with the buddy's record in the middle of its
+		// bucket
+		db.assign(md.num_buckets * md.bucket_size * record_bytes, '\0');
+		random_bytes((unsigned char *) &db[0], db.size());
+		BuddyKeyCache regkeys(buddypriv, BuddyKeyCache::REGISTER);
+		BuddyKeyCache::EpochKeys keys;
+		regkeys.epoch_keys(keys, md.epoch, mypub);
+		byte epoch_bytes[EPOCH_BYTES];
+		epoch_num_to_bytes(epoch_bytes, md.epoch);
+		string ad((char *) epoch_bytes, EPOCH_BYTES);
+		ad.append(mypub);
+		ad.append((char *) keys.shared_key, SHAREDKEY_BYTES);
+		data.assign(md.dataplain_bytes(), 'd');
+		string record((char *) keys.hash_key, HASHKEY_BYTES);
+		record += Enc(keys.data_key, data, ad);
+		PRF prf(md.prfkey, md.num_buckets);
+		unsigned int bucket = prf.M(keys.hash_key);
+		db.replace((bucket * md.bucket_size + 1) * record_bytes,
+			record_bytes, record);
+
+		reply.assign("\x82");
+		reply.append((char *) epoch_bytes, EPOCH_BYTES);
+		reply += db;
+	}
+};
+
+// A download-mode reply fed in small chunks must give the same answer
+// as the whole reply passed to lookup_reply
+TEST_F(LookupClientDownloadTest, Streamed) {
+	make_database(2);
+
+	DP5LookupClient client(mypriv);
+	string metadata_request;
+	client.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(client.metadata_reply(md.toString()), 0);
+
+	vector<PubKey> buddies(1, buddypub);
+	DP5LookupClient::Request request;
+	ASSERT_EQ(client.lookup_request(request, buddies, 2, 1), 0);
+	ASSERT_TRUE(request.is_download());
+	vector<string> msgs = request.get_msgs();
+	ASSERT_EQ(msgs.size(), 2u);
+
+	DP5LookupClient::Request whole(request), streamed(request);
+
+	vector<string> replies(2);
+	replies[msgs[0] == "" ? 1 : 0] = reply;
+	vector<DP5LookupClient::Presence> presence;
+	ASSERT_EQ(whole.lookup_reply(presence, replies), 0);
+	ASSERT_EQ(presence.size(), 1u);
+	EXPECT_TRUE(presence[0].is_online);
+	EXPECT_EQ(presence[0].data, data);
+
+	for (size_t off = 0; off < reply.size(); off += 7) {
+		size_t len = reply.size() - off < 7 ? reply.size() - off : 7;
+		ASSERT_EQ(streamed.download_feed(reply.data() + off, len), 0);
+	}
+	vector<DP5LookupClient::Presence> presence2;
+	ASSERT_EQ(streamed.download_finish(presence2), 0);
+	ASSERT_EQ(presence2.size(), 1u);
+	EXPECT_TRUE(presence2[0].is_online);
+	EXPECT_EQ(presence2[0].data, data);
+
+	// Adding the reply incrementally; decoding twice is fine
+	DP5LookupClient::Request incremental(request);
+	EXPECT_FALSE(incremental.can_decode());
+	ASSERT_EQ(incremental.add_reply(msgs[0] == "" ? 1 : 0, reply), 0);
+	EXPECT_TRUE(incremental.can_decode());
+	for (int i = 0; i < 2; i++) {
+		ASSERT_EQ(incremental.decode(presence2), 0);
+		ASSERT_EQ(presence2.size(), 1u);
+		EXPECT_EQ(presence2[0].data, data);
+	}
+
+	// A truncated database is an error
+	DP5LookupClient::Request truncated(request);
+	ASSERT_EQ(truncated.download_feed(reply.data(), reply.size() - 1), 0);
+	EXPECT_NE(truncated.download_finish(presence2), 0);
+}
+
+// A cost model that always chooses plans using one method
+class ForcedCostModel : public LookupCostModel {
+public:
+	ForcedCostModel(LookupPlan::Method method) : _method(method) {}
+	virtual double expected_seconds(const LookupPlan &plan) const {
+		return plan.method == _method ? 0 : 1;
+	}
+private:
+	LookupPlan::Method _method;
+};
+
+// A ranged download asks each server for a stripe of the database, and
+// needs every stripe
+TEST_F(LookupClientDownloadTest, Ranged) {
+	make_database(7);
+	const size_t header_bytes = 1 + EPOCH_BYTES;
+	const size_t bucket_bytes =
+		md.bucket_size * (HASHKEY_BYTES + md.dataenc_bytes);
+
+	DP5LookupClient client(mypriv);
+	ForcedCostModel ranged(LookupPlan::RANGED_DOWNLOAD);
+	client.set_cost_model(&ranged);
+	string metadata_request;
+	client.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(client.metadata_reply(md.toString()), 0);
+
+	vector<PubKey> buddies(1, buddypub);
+	DP5LookupClient::Request request;
+	ASSERT_EQ(client.lookup_request(request, buddies, 3, 1), 0);
+	ASSERT_FALSE(request.is_download());
+	ASSERT_EQ(request.plan().method, LookupPlan::RANGED_DOWNLOAD);
+	vector<string> msgs = request.get_msgs();
+	ASSERT_EQ(msgs.size(), 3u);
+
+	// The stripes cover the database in order
+	vector<string> replies(3);
+	unsigned int next = 0;
+	for (unsigned int j = 0; j < 3; j++) {
+		ASSERT_EQ(msgs[j].size(), header_bytes + 2 * UINT_BYTES);
+		EXPECT_EQ((unsigned char) msgs[j][0], 0xf7);
+		unsigned int first = uint_bytes_to_num(
+			(const unsigned char *) msgs[j].data() + header_bytes);
+		unsigned int count = uint_bytes_to_num(
+			(const unsigned char *) msgs[j].data() + header_bytes +
+			UINT_BYTES);
+		EXPECT_EQ(first, next);
+		next = first + count;
+		replies[j] = reply.substr(0, header_bytes) +
+			db.substr(first * bucket_bytes, count * bucket_bytes);
+	}
+	EXPECT_EQ(next, md.num_buckets);
+
+	DP5LookupClient::Request incremental(request);
+	vector<DP5LookupClient::Presence> presence;
+	ASSERT_EQ(request.lookup_reply(presence, replies), 0);
+	ASSERT_EQ(presence.size(), 1u);
+	EXPECT_TRUE(presence[0].is_online);
+	EXPECT_EQ(presence[0].data, data);
+
+	// Every stripe is needed, and must be whole
+	for (unsigned int j = 0; j < 3; j++) {
+		EXPECT_FALSE(incremental.can_decode());
+		EXPECT_NE(incremental.add_reply(j,
+			replies[j] + string(1, '\0')), 0);
+		ASSERT_EQ(incremental.add_reply(j, replies[j]), 0);
+	}
+	ASSERT_TRUE(incremental.can_decode());
+	ASSERT_EQ(incremental.decode(presence), 0);
+	EXPECT_EQ(presence[0].data, data);
+
+	// Not streamed
+	EXPECT_NE(incremental.download_feed(reply.data(), reply.size()), 0);
+
+	// The timings go to the cost model in use
+	MeasuredCostModel measured;
+	client.set_cost_model(&measured);
+	client.observe_metadata(2, 0.25);
+	client.observe_lookup(request, vector<double>(3, 1.0));
+	EXPECT_EQ(measured.round_trip(2), 0.25);
+	EXPECT_EQ(measured.round_trip(0), MeasuredCostModel::PRIOR_ROUND_TRIP);
+}
+
+// The cost model weighs the servers' processing as well as the bytes
+// sent: PIR queries of servers that turn out to be slow lose out to a
+// download of the database
+TEST_F(LookupClientDownloadTest, SlowServers) {
+	make_database(2000);
+
+	DP5LookupClient client(mypriv);
+	string metadata_request;
+	client.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(client.metadata_reply(md.toString()), 0);
+
+	vector<PubKey> buddies(1, buddypub);
+	DP5LookupClient::Request request;
+	ASSERT_EQ(client.lookup_request(request, buddies, 3, 1), 0);
+	ASSERT_EQ(request.plan().method, LookupPlan::PIR);
+
+	for (int i = 0; i < 10; i++) {
+		client.observe_lookup(request, vector<double>(3, 100.0));
+	}
+	ASSERT_EQ(client.lookup_request(request, buddies, 3, 1), 0);
+	EXPECT_NE(request.plan().method, LookupPlan::PIR);
+}
+
+// A multi-identity lookup pools the identities' buckets into one
+// request, and hands each identity the presence of its own buddies
+TEST_F(LookupClientDownloadTest, MultiIdentity) {
+	make_database(5);
+
+	// The buddy is online to mypub only
+	PubKey otherpub;
+	PrivKey otherpriv;
+	genkeypair(otherpub, otherpriv);
+	DP5LookupClient me(mypriv), other(otherpriv);
+	ForcedCostModel download(LookupPlan::DOWNLOAD), pir(LookupPlan::PIR);
+	me.set_cost_model(&download);
+	other.set_cost_model(&pir);
+	string metadata_request;
+	me.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(me.metadata_reply(md.toString()), 0);
+	other.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(other.metadata_reply(md.toString()), 0);
+
+	vector<DP5LookupClient *> clients;
+	clients.push_back(&other);
+	clients.push_back(&me);
+	vector<vector<PubKey> > buddies(2);
+	buddies[0].push_back(buddypub);
+	buddies[0].push_back(mypub);
+	buddies[1].push_back(buddypub);
+
+	// The first client's cost model is the one used
+	DP5LookupClient::MultiRequest request;
+	ASSERT_EQ(DP5LookupClient::multi_lookup_request(request, clients,
+		buddies, 2, 1), 0);
+	ASSERT_FALSE(request.request(0).is_download());
+	clients[0] = &me;
+	clients[1] = &other;
+	buddies[0].swap(buddies[1]);
+	ASSERT_EQ(DP5LookupClient::multi_lookup_request(request, clients,
+		buddies, 2, 1), 0);
+	ASSERT_EQ(request.num_requests(), 1u);
+	EXPECT_EQ(request.request_of(1), 0u);
+	ASSERT_TRUE(request.request(0).is_download());
+
+	vector<vector<string> > msgs = request.get_msgs();
+	ASSERT_EQ(msgs.size(), 1u);
+	ASSERT_EQ(msgs[0].size(), 2u);
+	vector<vector<string> > replies(1, vector<string>(2));
+	replies[0][msgs[0][0] == "" ? 1 : 0] = reply;
+	vector<vector<DP5LookupClient::Presence> > presence;
+	ASSERT_EQ(request.lookup_reply(presence, replies), 0);
+	ASSERT_EQ(presence.size(), 2u);
+	ASSERT_EQ(presence[0].size(), 1u);
+	EXPECT_TRUE(presence[0][0].is_online);
+	EXPECT_EQ(presence[0][0].data, data);
+	ASSERT_EQ(presence[1].size(), 2u);
+	EXPECT_EQ(presence[1][0].pubkey, buddypub);
+	EXPECT_FALSE(presence[1][0].is_online);
+	EXPECT_EQ(presence[1][1].pubkey, mypub);
+	EXPECT_FALSE(presence[1][1].is_online);
+
+	// The clients must agree on the metadata
+	Metadata later(md);
+	later.epoch++;
+	other.metadata_request(metadata_request, later.epoch);
+	ASSERT_EQ(other.metadata_reply(later.toString()), 0);
+	EXPECT_NE(DP5LookupClient::multi_lookup_request(request, clients,
+		buddies, 2, 1), 0);
+}
+
+// Identities whose buckets together are more than a query can ask for
+// are split across requests
+TEST(LookupClientMultiTest, Groups) {
+	Metadata md;
+	md.epoch_len = 1800;
+	md.epoch = 0x2323;
+	md.dataenc_bytes = 32;
+	md.num_buckets = 100000;
+	md.bucket_size = 10;
+	random_bytes((unsigned char *) md.prfkey, PRFKEY_BYTES);
+
+	// Three identities with 40 buddies each, in (all but surely)
+	// distinct buckets: two fit in a request, the third does not
+	vector<PrivKey> privs(3);
+	vector<DP5LookupClient *> clients;
+	vector<vector<PubKey> > buddies(3, vector<PubKey>(40));
+	for (unsigned int k = 0; k < 3; k++) {
+		PubKey pub;
+		genkeypair(pub, privs[k]);
+		clients.push_back(new DP5LookupClient(privs[k]));
+		string metadata_request;
+		clients[k]->metadata_request(metadata_request, md.epoch);
+		ASSERT_EQ(clients[k]->metadata_reply(md.toString()), 0);
+		for (unsigned int i = 0; i < buddies[k].size(); i++) {
+			PrivKey priv;
+			genkeypair(buddies[k][i], priv);
+		}
+	}
+
+	DP5LookupClient::MultiRequest request;
+	ASSERT_EQ(DP5LookupClient::multi_lookup_request(request, clients,
+		buddies, 3, 1), 0);
+	ASSERT_EQ(request.num_requests(), 2u);
+	EXPECT_EQ(request.request_of(0), 0u);
+	EXPECT_EQ(request.request_of(1), 0u);
+	EXPECT_EQ(request.request_of(2), 1u);
+
+	// A list of buddies that is too long is refused
+	buddies[1].resize(MAX_BUDDIES + 1);
+	EXPECT_NE(DP5LookupClient::multi_lookup_request(request, clients,
+		buddies, 3, 1), 0);
+
+	for (unsigned int k = 0; k < 3; k++) {
+		delete clients[k];
+	}
+}
+
+// PIR lookups in an epoch share one engine, which outlives the epoch
+// for as long as a request uses it
+TEST_F(LookupClientDownloadTest, SharedEngine) {
+	make_database(2000);
+	md.batch_pir = true;
+
+	DP5LookupClient client(mypriv);
+	ForcedCostModel pir(LookupPlan::PIR);
+	client.set_cost_model(&pir);
+	string metadata_request;
+	client.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(client.metadata_reply(md.toString()), 0);
+
+	vector<PubKey> buddies(1, buddypub);
+	DP5LookupClient::Request first, second;
+	ASSERT_EQ(client.lookup_request(first, buddies, 3, 1), 0);
+	ASSERT_EQ(client.lookup_request(second, buddies, 3, 1), 0);
+	const PIREngine *engine = first.pir_engine();
+	ASSERT_TRUE(engine != NULL);
+	EXPECT_EQ(second.pir_engine(), engine);
+	ASSERT_TRUE(engine->batch_code() != NULL);
+	EXPECT_EQ(engine->batch_code()->num_buckets(), md.num_buckets);
+
+	// The same metadata again keeps the engine
+	client.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(client.metadata_reply(md.toString()), 0);
+	ASSERT_EQ(client.lookup_request(second, buddies, 3, 1), 0);
+	EXPECT_EQ(second.pir_engine(), engine);
+
+	// A new epoch gets a new engine; the old request keeps its own
+	Metadata later(md);
+	later.epoch++;
+	client.metadata_request(metadata_request, later.epoch);
+	ASSERT_EQ(client.metadata_reply(later.toString()), 0);
+	ASSERT_EQ(client.lookup_request(second, buddies, 3, 1), 0);
+	EXPECT_NE(second.pir_engine(), engine);
+	EXPECT_EQ(second.pir_engine()->metadata().epoch, later.epoch);
+	DP5LookupClient::Request copied(first);
+	EXPECT_EQ(copied.pir_engine(), engine);
+	EXPECT_EQ(engine->metadata().epoch, md.epoch);
+	EXPECT_EQ(copied.get_msgs().size(), 3u);
+
+	// Downloads have none
+	ForcedCostModel download(LookupPlan::DOWNLOAD);
+	client.set_cost_model(&download);
+	ASSERT_EQ(client.lookup_request(second, buddies, 3, 1), 0);
+	EXPECT_TRUE(second.pir_engine() == NULL);
+}
+
+// PIR replies added one at a time, as they arrive from real lookup
+// servers: decoding needs privacy_level+1 of them, and later ones,
+// even a corrupted one, can still be added and decoded again
+TEST_F(LookupClientDownloadTest, IncrementalPIR) {
+	make_database(50);
+
+	char metadatafilename[] = "/tmp/.dp5.metadata.XXXXXXX";
+	char datafilename[] = "/tmp/.dp5.data.XXXXXXXX";
+	int metadatafd = mkstemp(metadatafilename);
+	ASSERT_GE(metadatafd, 0);
+	string metadatastr = md.toString();
+	ASSERT_EQ(write(metadatafd, metadatastr.data(), metadatastr.length()),
+		(ssize_t) metadatastr.length());
+	close(metadatafd);
+	int datafd = mkstemp(datafilename);
+	ASSERT_GE(datafd, 0);
+	ASSERT_EQ(write(datafd, db.data(), db.length()), (ssize_t) db.length());
+	close(datafd);
+	DP5LookupServer server(metadatafilename, datafilename);
+	unlink(metadatafilename);
+	unlink(datafilename);
+
+	DP5LookupClient client(mypriv);
+	ForcedCostModel pir(LookupPlan::PIR);
+	client.set_cost_model(&pir);
+	string metadata_request;
+	client.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(client.metadata_reply(md.toString()), 0);
+
+	// Five servers at privacy level 2: three replies are needed, and
+	// with all five, one of them may be wrong
+	vector<PubKey> buddies(1, buddypub);
+	DP5LookupClient::Request request;
+	ASSERT_EQ(client.lookup_request(request, buddies, 5, 2), 0);
+	ASSERT_EQ(request.plan().method, LookupPlan::PIR);
+	vector<string> msgs = request.get_msgs();
+	ASSERT_EQ(msgs.size(), 5u);
+	vector<string> replies(5);
+	for (unsigned int j = 0; j < 5; j++) {
+		server.process_request(replies[j], msgs[j]);
+		ASSERT_GT(replies[j].size(), 1u + EPOCH_BYTES);
+		ASSERT_EQ((unsigned char) replies[j][0], 0x81);
+	}
+
+	vector<DP5LookupClient::Presence> presence;
+	EXPECT_EQ(request.add_reply(5, replies[0]), 0x01);
+	EXPECT_EQ(request.add_reply(0, reply), 0x03);
+	for (unsigned int j = 0; j < 3; j++) {
+		EXPECT_FALSE(request.can_decode());
+		EXPECT_EQ(request.decode(presence), 0x05);
+		ASSERT_EQ(request.add_reply(j, replies[j]), 0);
+	}
+	ASSERT_TRUE(request.can_decode());
+	ASSERT_EQ(request.decode(presence), 0);
+	ASSERT_EQ(presence.size(), 1u);
+	EXPECT_TRUE(presence[0].is_online);
+	EXPECT_EQ(presence[0].data, data);
+
+	// An extra reply, used to check the answer
+	ASSERT_EQ(request.add_reply(3, replies[3]), 0);
+	ASSERT_EQ(request.decode(presence), 0);
+	EXPECT_TRUE(presence[0].is_online);
+	EXPECT_EQ(presence[0].data, data);
+
+	// And one that is wrong throughout, which is corrected
+	string corrupted(replies[4]);
+	for (size_t i = 1 + EPOCH_BYTES; i < corrupted.size(); i++) {
+		corrupted[i] ^= 0x5a;
+	}
+	ASSERT_EQ(request.add_reply(4, corrupted), 0);
+	ASSERT_EQ(request.decode(presence), 0);
+	ASSERT_EQ(presence.size(), 1u);
+	EXPECT_TRUE(presence[0].is_online);
+	EXPECT_EQ(presence[0].data, data);
+}
+
+// A lookup is padded to the smallest rung of the metadata's query-size
+// ladder that fits
+TEST(LookupClientLadderTest, PadsToRung) {
+	PubKey mypub;
+	PrivKey mypriv;
+	genkeypair(mypub, mypriv);
+
+	Metadata md;
+	md.epoch_len = 1800;
+	md.epoch = 0x2323;
+	md.dataenc_bytes = 32;
+	md.num_buckets = 1000;
+	md.bucket_size = 10;
+	md.num_query_sizes = 4;
+	md.query_sizes[1] = 5;
+	md.query_sizes[2] = 20;
+	md.query_sizes[3] = MAX_BUDDIES;
+	random_bytes((unsigned char *) md.prfkey, PRFKEY_BYTES);
+
+	DP5LookupClient client(mypriv);
+	string metadata_request;
+	client.metadata_request(metadata_request, md.epoch);
+	ASSERT_EQ(client.metadata_reply(md.toString()), 0);
+
+	// Three buddies, in two or three distinct buckets (all but surely)
+	vector<PubKey> buddies(3);
+	for (size_t i = 0; i < buddies.size(); i++) {
+		PrivKey priv;
+		genkeypair(buddies[i], priv);
+	}
+	DP5LookupClient::Request request;
+	ASSERT_EQ(client.lookup_request(request, buddies, 3, 1), 0);
+	ASSERT_FALSE(request.is_download());
+	vector<string> msgs = request.get_msgs();
+	ASSERT_EQ(msgs.size(), 3u);
+	for (size_t j = 0; j < msgs.size(); j++) {
+		ASSERT_GE(msgs[j].size(), 7u);
+		unsigned int numqs = (unsigned char) msgs[j][5] |
+			((unsigned char) msgs[j][6] << 8);
+		EXPECT_EQ(numqs, 5u);
+	}
+}
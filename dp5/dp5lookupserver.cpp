@@ -7,11 +7,14 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
 
 #include "dp5lookupserver.h"
+#include "dp5dpf.h"
+#include "dp5gf28.h"
 
 using namespace std;
 
@@ -23,8 +26,12 @@ using namespace dp5::internal;
 // filenames of the current metadata and data files.
 DP5LookupServer::DP5LookupServer(const char *metadatafilename,
 	const char *datafilename, nservers_t numthreads,
-	DistSplit splittype)
+	DistSplit splittype) : _metadatafilename(NULL),
+	_datafilename(NULL), _pirparams(NULL), _pirserverparams(NULL),
+	_datastore(NULL), _pirserver(NULL), _batchcode(NULL),
+	_loaded(NULL), _download_count(0)
 {
+    pthread_mutex_init(&_stats_lock, NULL);
     init(metadatafilename, datafilename, numthreads, splittype);
 }
 
@@ -33,10 +40,13 @@ void DP5LookupServer::init(const char *metadatafilename,
     const char *datafilename, nservers_t numthreads,
     DistSplit splittype)
 {
+    release();
     _metadatafilename = strdup(metadatafilename);
     _datafilename = strdup(datafilename);
     _numthreads = numthreads;
     _splittype = splittype;
+    _rung_counts.clear();
+    _download_count = 0;
 
     ifstream metadatafile(metadatafilename);
     if (!metadatafile) {
@@ -63,64 +73,131 @@ void DP5LookupServer::init(const char *metadatafilename,
         _pirserver = NULL;
         _datastore = NULL;
     }
+
+    _batchcode = NULL;
+    if (_datastore && _metadata.batch_pir &&
+	    _metadata.pir_backend == PIR_BACKEND_PERCY) {
+	_batchcode = new BatchCode(_metadata.num_buckets,
+	    BatchCode::num_partitions_for(MAX_BUDDIES), _metadata.prfkey);
+    }
+
+    _loaded = new Loaded(_pirparams, _pirserverparams, _datastore,
+	_pirserver, _batchcode);
 }
 
-// Copy constructor
-DP5LookupServer::DP5LookupServer(const DP5LookupServer &other)
+// Copy constructor: share other's loaded state
+DP5LookupServer::DP5LookupServer(const DP5LookupServer &other) :
+	_metadatafilename(other._metadatafilename ?
+	    strdup(other._metadatafilename) : NULL),
+	_datafilename(other._datafilename ?
+	    strdup(other._datafilename) : NULL),
+	_pirparams(other._pirparams),
+	_pirserverparams(other._pirserverparams),
+	_datastore(other._datastore), _pirserver(other._pirserver),
+	_batchcode(other._batchcode), _loaded(other._loaded),
+	_metadata(other._metadata), _numthreads(other._numthreads),
+	_splittype(other._splittype), _download_count(0)
 {
-    init(other._metadatafilename, other._datafilename,
-	    other._numthreads, other._splittype);
+    pthread_mutex_init(&_stats_lock, NULL);
+    if (_loaded) {
+	pthread_mutex_lock(&_loaded->refs_lock);
+	++_loaded->refs;
+	pthread_mutex_unlock(&_loaded->refs_lock);
+    }
 }
 
 // Assignment operator
-DP5LookupServer& DP5LookupServer::operator=(DP5LookupServer other)
+DP5LookupServer& DP5LookupServer::operator=(const DP5LookupServer &other)
 {
-    // Swap the fields of the temporary "other" with ours so things get
-    // properly freed
-    char *tmp = other._metadatafilename;
-    other._metadatafilename = _metadatafilename;
-    _metadatafilename = tmp;
-
-    tmp = other._datafilename;
-    other._datafilename = _datafilename;
-    _datafilename = tmp;
-
-    GF2EParams *tmpp = other._pirparams;
-    other._pirparams = _pirparams;
-    _pirparams = tmpp;
-
-    PercyServerParams *tmppsp = other._pirserverparams;
-    other._pirserverparams = _pirserverparams;
-    _pirserverparams = tmppsp;
-
-    FileDataStore *tmpfds = other._datastore;
-    other._datastore = _datastore;
-    _datastore = tmpfds;
+    // Swap our fields with those of a copy so that ours get properly
+    // released
+    if (this != &other) {
+	DP5LookupServer tmp(other);
+	swap(tmp);
+    }
+    return *this;
+}
 
-    PercyServer *tmpps = other._pirserver;
-    other._pirserver = _pirserver;
-    _pirserver = tmpps;
+// Exchange the state of two servers, other than their locks
+void DP5LookupServer::swap(DP5LookupServer &other)
+{
+    std::swap(_metadatafilename, other._metadatafilename);
+    std::swap(_datafilename, other._datafilename);
+    std::swap(_pirparams, other._pirparams);
+    std::swap(_pirserverparams, other._pirserverparams);
+    std::swap(_datastore, other._datastore);
+    std::swap(_pirserver, other._pirserver);
+    std::swap(_batchcode, other._batchcode);
+    std::swap(_loaded, other._loaded);
+    std::swap(_metadata, other._metadata);
+    std::swap(_numthreads, other._numthreads);
+    std::swap(_splittype, other._splittype);
+    _rung_counts.swap(other._rung_counts);
+    std::swap(_download_count, other._download_count);
+}
 
-    // copy other fields
-    _metadata = other._metadata;
-    _numthreads = other._numthreads;
-    _splittype = other._splittype;
+// Drop our reference to the loaded state, and forget the filenames
+void DP5LookupServer::release()
+{
+    if (_loaded) {
+	pthread_mutex_lock(&_loaded->refs_lock);
+	bool last = (--_loaded->refs == 0);
+	pthread_mutex_unlock(&_loaded->refs_lock);
+	if (last) {
+	    delete _loaded;
+	}
+	_loaded = NULL;
+    }
+    _pirparams = NULL;
+    _pirserverparams = NULL;
+    _datastore = NULL;
+    _pirserver = NULL;
+    _batchcode = NULL;
 
-    return *this;
+    free(_datafilename);
+    free(_metadatafilename);
+    _datafilename = NULL;
+    _metadatafilename = NULL;
 }
 
 // Destructor
 DP5LookupServer::~DP5LookupServer()
 {
-    if (_pirserver) {
-        delete _pirserver;
-        delete _datastore;
-        delete _pirserverparams;
-        delete _pirparams;
+    release();
+    pthread_mutex_destroy(&_stats_lock);
+}
+
+DP5LookupServer::Loaded::Loaded(GF2EParams *pp, PercyServerParams *psp,
+	FileDataStore *ds, PercyServer *ps, BatchCode *bc) :
+	pirparams(pp), pirserverparams(psp), datastore(ds), pirserver(ps),
+	batchcode(bc), refs(1)
+{
+    pthread_mutex_init(&refs_lock, NULL);
+}
+
+DP5LookupServer::Loaded::~Loaded()
+{
+    if (pirserver) {
+        delete pirserver;
+        delete datastore;
+        delete pirserverparams;
+        delete pirparams;
     }
+    delete batchcode;
+    pthread_mutex_destroy(&refs_lock);
+}
 
-    free(_datafilename);
-    free(_metadatafilename);
+// The requests answered so far: rungs maps each number of buckets a PIR
+// lookup asked for to the number of PIR requests for that many, and
+// downloads is the number of downloads of the whole database, or of
+// a stripe of it
+void DP5LookupServer::query_stats(map<unsigned int, unsigned long> &rungs,
+    unsigned long &downloads) const
+{
+    pthread_mutex_lock(&_stats_lock);
+    rungs = _rung_counts;
+    downloads = _download_count;
+    pthread_mutex_unlock(&_stats_lock);
 }
 
 // The glue API to the PIR layer (single-client version).  Pass a
@@ -186,6 +263,240 @@ clean:
     return ret ? 0 : -1;
 }
 
+// Expand a seeded PIR query, as produced by pir_query, into the full
+// query it stands for.  Return 0 on success, non-0 on failure.
+int DP5LookupServer::expand_seeded_query(string &query,
+    const string &seeded) const
+{
+    if (seeded.length() != 2 + PIRSEED_BYTES) {
+	return -1;
+    }
+    const unsigned char *data = (const unsigned char *) seeded.data();
+    unsigned int numqs = data[0] | (data[1] << 8);
+    size_t num_buckets = _metadata.num_buckets;
+
+    // A few bytes of seed can stand for a great deal of query, so
+    // allow no more than any client would ask for
+    if (numqs > MAX_BUDDIES) {
+	return -1;
+    }
+
+    query.assign(seeded, 0, 2);
+    query.resize(2 + numqs * num_buckets);
+    for (unsigned int q=0; q<numqs; ++q) {
+	if (PRG((unsigned char *) &query[2 + q * num_buckets], num_buckets,
+		data + 2, q)) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+// Set response to the concatenation, for each of numqs queries, of the
+// XOR of the buckets whose bits are set in that query's bit vector.
+// The vectors are bitslen bytes each, one after the other in bits, with
+// the bit for bucket x in bit (x & 7) of byte (x >> 3).  Return 0 on
+// success, non-0 on failure.
+//
+// This is the whole of the server's work for the DPF and Chor
+// backends.  It makes one pass over the database for all the queries,
+// so each bucket is read from memory once.
+int DP5LookupServer::xor_scan(string &response, const unsigned char *bits,
+    size_t bitslen, unsigned int numqs) const
+{
+    if (!_datastore) {
+	return -1;
+    }
+    unsigned int num_buckets = _metadata.num_buckets;
+    size_t block = _metadata.bucket_size *
+	(HASHKEY_BYTES + _metadata.dataenc_bytes);
+    response.assign(numqs * block, '\0');
+    unsigned char *out = (unsigned char *) &response[0];
+    const unsigned char *records =
+	(const unsigned char *) _datastore->get_data();
+    for (unsigned int x=0; x<num_buckets; ++x) {
+	const unsigned char *record = records + x * block;
+	unsigned int byte = x >> 3, bit = x & 7;
+	for (unsigned int q=0; q<numqs; ++q) {
+	    if ((bits[q * bitslen + byte] >> bit) & 1) {
+		GF28::add(out + q * block, record, block);
+	    }
+	}
+    }
+    return 0;
+}
+
+// Answer a DPF PIR query, as produced by pir_query when the metadata
+// selects the DPF backend.  Return 0 on success, non-0 on failure.
+int DP5LookupServer::dpf_process(string &response, const string &request)
+    const
+{
+    if (_metadata.pir_backend != PIR_BACKEND_DPF || request.length() < 2) {
+	return -1;
+    }
+    const unsigned char *data = (const unsigned char *) request.data();
+    unsigned int numqs = data[0] | (data[1] << 8);
+    unsigned int num_buckets = _metadata.num_buckets;
+    size_t keylen = DPF::key_bytes(num_buckets);
+
+    // Every query costs a pass over the whole database, so allow no
+    // more than any client would ask for
+    if (numqs > MAX_BUDDIES || request.length() != 2 + numqs * keylen) {
+	return -1;
+    }
+
+    // Each query's share of the indicator vector of the bucket it wants
+    size_t bitslen = DPF::eval_bytes(num_buckets);
+    vector<unsigned char> bits(numqs * bitslen);
+    for (unsigned int q=0; q<numqs; ++q) {
+	if (DPF::eval_all(&bits[q * bitslen], data + 2 + q * keylen,
+		num_buckets)) {
+	    return -1;
+	}
+    }
+    return xor_scan(response, numqs ? &bits[0] : NULL, bitslen, numqs);
+}
+
+// Answer a Chor PIR query, as produced by pir_query when the metadata
+// selects the Chor backend.  Return 0 on success, non-0 on failure.
+int DP5LookupServer::chor_process(string &response, const string &request)
+    const
+{
+    if (_metadata.pir_backend != PIR_BACKEND_CHOR || request.length() < 2) {
+	return -1;
+    }
+    const unsigned char *data = (const unsigned char *) request.data();
+    unsigned int numqs = data[0] | (data[1] << 8);
+    size_t bitslen = (_metadata.num_buckets + 7) / 8;
+    if (request.length() != 2 + numqs * bitslen) {
+	return -1;
+    }
+    return xor_scan(response, data + 2, bitslen, numqs);
+}
+
+// Answer a batch PIR query, as produced by batch_query, with a query
+// for each partition of the batch code.  Return 0 on success, non-0 on
+// failure.
+//
+// The query for partition p has a byte for each bucket in it, a share
+// of the unit vector picking out the bucket wanted from p, exactly as
+// if p were the whole database.  So the reply for p is the sum of
+// those bytes times the buckets, and the servers' work for all the
+// partitions together is NUM_HASHES passes over the database.
+int DP5LookupServer::batch_process(string &response, const string &request)
+    const
+{
+    if (!_batchcode || !_datastore || request.length() < 2) {
+	return -1;
+    }
+    const unsigned char *data = (const unsigned char *) request.data();
+    unsigned int numqs = data[0] | (data[1] << 8);
+    if (numqs != _batchcode->num_partitions() ||
+	    request.length() != 2 + _batchcode->total_size()) {
+	return -1;
+    }
+
+    size_t block = _metadata.bucket_size *
+	(HASHKEY_BYTES + _metadata.dataenc_bytes);
+    response.assign(numqs * block, '\0');
+    const unsigned char *records =
+	(const unsigned char *) _datastore->get_data();
+    const unsigned char *share = data + 2;
+    for (unsigned int p=0; p<numqs; ++p) {
+	unsigned char *out = (unsigned char *) &response[p * block];
+	const vector<unsigned int> &part = _batchcode->partition(p);
+	for (size_t i=0; i<part.size(); ++i) {
+	    GF28::mul_add(out, records + part[i] * block, block, share[i]);
+	}
+	share += part.size();
+    }
+    return 0;
+}
+
+// Answer a recursive PIR query, as produced by recursive_query, which
+// treats the database as a cube.  Return 0 on success, non-0 on
+// failure.
+//
+// Each query has a share of a unit vector of the cube's side for each
+// of its dimensions.  The first is used to add up the slices of the
+// cube along the first dimension (the buckets' most significant digit)
+// with those bytes as weights, leaving a cube of one less dimension;
+// each slice is a contiguous run of buckets, so this is one mul_add per
+// slice, and the one pass over the database is shared by all the
+// queries.  The rest of the shares then reduce each query's much
+// smaller cube in the same way, down to a single bucket.  The slices
+// past the end of the database are all zero, and are skipped.
+int DP5LookupServer::recursive_process(string &response,
+    const string &request) const
+{
+    if (_metadata.pir_backend != PIR_BACKEND_PERCY || !_datastore ||
+	    request.length() < 3) {
+	return -1;
+    }
+    const unsigned char *data = (const unsigned char *) request.data();
+    unsigned int numqs = data[0] | (data[1] << 8);
+    unsigned int depth = data[2];
+    if (depth < 1 || depth > _metadata.pir_depth) {
+	return -1;
+    }
+    unsigned int num_buckets = _metadata.num_buckets;
+    unsigned int side = pir_cube_side(num_buckets, depth);
+    size_t query_len = depth * side;
+
+    // Every query costs a pass over the whole database, so allow no
+    // more than any client would ask for
+    if (numqs > MAX_BUDDIES || request.length() != 3 + numqs * query_len) {
+	return -1;
+    }
+
+    size_t block = _metadata.bucket_size *
+	(HASHKEY_BYTES + _metadata.dataenc_bytes);
+    response.assign(numqs * block, '\0');
+    if (numqs == 0) {
+	return 0;
+    }
+
+    // The number of buckets in a slice of the cube along the first
+    // dimension
+    size_t slice = 1;
+    for (unsigned int k=1; k<depth; ++k) {
+	slice *= side;
+    }
+
+    // The first dimension, for every query at once
+    vector<unsigned char> cubes(numqs * slice * block, 0);
+    const unsigned char *records =
+	(const unsigned char *) _datastore->get_data();
+    for (unsigned int i=0; i<side && i * slice < num_buckets; ++i) {
+	size_t len = num_buckets - i * slice;
+	if (len > slice) len = slice;
+	for (unsigned int q=0; q<numqs; ++q) {
+	    GF28::mul_add(&cubes[q * slice * block],
+		records + i * slice * block, len * block,
+		data[3 + q * query_len + i]);
+	}
+    }
+
+    // The rest, one query at a time
+    vector<unsigned char> next(slice / side * block);
+    for (unsigned int q=0; q<numqs; ++q) {
+	unsigned char *cube = &cubes[q * slice * block];
+	size_t len = slice;
+	for (unsigned int k=1; k<depth; ++k) {
+	    const unsigned char *share = data + 3 + q * query_len + k * side;
+	    len /= side;
+	    memset(&next[0], 0, len * block);
+	    for (unsigned int i=0; i<side; ++i) {
+		GF28::mul_add(&next[0], cube + i * len * block, len * block,
+		    share[i]);
+	    }
+	    memcpy(cube, &next[0], len * block);
+	}
+	memcpy(&response[q * block], cube, block);
+    }
+    return 0;
+}
+
 // Process a received request from a lookup client.  This may be either
 // a metadata or a data request.  Set reply to the reply to return to
 // the client.
@@ -196,12 +507,15 @@ void DP5LookupServer::process_request(string &reply, const string &request)
 
     // Check for a well-formed command
     if (reqlen < 5 ||
-	    (reqdata[0] != 0xff && reqdata[0] != 0xfe && reqdata[0] != 0xfd)
+	    (reqdata[0] != 0xff && reqdata[0] != 0xfe && reqdata[0] != 0xfd
+	     && reqdata[0] != 0xfc && reqdata[0] != 0xfb && reqdata[0] != 0xfa
+	     && reqdata[0] != 0xf9 && reqdata[0] != 0xf8 && reqdata[0] != 0xf7)
 	    || epoch_bytes_to_num(reqdata+1) != _metadata.epoch) {
 	unsigned char errmsg[5];
-	if (reqlen > 0 && reqdata[0] == 0xfe) {
-	    errmsg[0] = 0x80;
-	} else if (reqlen > 0 && reqdata[1] == 0xfd) {
+	if (reqlen > 0 && (reqdata[0] == 0xfe || reqdata[0] == 0xfc ||
+		reqdata[0] == 0xfb || reqdata[0] == 0xfa ||
+		reqdata[0] == 0xf9 || reqdata[0] == 0xf8 ||
+		reqdata[0] == 0xfd || reqdata[0] == 0xf7)) {
 	    errmsg[0] = 0x80;
 	} else {
 	    errmsg[0] = 0x00;
@@ -218,11 +532,46 @@ void DP5LookupServer::process_request(string &reply, const string &request)
     	return;
     }
 
-    if (reqdata[0] == 0xfe) {
-	// PIR query
+    if (reqdata[0] == 0xfe || reqdata[0] == 0xfc || reqdata[0] == 0xfb ||
+	    reqdata[0] == 0xfa || reqdata[0] == 0xf9 || reqdata[0] == 0xf8) {
+	// PIR query, possibly seeded, or DPF, Chor, batch or recursive
+	// query
 	string pirquery((const char *)reqdata+5, reqlen-5);
 	string pirresp;
-	int ret = pir_process(pirresp, pirquery);
+	int ret = 0;
+
+	// Every lookup is padded to a rung of the query-size ladder, so
+	// that the servers learn little about how many buddies it is for;
+	// a request for any other number of buckets would stand out, and
+	// is refused.  A batch query is for the top rung.
+	unsigned int rung = MAX_BUDDIES;
+	if (reqdata[0] != 0xf9) {
+	    rung = reqlen >= 7 ? (reqdata[5] | (reqdata[6] << 8)) : 0;
+	    if (!_metadata.is_query_size(rung)) {
+		ret = -1;
+	    }
+	}
+
+	if (ret) {
+	    // Not on the ladder
+	} else if (reqdata[0] == 0xfb) {
+	    ret = dpf_process(pirresp, pirquery);
+	} else if (reqdata[0] == 0xfa) {
+	    ret = chor_process(pirresp, pirquery);
+	} else if (reqdata[0] == 0xf9) {
+	    ret = batch_process(pirresp, pirquery);
+	} else if (reqdata[0] == 0xf8) {
+	    ret = recursive_process(pirresp, pirquery);
+	} else {
+	    if (reqdata[0] == 0xfc) {
+		string seeded;
+		seeded.swap(pirquery);
+		ret = expand_seeded_query(pirquery, seeded);
+	    }
+	    if (!ret) {
+		ret = pir_process(pirresp, pirquery);
+	    }
+	}
 	if (ret) {
 	    // Error occurred
 	    unsigned char errmsg[5];
@@ -231,6 +580,10 @@ void DP5LookupServer::process_request(string &reply, const string &request)
 	    reply.assign((char *) errmsg, 5);
 	    return;
 	}
+	pthread_mutex_lock(&_stats_lock);
+	++_rung_counts[rung];
+	pthread_mutex_unlock(&_stats_lock);
+
 	unsigned char repmsg[5];
 	repmsg[0] = 0x81;
 	epoch_num_to_bytes(repmsg+1, _metadata.epoch);
@@ -239,17 +592,39 @@ void DP5LookupServer::process_request(string &reply, const string &request)
 	return;
     }
 
-    if (reqdata[0] == 0xfd) {
-	// Request for the whole data file
+    if (reqdata[0] == 0xfd || reqdata[0] == 0xf7) {
+	// Request for the whole data file, or a range of its buckets
+	uint64_t bucket_bytes = (uint64_t) _metadata.bucket_size *
+	    (HASHKEY_BYTES + _metadata.dataenc_bytes);
+	uint64_t first = 0, count = _metadata.num_buckets;
+	bool ok = true;
+	if (reqdata[0] == 0xf7) {
+	    ok = (reqlen == 5 + 2*UINT_BYTES);
+	    if (ok) {
+		first = uint_bytes_to_num(reqdata+5);
+		count = uint_bytes_to_num(reqdata+5+UINT_BYTES);
+	    }
+	}
+	if (!ok || first + count > _metadata.num_buckets) {
+	    unsigned char errmsg[5];
+	    errmsg[0] = 0x80;
+	    epoch_num_to_bytes(errmsg+1, _metadata.epoch);
+	    reply.assign((char *) errmsg, 5);
+	    return;
+	}
+
+	pthread_mutex_lock(&_stats_lock);
+	++_download_count;
+	pthread_mutex_unlock(&_stats_lock);
+
 	unsigned char repmsg[5];
 	repmsg[0] = 0x82;
 	epoch_num_to_bytes(repmsg+1, _metadata.epoch);
 	reply.assign((char *) repmsg, 5);
-    if (_datastore) {
-    	reply.append((const char *)(_datastore->get_data()),
-    	    _metadata.num_buckets * _metadata.bucket_size *
-    	    (HASHKEY_BYTES + _metadata.dataenc_bytes));
-    }
+	if (_datastore) {
+	    reply.append((const char *)(_datastore->get_data()) +
+		first * bucket_bytes, count * bucket_bytes);
+	}
 	return;
     }
 
@@ -313,6 +688,17 @@ void test_pirglue(int num_blocks_to_fetch)
     	servers[s].init("metadata.out", "data.out");
     }
 
+    // Let the servers answer lookups of num_blocks_to_fetch buckets
+    if (num_blocks_to_fetch > 1 &&
+	    (unsigned int) num_blocks_to_fetch < MAX_BUDDIES) {
+	for(unsigned int s=0; s<num_servers; ++s) {
+	    Metadata &md = servers[s]._metadata;
+	    md.num_query_sizes = 3;
+	    md.query_sizes[1] = num_blocks_to_fetch;
+	    md.query_sizes[2] = MAX_BUDDIES;
+	}
+    }
+
     PIRRequest req;
     req.init(num_servers, 2, servers[0].getMetadata(),
         servers[0].getConfig().dataenc_bytes + HASHKEY_BYTES);
@@ -349,12 +735,176 @@ void test_pirglue(int num_blocks_to_fetch)
 	responses.push_back(resp);
     }
 
+    // Decoding from just privacy_level+1 of the replies, with a copy of
+    // the request, must give the same answer as from all of them
+    PIRRequest early(req);
+    vector<string> early_responses(responses);
+    early_responses[0] = "";
+    early_responses[num_servers-1] = "";
+    vector<string> early_buckets;
+    res = early.pir_response(early_buckets, early_responses);
+    if (res) {
+	throw runtime_error("Calling pir_response with 3 replies");
+    }
+
     vector<string> buckets;
 
     res = req.pir_response(buckets, responses);
     if (res) {
 	throw runtime_error("Calling pir_response");
     }
+    if (buckets != early_buckets) {
+	throw runtime_error("Early decode differs");
+    }
+
+    // The same lookup with seeded queries, through process_request
+    vector<bool> seeded;
+    res = req.pir_query(requests, bucketnums, &seeded);
+    if (res) {
+	throw runtime_error("Calling pir_query with seeds");
+    }
+    vector<string> seeded_responses;
+    for(unsigned int s=0; s<num_servers; ++s) {
+	unsigned char header[5];
+	header[0] = seeded[s] ? 0xfc : 0xfe;
+	epoch_num_to_bytes(header+1, servers[s].getMetadata().epoch);
+	string reply;
+	servers[s].process_request(reply,
+	    string((char *) header, 5) + requests[s]);
+	cerr << (seeded[s] ? "Seeded query " : "Query ") << s+1 <<
+	    " has length " << requests[s].length() << "\n";
+	if (reply.length() < 5 || (unsigned char) reply[0] != 0x81) {
+	    throw runtime_error("Calling process_request with seeds");
+	}
+	seeded_responses.push_back(reply.substr(5));
+    }
+    vector<string> seeded_buckets;
+    res = req.pir_response(seeded_buckets, seeded_responses);
+    if (res) {
+	throw runtime_error("Calling pir_response with seeds");
+    }
+    if (seeded_buckets != buckets) {
+	throw runtime_error("Seeded decode differs");
+    }
+
+    // The same lookup with recursive queries of depth 2 and 3, at
+    // privacy level 1.  At depth 2 the replies have degree 2, so one
+    // of the five can be wrong and still be corrected.
+    Metadata recursive_metadata(servers[0].getMetadata());
+    recursive_metadata.pir_depth = PIR_MAX_DEPTH;
+    for(unsigned int s=0; s<num_servers; ++s) {
+	servers[s]._metadata.pir_depth = PIR_MAX_DEPTH;
+    }
+    for (unsigned int depth=2; depth<=PIR_MAX_DEPTH; ++depth) {
+	PIRRequest recursive_req;
+	recursive_req.init(num_servers, 1, recursive_metadata,
+	    servers[0].getConfig().dataenc_bytes + HASHKEY_BYTES);
+	res = recursive_req.recursive_query(requests, bucketnums, depth);
+	if (res) {
+	    throw runtime_error("Calling recursive_query");
+	}
+	vector<string> recursive_responses;
+	for(unsigned int s=0; s<num_servers; ++s) {
+	    unsigned char header[5];
+	    header[0] = 0xf8;
+	    epoch_num_to_bytes(header+1, servers[s].getMetadata().epoch);
+	    string reply;
+	    servers[s].process_request(reply,
+		string((char *) header, 5) + requests[s]);
+	    cerr << "Depth " << depth << " query " << s+1 <<
+		" has length " << requests[s].length() << "\n";
+	    if (reply.length() < 5 || (unsigned char) reply[0] != 0x81) {
+		throw runtime_error("Calling process_request recursively");
+	    }
+	    recursive_responses.push_back(reply.substr(5));
+	}
+	if (depth == 2 && !recursive_responses[1].empty()) {
+	    recursive_responses[1][0] ^= 1;
+	}
+	vector<string> recursive_buckets;
+	res = recursive_req.pir_response(recursive_buckets,
+	    recursive_responses);
+	if (res) {
+	    throw runtime_error("Calling pir_response recursively");
+	}
+	if (recursive_buckets != buckets) {
+	    throw runtime_error("Recursive decode differs");
+	}
+    }
+
+    // The same lookup with the DPF backend, from two of the servers.
+    // The database is laid out the same way for either backend.
+    Metadata dpf_metadata(servers[0].getMetadata());
+    dpf_metadata.pir_backend = PIR_BACKEND_DPF;
+    servers[0]._metadata.pir_backend = PIR_BACKEND_DPF;
+    servers[1]._metadata.pir_backend = PIR_BACKEND_DPF;
+    PIRRequest dpf_req;
+    dpf_req.init(2, 1, dpf_metadata,
+        servers[0].getConfig().dataenc_bytes + HASHKEY_BYTES);
+    res = dpf_req.pir_query(requests, bucketnums, &seeded);
+    if (res) {
+	throw runtime_error("Calling pir_query with DPF");
+    }
+    vector<string> dpf_responses;
+    for(unsigned int s=0; s<2; ++s) {
+	unsigned char header[5];
+	header[0] = 0xfb;
+	epoch_num_to_bytes(header+1, servers[s].getMetadata().epoch);
+	string reply;
+	servers[s].process_request(reply,
+	    string((char *) header, 5) + requests[s]);
+	cerr << "DPF query " << s+1 << " has length " <<
+	    requests[s].length() << "\n";
+	if (reply.length() < 5 || (unsigned char) reply[0] != 0x81) {
+	    throw runtime_error("Calling process_request with DPF");
+	}
+	dpf_responses.push_back(reply.substr(5));
+    }
+    vector<string> dpf_buckets;
+    res = dpf_req.pir_response(dpf_buckets, dpf_responses);
+    if (res) {
+	throw runtime_error("Calling pir_response with DPF");
+    }
+    if (dpf_buckets != buckets) {
+	throw runtime_error("DPF decode differs");
+    }
+
+    // And with the Chor backend, from three of the servers
+    Metadata chor_metadata(servers[0].getMetadata());
+    chor_metadata.pir_backend = PIR_BACKEND_CHOR;
+    for(unsigned int s=0; s<3; ++s) {
+	servers[s]._metadata.pir_backend = PIR_BACKEND_CHOR;
+    }
+    PIRRequest chor_req;
+    chor_req.init(3, 2, chor_metadata,
+        servers[0].getConfig().dataenc_bytes + HASHKEY_BYTES);
+    res = chor_req.pir_query(requests, bucketnums, &seeded);
+    if (res) {
+	throw runtime_error("Calling pir_query with Chor");
+    }
+    vector<string> chor_responses;
+    for(unsigned int s=0; s<3; ++s) {
+	unsigned char header[5];
+	header[0] = 0xfa;
+	epoch_num_to_bytes(header+1, servers[s].getMetadata().epoch);
+	string reply;
+	servers[s].process_request(reply,
+	    string((char *) header, 5) + requests[s]);
+	cerr << "Chor query " << s+1 << " has length " <<
+	    requests[s].length() << "\n";
+	if (reply.length() < 5 || (unsigned char) reply[0] != 0x81) {
+	    throw runtime_error("Calling process_request with Chor");
+	}
+	chor_responses.push_back(reply.substr(5));
+    }
+    vector<string> chor_buckets;
+    res = chor_req.pir_response(chor_buckets, chor_responses);
+    if (res) {
+	throw runtime_error("Calling pir_response with Chor");
+    }
+    if (chor_buckets != buckets) {
+	throw runtime_error("Chor decode differs");
+    }
 
     size_t num_blocks = buckets.size();
     cerr << num_blocks << " blocks retrieved\n";
@@ -630,3 +1180,334 @@ int main(int argc, char **argv)
 }
 
 #endif // TEST_PIRMULTIC
+
+#ifdef TEST_PIRDECODEBENCH
+// Time the client's side of PIR: encoding a full-size query, and
+// reconstructing the replies, with and without the interpolation fast
+// path, when all the servers are honest and when one of them is not,
+// and with many servers, nearly half of them wrong.  Makes its own
+// random database.
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "dp5lookupclient.h"
+
+namespace dp5 {
+    using namespace dp5::internal;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Decode responses iters times with a copy of req each time, and return
+// the average time per decode
+static double time_decode(vector<string> &buckets, const PIRRequest &req,
+    const vector<string> &responses, bool fast_decode, int iters)
+{
+    double start = now();
+    for (int i=0; i<iters; ++i) {
+	PIRRequest decoder(req);
+	decoder.set_fast_decode(fast_decode);
+	if (decoder.pir_response(buckets, responses)) {
+	    throw runtime_error("Calling pir_response");
+	}
+    }
+    return (now() - start) / iters;
+}
+
+void test_pirdecodebench(unsigned int num_buckets, unsigned int bucket_size,
+    int iters)
+{
+    unsigned int num_servers = 5;
+    unsigned int privacy_level = 2;
+
+    Metadata metadata;
+    metadata.epoch = 1;
+    metadata.epoch_len = 1;
+    metadata.dataenc_bytes = 32;
+    metadata.num_buckets = num_buckets;
+    metadata.bucket_size = bucket_size;
+    unsigned int record_size = metadata.dataenc_bytes + HASHKEY_BYTES;
+
+    char metadatafilename[] = "/tmp/.dp5.bench.metadata.XXXXXX";
+    char datafilename[] = "/tmp/.dp5.bench.data.XXXXXX";
+    int metadatafd = mkstemp(metadatafilename);
+    int datafd = mkstemp(datafilename);
+    if (metadatafd < 0 || datafd < 0) {
+	throw runtime_error("Creating temporary files");
+    }
+    string metadatastr = metadata.toString();
+    string data(num_buckets * bucket_size * record_size, '\0');
+    random_bytes((unsigned char *) &data[0], data.size());
+    if (write(metadatafd, metadatastr.data(), metadatastr.size()) !=
+	    (ssize_t) metadatastr.size() ||
+	    write(datafd, data.data(), data.size()) != (ssize_t) data.size()) {
+	throw runtime_error("Writing temporary files");
+    }
+    close(metadatafd);
+    close(datafd);
+
+    vector<string> responses;
+    PIRRequest req;
+    unsigned int many_servers = 40;
+    unsigned int many_privacy_level = 5;
+    unsigned int many_wrong = (many_servers - many_privacy_level - 1) / 2;
+    vector<string> many_responses;
+    PIRRequest many_req;
+    req.init(num_servers, privacy_level, metadata, record_size);
+    vector<unsigned int> bucketnums;
+    for (unsigned int i=0; i<MAX_BUDDIES; ++i) {
+	bucketnums.push_back(lrand48() % num_buckets);
+    }
+    double encode_time;
+    {
+	DP5LookupServer server(metadatafilename, datafilename);
+	vector<string> requests;
+	double start = now();
+	for (int i=0; i<iters; ++i) {
+	    if (req.pir_query(requests, bucketnums)) {
+		throw runtime_error("Calling pir_query");
+	    }
+	}
+	encode_time = (now() - start) / iters;
+	for (unsigned int s=0; s<num_servers; ++s) {
+	    string resp;
+	    if (server.pir_process(resp, requests[s])) {
+		throw runtime_error("Calling pir_process");
+	    }
+	    responses.push_back(resp);
+	}
+
+	// Many servers, as many of them wrong throughout as can be
+	// corrected
+	many_req.init(many_servers, many_privacy_level, metadata,
+	    record_size);
+	if (many_req.pir_query(requests, bucketnums)) {
+	    throw runtime_error("Calling pir_query");
+	}
+	for (unsigned int s=0; s<many_servers; ++s) {
+	    string resp;
+	    if (server.pir_process(resp, requests[s])) {
+		throw runtime_error("Calling pir_process");
+	    }
+	    if (s < many_wrong) {
+		for (size_t b=0; b<resp.size(); ++b) resp[b] ^= 0x5a;
+	    }
+	    many_responses.push_back(resp);
+	}
+    }
+    unlink(metadatafilename);
+    unlink(datafilename);
+
+    size_t block_size = bucket_size * record_size;
+    vector<string> expected;
+    for (unsigned int i=0; i<bucketnums.size(); ++i) {
+	expected.push_back(data.substr(bucketnums[i] * block_size,
+	    block_size));
+    }
+
+    // One server flips a byte of its reply
+    vector<string> byzantine(responses);
+    byzantine[0][lrand48() % byzantine[0].size()] ^= 0x5a;
+
+    vector<string> slow, fast, slow_byz, fast_byz;
+    double slow_time = time_decode(slow, req, responses, false, iters);
+    double fast_time = time_decode(fast, req, responses, true, iters);
+    double slow_byz_time = time_decode(slow_byz, req, byzantine, false,
+	iters);
+    double fast_byz_time = time_decode(fast_byz, req, byzantine, true,
+	iters);
+    vector<string> many;
+    double many_time = time_decode(many, many_req, many_responses, true,
+	iters);
+
+    printf("%u buckets of %u records, %u servers, privacy level %u\n",
+	num_buckets, bucket_size, num_servers, privacy_level);
+    printf("encode:    %.3f ms\n", encode_time * 1000);
+    printf("honest:    %.3f ms -> %.3f ms %s\n", slow_time * 1000,
+	fast_time * 1000,
+	(slow == expected && fast == expected) ? "MATCH" : "NO MATCH");
+    printf("byzantine: %.3f ms -> %.3f ms %s\n", slow_byz_time * 1000,
+	fast_byz_time * 1000,
+	(slow_byz == expected && fast_byz == expected) ? "MATCH" :
+	"NO MATCH");
+    printf("%u servers, privacy level %u, %u wrong: %.3f ms %s\n",
+	many_servers, many_privacy_level, many_wrong, many_time * 1000,
+	many == expected ? "MATCH" : "NO MATCH");
+}
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int num_buckets = argc > 1 ? atoi(argv[1]) : 1000;
+    unsigned int bucket_size = argc > 2 ? atoi(argv[2]) : 10;
+    int iters = argc > 3 ? atoi(argv[3]) : 10;
+
+    ZZ_p::init(to_ZZ(256));
+    dp5::test_pirdecodebench(num_buckets, bucket_size, iters);
+
+    return 0;
+}
+
+#endif // TEST_PIRDECODEBENCH
+
+#ifdef TEST_PIRBACKENDBENCH
+// Time a PIR lookup of MAX_BUDDIES buckets with each of the backends,
+// and with batch and recursive queries: the client encoding the queries, one server
+// answering its query, and the client decoding the replies.  Makes its
+// own random database.
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "dp5lookupclient.h"
+
+namespace dp5 {
+    using namespace dp5::internal;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void bench_backend(const char *name, unsigned int pir_backend,
+    bool batch, unsigned int depth, unsigned char request_type,
+    unsigned int num_servers, unsigned int privacy_level, Metadata metadata,
+    const string &data, const vector<unsigned int> &bucketnums, int iters)
+{
+    metadata.pir_backend = pir_backend;
+    metadata.batch_pir = batch;
+    metadata.pir_depth = depth;
+    unsigned int record_size = metadata.dataenc_bytes + HASHKEY_BYTES;
+
+    char metadatafilename[] = "/tmp/.dp5.bench.metadata.XXXXXX";
+    char datafilename[] = "/tmp/.dp5.bench.data.XXXXXX";
+    int metadatafd = mkstemp(metadatafilename);
+    int datafd = mkstemp(datafilename);
+    if (metadatafd < 0 || datafd < 0) {
+	throw runtime_error("Creating temporary files");
+    }
+    string metadatastr = metadata.toString();
+    if (write(metadatafd, metadatastr.data(), metadatastr.size()) !=
+	    (ssize_t) metadatastr.size() ||
+	    write(datafd, data.data(), data.size()) != (ssize_t) data.size()) {
+	throw runtime_error("Writing temporary files");
+    }
+    close(metadatafd);
+    close(datafd);
+
+    PIRRequest req;
+    req.init(num_servers, privacy_level, metadata, record_size);
+    vector<string> requests;
+    double start = now();
+    for (int i=0; i<iters; ++i) {
+	if (batch ? req.batch_query(requests, bucketnums) :
+		depth > 1 ? req.recursive_query(requests, bucketnums, depth) :
+		req.pir_query(requests, bucketnums)) {
+	    throw runtime_error("Calling pir_query");
+	}
+    }
+    double encode_time = (now() - start) / iters;
+
+    unsigned char header[5];
+    header[0] = request_type;
+    epoch_num_to_bytes(header+1, metadata.epoch);
+    vector<string> responses(num_servers);
+    double server_time;
+    {
+	DP5LookupServer server(metadatafilename, datafilename);
+	string reply;
+	start = now();
+	for (int i=0; i<iters; ++i) {
+	    server.process_request(reply,
+		string((char *) header, 5) + requests[0]);
+	}
+	server_time = (now() - start) / iters;
+	for (unsigned int s=0; s<num_servers; ++s) {
+	    server.process_request(reply,
+		string((char *) header, 5) + requests[s]);
+	    if (reply.length() < 5 || (unsigned char) reply[0] != 0x81) {
+		throw runtime_error("Calling process_request");
+	    }
+	    responses[s] = reply.substr(5);
+	}
+    }
+    unlink(metadatafilename);
+    unlink(datafilename);
+
+    vector<string> buckets;
+    start = now();
+    for (int i=0; i<iters; ++i) {
+	PIRRequest decoder(req);
+	if (decoder.pir_response(buckets, responses)) {
+	    throw runtime_error("Calling pir_response");
+	}
+    }
+    double decode_time = (now() - start) / iters;
+
+    size_t block_size = metadata.bucket_size * record_size;
+    bool match = buckets.size() == bucketnums.size();
+    for (unsigned int i=0; match && i<bucketnums.size(); ++i) {
+	match = buckets[i] == data.substr(bucketnums[i] * block_size,
+	    block_size);
+    }
+
+    printf("%-6s %u servers: query %7lu bytes, encode %8.3f ms, "
+	"server %8.3f ms, decode %8.3f ms %s\n", name, num_servers,
+	(unsigned long) requests[0].length(), encode_time * 1000,
+	server_time * 1000, decode_time * 1000,
+	match ? "MATCH" : "NO MATCH");
+}
+
+void test_pirbackendbench(unsigned int num_buckets, unsigned int bucket_size,
+    int iters)
+{
+    Metadata metadata;
+    metadata.epoch = 1;
+    metadata.epoch_len = 1;
+    metadata.dataenc_bytes = 32;
+    metadata.num_buckets = num_buckets;
+    metadata.bucket_size = bucket_size;
+    unsigned int record_size = metadata.dataenc_bytes + HASHKEY_BYTES;
+
+    string data(num_buckets * bucket_size * record_size, '\0');
+    random_bytes((unsigned char *) &data[0], data.size());
+    vector<unsigned int> bucketnums;
+    for (unsigned int i=0; i<MAX_BUDDIES; ++i) {
+	bucketnums.push_back(lrand48() % num_buckets);
+    }
+
+    printf("%u buckets of %u records, %u buckets per lookup\n",
+	num_buckets, bucket_size, MAX_BUDDIES);
+    bench_backend("Percy", PIR_BACKEND_PERCY, false, 1, 0xfe, 5, 2,
+	metadata, data, bucketnums, iters);
+    bench_backend("Batch", PIR_BACKEND_PERCY, true, 1, 0xf9, 5, 2,
+	metadata, data, bucketnums, iters);
+    bench_backend("Depth2", PIR_BACKEND_PERCY, false, 2, 0xf8, 5, 2,
+	metadata, data, bucketnums, iters);
+    bench_backend("Depth3", PIR_BACKEND_PERCY, false, 3, 0xf8, 7, 2,
+	metadata, data, bucketnums, iters);
+    bench_backend("Chor", PIR_BACKEND_CHOR, false, 1, 0xfa, 2, 1,
+	metadata, data, bucketnums, iters);
+    bench_backend("DPF", PIR_BACKEND_DPF, false, 1, 0xfb, 2, 1,
+	metadata, data, bucketnums, iters);
+}
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int num_buckets = argc > 1 ? atoi(argv[1]) : 1000;
+    unsigned int bucket_size = argc > 2 ? atoi(argv[2]) : 10;
+    int iters = argc > 3 ? atoi(argv[3]) : 10;
+
+    ZZ_p::init(to_ZZ(256));
+    dp5::test_pirbackendbench(num_buckets, bucket_size, iters);
+
+    return 0;
+}
+
+#endif // TEST_PIRBACKENDBENCH
@@ -2,8 +2,11 @@
 #define __DP5LOOKUPSERVER_H__
 
 #include <string>
+#include <map>
+#include <pthread.h>
 #include "dp5params.h"
 #include "dp5metadata.h"
+#include "dp5batchcode.h"
 #include "percyserver.h"
 
 namespace dp5 {
@@ -23,15 +26,23 @@ public:
     // Default constructor
     DP5LookupServer() : _metadatafilename(NULL),
 	    _datafilename(NULL), _pirparams(NULL), _pirserverparams(NULL),
-	    _datastore(NULL), _pirserver(NULL), _metadata(),
+	    _datastore(NULL), _pirserver(NULL), _batchcode(NULL),
+	    _loaded(NULL), _metadata(),
 	    _numthreads(DEFAULT_NUM_THREADS),
-	    _splittype(DEFAULT_SPLIT_TYPE) {}
+	    _splittype(DEFAULT_SPLIT_TYPE), _download_count(0) {
+	pthread_mutex_init(&_stats_lock, NULL);
+    }
 
-    // Copy constructor
+    // Copy constructor.  The copy shares the data file and PIR state
+    // already loaded, rather than loading them again.  Its query_stats
+    // start from zero.
     DP5LookupServer(const DP5LookupServer &other);
 
-    // Assignment operator
-    DP5LookupServer& operator=(DP5LookupServer other);
+    // Assignment operator, which likewise shares the loaded state
+    DP5LookupServer& operator=(const DP5LookupServer &other);
+
+    // Exchange the state of two servers
+    void swap(DP5LookupServer &other);
 
     // Destructor
     ~DP5LookupServer();
@@ -51,6 +62,16 @@ public:
 
     const DP5Config & getConfig() { return _metadata; }
 
+    // The requests answered so far: rungs maps each number of buckets
+    // a PIR lookup asked for (a rung of the metadata's query-size
+    // ladder) to the number of PIR requests for that many, and
+    // downloads is the number of downloads of the whole database, or of
+    // a stripe of it.
+    // Each lookup sends a PIR request to several servers, so each
+    // server sees only its share of them.
+    void query_stats(std::map<unsigned int, unsigned long> &rungs,
+	unsigned long &downloads) const;
+
 private:
     // The glue API to the PIR layer (single-client version).  Pass a
     // request string as produced by pir_query.  reponse is filled in
@@ -64,6 +85,45 @@ private:
     // pir_response.  Return 0 on success, non-0 on failure.
     int pir_process(vector<string> &responses, const vector<string>&requests);
 
+    // Expand a seeded PIR query, as produced by pir_query, into the
+    // full query it stands for.  Return 0 on success, non-0 on failure.
+    int expand_seeded_query(std::string &query,
+	const std::string &seeded) const;
+
+    // Answer a DPF PIR query, as produced by pir_query when the
+    // metadata selects the DPF backend.  Return 0 on success, non-0 on
+    // failure.
+    int dpf_process(std::string &response, const std::string &request) const;
+
+    // Answer a Chor PIR query, as produced by pir_query when the
+    // metadata selects the Chor backend.  Return 0 on success, non-0 on
+    // failure.
+    int chor_process(std::string &response, const std::string &request)
+	const;
+
+    // Set response to the concatenation, for each of numqs queries, of
+    // the XOR of the buckets whose bits are set in that query's
+    // bitslen-byte bit vector in bits.  Return 0 on success, non-0 on
+    // failure.
+    int xor_scan(std::string &response, const unsigned char *bits,
+	size_t bitslen, unsigned int numqs) const;
+
+    // Answer a batch PIR query, as produced by batch_query, with a
+    // query for each partition of the batch code.  Return 0 on success,
+    // non-0 on failure.
+    int batch_process(std::string &response, const std::string &request)
+	const;
+
+    // Answer a recursive PIR query, as produced by recursive_query,
+    // which treats the database as a cube.  Return 0 on success, non-0
+    // on failure.
+    int recursive_process(std::string &response,
+	const std::string &request) const;
+
+    // Drop this server's reference to the loaded state, and forget
+    // the filenames
+    void release();
+
     // The metadata filename
     char *_metadatafilename;
 
@@ -80,6 +140,35 @@ private:
     // The PercyServer used to serve requests
     PercyServer *_pirserver;
 
+    // The layout of the partitions for batch PIR queries, if the
+    // metadata allows them
+    internal::BatchCode *_batchcode;
+
+    // The owner of the five objects above, which are loaded by init
+    // and shared by copies of the server.  The last server using them
+    // frees them.
+    struct Loaded {
+	GF2EParams *pirparams;
+	PercyServerParams *pirserverparams;
+	FileDataStore *datastore;
+	PercyServer *pirserver;
+	internal::BatchCode *batchcode;
+
+	// The number of servers using them, protected by refs_lock
+	unsigned long refs;
+	pthread_mutex_t refs_lock;
+
+	Loaded(GF2EParams *pp, PercyServerParams *psp, FileDataStore *ds,
+		PercyServer *ps, internal::BatchCode *bc);
+	~Loaded();
+
+    private:
+	// Not implemented
+	Loaded(const Loaded &);
+	Loaded& operator=(const Loaded &);
+    };
+    Loaded *_loaded;
+
     internal::Metadata _metadata;
 
     // The number of threads to use
@@ -89,6 +178,12 @@ private:
     // (DIST_SPLIT_RECORDS)?
     DistSplit _splittype;
 
+    // See query_stats.  Requests are processed concurrently, so the
+    // counts are protected by _stats_lock.
+    mutable pthread_mutex_t _stats_lock;
+    std::map<unsigned int, unsigned long> _rung_counts;
+    unsigned long _download_count;
+
 #ifdef TEST_PIRGLUE
     friend void test_pirglue(int num_blocks_to_fetch);
 #endif
@@ -99,6 +194,10 @@ private:
 #ifdef TEST_PIRMULTIC
     friend void test_pirmultic(int num_clients, int num_blocks_to_fetch);
 #endif
+#ifdef TEST_PIRDECODEBENCH
+    friend void test_pirdecodebench(unsigned int num_buckets,
+	unsigned int bucket_size, int iters);
+#endif
 };
 
 }
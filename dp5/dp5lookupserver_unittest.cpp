@@ -77,3 +77,153 @@ TEST_F(EmptyFileTest, Download) {
     EXPECT_EQ(reply.length(), (unsigned int) 5);
 }
 
+
+TEST_F(EmptyFileTest, WrongEpoch) {
+    DP5LookupServer ls(metadatafilename.c_str(), datafilename.c_str());
+    unsigned char request[5];
+    epoch_num_to_bytes(request+1, epoch + 1);
+    string reply;
+
+    // Downloads and PIR requests for another epoch get an error status
+    request[0] = 0xfd;
+    ls.process_request(reply, string((char *) request, 5));
+    EXPECT_EQ(reply[0], '\x80');
+    EXPECT_EQ(epoch_bytes_to_num((const unsigned char *) reply.data() + 1),
+        (unsigned int) epoch);
+
+    request[0] = 0xfe;
+    ls.process_request(reply, string((char *) request, 5));
+    EXPECT_EQ(reply[0], '\x80');
+
+    // Metadata requests still get 0x00
+    request[0] = 0xff;
+    ls.process_request(reply, string((char *) request, 5));
+    EXPECT_EQ(reply[0], '\x00');
+}
+
+TEST_F(EmptyFileTest, DownloadStats) {
+    DP5LookupServer ls(metadatafilename.c_str(), datafilename.c_str());
+    unsigned char request[5];
+    request[0] = 0xfd;
+    epoch_num_to_bytes(request+1, epoch);
+    string requeststr((char *) request, 5);
+    string reply;
+
+    ls.process_request(reply, requeststr);
+    ls.process_request(reply, requeststr);
+
+    map<unsigned int, unsigned long> rungs;
+    unsigned long downloads;
+    ls.query_stats(rungs, downloads);
+    EXPECT_EQ(downloads, 2u);
+    EXPECT_TRUE(rungs.empty());
+}
+
+// A small database served with the Chor backend, whose queries are
+// easy to write by hand, and a query-size ladder of {1, 2, MAX_BUDDIES}
+class LadderTest : public ::testing::Test {
+protected:
+    string metadatafilename;
+    string datafilename;
+    static const int epoch = 1234;
+
+    virtual void SetUp() {
+        char tempmetadata[] = "/tmp/.dp5.metadata.XXXXXXX";
+        char tempdata[] = "/tmp/.dp5.data.XXXXXXXX";
+
+        int metadatafd = mkstemp(tempmetadata);
+        ASSERT_GE(metadatafd, 0);
+
+        Metadata metadata;
+        metadata.epoch = epoch;
+        metadata.epoch_len = 1;
+        metadata.dataenc_bytes = 32;
+        metadata.num_buckets = 4;
+        metadata.bucket_size = 1;
+        metadata.pir_backend = PIR_BACKEND_CHOR;
+        metadata.num_query_sizes = 3;
+        metadata.query_sizes[1] = 2;
+        metadata.query_sizes[2] = MAX_BUDDIES;
+
+        string metadataStr = metadata.toString();
+        write(metadatafd, metadataStr.c_str(), metadataStr.length());
+        close(metadatafd);
+
+        int datafd = mkstemp(tempdata);
+        ASSERT_GE(datafd, 0);
+        string data(4 * (HASHKEY_BYTES + 32), '\x5a');
+        write(datafd, data.data(), data.length());
+        close(datafd);
+
+        metadatafilename.assign(tempmetadata, strlen(tempmetadata));
+        datafilename.assign(tempdata, strlen(tempdata));
+    }
+
+    virtual void TearDown() {
+        unlink(metadatafilename.c_str());
+        unlink(datafilename.c_str());
+    }
+
+    // A Chor query for numqs buckets, each asking for bucket 0
+    static string chor_request(unsigned int numqs) {
+        unsigned char header[7];
+        header[0] = 0xfa;
+        epoch_num_to_bytes(header+1, epoch);
+        header[5] = numqs & 0xff;
+        header[6] = numqs >> 8;
+        return string((char *) header, 7) + string(numqs, '\x01');
+    }
+};
+
+TEST_F(LadderTest, Rungs) {
+    DP5LookupServer ls(metadatafilename.c_str(), datafilename.c_str());
+    string reply;
+
+    ls.process_request(reply, chor_request(2));
+    EXPECT_EQ(reply[0], '\x81');
+    ls.process_request(reply, chor_request(1));
+    EXPECT_EQ(reply[0], '\x81');
+    ls.process_request(reply, chor_request(2));
+    EXPECT_EQ(reply[0], '\x81');
+
+    // Not on the ladder
+    ls.process_request(reply, chor_request(3));
+    EXPECT_EQ(reply[0], '\x80');
+
+    map<unsigned int, unsigned long> rungs;
+    unsigned long downloads;
+    ls.query_stats(rungs, downloads);
+    EXPECT_EQ(downloads, 0u);
+    EXPECT_EQ(rungs.size(), 2u);
+    EXPECT_EQ(rungs[1], 1u);
+    EXPECT_EQ(rungs[2], 2u);
+}
+
+// A ranged download gets just the stripe of buckets asked for
+TEST_F(LadderTest, RangedDownload) {
+    DP5LookupServer ls(metadatafilename.c_str(), datafilename.c_str());
+    unsigned char request[5 + 2*UINT_BYTES];
+    request[0] = 0xf7;
+    epoch_num_to_bytes(request+1, epoch);
+    string reply;
+
+    uint_num_to_bytes(request+5, 1);
+    uint_num_to_bytes(request+5+UINT_BYTES, 2);
+    ls.process_request(reply, string((char *) request, sizeof(request)));
+    EXPECT_EQ(reply[0], '\x82');
+    EXPECT_EQ(reply.length(), 5 + 2 * (HASHKEY_BYTES + 32));
+
+    // Past the end of the database
+    uint_num_to_bytes(request+5, 3);
+    ls.process_request(reply, string((char *) request, sizeof(request)));
+    EXPECT_EQ(reply[0], '\x80');
+
+    // Without the range
+    ls.process_request(reply, string((char *) request, 5));
+    EXPECT_EQ(reply[0], '\x80');
+
+    map<unsigned int, unsigned long> rungs;
+    unsigned long downloads;
+    ls.query_stats(rungs, downloads);
+    EXPECT_EQ(downloads, 1u);
+}
@@ -24,18 +24,19 @@ namespace dp5 {
 
 namespace internal {
 
-Metadata::Metadata() : epoch(0), num_buckets(0), bucket_size (0) {
+Metadata::Metadata() : epoch(0), num_buckets(0), bucket_size (0),
+    sorted_buckets(false) {
     memset(prfkey, 0, sizeof(prfkey));
 }
 
 Metadata::Metadata(const DP5Config & config) : DP5Config(config),
-    epoch(0), num_buckets(0), bucket_size(0) {
+    epoch(0), num_buckets(0), bucket_size(0), sorted_buckets(false) {
     memset(prfkey, 0, sizeof(prfkey));
 }
 
 Metadata::Metadata(const Metadata & other) :
     DP5Config(other), epoch(other.epoch), num_buckets(other.num_buckets),
-    bucket_size(other.bucket_size)
+    bucket_size(other.bucket_size), sorted_buckets(other.sorted_buckets)
 {
     memcpy(prfkey, other.prfkey, sizeof(prfkey));
 }
@@ -69,19 +70,38 @@ int Metadata::fromStream(istream & is) {
     is.exceptions(ios::eofbit | ios::failbit | ios::badbit);
     try {
         unsigned int version = is.get();
-        if (version != METADATA_VERSION) {
+        if (version != METADATA_VERSION &&
+                version != METADATA_VERSION_NO_LADDER &&
+                version != METADATA_VERSION_UNSORTED) {
             return 0x01;
         }
         unsigned int x = is.get();
-        if (x == 0) {
-            combined = false;
-        } else if (x == 1) {
-            combined = true;
-        } else {
+        unsigned int known_flags = METADATA_FLAG_COMBINED;
+        if (version != METADATA_VERSION_UNSORTED) {
+            known_flags |= METADATA_FLAG_SORTED |
+                METADATA_FLAG_BACKEND_MASK | METADATA_FLAG_BATCH |
+                METADATA_FLAG_DEPTH_MASK;
+        }
+        if (x & ~known_flags) {
             // we are not being liberal in what we accept
             // since any other value is almost certainly an error
             return 0x02;
         }
+        combined = (x & METADATA_FLAG_COMBINED) != 0;
+        sorted_buckets = (x & METADATA_FLAG_SORTED) != 0;
+        batch_pir = (x & METADATA_FLAG_BATCH) != 0;
+        pir_backend = (x & METADATA_FLAG_BACKEND_MASK) >>
+            METADATA_FLAG_BACKEND_SHIFT;
+        if (pir_backend != PIR_BACKEND_PERCY &&
+                pir_backend != PIR_BACKEND_DPF &&
+                pir_backend != PIR_BACKEND_CHOR) {
+            return 0x02;
+        }
+        pir_depth = ((x & METADATA_FLAG_DEPTH_MASK) >>
+            METADATA_FLAG_DEPTH_SHIFT) + 1;
+        if (pir_depth > PIR_MAX_DEPTH) {
+            return 0x02;
+        }
         // Read in rest of parameters
         epoch = read_epoch(is);
         dataenc_bytes = read_uint(is);
@@ -89,6 +109,19 @@ int Metadata::fromStream(istream & is) {
         num_buckets = read_uint(is);
         bucket_size = read_uint(is);
         is.read((char *) prfkey, sizeof(prfkey));
+        default_query_sizes();
+        if (version == METADATA_VERSION) {
+            num_query_sizes = is.get();
+            if (num_query_sizes < 1 || num_query_sizes > MAX_QUERY_SIZES) {
+                return 0x02;
+            }
+            for (unsigned int i = 0; i < MAX_QUERY_SIZES; ++i) {
+                query_sizes[i] = i < num_query_sizes ? read_uint(is) : 0;
+            }
+            if (!valid_query_sizes()) {
+                return 0x02;
+            }
+        }
         is.exceptions(exceptions);
     } catch (ios::failure f) {
         return 0x03;
@@ -119,14 +152,27 @@ unsigned int uint_bytes_to_num(const unsigned char uint_bytes[UINT_BYTES]) {
 }
 
 void Metadata::toStream(ostream & os) const {
-    os.put(METADATA_VERSION);
-    os.put(combined);
+    bool ladder = !has_default_query_sizes();
+    os.put(ladder ? METADATA_VERSION : METADATA_VERSION_NO_LADDER);
+    os.put((combined ? METADATA_FLAG_COMBINED : 0) |
+        (sorted_buckets ? METADATA_FLAG_SORTED : 0) |
+        (batch_pir ? METADATA_FLAG_BATCH : 0) |
+        ((pir_backend << METADATA_FLAG_BACKEND_SHIFT) &
+         METADATA_FLAG_BACKEND_MASK) |
+        (((pir_depth > 0 ? pir_depth - 1 : 0) << METADATA_FLAG_DEPTH_SHIFT) &
+         METADATA_FLAG_DEPTH_MASK));
     write_epoch(os, epoch);
     write_uint(os, dataenc_bytes);
     write_uint(os, epoch_len);
     write_uint(os, num_buckets);
     write_uint(os, bucket_size);
     os.write((char *) prfkey, sizeof(prfkey));
+    if (ladder) {
+        os.put(num_query_sizes);
+        for (unsigned int i = 0; i < num_query_sizes; ++i) {
+            write_uint(os, query_sizes[i]);
+        }
+    }
 }
 
 string Metadata::toString() const {
@@ -12,13 +12,38 @@ namespace dp5 {
         // Metadata for a given database
 
         static const unsigned int UINT_BYTES = 4;
-        static const unsigned int METADATA_VERSION = 0x02;
+        static const unsigned int METADATA_VERSION = 0x04;
+        // Version 0x03 metadata has no query-size ladder, and is
+        // written when the ladder is the default, so that older
+        // clients can still read it.
+        static const unsigned int METADATA_VERSION_NO_LADDER = 0x03;
+        // Version 0x02 metadata is still accepted; it has a combined
+        // byte where later versions have the flags byte.
+        static const unsigned int METADATA_VERSION_UNSORTED = 0x02;
+
+        // Bits of the flags byte
+        static const unsigned int METADATA_FLAG_COMBINED = 0x01;
+        static const unsigned int METADATA_FLAG_SORTED = 0x02;
+        // Two bits holding the PIR backend
+        static const unsigned int METADATA_FLAG_BACKEND_SHIFT = 2;
+        static const unsigned int METADATA_FLAG_BACKEND_MASK = 0x0c;
+        static const unsigned int METADATA_FLAG_BATCH = 0x10;
+        // Two bits holding one less than the greatest PIR recursion
+        // depth
+        static const unsigned int METADATA_FLAG_DEPTH_SHIFT = 5;
+        static const unsigned int METADATA_FLAG_DEPTH_MASK = 0x60;
+
         class Metadata : public DP5Config {
         public:
             PRFKey prfkey;
             unsigned int epoch;
             unsigned int num_buckets;
             unsigned int bucket_size;
+            // If true, the records in each bucket are sorted by hash
+            // key, and the unused space at the end of each bucket is
+            // filled with padding records whose hash keys are all 0xff
+            // bytes.  Otherwise the records are in no particular order.
+            bool sorted_buckets;
 
             Metadata(std::istream & is);
 
@@ -14,6 +14,14 @@ TEST(TestConfig, DefaultConstructor) {
     EXPECT_EQ(dp5.epoch_len, 0u);
     EXPECT_EQ(dp5.dataenc_bytes, 0u);
     EXPECT_EQ(dp5.combined, false);
+    EXPECT_EQ(dp5.pir_backend, PIR_BACKEND_PERCY);
+    EXPECT_EQ(dp5.batch_pir, false);
+    EXPECT_EQ(dp5.pir_depth, 1u);
+    EXPECT_EQ(dp5.num_query_sizes, 2u);
+    EXPECT_EQ(dp5.query_sizes[0], 1u);
+    EXPECT_EQ(dp5.query_sizes[1], MAX_BUDDIES);
+    EXPECT_TRUE(dp5.valid_query_sizes());
+    EXPECT_TRUE(dp5.has_default_query_sizes());
 }
 
 TEST(TestConfig, CopyConstructor) {
@@ -21,11 +29,53 @@ TEST(TestConfig, CopyConstructor) {
     dp5.epoch_len = 1234;
     dp5.dataenc_bytes = 5678;
     dp5.combined = true;
+    dp5.pir_backend = PIR_BACKEND_DPF;
+    dp5.batch_pir = true;
+    dp5.pir_depth = 3;
+    dp5.num_query_sizes = 3;
+    dp5.query_sizes[1] = 20;
+    dp5.query_sizes[2] = MAX_BUDDIES;
 
     DP5Config copy(dp5);
     EXPECT_EQ(dp5.epoch_len, copy.epoch_len);
     EXPECT_EQ(dp5.dataenc_bytes, copy.dataenc_bytes);
     EXPECT_EQ(dp5.combined, copy.combined);
+    EXPECT_EQ(dp5.pir_backend, copy.pir_backend);
+    EXPECT_EQ(dp5.batch_pir, copy.batch_pir);
+    EXPECT_EQ(dp5.pir_depth, copy.pir_depth);
+    EXPECT_EQ(dp5.num_query_sizes, copy.num_query_sizes);
+    EXPECT_EQ(copy.query_sizes[1], 20u);
+    EXPECT_EQ(copy.query_sizes[2], MAX_BUDDIES);
+}
+
+TEST(TestConfig, QuerySizes) {
+    DP5Config dp5;
+    EXPECT_EQ(dp5.query_size_for(0), 1u);
+    EXPECT_EQ(dp5.query_size_for(1), 1u);
+    EXPECT_EQ(dp5.query_size_for(2), MAX_BUDDIES);
+
+    dp5.num_query_sizes = 4;
+    dp5.query_sizes[0] = 1;
+    dp5.query_sizes[1] = 5;
+    dp5.query_sizes[2] = 20;
+    dp5.query_sizes[3] = MAX_BUDDIES;
+    EXPECT_TRUE(dp5.valid_query_sizes());
+    EXPECT_FALSE(dp5.has_default_query_sizes());
+    EXPECT_EQ(dp5.query_size_for(2), 5u);
+    EXPECT_EQ(dp5.query_size_for(5), 5u);
+    EXPECT_EQ(dp5.query_size_for(6), 20u);
+    EXPECT_EQ(dp5.query_size_for(21), MAX_BUDDIES);
+    EXPECT_TRUE(dp5.is_query_size(20));
+    EXPECT_FALSE(dp5.is_query_size(19));
+
+    // Out of order, or not ending with MAX_BUDDIES
+    dp5.query_sizes[2] = 4;
+    EXPECT_FALSE(dp5.valid_query_sizes());
+    dp5.query_sizes[2] = 20;
+    dp5.query_sizes[3] = 50;
+    EXPECT_FALSE(dp5.valid_query_sizes());
+    dp5.num_query_sizes = 0;
+    EXPECT_FALSE(dp5.valid_query_sizes());
 }
 
 TEST(TestConfig, Valid) {
@@ -47,6 +97,16 @@ TEST(TestConfig, CurrentEpoch) {
     EXPECT_NE(dp5.current_epoch(), 0u);
 }
 
+TEST(TestConfig, CubeSide) {
+    EXPECT_EQ(pir_cube_side(1000, 1), 1000u);
+    EXPECT_EQ(pir_cube_side(1000, 2), 32u);
+    EXPECT_EQ(pir_cube_side(1024, 2), 32u);
+    EXPECT_EQ(pir_cube_side(1025, 2), 33u);
+    EXPECT_EQ(pir_cube_side(1000, 3), 10u);
+    EXPECT_EQ(pir_cube_side(1001, 3), 11u);
+    EXPECT_EQ(pir_cube_side(1, 3), 1u);
+}
+
 TEST(TestUint, ToFromBytes) {
     unsigned int test_uint = 0x5678;
     unsigned char bytes[UINT_BYTES];
@@ -105,7 +165,7 @@ protected:
     string valid_metadata;
 
     virtual void SetUp(void) {
-        valid_metadata.push_back(METADATA_VERSION);
+        valid_metadata.push_back(METADATA_VERSION_NO_LADDER);
         valid_metadata.push_back(0x01);
         for (unsigned int i = 0; i < PRFKEY_BYTES + UINT_BYTES*4 + EPOCH_BYTES;
             i++) {
@@ -196,3 +256,134 @@ TEST_F(MetadataTest, ConfigConstructor) {
     EXPECT_EQ(md.epoch_len, config.epoch_len);
     EXPECT_EQ(md.dataenc_bytes, config.dataenc_bytes);
 }
+
+TEST_F(MetadataTest, Flags) {
+    Metadata md;
+    md.fromString(valid_metadata);
+    EXPECT_EQ(md.combined, true);
+    EXPECT_EQ(md.sorted_buckets, false);
+
+    string sorted(valid_metadata);
+    sorted[1] = METADATA_FLAG_SORTED;
+    EXPECT_EQ(md.fromString(sorted), 0);
+    EXPECT_EQ(md.combined, false);
+    EXPECT_EQ(md.sorted_buckets, true);
+    EXPECT_EQ(md.toString(), sorted);
+
+    string unknown(valid_metadata);
+    unknown[1] = 0x80;
+    EXPECT_NE(md.fromString(unknown), 0);
+}
+
+TEST_F(MetadataTest, Batch) {
+    Metadata md;
+    md.fromString(valid_metadata);
+    EXPECT_EQ(md.batch_pir, false);
+
+    string batch(valid_metadata);
+    batch[1] = METADATA_FLAG_BATCH;
+    EXPECT_EQ(md.fromString(batch), 0);
+    EXPECT_EQ(md.batch_pir, true);
+    EXPECT_EQ(md.pir_backend, PIR_BACKEND_PERCY);
+    EXPECT_EQ(md.toString(), batch);
+
+    Metadata copy(md);
+    EXPECT_EQ(copy.batch_pir, true);
+}
+
+TEST_F(MetadataTest, Depth) {
+    Metadata md;
+    md.fromString(valid_metadata);
+    EXPECT_EQ(md.pir_depth, 1u);
+
+    string deep(valid_metadata);
+    deep[1] = (3 - 1) << METADATA_FLAG_DEPTH_SHIFT;
+    EXPECT_EQ(md.fromString(deep), 0);
+    EXPECT_EQ(md.pir_depth, 3u);
+    EXPECT_EQ(md.toString(), deep);
+
+    Metadata copy(md);
+    EXPECT_EQ(copy.pir_depth, 3u);
+
+    string toodeep(valid_metadata);
+    toodeep[1] = METADATA_FLAG_DEPTH_MASK;
+    EXPECT_NE(md.fromString(toodeep), 0);
+}
+
+TEST_F(MetadataTest, Backend) {
+    Metadata md;
+    md.fromString(valid_metadata);
+    EXPECT_EQ(md.pir_backend, PIR_BACKEND_PERCY);
+
+    string dpf(valid_metadata);
+    dpf[1] = PIR_BACKEND_DPF << METADATA_FLAG_BACKEND_SHIFT;
+    EXPECT_EQ(md.fromString(dpf), 0);
+    EXPECT_EQ(md.pir_backend, PIR_BACKEND_DPF);
+    EXPECT_EQ(md.combined, false);
+    EXPECT_EQ(md.toString(), dpf);
+
+    Metadata copy(md);
+    EXPECT_EQ(copy.pir_backend, PIR_BACKEND_DPF);
+
+    string chor(valid_metadata);
+    chor[1] = PIR_BACKEND_CHOR << METADATA_FLAG_BACKEND_SHIFT;
+    EXPECT_EQ(md.fromString(chor), 0);
+    EXPECT_EQ(md.pir_backend, PIR_BACKEND_CHOR);
+    EXPECT_EQ(md.toString(), chor);
+
+    string unknown(valid_metadata);
+    unknown[1] = METADATA_FLAG_BACKEND_MASK;
+    EXPECT_NE(md.fromString(unknown), 0);
+
+    // The previous version has no backend bits
+    string old(dpf);
+    old[0] = METADATA_VERSION_UNSORTED;
+    EXPECT_NE(md.fromString(old), 0);
+}
+
+TEST_F(MetadataTest, QuerySizes) {
+    Metadata md;
+    md.fromString(valid_metadata);
+    EXPECT_TRUE(md.has_default_query_sizes());
+    EXPECT_EQ(md.toString(), valid_metadata);
+
+    // A non-default ladder needs the newer version
+    md.num_query_sizes = 3;
+    md.query_sizes[1] = 10;
+    md.query_sizes[2] = MAX_BUDDIES;
+    string ladder = md.toString();
+    EXPECT_EQ((unsigned char) ladder[0], METADATA_VERSION);
+    EXPECT_EQ(ladder.size(), valid_metadata.size() + 1 + 3 * UINT_BYTES);
+
+    Metadata md2;
+    EXPECT_EQ(md2.fromString(ladder), 0);
+    EXPECT_EQ(md2.num_query_sizes, 3u);
+    EXPECT_EQ(md2.query_sizes[0], 1u);
+    EXPECT_EQ(md2.query_sizes[1], 10u);
+    EXPECT_EQ(md2.query_sizes[2], MAX_BUDDIES);
+    EXPECT_EQ(md2.toString(), ladder);
+
+    // Reading older metadata resets the ladder
+    EXPECT_EQ(md2.fromString(valid_metadata), 0);
+    EXPECT_TRUE(md2.has_default_query_sizes());
+
+    // A ladder not ending with MAX_BUDDIES, and a truncated one
+    string bad(ladder);
+    bad[bad.size() - 1] = 99;
+    EXPECT_NE(md2.fromString(bad), 0);
+    bad.erase(bad.size() - 1);
+    EXPECT_NE(md2.fromString(bad), 0);
+}
+
+TEST_F(MetadataTest, UnsortedVersion) {
+    // The previous version has no sorted flag
+    string old(valid_metadata);
+    old[0] = METADATA_VERSION_UNSORTED;
+    Metadata md;
+    EXPECT_EQ(md.fromString(old), 0);
+    EXPECT_EQ(md.combined, true);
+    EXPECT_EQ(md.sorted_buckets, false);
+
+    old[1] = METADATA_FLAG_SORTED;
+    EXPECT_NE(md.fromString(old), 0);
+}
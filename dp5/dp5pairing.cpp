@@ -0,0 +1,215 @@
+#include <string.h>
+
+#include "dp5pairing.h"
+
+using namespace std;
+
+namespace dp5 {
+namespace internal {
+
+static PairingContext *shared_context = NULL;
+static pthread_once_t shared_context_once = PTHREAD_ONCE_INIT;
+
+void PairingContext::create()
+{
+    shared_context = new PairingContext();
+}
+
+// The shared instance
+PairingContext &PairingContext::get()
+{
+    pthread_once(&shared_context_once, create);
+    return *shared_context;
+}
+
+PairingContext::PairingContext() : _pairing()
+{
+    _g1_gen = _pairing.g1_get_gen();
+
+    // Fill in the fixed-base table, one window at a time.  The entries
+    // are kept serialized, so that g1_gen_pow can pick one out with a
+    // masked scan rather than by indexing.
+    _g1_gen_table.resize(NUM_WINDOWS * WINDOW_SIZE * BLS_PUB_BYTES);
+    G1 base = _g1_gen;
+    for (unsigned int w = 0; w < NUM_WINDOWS; ++w) {
+        G1 row[WINDOW_SIZE];
+        // row[0] is left as the identity
+        row[1] = base;
+        row[2] = base ^ Zr(2);
+        for (unsigned int d = 3; d < WINDOW_SIZE; ++d) {
+            row[d] = row[d-1] * base;
+        }
+        for (unsigned int d = 0; d < WINDOW_SIZE; ++d) {
+            row[d].toBin((char *) &_g1_gen_table[
+                (w * WINDOW_SIZE + d) * BLS_PUB_BYTES]);
+        }
+        base = base ^ Zr((int) WINDOW_SIZE);
+    }
+
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+// g1_gen() ^ exponent, using the precomputed table.  The exponent is
+// usually a private key, so every window does the same work whatever
+// its digit: the whole row is read, and the selected entry (the
+// identity, for a zero digit) is always multiplied in.
+G1 PairingContext::g1_gen_pow(const Zr &exponent) const
+{
+    // Big-endian
+    unsigned char expbytes[BLS_PRIV_BYTES];
+    exponent.toBin((char *) expbytes);
+
+    G1 result;
+    unsigned char selected[BLS_PUB_BYTES];
+    for (unsigned int w = 0; w < NUM_WINDOWS; ++w) {
+        unsigned char b = expbytes[BLS_PRIV_BYTES - 1 - w / 2];
+        unsigned int digit = (w & 1) ? (b >> 4) : (b & 0x0f);
+        const unsigned char *row =
+            &_g1_gen_table[w * WINDOW_SIZE * BLS_PUB_BYTES];
+
+        memset(selected, 0, sizeof(selected));
+        for (unsigned int d = 0; d < WINDOW_SIZE; ++d) {
+            // 0xff if d == digit, and 0 otherwise, without a branch
+            unsigned char mask = (unsigned char) (((d ^ digit) - 1) >> 8);
+            for (unsigned int i = 0; i < BLS_PUB_BYTES; ++i) {
+                selected[i] |= row[d * BLS_PUB_BYTES + i] & mask;
+            }
+        }
+
+        G1 entry;
+        entry.fromBin(selected, BLS_PUB_BYTES);
+        result *= entry;
+    }
+    return result;
+}
+
+// H(epoch), hashed into G2
+G2 PairingContext::epoch_hash(Epoch epoch)
+{
+    pthread_mutex_lock(&_mutex);
+    map<Epoch, G2>::const_iterator it = _epoch_hashes.find(epoch);
+    if (it != _epoch_hashes.end()) {
+        G2 hash = it->second;
+        pthread_mutex_unlock(&_mutex);
+        return hash;
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    // Hash outside the lock; if two threads race here they will just
+    // compute the same value.
+    unsigned char E[EPOCH_BYTES];
+    epoch_num_to_bytes(E, epoch);
+    G2 hash(_pairing, E, EPOCH_BYTES);
+
+    pthread_mutex_lock(&_mutex);
+    _epoch_hashes[epoch] = hash;
+    if (_epoch_hashes.size() > EPOCH_CACHE_SIZE) {
+        // Forget the oldest epoch
+        _epoch_hashes.erase(_epoch_hashes.begin());
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    return hash;
+}
+
+} // namespace dp5::internal
+} // namespace dp5
+
+#ifdef TEST_PAIRINGBENCH
+// Time the combined-mode hash key derivations, with and without the
+// shared PairingContext.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+using namespace dp5;
+using namespace dp5::internal;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// The derivations as they were done before the shared context: a new
+// Pairing, and a fresh hash into G2, every time
+static int uncached_hash_key_from_sig(unsigned char key[HASHKEY_BYTES],
+    const unsigned char signature[EPOCH_SIG_BYTES]) {
+    Pairing pairing;
+    G2 sig(pairing);
+    if (sig.fromBin(signature, EPOCH_SIG_BYTES) != 0) {
+        return -1;
+    }
+    GT verify_token = pairing.apply(pairing.g1_get_gen(), sig);
+    unsigned char verifybytes[SIG_VERIFY_BYTES];
+    verify_token.toBin((char *) verifybytes);
+    H4(key, verifybytes);
+    return 0;
+}
+
+static int uncached_hash_key_from_pk(unsigned char key[HASHKEY_BYTES],
+    const BLSPubKey & pubkey, unsigned int epoch) {
+    Pairing pairing;
+    G1 pubkey_g1;
+    if (pubkey_g1.fromBin(pubkey, pubkey.size) != 0) {
+        return -1;
+    }
+    unsigned char E[EPOCH_BYTES];
+    epoch_num_to_bytes(E, epoch);
+    G2 epoch_hash(pairing, E, EPOCH_BYTES);
+    GT verify_token = pairing.apply(pubkey_g1, epoch_hash);
+    unsigned char verifybytes[SIG_VERIFY_BYTES];
+    verify_token.toBin((char *) verifybytes);
+    H4(key, verifybytes);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 100;
+    Epoch epoch = 1000;
+
+    initPairing();
+
+    BLSPubKey pubkey;
+    BLSPrivKey privkey;
+    genkeypair(pubkey, privkey);
+
+    Zr privzr;
+    privzr.fromBin((const char *) (const byte *) privkey);
+    G2 sig = PairingContext::get().epoch_hash(epoch) ^ privzr;
+    unsigned char sigbytes[EPOCH_SIG_BYTES];
+    sig.toBin((char *) sigbytes);
+
+    unsigned char key1[HASHKEY_BYTES], key2[HASHKEY_BYTES];
+    double start;
+
+    start = now();
+    for (int i=0; i<iters; ++i) uncached_hash_key_from_sig(key1, sigbytes);
+    double sig_before = (now() - start) / iters;
+
+    start = now();
+    for (int i=0; i<iters; ++i) hash_key_from_sig(key2, sigbytes);
+    double sig_after = (now() - start) / iters;
+
+    printf("hash_key_from_sig: %.3f ms -> %.3f ms %s\n", sig_before * 1000,
+        sig_after * 1000,
+        memcmp(key1, key2, HASHKEY_BYTES) ? "NO MATCH" : "MATCH");
+
+    start = now();
+    for (int i=0; i<iters; ++i) uncached_hash_key_from_pk(key1, pubkey, epoch);
+    double pk_before = (now() - start) / iters;
+
+    start = now();
+    for (int i=0; i<iters; ++i) hash_key_from_pk(key2, pubkey, epoch);
+    double pk_after = (now() - start) / iters;
+
+    printf("hash_key_from_pk:  %.3f ms -> %.3f ms %s\n", pk_before * 1000,
+        pk_after * 1000,
+        memcmp(key1, key2, HASHKEY_BYTES) ? "NO MATCH" : "MATCH");
+
+    return 0;
+}
+#endif // TEST_PAIRINGBENCH
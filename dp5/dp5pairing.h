@@ -0,0 +1,75 @@
+#ifndef __DP5PAIRING_H__
+#define __DP5PAIRING_H__
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+#include <Pairing.h>
+#include "dp5params.h"
+
+namespace dp5 {
+
+namespace internal {
+
+    // Process-wide state for the combined (pairing-based) mode: a
+    // single Pairing object, the G1 generator with a fixed-base table
+    // for raising it to powers, and a cache of the per-epoch hashes
+    // H(epoch) in G2 that every registration and lookup in an epoch
+    // pairs against.  Thread-safe.
+    class PairingContext {
+    public:
+        // The shared instance
+        static PairingContext &get();
+
+        const Pairing &pairing() const { return _pairing; }
+
+        // The generator of G1
+        const G1 &g1_gen() const { return _g1_gen; }
+
+        // g1_gen() ^ exponent, using the precomputed table.  Safe to
+        // use with secret exponents: which table entries are used
+        // does not show in the memory access pattern or the number of
+        // group operations.  (How long each group operation takes is
+        // up to Relic.)
+        G1 g1_gen_pow(const Zr &exponent) const;
+
+        // H(epoch), hashed into G2
+        G2 epoch_hash(Epoch epoch);
+
+    private:
+        PairingContext();
+
+        // Not copyable
+        PairingContext(const PairingContext &);
+        PairingContext& operator=(const PairingContext &);
+
+        static void create();
+
+        // The number of epochs for which to keep H(epoch) around.  At
+        // an epoch boundary, both the old and the new one are in use.
+        static const unsigned int EPOCH_CACHE_SIZE = 4;
+
+        // The fixed-base table has one row per WINDOW_BITS-bit window
+        // of the exponent; entry [w][d] is g1_gen ^ (d << (w *
+        // WINDOW_BITS)), serialized in BLS_PUB_BYTES bytes.  An
+        // exponentiation is then exactly NUM_WINDOWS group operations,
+        // and no doublings.
+        static const unsigned int WINDOW_BITS = 4;
+        static const unsigned int WINDOW_SIZE = 1 << WINDOW_BITS;
+        static const unsigned int NUM_WINDOWS = BLS_PRIV_BYTES * 8 /
+            WINDOW_BITS;
+
+        const Pairing _pairing;
+        G1 _g1_gen;
+        std::vector<unsigned char> _g1_gen_table;
+
+        std::map<Epoch, G2> _epoch_hashes;
+        pthread_mutex_t _mutex;
+    };
+
+}  // namespace dp5::internal
+
+}  // namespace dp5
+
+#endif
@@ -9,8 +9,9 @@
 
 #include <stdexcept>
 #include <assert.h>
+#include <pthread.h>
 
-#include <openssl/rand.h>
+#include <openssl/crypto.h>
 #include <openssl/sha.h>
 #include <openssl/aes.h>
 #include <openssl/evp.h>
@@ -21,6 +22,7 @@
 #include "Pairing.h"
 
 #include "dp5params.h"
+#include "dp5pairing.h"
 
 extern "C" {
     int curve25519_donna(unsigned char *mypublic,
@@ -43,6 +45,46 @@ unsigned int DP5Config::current_epoch() const
     return time(NULL)/epoch_len;
 }
 
+// Is the query-size ladder well formed: num_query_sizes rungs, in
+// increasing order, the first at least 1 and the last MAX_BUDDIES?
+bool DP5Config::valid_query_sizes() const
+{
+    if (num_query_sizes < 1 || num_query_sizes > MAX_QUERY_SIZES ||
+            query_sizes[0] < 1 ||
+            query_sizes[num_query_sizes - 1] != MAX_BUDDIES) {
+        return false;
+    }
+    for (unsigned int i = 1; i < num_query_sizes; ++i) {
+        if (query_sizes[i] <= query_sizes[i - 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The smallest rung of the query-size ladder with room for num_buckets
+// buckets
+unsigned int DP5Config::query_size_for(unsigned int num_buckets) const
+{
+    for (unsigned int i = 0; i < num_query_sizes; ++i) {
+        if (query_sizes[i] >= num_buckets) {
+            return query_sizes[i];
+        }
+    }
+    return MAX_BUDDIES;
+}
+
+// Is num_buckets a rung of the query-size ladder?
+bool DP5Config::is_query_size(unsigned int num_buckets) const
+{
+    for (unsigned int i = 0; i < num_query_sizes; ++i) {
+        if (query_sizes[i] == num_buckets) {
+            return true;
+        }
+    }
+    return false;
+}
+
 
 
 // Get public key from private key
@@ -73,8 +115,7 @@ void genkeypair<PubKey,PrivKey>(PubKey & pubkey, PrivKey & privkey)
 
 template<>
 void getpubkey<BLSPubKey,Zr>(BLSPubKey & pubkey, const Zr & privkey) {
-    static Pairing pairing;
-    G1 g1 = pairing.g1_get_gen() ^ privkey;
+    G1 g1 = PairingContext::get().g1_gen_pow(privkey);
     byte pubkey_buf[pubkey.size];
     g1.toBin(reinterpret_cast<char *>(pubkey_buf));
     pubkey.assign(pubkey_buf, sizeof(pubkey_buf));
@@ -100,40 +141,149 @@ void getpubkey<BLSPubKey,BLSPrivKey>(BLSPubKey & pubkey,
 }
 
 namespace internal {
-class RandSeeder {
+
+// A per-thread AES-128-CTR deterministic random bit generator, seeded
+// from the OS.  Output is produced a buffer at a time.  Each refill
+// also produces the key for the next one, and bytes are wiped from the
+// buffer as they are handed out, so the generator's state never allows
+// earlier output to be recovered.  Since every thread has its own
+// generator, no locking is needed.
+class DRBG {
 public:
-    RandSeeder() {
-        unsigned char osrandbuf[32];
+    DRBG() : _ctx(EVP_CIPHER_CTX_new()), _avail(0), _fork_generation(0) {
+        if (!_ctx) {
+            throw runtime_error("Unable to allocate DRBG context");
+        }
+        reseed();
+    }
+
+    ~DRBG() {
+        EVP_CIPHER_CTX_free(_ctx);
+        OPENSSL_cleanse(_key, sizeof(_key));
+        OPENSSL_cleanse(_buffer, sizeof(_buffer));
+    }
+
+    // The calling thread's generator
+    static DRBG &get();
+
+    void generate(byte *buf, size_t num_bytes) {
+        if (_fork_generation != fork_generation) {
+            // We are in a child process that inherited our state from
+            // its parent.  Don't repeat the parent's output.
+            reseed();
+        }
+        while (num_bytes > 0) {
+            if (_avail == 0) {
+                refill();
+            }
+            size_t chunk = num_bytes < _avail ? num_bytes : _avail;
+            byte *src = _buffer + sizeof(_buffer) - _avail;
+            memmove(buf, src, chunk);
+            memset(src, 0, chunk);
+            _avail -= chunk;
+            buf += chunk;
+            num_bytes -= chunk;
+        }
+    }
+
+private:
+    // Not copyable
+    DRBG(const DRBG &);
+    DRBG& operator=(const DRBG &);
 
-        // Grab 32 random bytes from the OS and use it to seed openssl's
-        // PRNG.  (openssl actually seeds from /dev/urandom itself on
-        // systems with one, but in case we switch to another crypto
-        // library, make it explicit.)
+    static const size_t KEY_BYTES = 16;
+    static const size_t BUFFER_BYTES = 4096;
+
+    // Take a fresh key from the OS, and discard any buffered output
+    void reseed() {
         int urandfd = open("/dev/urandom", O_RDONLY);
         if (urandfd < 0) {
             throw runtime_error("Unable to open /dev/urandom");
         }
-        int res = read(urandfd, osrandbuf, sizeof(osrandbuf));
-        if (res < (int)sizeof(osrandbuf)) {
+        int res = read(urandfd, _key, sizeof(_key));
+        close(urandfd);
+        if (res < (int)sizeof(_key)) {
             throw runtime_error("Unable to read /dev/urandom");
         }
-        close(urandfd);
-        RAND_seed(osrandbuf, sizeof(osrandbuf));
+        OPENSSL_cleanse(_buffer, sizeof(_buffer));
+        _avail = 0;
+        _fork_generation = fork_generation;
+    }
+
+    // Run AES-CTR under the current key to produce the next key and a
+    // buffer's worth of output
+    void refill() {
+        static const byte zeroes[KEY_BYTES + BUFFER_BYTES] = {0, };
+        static const byte zeroiv[16] = {0, };
+        byte out[KEY_BYTES + BUFFER_BYTES];
+        int len = 0;
+        if (EVP_EncryptInit_ex(_ctx, EVP_aes_128_ctr(), NULL, _key,
+                zeroiv) != 1 ||
+            EVP_EncryptUpdate(_ctx, out, &len, zeroes, sizeof(out)) != 1 ||
+            len != (int)sizeof(out)) {
+            throw runtime_error("DRBG failure");
+        }
+        memmove(_key, out, KEY_BYTES);
+        memmove(_buffer, out + KEY_BYTES, BUFFER_BYTES);
+        OPENSSL_cleanse(out, sizeof(out));
+        _avail = BUFFER_BYTES;
     }
+
+    static void init_once();
+    static void destroy(void *drbg);
+    static void forked_child();
+
+    EVP_CIPHER_CTX *_ctx;
+    byte _key[KEY_BYTES];
+    byte _buffer[BUFFER_BYTES];
+    // The number of unused bytes at the end of _buffer
+    size_t _avail;
+    // The value of fork_generation when we were last seeded
+    unsigned long _fork_generation;
+
+    // Incremented in the child after every fork()
+    static volatile unsigned long fork_generation;
+    static pthread_key_t thread_key;
+    static pthread_once_t thread_key_once;
 };
 
-// Place num_bytes random bytes into buf.  This is not static, so that
-// the PRNG can keep state if necessary
-void init_seed() {
-    static RandSeeder seeder;
+volatile unsigned long DRBG::fork_generation = 0;
+pthread_key_t DRBG::thread_key;
+pthread_once_t DRBG::thread_key_once = PTHREAD_ONCE_INIT;
+
+void DRBG::init_once()
+{
+    pthread_key_create(&thread_key, destroy);
+    pthread_atfork(NULL, NULL, forked_child);
 }
 
+void DRBG::destroy(void *drbg)
+{
+    delete (DRBG *) drbg;
+}
+
+void DRBG::forked_child()
+{
+    ++fork_generation;
+}
+
+// The calling thread's generator
+DRBG &DRBG::get()
+{
+    pthread_once(&thread_key_once, init_once);
+    DRBG *drbg = (DRBG *) pthread_getspecific(thread_key);
+    if (!drbg) {
+        drbg = new DRBG();
+        pthread_setspecific(thread_key, drbg);
+    }
+    return *drbg;
+}
+
+// Place num_bytes random bytes into buf.  This is not static, so that
+// the PRNG can keep state if necessary
 void random_bytes(byte *buf, unsigned int num_bytes)
 {
-    // Will be constructed on first call to this function
-    // FIXME: not thread-safe
-    init_seed();
-    RAND_bytes(buf, num_bytes);
+    DRBG::get().generate(buf, num_bytes);
 }
 
 
@@ -149,8 +299,7 @@ void random_bytes(ByteArray<N> &array, unsigned int num_bytes)
 
 template<size_t N>
 void ByteArray<N>::random() {
-    init_seed();
-    RAND_bytes(data, N);
+    random_bytes(data, N);
 }
 
 // Compute the Diffie-Hellman output for a given (buddy's) public
@@ -259,53 +408,173 @@ unsigned int PRF::M(const HashKey x)
     return outint % _num_buckets;
 }
 
+// The pseudorandom generator for seeded PIR queries: expand seed into
+// len bytes of AES-128-CTR keystream, using the seed as the key.  Each
+// value of stream gives an independent output: it is the first four
+// bytes (big-endian) of the initial counter block, the rest of which is
+// zero.  Return 0 on success, non-0 on failure.
+int PRG(unsigned char *out, size_t len, const PIRSeed seed,
+    unsigned int stream)
+{
+    // EVP_EncryptUpdate takes an int length
+    static const size_t CHUNK_BYTES = 1 << 20;
+
+    unsigned char ctr[16] = {0, };
+    ctr[0] = (stream >> 24) & 0xff;
+    ctr[1] = (stream >> 16) & 0xff;
+    ctr[2] = (stream >> 8) & 0xff;
+    ctr[3] = stream & 0xff;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) return -1;
+    int err = 0;
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, seed, ctr)
+            != 1) {
+        err = -1;
+    }
+
+    // Encrypting zeroes in place leaves the keystream
+    memset(out, 0, len);
+    for (size_t off = 0; !err && off < len; off += CHUNK_BYTES) {
+        int chunk = (int) (len - off < CHUNK_BYTES ? len - off : CHUNK_BYTES);
+        int outlen;
+        if (EVP_EncryptUpdate(ctx, out + off, &outlen, out + off, chunk)
+                != 1 || outlen != chunk) {
+            err = -1;
+        }
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return err;
+}
+
+// The side of the smallest cube of the given depth (number of
+// dimensions) with room for num_buckets buckets, as used by recursive
+// PIR queries
+unsigned int pir_cube_side(unsigned int num_buckets, unsigned int depth)
+{
+    if (depth <= 1 || num_buckets <= 1) {
+        return num_buckets;
+    }
+    unsigned int side = 1;
+    for (;;) {
+        unsigned long long volume = 1;
+        for (unsigned int d = 0; d < depth && volume < num_buckets; ++d) {
+            volume *= side;
+        }
+        if (volume >= num_buckets) {
+            return side;
+        }
+        ++side;
+    }
+}
+
 static const unsigned char zeroiv[12] = {0, };
 
-string Enc(const DataKey datakey, const string & plaintext,
-    const string & additionaldata)
+// Every thread keeps one AES-GCM context around, and re-keys it for
+// each record, rather than allocating and setting up a new one each
+// time.
+static pthread_key_t gcm_ctx_key;
+static pthread_once_t gcm_ctx_key_once = PTHREAD_ONCE_INIT;
+
+static void free_gcm_ctx(void *ctx)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx)
-        return "";
+    EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *) ctx);
+}
 
-    int ok = EVP_EncryptInit(ctx, EVP_aes_128_gcm(), (const byte *)datakey,
-        zeroiv);
-    if (ok != 1)
-        return "";
+static void create_gcm_ctx_key()
+{
+    pthread_key_create(&gcm_ctx_key, free_gcm_ctx);
+}
 
-    int len = 0;
-    unsigned int ciphertext_len = 0;
-    unsigned char ciphertext[plaintext.size() + 32];
-    if (additionaldata.size() > 0) {
-        ok = EVP_EncryptUpdate(ctx, NULL, &len,
-            reinterpret_cast<const unsigned char *>(additionaldata.data()),
-            additionaldata.size());
-        if (ok != 1)
-            return "";
-    }
-    ok = EVP_EncryptUpdate(ctx, ciphertext, &len,
-        (const unsigned char *)plaintext.data(), plaintext.size());
-    if (ok != 1)
-        return "";
+// The calling thread's AES-GCM context, or NULL on failure
+static EVP_CIPHER_CTX *thread_gcm_ctx()
+{
+    pthread_once(&gcm_ctx_key_once, create_gcm_ctx_key);
+    EVP_CIPHER_CTX *ctx = (EVP_CIPHER_CTX *) pthread_getspecific(gcm_ctx_key);
+    if (!ctx) {
+        ctx = EVP_CIPHER_CTX_new();
+        if (!ctx)
+            return NULL;
+        if (EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+                != 1) {
+            EVP_CIPHER_CTX_free(ctx);
+            return NULL;
+        }
+        pthread_setspecific(gcm_ctx_key, ctx);
+    }
+    return ctx;
+}
 
-    ciphertext_len = len;
-    ok = EVP_EncryptFinal(ctx, ciphertext+ciphertext_len, &len);
-    if (ok != 1)
-        return "";
+// Encrypt a single record with ctx.  ciphertext must have room for
+// plaintext_len + ENCRYPTION_OVERHEAD bytes.  Return 0 on success,
+// non-0 on failure.
+static int gcm_encrypt(EVP_CIPHER_CTX *ctx, unsigned char *ciphertext,
+    const DataKey datakey, const unsigned char *plaintext,
+    size_t plaintext_len, const unsigned char *ad, size_t ad_len)
+{
+    int len = 0;
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, datakey, zeroiv, 1) != 1)
+        return 1;
+    if (ad_len > 0 &&
+            EVP_EncryptUpdate(ctx, NULL, &len, ad, ad_len) != 1)
+        return 2;
+    if (EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext,
+            plaintext_len) != 1)
+        return 3;
+    size_t ciphertext_len = len;
+    if (EVP_EncryptFinal_ex(ctx, ciphertext + ciphertext_len, &len) != 1)
+        return 4;
     ciphertext_len += len;
+    assert(ciphertext_len == plaintext_len);
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, ENCRYPTION_OVERHEAD,
+            ciphertext + ciphertext_len) != 1)
+        return 5;
+    return 0;
+}
 
-    ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16,
-        ciphertext + ciphertext_len);
-    if (ok != 1)
-        return "";
-
-    ciphertext_len += 16;
+// Decrypt a single record with ctx.  plaintext must have room for
+// ciphertext_len - ENCRYPTION_OVERHEAD bytes.  Return 0 on success,
+// non-0 on failure.
+static int gcm_decrypt(EVP_CIPHER_CTX *ctx, unsigned char *plaintext,
+    const DataKey enckey, const unsigned char *ciphertext,
+    size_t ciphertext_len, const unsigned char *ad, size_t ad_len)
+{
+    int len = 0;
+    if (ciphertext_len < ENCRYPTION_OVERHEAD)
+        return 7;
+    size_t body_len = ciphertext_len - ENCRYPTION_OVERHEAD;
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, enckey, zeroiv, 0) != 1)
+        return 2;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, ENCRYPTION_OVERHEAD,
+            (void *) (ciphertext + body_len)) != 1)
+        return 4;
+    if (ad_len > 0 &&
+            EVP_DecryptUpdate(ctx, NULL, &len, ad, ad_len) != 1)
+        return 6;
+    if (EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, body_len) != 1)
+        return 3;
+    size_t plaintext_len = len;
+    if (EVP_DecryptFinal_ex(ctx, plaintext + plaintext_len, &len) <= 0)
+        return 5;
+    assert(plaintext_len + len == body_len);
+    return 0;
+}
 
-    assert(ciphertext_len <= sizeof(ciphertext));
+string Enc(const DataKey datakey, const string & plaintext,
+    const string & additionaldata)
+{
+    EVP_CIPHER_CTX *ctx = thread_gcm_ctx();
+    if (!ctx)
+        return "";
 
-    EVP_CIPHER_CTX_free(ctx);
+    string ciphertext(plaintext.size() + ENCRYPTION_OVERHEAD, '\0');
+    if (gcm_encrypt(ctx, (unsigned char *) &ciphertext[0], datakey,
+            (const unsigned char *) plaintext.data(), plaintext.size(),
+            (const unsigned char *) additionaldata.data(),
+            additionaldata.size()) != 0)
+        return "";
 
-    return string((const char *)ciphertext, ciphertext_len);
+    return ciphertext;
 }
 
 // Decrypt using a key of size DATAKEY_BYTES bytes a ciphertext of
@@ -315,44 +584,90 @@ string Enc(const DataKey datakey, const string & plaintext,
 int Dec(string & plaintext, const DataKey enckey, const string & ciphertext,
     const string & additionaldata)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX *ctx = thread_gcm_ctx();
     if (!ctx)
         return 1;
-    int ok = EVP_DecryptInit(ctx, EVP_aes_128_gcm(), (const byte *) enckey,
-        zeroiv);
-    if (!ok)
-        return 2;
+    if (ciphertext.size() < ENCRYPTION_OVERHEAD)
+        return 7;
+
+    // One spare byte so that &buf[0] is valid for empty plaintexts
+    string buf(ciphertext.size() - ENCRYPTION_OVERHEAD + 1, '\0');
+    int err = gcm_decrypt(ctx, (unsigned char *) &buf[0], enckey,
+        (const unsigned char *) ciphertext.data(), ciphertext.size(),
+        (const unsigned char *) additionaldata.data(),
+        additionaldata.size());
+    if (err)
+        return err;
+
+    plaintext.assign(buf.data(), buf.size() - 1);
+    return 0;
+}
 
-    unsigned char plaintext_bytes[ciphertext.size()];
-    int len;
-    ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16,
-        (void *) (ciphertext.data() + ciphertext.size() - 16));
-    if (!ok)
-        return 4;
-    if (additionaldata.size() > 0) {
-        ok = EVP_DecryptUpdate(ctx, NULL, &len,
-            reinterpret_cast<const unsigned char *>(additionaldata.data()),
-            additionaldata.size());
-        if (!ok)
-            return 6;
-    }
-    ok = EVP_DecryptUpdate(ctx, plaintext_bytes, &len,
-        (const unsigned char*) ciphertext.data(), ciphertext.size()-16);
-    if (!ok)
-        return 3;
-    int plaintext_len = len;
+// Encrypt num_records records, each of plaintext_len bytes, from
+// plaintexts into ciphertexts (which must have room for num_records *
+// (plaintext_len + ENCRYPTION_OVERHEAD) bytes).  Record i uses key
+// datakeys[i] and additional data additionaldata[i] (if
+// additionaldata is not NULL).  Return 0 on success, non-0 on failure.
+int EncBatch(unsigned char *ciphertexts, const DataKey *datakeys,
+    const unsigned char *plaintexts, size_t plaintext_len,
+    size_t num_records, const string *additionaldata)
+{
+    EVP_CIPHER_CTX *ctx = thread_gcm_ctx();
+    if (!ctx)
+        return 1;
 
-    ok = EVP_DecryptFinal_ex(ctx, plaintext_bytes+plaintext_len, &len);
+    for (size_t i = 0; i < num_records; ++i) {
+        const unsigned char *ad = NULL;
+        size_t ad_len = 0;
+        if (additionaldata) {
+            ad = (const unsigned char *) additionaldata[i].data();
+            ad_len = additionaldata[i].size();
+        }
+        int err = gcm_encrypt(ctx,
+            ciphertexts + i * (plaintext_len + ENCRYPTION_OVERHEAD),
+            datakeys[i], plaintexts + i * plaintext_len, plaintext_len,
+            ad, ad_len);
+        if (err)
+            return err;
+    }
+    return 0;
+}
 
-    EVP_CIPHER_CTX_free(ctx);
+// Decrypt num_records records, each of ciphertext_len bytes, from
+// ciphertexts into plaintexts (which must have room for num_records *
+// (ciphertext_len - ENCRYPTION_OVERHEAD) bytes).  Record i uses key
+// enckeys[i] and additional data additionaldata[i] (if additionaldata
+// is not NULL).  If errors is not NULL, errors[i] is set to 0 if record
+// i decrypted successfully, and non-0 otherwise.  Return 0 if every
+// record decrypted successfully, non-0 otherwise.
+int DecBatch(unsigned char *plaintexts, const DataKey *enckeys,
+    const unsigned char *ciphertexts, size_t ciphertext_len,
+    size_t num_records, const string *additionaldata, int *errors)
+{
+    if (ciphertext_len < ENCRYPTION_OVERHEAD)
+        return 7;
+    EVP_CIPHER_CTX *ctx = thread_gcm_ctx();
+    if (!ctx)
+        return 1;
 
-    if (ok > 0) {
-        plaintext_len += len;
-        plaintext.assign((const char*) plaintext_bytes, plaintext_len);
-        return 0;
-    } else {
-        return 5;
+    int ret = 0;
+    size_t plaintext_len = ciphertext_len - ENCRYPTION_OVERHEAD;
+    for (size_t i = 0; i < num_records; ++i) {
+        const unsigned char *ad = NULL;
+        size_t ad_len = 0;
+        if (additionaldata) {
+            ad = (const unsigned char *) additionaldata[i].data();
+            ad_len = additionaldata[i].size();
+        }
+        int err = gcm_decrypt(ctx, plaintexts + i * plaintext_len,
+            enckeys[i], ciphertexts + i * ciphertext_len, ciphertext_len,
+            ad, ad_len);
+        if (errors)
+            errors[i] = err;
+        if (err && !ret)
+            ret = err;
     }
+    return ret;
 }
 
 
@@ -372,15 +687,15 @@ unsigned int epoch_bytes_to_num(const WireEpoch wire_epoch)
 
 int hash_key_from_sig(unsigned char key[HASHKEY_BYTES],
     const unsigned char signature[EPOCH_SIG_BYTES]) {
-    Pairing pairing;
-    G2 sig(pairing);
+    PairingContext &ctx = PairingContext::get();
+    G2 sig(ctx.pairing());
 
     if (sig.fromBin(signature, EPOCH_SIG_BYTES) != 0) {
         return -1;
     }
 
     // e(g, sig)
-    GT verify_token = pairing.apply(pairing.g1_get_gen(), sig);
+    GT verify_token = ctx.pairing().apply(ctx.g1_gen(), sig);
 
     unsigned char verifybytes[SIG_VERIFY_BYTES];
 
@@ -394,17 +709,16 @@ int hash_key_from_sig(unsigned char key[HASHKEY_BYTES],
 int hash_key_from_pk(unsigned char key[HASHKEY_BYTES],
     const BLSPubKey & pubkey,
     unsigned int epoch) {
-    Pairing pairing;
+    PairingContext &ctx = PairingContext::get();
     G1 pubkey_g1;
     if (pubkey_g1.fromBin(pubkey, pubkey.size) != 0) {
         return -1; // Invalid key
     }
 
-    unsigned char E[EPOCH_BYTES];
-    epoch_num_to_bytes(E, epoch);
-    G2 epoch_hash(pairing, E, EPOCH_BYTES);
+    // H(epoch) is the same for every buddy, so it comes from the cache
+    G2 epoch_hash = ctx.epoch_hash(epoch);
 
-    GT verify_token = pairing.apply(pubkey_g1, epoch_hash);
+    GT verify_token = ctx.pairing().apply(pubkey_g1, epoch_hash);
 
     unsigned char verifybytes[SIG_VERIFY_BYTES];
     verify_token.toBin((char *) verifybytes);
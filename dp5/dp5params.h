@@ -42,16 +42,63 @@ namespace dp5 {
     // 128 bits for the final authentication tag
     static const unsigned int ENCRYPTION_OVERHEAD = 16;
 
+    // The PIR schemes the lookup servers can use.  PERCY is Goldberg's
+    // robust t-private scheme over GF(2^8), for any number of servers;
+    // DPF is a two-server scheme built on a distributed point function,
+    // with much smaller queries; CHOR is Chor et al.'s scheme over
+    // GF(2), for two or more servers, with the cheapest server side.
+    // DPF and CHOR need every server to answer, and honestly, for the
+    // lookup to succeed.
+    static const unsigned int PIR_BACKEND_PERCY = 0;
+    static const unsigned int PIR_BACKEND_DPF = 1;
+    static const unsigned int PIR_BACKEND_CHOR = 2;
+
+    // The greatest recursion depth of PERCY backend queries.  A query of
+    // depth d treats the database as a d-dimensional cube of buckets,
+    // and is about d times the d-th root of the number of buckets long,
+    // but needs d * privacy_level + 1 of the servers to answer.
+    static const unsigned int PIR_MAX_DEPTH = 3;
+
+    // The greatest number of rungs in a ladder of query sizes.  The
+    // servers learn which rung each lookup used, so this bounds what
+    // they learn about the number of buddies looked up to 3 bits.
+    static const unsigned int MAX_QUERY_SIZES = 8;
+
     // Runtime configurable variables
     struct DP5Config {
         unsigned int epoch_len;
         unsigned int dataenc_bytes;
         bool combined;
-        DP5Config() : epoch_len(0), dataenc_bytes(0), combined(false) {}
+        unsigned int pir_backend;
+        // If true, the lookup servers also answer batch PIR queries
+        // (see dp5batchcode.h), with the PERCY backend
+        bool batch_pir;
+        // The greatest recursion depth of the PERCY backend queries the
+        // lookup servers answer, from 1 (flat queries only) to
+        // PIR_MAX_DEPTH
+        unsigned int pir_depth;
+        // The ladder of numbers of buckets a PIR lookup may ask for:
+        // num_query_sizes rungs, in increasing order, the first at
+        // least 1 and the last MAX_BUDDIES.  Lookups are padded to the
+        // smallest rung with room for them.  The default is {1,
+        // MAX_BUDDIES}.
+        unsigned int num_query_sizes;
+        unsigned int query_sizes[MAX_QUERY_SIZES];
+        DP5Config() : epoch_len(0), dataenc_bytes(0), combined(false),
+            pir_backend(PIR_BACKEND_PERCY), batch_pir(false),
+            pir_depth(1) {
+            default_query_sizes();
+        }
         DP5Config(const DP5Config & other)
             : epoch_len(other.epoch_len), dataenc_bytes(other.dataenc_bytes),
-            combined(other.combined)
-            {}
+            combined(other.combined), pir_backend(other.pir_backend),
+            batch_pir(other.batch_pir), pir_depth(other.pir_depth),
+            num_query_sizes(other.num_query_sizes)
+            {
+            for (unsigned int i = 0; i < MAX_QUERY_SIZES; ++i) {
+                query_sizes[i] = other.query_sizes[i];
+            }
+        }
 
         bool valid() const {
             return epoch_len != 0;
@@ -61,6 +108,32 @@ namespace dp5 {
         }
 
         Epoch current_epoch() const;
+
+        // Set the query-size ladder to the default
+        void default_query_sizes() {
+            num_query_sizes = 2;
+            query_sizes[0] = 1;
+            query_sizes[1] = MAX_BUDDIES;
+            for (unsigned int i = 2; i < MAX_QUERY_SIZES; ++i) {
+                query_sizes[i] = 0;
+            }
+        }
+
+        // Is the query-size ladder well formed, as described above?
+        bool valid_query_sizes() const;
+
+        // Is the query-size ladder the default one?
+        bool has_default_query_sizes() const {
+            return num_query_sizes == 2 && query_sizes[0] == 1 &&
+                query_sizes[1] == MAX_BUDDIES;
+        }
+
+        // The smallest rung of the query-size ladder with room for
+        // num_buckets buckets (which must be at most MAX_BUDDIES)
+        unsigned int query_size_for(unsigned int num_buckets) const;
+
+        // Is num_buckets a rung of the query-size ladder?
+        bool is_query_size(unsigned int num_buckets) const;
     };
 
 
@@ -83,12 +156,19 @@ namespace dp5 {
 
         // The number of PIR words per byte.  This is 8 for Chor et al.'s
         // super-simple PIR scheme, and 1 for Goldberg's scheme over GF(2^8)
-        static const unsigned int PIR_WORDS_PER_BYTE = 1;
+        inline unsigned int pir_words_per_byte(unsigned int pir_backend) {
+            return pir_backend == PIR_BACKEND_CHOR ? 8 : 1;
+        }
 
         // Number of bytes in a key for the pseudorandom function family
         static const unsigned int PRFKEY_BYTES = 8;
         typedef unsigned char PRFKey[PRFKEY_BYTES];
 
+        // Number of bytes in the seed from which a server expands its
+        // share of a seeded PIR query
+        static const unsigned int PIRSEED_BYTES = 16;
+        typedef unsigned char PIRSeed[PIRSEED_BYTES];
+
         // The length of a byte-array version of an epoch number
         static const unsigned int EPOCH_BYTES = 4;  // epochs are 32 bit
         typedef unsigned char WireEpoch[EPOCH_BYTES];
@@ -164,6 +244,21 @@ namespace dp5 {
         	unsigned int _num_buckets;
         };
 
+        // The pseudorandom generator for seeded PIR queries: expand seed
+        // into len bytes of AES-128-CTR keystream, using the seed as
+        // the key.  Each value of stream gives an independent output:
+        // it is the first four bytes (big-endian) of the initial
+        // counter block, the rest of which is zero.  Return 0 on
+        // success, non-0 on failure.
+        int PRG(unsigned char *out, size_t len, const PIRSeed seed,
+            unsigned int stream);
+
+        // The side of the smallest cube of the given depth (number of
+        // dimensions) with room for num_buckets buckets, as used by
+        // recursive PIR queries
+        unsigned int pir_cube_side(unsigned int num_buckets,
+            unsigned int depth);
+
         // Encryption and decryption of associated data
         // Each (small) piece of associated data is encrypted with a
         // different key, so keeping key state is unnecessary.
@@ -182,6 +277,33 @@ namespace dp5 {
             const std::string & ciphertext,
             const std::string & additionaldata = "");
 
+        // Batched versions of the above, for many records of the same
+        // size.  These write into caller-provided buffers, and avoid
+        // any per-record allocation.
+
+        // Encrypt num_records records, each of plaintext_len bytes,
+        // from plaintexts into ciphertexts (which must have room for
+        // num_records * (plaintext_len + ENCRYPTION_OVERHEAD) bytes).
+        // Record i uses key datakeys[i] and additional data
+        // additionaldata[i] (if additionaldata is not NULL).  Return 0
+        // on success, non-0 on failure.
+        int EncBatch(unsigned char *ciphertexts, const DataKey *datakeys,
+            const unsigned char *plaintexts, size_t plaintext_len,
+            size_t num_records, const std::string *additionaldata = NULL);
+
+        // Decrypt num_records records, each of ciphertext_len bytes,
+        // from ciphertexts into plaintexts (which must have room for
+        // num_records * (ciphertext_len - ENCRYPTION_OVERHEAD) bytes).
+        // Record i uses key enckeys[i] and additional data
+        // additionaldata[i] (if additionaldata is not NULL).  If errors
+        // is not NULL, errors[i] is set to 0 if record i decrypted
+        // successfully, and non-0 otherwise.  Return 0 if every record
+        // decrypted successfully, non-0 otherwise.
+        int DecBatch(unsigned char *plaintexts, const DataKey *enckeys,
+            const unsigned char *ciphertexts, size_t ciphertext_len,
+            size_t num_records, const std::string *additionaldata = NULL,
+            int *errors = NULL);
+
 
         // Convert an epoch number to an epoch byte array
         void epoch_num_to_bytes(WireEpoch result, Epoch epoch_num);
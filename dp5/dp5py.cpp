@@ -11,6 +11,7 @@
 #include "Pairing.h"
 
 #include <fstream>
+#include <pthread.h>
 
 using namespace dp5;
 // Python module compilation notes
@@ -26,6 +27,10 @@ using namespace dp5;
 
 extern "C" {
 
+// The bindings release the GIL around the library's work, so that
+// the threads of a server (or client) can run on several cores.  A
+// client is not thread-safe, so its lock is held for any use of it;
+// it is only ever taken with the GIL released.
 struct s_client {
     PrivKey privkey;
     PubKey pubkey;
@@ -33,15 +38,106 @@ struct s_client {
     DP5LookupClient * cli;
     DP5Config config;
     DP5LookupClient::Request req;
+    pthread_mutex_t lock;
 };
 
+// Requests are answered with the GIL released, so replacing the lookup
+// server must wait for those in progress: lookups_lock is held for
+// reading while one is in use, and for writing to replace it.  Like a
+// client's lock, it is only ever taken with the GIL released.
 struct s_server {
     DP5RegServer * regs;
     DP5LookupServer * lookups;
     DP5Config config;
+    pthread_rwlock_t lookups_lock;
 };
 
 
+// ------------------------- Messages ------------------------
+
+// A message the library produced, handed to Python without a copy as
+// the object behind a read-only memoryview
+struct s_message {
+    PyObject_HEAD
+    string * data;
+};
+
+static void message_dealloc(s_message * self) {
+    delete self->data;
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int message_getbuffer(s_message * self, Py_buffer * view, int flags) {
+    return PyBuffer_FillInfo(view, (PyObject *) self,
+        (void *) self->data->data(), self->data->size(), 1, flags);
+}
+
+static PyBufferProcs message_as_buffer = {
+    0,                                  /* bf_getreadbuffer */
+    0,                                  /* bf_getwritebuffer */
+    0,                                  /* bf_getsegcount */
+    0,                                  /* bf_getcharbuffer */
+    (getbufferproc) message_getbuffer,  /* bf_getbuffer */
+    0,                                  /* bf_releasebuffer */
+};
+
+static PyTypeObject MessageType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "dp5.message",                      /* tp_name */
+    sizeof(s_message),                  /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor) message_dealloc,       /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    &message_as_buffer,                 /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+    "A message from the DP5 library",   /* tp_doc */
+};
+
+// Hand a message the library produced back to Python: copied into a
+// str, or, if view is true, as a memoryview of out itself, which is
+// taken over rather than copied.  That is worth it for large replies,
+// such as whole-database downloads.
+static PyObject * message_out(string & out, PyObject * view) {
+    int isView = view ? PyObject_IsTrue(view) : 0;
+    if (isView < 0)
+        return NULL;
+    if (!isView)
+        return PyString_FromStringAndSize(out.data(), out.length());
+
+    s_message * msg = PyObject_New(s_message, &MessageType);
+    if (!msg)
+        return NULL;
+    msg->data = new string();
+    msg->data->swap(out);
+
+    PyObject * ret = PyMemoryView_FromObject((PyObject *) msg);
+    Py_DECREF(msg);
+    return ret;
+}
+
+// Copy any object with the buffer interface (str, bytearray,
+// memoryview, ...) into out.  Returns 0, or -1 with an exception set.
+static int buffer_to_string(PyObject * obj, string & out) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0)
+        return -1;
+    out.assign((const char *) view.buf, view.len);
+    PyBuffer_Release(&view);
+    return 0;
+}
+
 // ------------------------- Util & Crypto interfaces ----------
 
 void config_delete(PyObject *self) {
@@ -54,15 +150,34 @@ static PyObject* pymake_config(PyObject* self, PyObject *args) {
     unsigned int epoch_len;
     unsigned int dataenc_bytes;
     PyObject *combined;
-    int ok = PyArg_ParseTuple(args, "IIO", &epoch_len, &dataenc_bytes,
-            &combined);
+    unsigned int pir_backend = PIR_BACKEND_PERCY;
+    PyObject *batch_pir = Py_False;
+    unsigned int pir_depth = 1;
+    PyObject *query_sizes = NULL;
+    int ok = PyArg_ParseTuple(args, "IIO|IOIO", &epoch_len, &dataenc_bytes,
+            &combined, &pir_backend, &batch_pir, &pir_depth, &query_sizes);
     if (!ok)
         return NULL;
 
+    if (pir_backend != PIR_BACKEND_PERCY && pir_backend != PIR_BACKEND_DPF &&
+            pir_backend != PIR_BACKEND_CHOR) {
+        PyErr_SetString(PyExc_ValueError, "Unknown PIR backend");
+        return NULL;
+    }
+
+    if (pir_depth < 1 || pir_depth > PIR_MAX_DEPTH) {
+        PyErr_SetString(PyExc_ValueError, "Bad PIR recursion depth");
+        return NULL;
+    }
+
     int isTrue = PyObject_IsTrue(combined);
     if (isTrue < 0)
         return NULL;
 
+    int isBatch = PyObject_IsTrue(batch_pir);
+    if (isBatch < 0)
+        return NULL;
+
     DP5Config * config = static_cast<DP5Config *>
         (PyMem_Malloc(sizeof(*config)));
     if (!config)
@@ -71,6 +186,36 @@ static PyObject* pymake_config(PyObject* self, PyObject *args) {
     config->epoch_len = epoch_len;
     config->dataenc_bytes = dataenc_bytes;
     config->combined = isTrue;
+    config->pir_backend = pir_backend;
+    config->batch_pir = isBatch;
+    config->pir_depth = pir_depth;
+    config->default_query_sizes();
+
+    // The query-size ladder, as a sequence of ints
+    if (query_sizes && query_sizes != Py_None) {
+        PyObject *seq = PySequence_Fast(query_sizes,
+            "Query sizes must be a sequence");
+        if (!seq) {
+            PyMem_Free(config);
+            return NULL;
+        }
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+        config->num_query_sizes = (unsigned int) n;
+        for (Py_ssize_t i = 0; i < n && i < MAX_QUERY_SIZES; ++i) {
+            config->query_sizes[i] = (unsigned int) PyInt_AsLong(
+                PySequence_Fast_GET_ITEM(seq, i));
+        }
+        Py_DECREF(seq);
+        if (PyErr_Occurred()) {
+            PyMem_Free(config);
+            return NULL;
+        }
+        if (!config->valid_query_sizes()) {
+            PyMem_Free(config);
+            PyErr_SetString(PyExc_ValueError, "Bad query size ladder");
+            return NULL;
+        }
+    }
 
     PyObject *capsule = PyCapsule_New(static_cast<void *>(config),
         "dp5_config", &config_delete);
@@ -130,6 +275,7 @@ void client_delete(PyObject * self){
     s_client * c = (s_client *) PyCapsule_GetPointer(self, "dp5_client");
     delete c->cli;
     delete c->reg;
+    pthread_mutex_destroy(&c->lock);
     delete c;
 }
 
@@ -152,6 +298,7 @@ static PyObject* pygetnewclient(PyObject* self, PyObject* args){
     c->config = *config;
     c->cli = new DP5LookupClient(c->privkey);
     c->reg = new DP5RegClient(c->config, c->privkey);
+    pthread_mutex_init(&c->lock, NULL);
 
 /*
     // Allocate a request in place
@@ -166,11 +313,13 @@ static PyObject* pygetnewclient(PyObject* self, PyObject* args){
 }
 
 static PyObject* pyclientregstart(PyObject* self, PyObject* args){
-    // We expect 2 arguments: an s_client and a buddy list
+    // We expect 2 arguments: an s_client and a buddy list, and
+    // whether to return a memoryview
     PyObject* sclient;
     PyObject* buddielist;
+    PyObject* view = NULL;
     unsigned int next_epoch;
-    int ok = PyArg_ParseTuple(args, "OIO", &sclient, &next_epoch, &buddielist);
+    int ok = PyArg_ParseTuple(args, "OIO|O", &sclient, &next_epoch, &buddielist, &view);
     if (!ok) return NULL;
     if (!PyCapsule_CheckExact(sclient)) return NULL;
     if (!PyList_Check(buddielist)) return NULL;
@@ -191,58 +340,78 @@ static PyObject* pyclientregstart(PyObject* self, PyObject* args){
             PyErr_SetString(PyExc_RuntimeError, "Item is null");
             return NULL; }
 
-        PyObject * pubk = PySequence_GetItem(item,0);
-        PyObject * data = PySequence_GetItem(item,1);
-        if (!pubk || !PyString_Check(pubk) || !data || !PyString_Check(data)){
+        // The public key and data may be any objects with the buffer
+        // interface
+        string pubk, data;
+        PyObject * pubk_obj = PySequence_GetItem(item,0);
+        PyObject * data_obj = PySequence_GetItem(item,1);
+        int err = (!pubk_obj || !data_obj
+            || buffer_to_string(pubk_obj, pubk) < 0
+            || buffer_to_string(data_obj, data) < 0);
+        Py_XDECREF(pubk_obj);
+        Py_XDECREF(data_obj);
+        if (err){
             PyErr_SetString(PyExc_RuntimeError, "Bad item format: type mismatch");
             return NULL;
         }
 
-        if (PyString_Size(pubk) != PubKey::size){
+        if (pubk.size() != PubKey::size){
             PyObject_Print(item, stdout, 0);
             PyErr_SetString(PyExc_RuntimeError, "Bad item format: pub. key length mismatch");
             return NULL;  }
 
-        if (PyString_Size(data) != c->config.dataplain_bytes()){
+        if (data.size() != c->config.dataplain_bytes()){
             PyObject_Print(item, stdout, 0);
             PyErr_SetString(PyExc_RuntimeError, "Bad item format: plaintext length mismatch");
             return NULL;  }
 
         BuddyInfo b;
-        b.pubkey.assign(reinterpret_cast<const byte *>(PyString_AsString(pubk)), b.pubkey.size);
-        b.data.assign(PyString_AsString(data), PyString_Size(data));
+        b.pubkey.assign(reinterpret_cast<const byte *>(pubk.data()), b.pubkey.size);
+        b.data.swap(data);
         bs.push_back(b);
     }
 
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&c->lock);
     ok = (c->reg)->start_reg(result, next_epoch, bs);
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+
     if (ok != 0x00){
         printf("Error: %d\n", ok);
         PyErr_SetString(PyExc_RuntimeError, "Protocol interface error");
         return NULL;
     }
-    PyObject *ret = Py_BuildValue("z#",
-                        (char *)result.data(), result.length());
-    return ret;
+    return message_out(result, view);
 }
 
 static PyObject* pyclientregcomplete(PyObject* self, PyObject* args){
     PyObject* sclient;
     unsigned int next_epoch;
-    char *msg;
-    Py_ssize_t msgsize = 0;
-    int ok = PyArg_ParseTuple(args, "Oz#I", &sclient, &msg, &msgsize, &next_epoch);
+    Py_buffer msg;
+    int ok = PyArg_ParseTuple(args, "Os*I", &sclient, &msg, &next_epoch);
     if (!ok) return NULL;
-    if (!PyCapsule_CheckExact(sclient)) return NULL;
-
-    string smsg;
-    smsg.assign(msg, msgsize);
+    if (!PyCapsule_CheckExact(sclient)) {
+        PyBuffer_Release(&msg);
+        return NULL;
+    }
 
     s_client * c = (s_client *) PyCapsule_GetPointer(sclient, "dp5_client");
     if (!c){
+         PyBuffer_Release(&msg);
          PyErr_SetString(PyExc_RuntimeError, "Bad capsule");
          return NULL;
     }
+
+    Py_BEGIN_ALLOW_THREADS
+    string smsg;
+    smsg.assign((char *) msg.buf, msg.len);
+    pthread_mutex_lock(&c->lock);
     ok = (c->reg)->complete_reg(smsg, next_epoch);
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&msg);
     if (ok != 0x00){
         printf("Error: %d\n",ok);
         PyErr_SetString(PyExc_RuntimeError, "Protocol interface error");
@@ -254,9 +423,10 @@ static PyObject* pyclientregcomplete(PyObject* self, PyObject* args){
 
 static PyObject* pyclientmetadatarequest(PyObject* self, PyObject* args){
     PyObject* sclient;
+    PyObject* view = NULL;
     unsigned int epoch;
 
-    int ok = PyArg_ParseTuple(args, "OI", &sclient, &epoch);
+    int ok = PyArg_ParseTuple(args, "OI|O", &sclient, &epoch, &view);
     if (!ok) return NULL;
     if (!PyCapsule_CheckExact(sclient)) return NULL;
 
@@ -268,46 +438,104 @@ static PyObject* pyclientmetadatarequest(PyObject* self, PyObject* args){
          return NULL;
     }
 
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&c->lock);
     (c->cli)->metadata_request(result, epoch);
-    PyObject *ret = Py_BuildValue("z#",
-                        (char *)result.data(), result.length());
-    return ret;
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+
+    return message_out(result, view);
 }
 
-static PyObject* pyclientmetadatareply(PyObject* self, PyObject* args){
+// Process a metadata reply: make it current (prefetch false), or cache
+// the reply to a request made ahead of time without making it current
+// (prefetch true)
+static PyObject* client_metadata_in(PyObject* args, bool prefetch){
     PyObject* sclient;
-    char * data;
-    Py_ssize_t datasize = 0;
+    Py_buffer data;
 
-    int ok = PyArg_ParseTuple(args, "Oz#", &sclient, &data, &datasize);
+    int ok = PyArg_ParseTuple(args, "Os*", &sclient, &data);
     if (!ok) return NULL;
-    if (!PyCapsule_CheckExact(sclient)) return NULL;
-
-    string datain;
-    datain.assign(data, datasize);
+    if (!PyCapsule_CheckExact(sclient)) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
 
     s_client * c = (s_client *) PyCapsule_GetPointer(sclient, "dp5_client");
     if (!c){
+         PyBuffer_Release(&data);
          PyErr_SetString(PyExc_RuntimeError, "Bad capsule");
          return NULL;
     }
 
-    ok = (c->cli)->metadata_reply(datain);
+    Py_BEGIN_ALLOW_THREADS
+    string datain;
+    datain.assign((char *) data.buf, data.len);
+    pthread_mutex_lock(&c->lock);
+    if (prefetch) {
+        ok = (c->cli)->metadata_prefetch(datain);
+    } else {
+        ok = (c->cli)->metadata_reply(datain);
+    }
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&data);
     if (ok != 0x00) {
-        printf("Error: %d\n",ok);
+        if (!prefetch) printf("Error: %d\n",ok);
         PyErr_SetString(PyExc_RuntimeError, "Protocol interface error");
         return NULL; }
 
     Py_RETURN_NONE;
 }
 
+static PyObject* pyclientmetadatareply(PyObject* self, PyObject* args){
+    return client_metadata_in(args, false);
+}
+
+// Cache the reply to a metadata request made ahead of time, without
+// making it current
+static PyObject* pyclientmetadataprefetch(PyObject* self, PyObject* args){
+    return client_metadata_in(args, true);
+}
+
+// Make an epoch's cached metadata current, if there is any; returns
+// whether there was, and so whether the metadata request can be skipped
+static PyObject* pyclientusecachedmetadata(PyObject* self, PyObject* args){
+    PyObject* sclient;
+    unsigned int epoch;
+
+    int ok = PyArg_ParseTuple(args, "OI", &sclient, &epoch);
+    if (!ok) return NULL;
+    if (!PyCapsule_CheckExact(sclient)) return NULL;
+
+    s_client * c = (s_client *) PyCapsule_GetPointer(sclient, "dp5_client");
+    if (!c || !(c->cli)){
+         PyErr_SetString(PyExc_RuntimeError, "Bad capsule");
+         return NULL;
+    }
+
+    bool cached;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&c->lock);
+    cached = (c->cli)->use_cached_metadata(epoch);
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+
+    if (cached) {
+        Py_RETURN_TRUE;
+    }
+    Py_RETURN_FALSE;
+}
+
 static PyObject* pyclientlookuprequest(PyObject* self, PyObject* args){
     // printf("Got to request... 1\n");
     PyObject* sclient;
     PyObject* buddies;
+    PyObject* view = NULL;
 	unsigned int num_servers;
 	unsigned int privacy;
-    int ok = PyArg_ParseTuple(args, "OOII", &sclient, &buddies, &num_servers, &privacy);
+    int ok = PyArg_ParseTuple(args, "OOII|O", &sclient, &buddies, &num_servers, &privacy, &view);
     if (!ok) return NULL;
     if (!PyCapsule_CheckExact(sclient)) return NULL;
     if (!PyList_Check(buddies)) return NULL;
@@ -322,31 +550,43 @@ static PyObject* pyclientlookuprequest(PyObject* self, PyObject* args){
     for(unsigned int i = 0; i < PyList_Size(buddies); i++)
     {
         PyObject * item = PyList_GetItem(buddies, i);
-        if (!item || !PyString_Check(item)
-                || PyString_Size(item) != PubKey::size) {
+        string pubk;
+        if (!item || buffer_to_string(item, pubk) < 0
+                || pubk.size() != PubKey::size) {
             PyErr_SetString(PyExc_RuntimeError,
                 "Item is null or not a string or not the right length");
             return NULL; }
 
         PubKey pk;
-        pk.assign(reinterpret_cast<const byte *>(
-            PyString_AsString(item)), PyString_Size(item));
+        pk.assign(reinterpret_cast<const byte *>(pubk.data()), pubk.size());
         buds.push_back(pk);
     }
 
     if (!(c->cli)) return NULL;
 
+    vector<string> msgCtoSpir;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&c->lock);
     ok = (c->cli)->lookup_request(c->req, buds, num_servers, privacy);
-    if (ok != 0x00) return NULL;
+    if (ok == 0x00) msgCtoSpir = (c->req).get_msgs();
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
 
-    vector<string> msgCtoSpir = (c->req).get_msgs();
+    if (ok != 0x00) return NULL;
 
     PyObject* ret = PyList_New(msgCtoSpir.size());
+    if (!ret) return NULL;
     for (unsigned int i = 0; i < msgCtoSpir.size(); i++){
         if (msgCtoSpir[i].length() > 0) {
-            PyList_SetItem(ret, i, PyString_FromStringAndSize(msgCtoSpir[i].data(), msgCtoSpir[i].length()));
+            PyObject * item = message_out(msgCtoSpir[i], view);
+            if (!item) {
+                Py_DECREF(ret);
+                return NULL;
+            }
+            PyList_SetItem(ret, i, item);
         }
         else {
+            Py_INCREF(Py_None);
             PyList_SetItem(ret, i, Py_None);
         }
     }
@@ -369,25 +609,54 @@ static PyObject* pyclientlookupreply(PyObject* self, PyObject* args){
          return NULL;
     }
 
-    vector<string> msgStoCpir;
-    for(unsigned int i = 0; i < PyList_Size(incoming); i++){
+    // Hold on to the replies (None, or any object with the buffer
+    // interface) while the GIL is released, rather than copying them
+    // first
+    Py_ssize_t num_replies = PyList_Size(incoming);
+    vector<Py_buffer> replies(num_replies);
+    vector<bool> have_reply(num_replies, false);
+    for(Py_ssize_t i = 0; i < num_replies; i++){
         PyObject * item = PyList_GetItem(incoming, i);
-        if (PyString_Check(item)
-                && PyString_Size(item) > 0) {
-            string s;
-            s.assign(PyString_AsString(item), PyString_Size(item));
-            msgStoCpir.push_back(s);
-        }
-        else if (item == Py_None){
-            msgStoCpir.push_back("");
-        } else {
+        if (item == Py_None) continue;
+        if (PyObject_GetBuffer(item, &replies[i], PyBUF_SIMPLE) < 0) {
+            for (Py_ssize_t j = 0; j < i; j++) {
+                if (have_reply[j]) PyBuffer_Release(&replies[j]);
+            }
             PyErr_SetString(PyExc_RuntimeError, "Unknown object type in list");
             return NULL;
         }
+        have_reply[i] = true;
     }
 
     vector<DP5LookupClient::Presence> presence;
-    ok = (c->req).lookup_reply(presence, msgStoCpir);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&c->lock);
+    if ((c->req).is_download()) {
+        // Stream the one download reply through in place
+        ok = 0x16;
+        for (Py_ssize_t i = 0; i < num_replies; i++){
+            if (!have_reply[i] || replies[i].len == 0) continue;
+            ok = (c->req).download_feed((const char *) replies[i].buf,
+                replies[i].len);
+            if (ok == 0x00) ok = (c->req).download_finish(presence);
+            break;
+        }
+    } else {
+        vector<string> msgStoCpir(num_replies);
+        for (Py_ssize_t i = 0; i < num_replies; i++){
+            if (!have_reply[i]) continue;
+            msgStoCpir[i].assign((const char *) replies[i].buf,
+                replies[i].len);
+        }
+        ok = (c->req).lookup_reply(presence, msgStoCpir);
+    }
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+
+    for (Py_ssize_t i = 0; i < num_replies; i++){
+        if (have_reply[i]) PyBuffer_Release(&replies[i]);
+    }
+
     if (ok != 0x00) {
         printf("Error: %d\n",ok);
         PyErr_SetString(PyExc_RuntimeError, "Protocol interface error");
@@ -413,12 +682,74 @@ static PyObject* pyclientlookupreply(PyObject* self, PyObject* args){
 }
 
 
+// Tell the client's cost model how long a metadata request to a
+// server took, in seconds
+static PyObject* pyclientobservemetadata(PyObject* self, PyObject* args){
+    PyObject* sclient;
+    unsigned int server;
+    double seconds;
+    int ok = PyArg_ParseTuple(args, "OId", &sclient, &server, &seconds);
+    if (!ok) return NULL;
+    if (!PyCapsule_CheckExact(sclient)) return NULL;
+
+    s_client * c = (s_client *) PyCapsule_GetPointer(sclient, "dp5_client");
+    if (!c || !(c->cli)){
+         PyErr_SetString(PyExc_RuntimeError, "Bad capsule");
+         return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&c->lock);
+    (c->cli)->observe_metadata(server, seconds);
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+// Tell the client's cost model how long each server's reply to the last
+// lookup took, in seconds, with None for servers that were sent
+// nothing or did not reply
+static PyObject* pyclientobservelookup(PyObject* self, PyObject* args){
+    PyObject* sclient;
+    PyObject* timings;
+    int ok = PyArg_ParseTuple(args, "OO", &sclient, &timings);
+    if (!ok) return NULL;
+    if (!PyCapsule_CheckExact(sclient)) return NULL;
+    if (!PyList_Check(timings)) return NULL;
+
+    s_client * c = (s_client *) PyCapsule_GetPointer(sclient, "dp5_client");
+    if (!c || !(c->cli)){
+         PyErr_SetString(PyExc_RuntimeError, "Bad capsule");
+         return NULL;
+    }
+
+    vector<double> seconds;
+    for(unsigned int i = 0; i < PyList_Size(timings); i++){
+        PyObject * item = PyList_GetItem(timings, i);
+        if (item == Py_None) {
+            seconds.push_back(-1);
+        } else {
+            double t = PyFloat_AsDouble(item);
+            if (PyErr_Occurred()) return NULL;
+            seconds.push_back(t);
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&c->lock);
+    (c->cli)->observe_lookup(c->req, seconds);
+    pthread_mutex_unlock(&c->lock);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
 // ----------------- Server interfaces --------------------
 
 void server_delete(PyObject * self){
     s_server * s = (s_server *) PyCapsule_GetPointer(self, "dp5_server");
     if (s->regs) delete s->regs;
     if (s->lookups) delete s->lookups;
+    pthread_rwlock_destroy(&s->lookups_lock);
 	PyMem_Free(s);
 }
 
@@ -436,6 +767,7 @@ static PyObject* pygetnewserver(PyObject* self, PyObject* args) {
     s->regs = NULL;
     s->lookups = NULL;
     s->config = *config;
+    pthread_rwlock_init(&s->lookups_lock, NULL);
 
     PyObject * cap = PyCapsule_New((void *) s, "dp5_server",
         (PyCapsule_Destructor) &server_delete);
@@ -462,10 +794,10 @@ static PyObject* pyserverinitreg(PyObject* self, PyObject* args){
 static PyObject* pyserverclientreg(PyObject* self, PyObject* args){
     PyObject * server_cap;
     Py_buffer data;
+    PyObject * view = NULL;
 
-    int ok = PyArg_ParseTuple(args, "Os*", &server_cap, &data);
+    int ok = PyArg_ParseTuple(args, "Os*|O", &server_cap, &data, &view);
     if (!ok) {
-        PyBuffer_Release(&data);
         cout << "Error 1" << "\n";
         return NULL;
     }
@@ -483,17 +815,16 @@ static PyObject* pyserverclientreg(PyObject* self, PyObject* args){
         return NULL;
     }
 
-    string datain;
-    datain.assign((char*) data.buf, data.len);
     string dataout;
 
     Py_BEGIN_ALLOW_THREADS
+    string datain;
+    datain.assign((char*) data.buf, data.len);
     (s->regs)->client_reg(dataout, datain);
     Py_END_ALLOW_THREADS
 
-    PyObject *ret = Py_BuildValue("z#", (char *)dataout.data(), dataout.length());
     PyBuffer_Release(&data);
-    return ret;
+    return message_out(dataout, view);
 }
 
 static PyObject* pyserverepochchange(PyObject* self, PyObject* args){
@@ -509,11 +840,15 @@ static PyObject* pyserverepochchange(PyObject* self, PyObject* args){
 
     if (!s->regs) return NULL;
 
+    // Registrations for the new epoch can go on meanwhile
+    unsigned int new_epoch;
+    Py_BEGIN_ALLOW_THREADS
     ofstream md(metafile);
     ofstream d(datafile);
-    unsigned int new_epoch = (s->regs)->epoch_change(md, d);
+    new_epoch = (s->regs)->epoch_change(md, d);
     d.close();
     md.close();
+    Py_END_ALLOW_THREADS
 
     return PyInt_FromLong(new_epoch);
 }
@@ -528,24 +863,73 @@ static PyObject* pyserverinitlookup(PyObject* self, PyObject* args){
     if (!PyCapsule_CheckExact(server_cap)) return NULL;
 
     s_server * s = (s_server *) PyCapsule_GetPointer(server_cap, "dp5_server");
-    // Clean delete of previous instance!
-    if (s->lookups) delete s->lookups;
 
-    s->lookups = new DP5LookupServer(metafile, datafile);
+    // Load the new instance before swapping it in, since other threads
+    // may be answering requests with the previous one meanwhile
+    Py_BEGIN_ALLOW_THREADS
+    DP5LookupServer * lookups = new DP5LookupServer(metafile, datafile);
+
+    pthread_rwlock_wrlock(&s->lookups_lock);
+    DP5LookupServer * old = s->lookups;
+    s->lookups = lookups;
+    pthread_rwlock_unlock(&s->lookups_lock);
+
+    // Clean delete of previous instance!
+    if (old) delete old;
+    Py_END_ALLOW_THREADS
     // printf("meta: %s data: %s\n", metafile, datafile);
 
     Py_RETURN_NONE;
 }
 
+static PyObject* pyserverquerystats(PyObject* self, PyObject* args){
+    PyObject * server_cap;
+    int ok = PyArg_ParseTuple(args, "O", &server_cap);
+    if (!ok) return NULL;
+    if (!PyCapsule_CheckExact(server_cap)) return NULL;
+
+    s_server * s = (s_server *) PyCapsule_GetPointer(server_cap, "dp5_server");
+
+    map<unsigned int, unsigned long> rungs;
+    unsigned long downloads = 0;
+    bool loaded;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&s->lookups_lock);
+    loaded = (s->lookups != NULL);
+    if (loaded) (s->lookups)->query_stats(rungs, downloads);
+    pthread_rwlock_unlock(&s->lookups_lock);
+    Py_END_ALLOW_THREADS
+    if (!loaded) return NULL;
+
+    // A dict from each rung of the query-size ladder to the number of
+    // PIR requests of that size, and the number of downloads
+    PyObject *rungdict = PyDict_New();
+    if (!rungdict) return NULL;
+    for (map<unsigned int, unsigned long>::const_iterator it = rungs.begin();
+            it != rungs.end(); ++it) {
+        PyObject *key = PyInt_FromLong(it->first);
+        PyObject *val = PyLong_FromUnsignedLong(it->second);
+        int err = (!key || !val) ? -1 : PyDict_SetItem(rungdict, key, val);
+        Py_XDECREF(key);
+        Py_XDECREF(val);
+        if (err) {
+            Py_DECREF(rungdict);
+            return NULL;
+        }
+    }
+    PyObject *ret = Py_BuildValue("Nk", rungdict, downloads);
+    return ret;
+}
+
 static PyObject* pyserverprocessrequest(PyObject* self, PyObject* args){
     PyObject * server_cap;
     Py_buffer data;
+    PyObject * view = NULL;
 
     // if (!self) return NULL;
 
-    int ok = PyArg_ParseTuple(args, "Os*", &server_cap, &data);
+    int ok = PyArg_ParseTuple(args, "Os*|O", &server_cap, &data, &view);
     if (!ok) {
-         PyBuffer_Release(&data);
          return NULL;
     }
     if (!PyCapsule_CheckExact(server_cap)) {
@@ -554,20 +938,24 @@ static PyObject* pyserverprocessrequest(PyObject* self, PyObject* args){
     }
 
     s_server * s = (s_server *) PyCapsule_GetPointer(server_cap, "dp5_server");
-    // Clean delete of previous instance!
-    if (!s->lookups) return NULL;
 
-    string datain;
-    datain.assign((char*)data.buf, data.len);
     string dataout;
+    bool loaded;
 
     Py_BEGIN_ALLOW_THREADS
-    (s->lookups)->process_request(dataout, datain);
+    pthread_rwlock_rdlock(&s->lookups_lock);
+    loaded = (s->lookups != NULL);
+    if (loaded) {
+        string datain;
+        datain.assign((char*)data.buf, data.len);
+        (s->lookups)->process_request(dataout, datain);
+    }
+    pthread_rwlock_unlock(&s->lookups_lock);
     Py_END_ALLOW_THREADS
 
-    PyObject *ret = Py_BuildValue("z#", (char *)dataout.data(), dataout.length());
     PyBuffer_Release(&data);
-    return ret;
+    if (!loaded) return NULL;
+    return message_out(dataout, view);
 }
 
 
@@ -588,8 +976,12 @@ static PyMethodDef dp5Methods[] =
      {"clientregcomplete", pyclientregcomplete, METH_VARARGS, "Complete client registration."},
      {"clientmetadatarequest", pyclientmetadatarequest, METH_VARARGS, "Metadata request"},
      {"clientmetadatareply", pyclientmetadatareply, METH_VARARGS, "Metadata reply"},
+     {"clientmetadataprefetch", pyclientmetadataprefetch, METH_VARARGS, "Prefetched metadata reply"},
+     {"clientusecachedmetadata", pyclientusecachedmetadata, METH_VARARGS, "Use cached metadata"},
      {"clientlookuprequest", pyclientlookuprequest, METH_VARARGS, "Lookup request."},
      {"clientlookupreply", pyclientlookupreply, METH_VARARGS, "Lookup request."},
+     {"clientobservemetadata", pyclientobservemetadata, METH_VARARGS, "Metadata request timing"},
+     {"clientobservelookup", pyclientobservelookup, METH_VARARGS, "Lookup reply timings"},
 
      // Server
      {"getnewserver", pygetnewserver, METH_VARARGS, "Get a new server instance."},
@@ -598,6 +990,7 @@ static PyMethodDef dp5Methods[] =
      {"serverepochchange", pyserverepochchange, METH_VARARGS, "Process a change of epoch"},
      {"serverinitlookup", pyserverinitlookup, METH_VARARGS, "Init lookup"},
      {"serverprocessrequest", pyserverprocessrequest, METH_VARARGS, "Process PIR request"},
+     {"serverquerystats", pyserverquerystats, METH_VARARGS, "Lookup request statistics"},
 
      // No not delete null entry
      {NULL, NULL, 0, NULL}
@@ -607,6 +1000,8 @@ PyMODINIT_FUNC
 
 initdp5(void)
 {
+     if (PyType_Ready(&MessageType) < 0)
+         return;
      (void) Py_InitModule("dp5", dp5Methods);
      printf("ZZ init\n");
      ZZ_p::init(to_ZZ(256));
@@ -17,7 +17,8 @@ using namespace dp5::internal;
 
 // Initialize the client by storing its private key
 DP5RegClient::DP5RegClient(const DP5Config & config, const PrivKey privkey)
-    : _config(config), _privkey(privkey) {
+    : _config(config), _privkey(privkey),
+      _key_cache(privkey, BuddyKeyCache::REGISTER) {
 }
 
 int DP5RegClient::start_reg(string &msgtosend, Epoch next_epoch,
@@ -27,9 +28,6 @@ int DP5RegClient::start_reg(string &msgtosend, Epoch next_epoch,
     if (buddies.size() > MAX_BUDDIES)
         return 0x01; // Number of buddies exceeds maximum.
 
-    PubKey mypub;
-    getpubkey(mypub, _privkey);
-
     // Determine the target epoch for the registration
     // as the next epoch, and convert to bytes.
 
@@ -38,42 +36,61 @@ int DP5RegClient::start_reg(string &msgtosend, Epoch next_epoch,
 
     // Placeholder for the output message
     size_t record_length = SHAREDKEY_BYTES+_config.dataenc_bytes;
-    vector<string> to_sort;
-
-    // For each real buddy
-    for(unsigned int i = 0; i < buddies.size(); i++)
+    size_t num_buddies = buddies.size();
+    size_t plain_bytes = _config.dataplain_bytes();
+    vector<string> to_sort(MAX_BUDDIES);
+
+    // Derive the epoch keys for each real buddy, and gather up the
+    // plaintexts so that they can all be encrypted in one batch
+    vector<unsigned char> data_key_bytes(num_buddies * DATAKEY_BYTES);
+    DataKey *data_keys = num_buddies ?
+        (DataKey *) &data_key_bytes[0] : NULL;
+    vector<string> ads(num_buddies);
+    vector<PubKey> buddy_pubkeys(num_buddies);
+    string plaintexts;
+    plaintexts.reserve(num_buddies * plain_bytes);
+    for(unsigned int i = 0; i < num_buddies; i++)
     {
-        string s;
         const BuddyInfo& current_buddy = buddies[i];
 
-        // Get the long terms shared DH key
-        unsigned char shared_dh_secret[PUBKEY_BYTES];
-        diffie_hellman(shared_dh_secret, _privkey, current_buddy.pubkey);
+        if (current_buddy.data.size() != plain_bytes)
+            return 0x02; // wrong data size
 
-        // Derive the epoch keys
-        unsigned char shared_key[SHAREDKEY_BYTES];
-        unsigned char data_key[DATAKEY_BYTES];
-        H1H2(shared_key, data_key, next_epoch, mypub, shared_dh_secret);
+        // Get the epoch keys, derived from the long-term shared DH
+        // key (both usually already computed)
+        BuddyKeyCache::EpochKeys keys;
+        _key_cache.epoch_keys(keys, next_epoch, current_buddy.pubkey);
+        memmove(data_keys[i], keys.data_key, DATAKEY_BYTES);
+        buddy_pubkeys[i] = current_buddy.pubkey;
 
-        s.assign((char *) shared_key, SHAREDKEY_BYTES);
+        to_sort[i].reserve(record_length);
+        to_sort[i].assign((char *) keys.shared_key, SHAREDKEY_BYTES);
 
-        string ad((char *) epoch_bytes, sizeof(epoch_bytes));
-        ad.append(current_buddy.pubkey);
-        ad.append((char *) shared_key, sizeof(shared_key));
+        ads[i].assign((char *) epoch_bytes, sizeof(epoch_bytes));
+        ads[i].append(current_buddy.pubkey);
+        ads[i].append((char *) keys.shared_key, SHAREDKEY_BYTES);
 
-        if (current_buddy.data.size() != _config.dataplain_bytes())
-            return 0x02; // wrong data size
-        s += Enc(data_key, current_buddy.data, ad);
-        to_sort.push_back(s);
+        plaintexts += current_buddy.data;
+    }
+
+    if (num_buddies > 0) {
+        string ciphertexts(num_buddies * _config.dataenc_bytes, '\0');
+        if (EncBatch((unsigned char *) &ciphertexts[0], data_keys,
+                (const unsigned char *) plaintexts.data(), plain_bytes,
+                num_buddies, &ads[0]) != 0)
+            return 0x03; // encryption failed
+        for(unsigned int i = 0; i < num_buddies; i++)
+        {
+            to_sort[i].append(ciphertexts, i * _config.dataenc_bytes,
+                _config.dataenc_bytes);
+        }
     }
 
     // Now pad the end of the array with random entries
-    for(unsigned int i = buddies.size(); i < MAX_BUDDIES; i++)
+    for(unsigned int i = num_buddies; i < MAX_BUDDIES; i++)
     {
-        char record[record_length];
-        random_bytes((unsigned char *) record, record_length);
-        string s(record, record_length);
-        to_sort.push_back(s);
+        to_sort[i].assign(record_length, '\0');
+        random_bytes((unsigned char *) &to_sort[i][0], record_length);
     }
 
     // Sort the records and construct the message
@@ -83,6 +100,10 @@ int DP5RegClient::start_reg(string &msgtosend, Epoch next_epoch,
        msgtosend += to_sort[i];
     }
 
+    // Get a head start on the following epoch's keys, assuming the
+    // buddy list stays much the same
+    _key_cache.precompute(next_epoch + 1, buddy_pubkeys);
+
     return 0x00;
 }
 
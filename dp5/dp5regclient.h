@@ -4,6 +4,7 @@
 #include <vector>
 #include <string>
 #include "dp5params.h"
+#include "dp5keycache.h"
 
 namespace dp5 {
 
@@ -37,6 +38,9 @@ private:
     // Save a copy of the private key
     DP5Config _config;
     PrivKey _privkey;
+
+    // Our long-term and per-epoch keys shared with each buddy
+    internal::BuddyKeyCache _key_cache;
 };
 
 }
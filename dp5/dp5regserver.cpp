@@ -15,9 +15,12 @@
 #include <stdexcept>
 #include <stdexcept>
 #include <set>
+#include <vector>
+#include <pthread.h>
 
 #include "dp5regserver.h"
 #include "dp5metadata.h"
+#include "dp5threadpool.h"
 
 using namespace std;
 
@@ -27,6 +30,108 @@ using namespace dp5::internal;
 
 static const unsigned int NUM_PRF_ITERS = 10;
 
+// With the DPF backend, a PIR query costs the client and the servers
+// only logarithmically in the number of buckets, and the reply is a
+// single bucket, so aim for buckets this many records long on average
+// rather than for the square-root layout.
+static const unsigned int DPF_RECORDS_PER_BUCKET = 8;
+
+// The number of combined-mode records handed to a single pairing worker
+// task
+static const unsigned int PAIRING_CHUNK_RECORDS = 16;
+
+// A combined-mode registration whose signatures are still being
+// checked by the pairing workers.  It owns the shared lock on the
+// registration file; the last of its chunks to finish releases it.
+class PendingRegistration {
+public:
+    PendingRegistration(int lockedfd, const unsigned char *indata,
+        size_t inlen, unsigned int numchunks) :
+        lockedfd(lockedfd), records((const char *) indata, inlen),
+        _remaining(numchunks)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+
+    ~PendingRegistration()
+    {
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    // Called by each chunk once its records have been appended to the
+    // registration file.  The last one to finish releases the lock and
+    // frees this object.
+    void chunk_done()
+    {
+        pthread_mutex_lock(&_mutex);
+        bool last = (--_remaining == 0);
+        pthread_mutex_unlock(&_mutex);
+
+        if (last) {
+            flock(lockedfd, LOCK_UN);
+            close(lockedfd);
+            delete this;
+        }
+    }
+
+    // The registration file, locked LOCK_SH
+    const int lockedfd;
+
+    // The (signature, encrypted data) records as sent by the client
+    const string records;
+
+private:
+    unsigned int _remaining;
+    pthread_mutex_t _mutex;
+};
+
+// Compute the hash keys for a range of records of a
+// PendingRegistration, and append them to the registration file.
+class SigHashTask : public Task {
+public:
+    SigHashTask(PendingRegistration *reg, unsigned int first,
+        unsigned int count, unsigned int dataenc_bytes) :
+        _reg(reg), _first(first), _count(count),
+        _dataenc_bytes(dataenc_bytes) {}
+
+    virtual void run()
+    {
+        const unsigned int inrecord_size = EPOCH_SIG_BYTES + _dataenc_bytes;
+        const unsigned int outrecord_size = HASHKEY_BYTES + _dataenc_bytes;
+
+        const unsigned char *indata =
+            (const unsigned char *) _reg->records.data() +
+            _first * inrecord_size;
+        unsigned char *outdata = new unsigned char[_count * outrecord_size];
+        unsigned char *outrecord = outdata;
+
+        for (unsigned int i=0; i<_count; ++i) {
+            // Records with invalid signatures are dropped
+            if (hash_key_from_sig(outrecord, indata) == 0) {
+                memmove(outrecord + HASHKEY_BYTES, indata + EPOCH_SIG_BYTES,
+                    _dataenc_bytes);
+                outrecord += outrecord_size;
+            }
+            indata += inrecord_size;
+        }
+
+        // Append all of the records with a single write, so that they
+        // are not interleaved with those of other writers
+        if (outrecord > outdata) {
+            write(_reg->lockedfd, outdata, outrecord - outdata);
+        }
+        delete[] outdata;
+
+        _reg->chunk_done();
+    }
+
+private:
+    PendingRegistration *_reg;
+    unsigned int _first;
+    unsigned int _count;
+    unsigned int _dataenc_bytes;
+};
+
 // Allocate a filename given the desired directory, the epoch number,
 // and the filename extension.  The caller must free() the result when
 // finished.
@@ -62,7 +167,8 @@ void DP5RegServer::create_nextreg_file(unsigned int useepoch)
 // files.
 DP5RegServer::DP5RegServer(const DP5Config & config, Epoch epoch,
     const char *regdir, const char *datadir) :
-    _config(config), _epoch(epoch)
+    _config(config), _epoch(epoch),
+    _pairing_pool(config.combined ? new ThreadPool() : NULL)
 {
     _regdir = strdup(regdir);
     _datadir = strdup(datadir);
@@ -73,7 +179,8 @@ DP5RegServer::DP5RegServer(const DP5Config & config, Epoch epoch,
 
 // Copy constructor
 DP5RegServer::DP5RegServer(const DP5RegServer &other)
-        : _config(other._config), _epoch(other._epoch)
+        : _config(other._config), _epoch(other._epoch),
+        _pairing_pool(other._config.combined ? new ThreadPool() : NULL)
 {
     _regdir = strdup(other._regdir);
     _datadir = strdup(other._datadir);
@@ -90,6 +197,9 @@ DP5RegServer& DP5RegServer::operator=(DP5RegServer other)
     tmp = other._datadir;
     other._datadir = _datadir;
     _datadir = tmp;
+    ThreadPool *tmppool = other._pairing_pool;
+    other._pairing_pool = _pairing_pool;
+    _pairing_pool = tmppool;
 
     _config = other._config;
     _epoch = other._epoch;
@@ -100,6 +210,9 @@ DP5RegServer& DP5RegServer::operator=(DP5RegServer other)
 // Destructor
 DP5RegServer::~DP5RegServer()
 {
+    // Let any registrations still in the pipeline finish
+    delete _pairing_pool;
+
     free(_regdir);
     free(_datadir);
 }
@@ -181,13 +294,31 @@ void DP5RegServer::client_reg(string &msgtoreply, const string &regmsg)
     }
     numrecords = regmsglen / inrecord_size;
 
-    for (unsigned int i=0; i<numrecords; ++i) {
-        if (_config.combined) {
-            hash_key_from_sig(outrecord, indata);
-        } else {
-            // Hash the key, copy the data
-            H3(outrecord, next_epoch, indata);
+    if (_config.combined && numrecords > 0) {
+        // Hand the records, and the lock, over to the pairing workers.
+        // They will append the records and release the lock when they
+        // are done.
+        unsigned int numchunks = (numrecords + PAIRING_CHUNK_RECORDS - 1)
+            / PAIRING_CHUNK_RECORDS;
+        PendingRegistration *pending = new PendingRegistration(lockedfd,
+            indata, regmsglen, numchunks);
+        lockedfd = -1;
+
+        for (unsigned int first=0; first<numrecords;
+                first += PAIRING_CHUNK_RECORDS) {
+            unsigned int count = numrecords - first;
+            if (count > PAIRING_CHUNK_RECORDS) {
+                count = PAIRING_CHUNK_RECORDS;
+            }
+            _pairing_pool->submit(new SigHashTask(pending, first, count,
+                _config.dataenc_bytes));
         }
+        numrecords = 0;
+    }
+
+    for (unsigned int i=0; i<numrecords; ++i) {
+        // Hash the key, copy the data
+        H3(outrecord, next_epoch, indata);
         memmove(outrecord + HASHKEY_BYTES,
             indata + inrecord_size - _config.dataenc_bytes,
             _config.dataenc_bytes);
@@ -203,10 +334,13 @@ void DP5RegServer::client_reg(string &msgtoreply, const string &regmsg)
 
 client_reg_return:
 
-    // Release the lock
+    // Release the lock, unless it was handed over to the pairing
+    // workers
     //printf("Unlocking %d\n", lockedfd);
-    flock(lockedfd, LOCK_UN);
-    close(lockedfd);
+    if (lockedfd >= 0) {
+        flock(lockedfd, LOCK_UN);
+        close(lockedfd);
+    }
 
     // Return the response to the client
     unsigned char resp[1+EPOCH_BYTES];
@@ -309,19 +443,25 @@ unsigned int DP5RegServer::epoch_change(ostream &metadataos, ostream &dataos)
     }
     uint64_t datasize = ostensible_numkeys *
             (HASHKEY_BYTES + _config.dataenc_bytes) *
-            PIR_WORDS_PER_BYTE;
+            pir_words_per_byte(_config.pir_backend);
 
     Metadata md(_config);
     md.epoch = _epoch;
-    md.num_buckets = (unsigned int)ceil(sqrt((double)datasize));
+    if (_config.pir_backend == PIR_BACKEND_DPF) {
+        md.num_buckets = (ostensible_numkeys + DPF_RECORDS_PER_BUCKET - 1) /
+            DPF_RECORDS_PER_BUCKET;
+    } else {
+        md.num_buckets = (unsigned int)ceil(sqrt((double)datasize));
+    }
 
     // Try NUM_PRF_ITERS random PRF keys and see which one results in
     // the smallest largest bucket.
     PRFKey best_prfkey;
     unsigned int best_size = regdata.size()+1;
     for (unsigned int iter=0; iter<NUM_PRF_ITERS; ++iter) {
-        unsigned long count[md.num_buckets];
-        memset(count, 0, sizeof(count));
+        // On the heap: with the DPF backend there can be a great many
+        // buckets
+        vector<unsigned long> count(md.num_buckets, 0);
         unsigned long largest_bucket_size = 0;
         PRFKey cur_prfkey;
         random_bytes((unsigned char *)cur_prfkey, sizeof(cur_prfkey));
@@ -342,6 +482,7 @@ unsigned int DP5RegServer::epoch_change(ostream &metadataos, ostream &dataos)
     }
     memcpy(md.prfkey, best_prfkey, sizeof(md.prfkey));
     md.bucket_size = best_size;
+    md.sorted_buckets = true;
 
     cerr << md.num_buckets << " " << best_size << "*" << (HASHKEY_BYTES + _config.dataenc_bytes) << "=" << (best_size*(HASHKEY_BYTES + _config.dataenc_bytes)) << "\n";
 
@@ -353,10 +494,11 @@ unsigned int DP5RegServer::epoch_change(ostream &metadataos, ostream &dataos)
     throw runtime_error("Out of memory allocating data file");
     }
     memset(datafile, 0x00, datafile_size);
-    unsigned long count[md.num_buckets];
-    memset(count, 0, sizeof(count));
+    vector<unsigned long> count(md.num_buckets, 0);
     PRF prf(md.prfkey, md.num_buckets);
 
+    // regdata is in order, so this fills each bucket from the front in
+    // order of hash key
     for (set<string>::const_iterator k = regdata.begin(); k != regdata.end(); k++) {
         unsigned int bucket = prf.M((const unsigned char *) k->data());
         if (count[bucket] >= best_size) {
@@ -365,11 +507,21 @@ unsigned int DP5RegServer::epoch_change(ostream &metadataos, ostream &dataos)
             throw runtime_error("Inconsistency creating buckets");
         }
         memmove(datafile+bucket*(best_size*(HASHKEY_BYTES+_config.dataenc_bytes))
-            + (best_size-count[bucket]-1)*(HASHKEY_BYTES+_config.dataenc_bytes),
+            + count[bucket]*(HASHKEY_BYTES+_config.dataenc_bytes),
             k->data(), HASHKEY_BYTES+_config.dataenc_bytes);
         count[bucket] += 1;
     }
 
+    // Pad out each bucket with records whose hash keys sort after
+    // every real one
+    for (unsigned int bucket = 0; bucket < md.num_buckets; bucket++) {
+        for (unsigned long r = count[bucket]; r < best_size; r++) {
+            memset(datafile+bucket*(best_size*(HASHKEY_BYTES+_config.dataenc_bytes))
+                + r*(HASHKEY_BYTES+_config.dataenc_bytes),
+                0xff, HASHKEY_BYTES);
+        }
+    }
+
     md.toStream(metadataos);
     metadataos.flush();
 
@@ -444,8 +596,11 @@ int main(int argc, char **argv)
     int num_buddies = (argc > 2 ? atoi(argv[2]) : MAX_BUDDIES);
     int multithread = 1;
     bool combined = (num_buddies == 0);
-    if (combined)
+    if (combined) {
         num_buddies = 1;
+        // The signatures are checked with pairings
+        initPairing();
+    }
 
 
     // Ensure the directories exist
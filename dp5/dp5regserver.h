@@ -9,6 +9,10 @@
 
 namespace dp5 {
 
+namespace internal {
+    class ThreadPool;
+}
+
 class DP5RegServer {
 public:
     // The constructor consumes the current epoch number, the directory
@@ -31,6 +35,12 @@ public:
     // pass it to this function.  msgtoreply will be filled in with the
     // message to return to the client in response.  Client
     // registrations will become visible in the *next* epoch.
+    //
+    // In combined mode, the reply is sent as soon as the message has
+    // been validated; the pairings that turn the signatures into hash
+    // keys are computed in the background, and are guaranteed to have
+    // landed in the registration file before the next epoch_change
+    // seals it.  Records with invalid signatures are dropped.
     void client_reg(std::string &msgtoreply, const std::string &regmsg);
 
     // Call this when the epoch changes.  Pass in ostreams to which this
@@ -52,6 +62,10 @@ protected:
 
     DP5Config _config;
     Epoch _epoch;
+
+    // The workers computing the pairings for combined-mode
+    // registrations (NULL if not in combined mode)
+    internal::ThreadPool *_pairing_pool;
 };
 
 }
@@ -29,7 +29,9 @@ class RootServer:
         self.config = config
 
         self.dp5config = dp5.make_config(config["epochLength"],
-            config["dataEncSize"], config["combined"])
+            config["dataEncSize"], config["combined"],
+            config.get("pirBackend", 0), config.get("batchPIR", False),
+            config.get("pirDepth", 1), config.get("querySizes"))
 
         self.is_register = config["isRegServer"]
         self.register_handlers = {}
@@ -51,6 +53,10 @@ class RootServer:
 
         self.lookup_lock = threading.Lock()
 
+        # Epoch changes run without the GIL, and take a while: only one
+        # thread may move the epoch on
+        self.epoch_lock = threading.Lock()
+
         self.check_epoch()
         name = "LOOKUP" if config["isLookupServer"] else "REG"
         name += "CB" if config["combined"] else "NORM"
@@ -127,33 +133,34 @@ class RootServer:
             return server
 
     def check_epoch(self):
-        if self.epoch == None:
+        with self.epoch_lock:
+            if self.epoch == None:
 
-            ## Initialize for this epoch
-            self.epoch = dp5.getepoch(self.dp5config)
+                ## Initialize for this epoch
+                self.epoch = dp5.getepoch(self.dp5config)
 
-            if self.is_register:
-                ## Initialize a new registration server
-                server = dp5.getnewserver(self.dp5config)
-                dp5.serverinitreg(server, self.epoch, self.config["regdir"], self.config["datadir"])
-                self.register_handlers[self.epoch] = server
+                if self.is_register:
+                    ## Initialize a new registration server
+                    server = dp5.getnewserver(self.dp5config)
+                    dp5.serverinitreg(server, self.epoch, self.config["regdir"], self.config["datadir"])
+                    self.register_handlers[self.epoch] = server
 
-        elif self.epoch < self.getepoch():
+            elif self.epoch < self.getepoch():
 
-            ## Move epoch and initialize
-            if self.is_register:
-                assert self.epoch in self.register_handlers
-                server = self.register_handlers[self.epoch]
+                ## Move epoch and initialize
+                if self.is_register:
+                    assert self.epoch in self.register_handlers
+                    server = self.register_handlers[self.epoch]
 
-                ## Save DB and update epoch
-                meta_name, data_name = self.filenames(self.epoch+1)
-                self.epoch = dp5.serverepochchange(server, meta_name, data_name)
-                self.register_handlers[self.epoch] = server
-            else:
-                self.epoch = self.getepoch()
+                    ## Save DB and update epoch
+                    meta_name, data_name = self.filenames(self.epoch+1)
+                    self.epoch = dp5.serverepochchange(server, meta_name, data_name)
+                    self.register_handlers[self.epoch] = server
+                else:
+                    self.epoch = self.getepoch()
 
-        else:
-            pass # do nothing
+            else:
+                pass # do nothing
 
     @cherrypy.expose
     def index(self, **keywords):
@@ -257,6 +264,19 @@ class RootServer:
 
         return reply_msg
 
+    @cherrypy.expose
+    def querystats(self, epoch):
+        "Returns how many lookups of each size this server has answered."
+        assert self.is_lookup
+        if int(epoch) not in self.lookup_handlers:
+            raise cherrypy.HTTPError(404)
+        server = self.lookup_handlers[int(epoch)]
+        rungs, downloads = dp5.serverquerystats(server)
+        stats = {}
+        stats["rungs"] = dict((str(k), v) for k, v in rungs.items())
+        stats["downloads"] = downloads
+        return json.dumps(stats)
+
     @cherrypy.expose
     def download(self, epoch, metadata=False):
         myaID = self.aid 
@@ -0,0 +1,207 @@
+#include <unistd.h>
+#include <stdexcept>
+
+#include "dp5threadpool.h"
+
+using namespace std;
+
+namespace dp5 {
+namespace internal {
+
+// Start numthreads workers.  Pass 0 to use one worker per online CPU.
+ThreadPool::ThreadPool(unsigned int numthreads) :
+    _pending(0), _stopping(false)
+{
+    if (numthreads == 0) {
+        numthreads = default_num_threads();
+    }
+
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_work_cond, NULL);
+    pthread_cond_init(&_idle_cond, NULL);
+
+    for (unsigned int i = 0; i < numthreads; ++i) {
+        pthread_t thr;
+        if (pthread_create(&thr, NULL, worker_main, this) != 0) {
+            if (_threads.empty()) {
+                throw runtime_error("Cannot start worker thread");
+            }
+            // Make do with the workers we have
+            break;
+        }
+        _threads.push_back(thr);
+    }
+}
+
+// Runs all of the tasks still in the queue, then stops and joins the
+// workers.
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_broadcast(&_work_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    for (size_t i = 0; i < _threads.size(); ++i) {
+        pthread_join(_threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&_idle_cond);
+    pthread_cond_destroy(&_work_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+// Queue a task.  The pool takes ownership of the task, and will delete
+// it once it has run.
+void ThreadPool::submit(Task *task)
+{
+    pthread_mutex_lock(&_mutex);
+    _queue.push_back(task);
+    ++_pending;
+    pthread_cond_signal(&_work_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Block until every task submitted so far has finished running.
+void ThreadPool::wait()
+{
+    pthread_mutex_lock(&_mutex);
+    while (_pending > 0) {
+        pthread_cond_wait(&_idle_cond, &_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+// The number of online CPUs (at least 1)
+unsigned int ThreadPool::default_num_threads()
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpus > 0 ? (unsigned int) ncpus : 1;
+}
+
+// The shared pool is created on first use.  A forked child has none of
+// the workers, so it abandons the parent's pool (and whatever was
+// queued on it) and creates its own the next time it needs one.
+static ThreadPool *shared_pool = NULL;
+static pthread_mutex_t shared_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+
+void ThreadPool::init_shared()
+{
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+}
+
+// Hold the locks across fork() so that the child sees neither the
+// pointer nor the pool's queue half-updated
+void ThreadPool::before_fork()
+{
+    pthread_mutex_lock(&shared_pool_mutex);
+    if (shared_pool) {
+        pthread_mutex_lock(&shared_pool->_mutex);
+    }
+}
+
+void ThreadPool::after_fork_parent()
+{
+    if (shared_pool) {
+        pthread_mutex_unlock(&shared_pool->_mutex);
+    }
+    pthread_mutex_unlock(&shared_pool_mutex);
+}
+
+void ThreadPool::after_fork_child()
+{
+    // The old pool cannot be destroyed, as its workers are not here to
+    // be joined; leak it.
+    shared_pool = NULL;
+    pthread_mutex_unlock(&shared_pool_mutex);
+}
+
+// A process-wide pool with one worker per online CPU, for work that is
+// not tied to any one object.  Never destroyed.
+ThreadPool &ThreadPool::shared()
+{
+    pthread_once(&shared_pool_once, init_shared);
+    pthread_mutex_lock(&shared_pool_mutex);
+    if (!shared_pool) {
+        shared_pool = new ThreadPool();
+    }
+    ThreadPool *pool = shared_pool;
+    pthread_mutex_unlock(&shared_pool_mutex);
+    return *pool;
+}
+
+void *ThreadPool::worker_main(void *pool)
+{
+    ((ThreadPool *) pool)->worker();
+    return NULL;
+}
+
+void ThreadPool::worker()
+{
+    pthread_mutex_lock(&_mutex);
+    while (1) {
+        while (_queue.empty() && !_stopping) {
+            pthread_cond_wait(&_work_cond, &_mutex);
+        }
+        if (_queue.empty()) {
+            // Stopping, and nothing left to do
+            break;
+        }
+        Task *task = _queue.front();
+        _queue.pop_front();
+        pthread_mutex_unlock(&_mutex);
+
+        task->run();
+        delete task;
+
+        pthread_mutex_lock(&_mutex);
+        if (--_pending == 0) {
+            pthread_cond_broadcast(&_idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+TaskGroup::TaskGroup() : _outstanding(0)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+// Waits for the outstanding tasks
+TaskGroup::~TaskGroup()
+{
+    wait();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void TaskGroup::add()
+{
+    pthread_mutex_lock(&_mutex);
+    ++_outstanding;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void TaskGroup::done()
+{
+    pthread_mutex_lock(&_mutex);
+    if (--_outstanding == 0) {
+        pthread_cond_broadcast(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Block until every added task has called done()
+void TaskGroup::wait()
+{
+    pthread_mutex_lock(&_mutex);
+    while (_outstanding > 0) {
+        pthread_cond_wait(&_cond, &_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+} // namespace dp5::internal
+} // namespace dp5
@@ -0,0 +1,107 @@
+#ifndef __DP5THREADPOOL_H__
+#define __DP5THREADPOOL_H__
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+namespace dp5 {
+
+namespace internal {
+
+    // A unit of work to be run by a ThreadPool.  Subclass this and
+    // implement run().
+    class Task {
+    public:
+        virtual ~Task() {}
+        virtual void run() = 0;
+    };
+
+    // A fixed-size pool of worker threads consuming Tasks from a FIFO
+    // queue.
+    class ThreadPool {
+    public:
+        // Start numthreads workers.  Pass 0 to use one worker per
+        // online CPU.
+        ThreadPool(unsigned int numthreads = 0);
+
+        // Runs all of the tasks still in the queue, then stops and
+        // joins the workers.
+        ~ThreadPool();
+
+        // Queue a task.  The pool takes ownership of the task, and will
+        // delete it once it has run.
+        void submit(Task *task);
+
+        // Block until every task submitted so far has finished running.
+        void wait();
+
+        // The number of worker threads
+        unsigned int size() const { return _threads.size(); }
+
+        // The number of online CPUs (at least 1)
+        static unsigned int default_num_threads();
+
+        // A process-wide pool with one worker per online CPU, for work
+        // that is not tied to any one object.  Never destroyed.  After
+        // a fork(), the child gets a new one; don't hold on to the
+        // reference across a fork.
+        static ThreadPool &shared();
+
+    private:
+        // Not copyable
+        ThreadPool(const ThreadPool &);
+        ThreadPool& operator=(const ThreadPool &);
+
+        static void init_shared();
+        static void before_fork();
+        static void after_fork_parent();
+        static void after_fork_child();
+        static void *worker_main(void *pool);
+        void worker();
+
+        std::vector<pthread_t> _threads;
+        std::deque<Task *> _queue;
+
+        // The number of tasks queued or running
+        unsigned long _pending;
+        bool _stopping;
+
+        pthread_mutex_t _mutex;
+        // Signalled when a task is queued or the pool is stopping
+        pthread_cond_t _work_cond;
+        // Signalled when _pending drops to 0
+        pthread_cond_t _idle_cond;
+    };
+
+    // Tracks a set of Tasks, possibly on a shared ThreadPool, so that
+    // their submitter can wait for just those to finish.  Call add()
+    // before submitting each task, and have the task call done() as the
+    // last thing it does.
+    class TaskGroup {
+    public:
+        TaskGroup();
+        // Waits for the outstanding tasks
+        ~TaskGroup();
+
+        void add();
+        void done();
+
+        // Block until every added task has called done()
+        void wait();
+
+    private:
+        // Not copyable
+        TaskGroup(const TaskGroup &);
+        TaskGroup& operator=(const TaskGroup &);
+
+        unsigned long _outstanding;
+        pthread_mutex_t _mutex;
+        pthread_cond_t _cond;
+    };
+
+}  // namespace dp5::internal
+
+}  // namespace dp5
+
+#endif
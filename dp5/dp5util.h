@@ -46,6 +46,11 @@ namespace dp5 {
                 return (memcmp(data, other.data, N) == 0);
             }
 
+            // So that ByteArrays can be used as map keys
+            bool operator<(const ByteArray<N> & other) const {
+                return (memcmp(data, other.data, N) < 0);
+            }
+
             // FIXME: these should eventually be explicit
             operator std::string() const {
                 return std::string((char *) data, N);
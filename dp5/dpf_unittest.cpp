@@ -0,0 +1,79 @@
+#include <string.h>
+#include <vector>
+
+#include "dp5dpf.h"
+
+#include "gtest/gtest.h"
+
+using namespace dp5::internal;
+
+using std::vector;
+
+static bool get_bit(const vector<unsigned char> &bits, unsigned int x) {
+	return (bits[x >> 3] >> (x & 7)) & 1;
+}
+
+// Evaluating both keys everywhere and XORing gives the point function
+static void check_point(unsigned int num_points, unsigned int point) {
+	size_t keylen = DPF::key_bytes(num_points);
+	vector<unsigned char> key0(keylen), key1(keylen);
+	ASSERT_EQ(DPF::gen(&key0[0], &key1[0], num_points, point), 0);
+	EXPECT_NE(key0, key1);
+
+	size_t outlen = DPF::eval_bytes(num_points);
+	vector<unsigned char> out0(outlen), out1(outlen);
+	ASSERT_EQ(DPF::eval_all(&out0[0], &key0[0], num_points), 0);
+	ASSERT_EQ(DPF::eval_all(&out1[0], &key1[0], num_points), 0);
+	for (unsigned int x = 0; x < num_points; ++x) {
+		ASSERT_EQ(get_bit(out0, x) ^ get_bit(out1, x), x == point)
+			<< "num_points " << num_points << " point " << point
+			<< " x " << x;
+	}
+}
+
+TEST(DPF, SmallDomains) {
+	unsigned int sizes[] = { 1, 2, 7, 8, 100, 127, 128 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		for (unsigned int p = 0; p < sizes[i]; ++p) {
+			check_point(sizes[i], p);
+		}
+	}
+}
+
+TEST(DPF, LargeDomains) {
+	unsigned int sizes[] = { 129, 256, 1000, 4096, 65537 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		unsigned int n = sizes[i];
+		check_point(n, 0);
+		check_point(n, n - 1);
+		check_point(n, n / 2);
+		check_point(n, 129 % n);
+	}
+}
+
+TEST(DPF, KeyBytes) {
+	// One leaf needs no correction words for the tree
+	EXPECT_EQ(DPF::key_bytes(128), DPF::key_bytes(1));
+	EXPECT_LT(DPF::key_bytes(128), DPF::key_bytes(129));
+	EXPECT_EQ(DPF::key_bytes(256), DPF::key_bytes(129));
+	// Logarithmic in the domain
+	EXPECT_EQ(DPF::key_bytes(1 << 20) - DPF::key_bytes(1 << 19),
+		DPF::key_bytes(1 << 19) - DPF::key_bytes(1 << 18));
+}
+
+TEST(DPF, BadPoint) {
+	size_t keylen = DPF::key_bytes(10);
+	vector<unsigned char> key0(keylen), key1(keylen);
+	EXPECT_NE(DPF::gen(&key0[0], &key1[0], 10, 10), 0);
+}
+
+// Each key on its own looks random: the same point gives different
+// keys each time
+TEST(DPF, Fresh) {
+	size_t keylen = DPF::key_bytes(1000);
+	vector<unsigned char> a0(keylen), a1(keylen), b0(keylen), b1(keylen);
+	ASSERT_EQ(DPF::gen(&a0[0], &a1[0], 1000, 17), 0);
+	ASSERT_EQ(DPF::gen(&b0[0], &b1[0], 1000, 17), 0);
+	EXPECT_NE(a0, b0);
+	EXPECT_NE(a1, b1);
+}
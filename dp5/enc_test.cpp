@@ -61,3 +61,97 @@ TEST(EncryptionTest, EncDecTestAD) {
     EXPECT_EQ(plaintext2, plaintext);
 }
 
+
+TEST(EncryptionTest, DecShortCiphertext) {
+    byte key_bytes[DATAKEY_BYTES];
+    memset(key_bytes, 0, sizeof(key_bytes));
+    string plaintext;
+    EXPECT_NE(Dec(plaintext, key_bytes, string(ENCRYPTION_OVERHEAD - 1, 'x')), 0);
+}
+
+// The batched calls must agree with Enc and Dec record by record
+TEST(EncryptionTest, BatchMatchesSingle) {
+    const size_t num_records = 5;
+    const size_t plain_bytes = 24;
+    const size_t enc_bytes = plain_bytes + ENCRYPTION_OVERHEAD;
+    DataKey keys[num_records];
+    string ads[num_records];
+    string plaintexts;
+    for (unsigned r = 0; r < num_records; r++) {
+        for (unsigned i = 0; i < DATAKEY_BYTES; i++) {
+            keys[r][i] = r * 0x11 + i;
+        }
+        ads[r] = string(r + 3, (char) (0x40 + r));
+        for (unsigned i = 0; i < plain_bytes; i++) {
+            plaintexts.push_back(r * 0x20 + i);
+        }
+    }
+
+    string ciphertexts(num_records * enc_bytes, '\0');
+    EXPECT_EQ(EncBatch((unsigned char *) &ciphertexts[0], keys,
+        (const unsigned char *) plaintexts.data(), plain_bytes,
+        num_records, ads), 0);
+    for (unsigned r = 0; r < num_records; r++) {
+        EXPECT_EQ(ciphertexts.substr(r * enc_bytes, enc_bytes),
+            Enc(keys[r], plaintexts.substr(r * plain_bytes, plain_bytes),
+                ads[r]));
+    }
+
+    string decrypted(num_records * plain_bytes, '\0');
+    int errors[num_records];
+    EXPECT_EQ(DecBatch((unsigned char *) &decrypted[0], keys,
+        (const unsigned char *) ciphertexts.data(), enc_bytes,
+        num_records, ads, errors), 0);
+    EXPECT_EQ(decrypted, plaintexts);
+    for (unsigned r = 0; r < num_records; r++) {
+        EXPECT_EQ(errors[r], 0);
+    }
+
+    // Corrupt one record; only that one should fail
+    ciphertexts[2 * enc_bytes + 1] ^= 1;
+    EXPECT_NE(DecBatch((unsigned char *) &decrypted[0], keys,
+        (const unsigned char *) ciphertexts.data(), enc_bytes,
+        num_records, ads, errors), 0);
+    for (unsigned r = 0; r < num_records; r++) {
+        if (r == 2) {
+            EXPECT_NE(errors[r], 0);
+        } else {
+            EXPECT_EQ(errors[r], 0);
+            EXPECT_EQ(decrypted.substr(r * plain_bytes, plain_bytes),
+                plaintexts.substr(r * plain_bytes, plain_bytes));
+        }
+    }
+}
+
+TEST(EncryptionTest, BatchNoAD) {
+    DataKey keys[2];
+    memset(keys, 0, sizeof(keys));
+    unsigned char plaintexts[32];
+    memset(plaintexts, 0, sizeof(plaintexts));
+    unsigned char ciphertexts[2 * (16 + ENCRYPTION_OVERHEAD)];
+    EXPECT_EQ(EncBatch(ciphertexts, keys, plaintexts, 16, 2), 0);
+    // Both records match GCMTestVector2
+    for (unsigned r = 0; r < 2; r++) {
+        EXPECT_EQ(string((char *) ciphertexts + r * 32, 32), "\x03\x88\xda\xce\x60\xb6\xa3\x92\xf3\x28\xc2\xb9\x71\xb2\xfe\x78\xab\x6e\x47\xd4\x2c\xec\x13\xbd\xf5\x3a\x67\xb2\x12\x57\xbd\xdf");
+    }
+}
+
+TEST(PRGTest, KnownAnswer) {
+    PIRSeed seed;
+    memset(seed, 0, sizeof(seed));
+    unsigned char out[16];
+    EXPECT_EQ(PRG(out, sizeof(out), seed, 0), 0);
+    // AES-128 of the zero block under the zero key
+    EXPECT_EQ(string((char *) out, 16), "\x66\xe9\x4b\xd4\xef\x8a\x2c\x3b\x88\x4c\xfa\x59\xca\x34\x2b\x2e");
+}
+
+TEST(PRGTest, Streams) {
+    PIRSeed seed;
+    random_bytes(seed, PIRSEED_BYTES);
+    string a(1000, '\0'), b(1000, '\0'), prefix(37, '\0');
+    EXPECT_EQ(PRG((unsigned char *) &a[0], a.size(), seed, 0), 0);
+    EXPECT_EQ(PRG((unsigned char *) &b[0], b.size(), seed, 1), 0);
+    EXPECT_EQ(PRG((unsigned char *) &prefix[0], prefix.size(), seed, 0), 0);
+    EXPECT_NE(a, b);
+    EXPECT_EQ(a.substr(0, prefix.size()), prefix);
+}
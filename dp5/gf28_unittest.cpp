@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include "dp5gf28.h"
+
+#include "gtest/gtest.h"
+
+using namespace dp5::internal;
+
+// Multiplication by shifting and reducing, one bit at a time
+static unsigned char slow_mul(unsigned char a, unsigned char b) {
+	unsigned char p = 0;
+	while (b) {
+		if (b & 1) p ^= a;
+		a = (a << 1) ^ ((a & 0x80) ? 0x1b : 0);
+		b >>= 1;
+	}
+	return p;
+}
+
+TEST(GF28, Mul) {
+	for (unsigned int a = 0; a < 256; ++a) {
+		for (unsigned int b = 0; b < 256; ++b) {
+			ASSERT_EQ(GF28::mul(a, b), slow_mul(a, b));
+		}
+	}
+	// The example from FIPS-197
+	EXPECT_EQ(GF28::mul(0x57, 0x83), 0xc1);
+}
+
+TEST(GF28, Inv) {
+	for (unsigned int a = 1; a < 256; ++a) {
+		EXPECT_EQ(GF28::mul(a, GF28::inv(a)), 1);
+	}
+}
+
+TEST(GF28, MulAdd) {
+	unsigned char in[256], out[256], expected[256];
+	for (unsigned int i = 0; i < 256; ++i) {
+		in[i] = i;
+		out[i] = expected[i] = 255 - i;
+	}
+	for (unsigned int c = 0; c < 256; ++c) {
+		GF28::mul_add(out, in, 256, c);
+		for (unsigned int i = 0; i < 256; ++i) {
+			expected[i] ^= slow_mul(c, in[i]);
+		}
+		ASSERT_EQ(memcmp(out, expected, 256), 0);
+	}
+}
+
+// Lengths that are not a multiple of the vector width
+TEST(GF28, MulAddUnaligned) {
+	unsigned char in[40], out[40], expected[40];
+	for (unsigned int len = 0; len <= 39; ++len) {
+		for (unsigned int i = 0; i < 40; ++i) {
+			in[i] = 37 * i + len;
+			out[i] = expected[i] = i;
+		}
+		GF28::mul_add(out + 1, in + 1, len, 0x8e);
+		for (unsigned int i = 1; i <= len; ++i) {
+			expected[i] ^= slow_mul(0x8e, in[i]);
+		}
+		ASSERT_EQ(memcmp(out, expected, 40), 0) << "len " << len;
+	}
+}
+
+// Lengths on either side of the vector width, and unaligned pointers
+TEST(GF28, Add) {
+	unsigned char in[80], out[80], expected[80];
+	for (unsigned int len = 0; len <= 79; ++len) {
+		for (unsigned int i = 0; i < 80; ++i) {
+			in[i] = 29 * i + len;
+			out[i] = expected[i] = i;
+		}
+		GF28::add(out + 1, in + 1, len);
+		for (unsigned int i = 1; i <= len; ++i) {
+			expected[i] ^= in[i];
+		}
+		ASSERT_EQ(memcmp(out, expected, 80), 0) << "len " << len;
+	}
+}
+
+// Interpolating a polynomial from enough points gives back its values
+TEST(GF28, Lagrange) {
+	// f(x) = 0x42 + 0x17 x + 0xa9 x^2
+	unsigned char poly[3] = { 0x42, 0x17, 0xa9 };
+	unsigned char alphas[3] = { 1, 2, 5 };
+	unsigned char values[3];
+	for (unsigned int j = 0; j < 3; ++j) {
+		unsigned char x = alphas[j];
+		values[j] = poly[0] ^ GF28::mul(poly[1], x) ^
+			GF28::mul(poly[2], GF28::mul(x, x));
+	}
+
+	unsigned char coeffs[3];
+	for (unsigned int x = 0; x < 256; ++x) {
+		GF28::lagrange(coeffs, alphas, 3, x);
+		unsigned char fx = 0;
+		for (unsigned int j = 0; j < 3; ++j) {
+			fx ^= GF28::mul(coeffs[j], values[j]);
+		}
+		ASSERT_EQ(fx, poly[0] ^ GF28::mul(poly[1], x) ^
+			GF28::mul(poly[2], GF28::mul(x, x)));
+	}
+}
@@ -0,0 +1,224 @@
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <Pairing.h>
+#include "dp5keycache.h"
+#include "gtest/gtest.h"
+
+using namespace std;
+using namespace dp5;
+using namespace dp5::internal;
+
+class BuddyKeyCacheTest : public ::testing::Test {
+public:
+    PrivKey alice_priv, bob_priv;
+    PubKey alice_pub, bob_pub;
+
+    virtual void SetUp() {
+        genkeypair(alice_pub, alice_priv);
+        genkeypair(bob_pub, bob_priv);
+    }
+
+    // The keys as derived without the cache
+    void expected_keys(BuddyKeyCache::EpochKeys &keys, Epoch epoch,
+        const PrivKey &mypriv, const PubKey &buddy, const PubKey &registrant) {
+        DHOutput dh_output;
+        diffie_hellman(dh_output, mypriv, buddy);
+        H1H2(keys.shared_key, keys.data_key, epoch, registrant, dh_output);
+        H3(keys.hash_key, epoch, keys.shared_key);
+    }
+
+    void expect_equal(const BuddyKeyCache::EpochKeys &a,
+        const BuddyKeyCache::EpochKeys &b) {
+        EXPECT_EQ(memcmp(a.shared_key, b.shared_key, SHAREDKEY_BYTES), 0);
+        EXPECT_EQ(memcmp(a.data_key, b.data_key, DATAKEY_BYTES), 0);
+        EXPECT_EQ(memcmp(a.hash_key, b.hash_key, HASHKEY_BYTES), 0);
+    }
+};
+
+TEST_F(BuddyKeyCacheTest, PubKey) {
+    BuddyKeyCache cache(alice_priv, BuddyKeyCache::REGISTER);
+    EXPECT_TRUE(cache.pubkey() == alice_pub);
+}
+
+// Alice registering and Bob looking her up must agree on the keys
+TEST_F(BuddyKeyCacheTest, BothEnds) {
+    BuddyKeyCache alice(alice_priv, BuddyKeyCache::REGISTER);
+    BuddyKeyCache bob(bob_priv, BuddyKeyCache::LOOKUP);
+
+    for (Epoch epoch = 100; epoch < 105; ++epoch) {
+        BuddyKeyCache::EpochKeys reg, lookup, expected;
+        alice.epoch_keys(reg, epoch, bob_pub);
+        bob.epoch_keys(lookup, epoch, alice_pub);
+        expected_keys(expected, epoch, alice_priv, bob_pub, alice_pub);
+        expect_equal(reg, expected);
+        expect_equal(lookup, expected);
+
+        // A second lookup comes from the cache
+        alice.epoch_keys(reg, epoch, bob_pub);
+        expect_equal(reg, expected);
+    }
+}
+
+TEST_F(BuddyKeyCacheTest, Precompute) {
+    BuddyKeyCache cache(alice_priv, BuddyKeyCache::REGISTER);
+    vector<PubKey> buddies;
+    for (int i = 0; i < 10; ++i) {
+        PubKey pub;
+        PrivKey priv;
+        genkeypair(pub, priv);
+        buddies.push_back(pub);
+    }
+    cache.precompute(7, buddies);
+    cache.wait();
+
+    for (size_t i = 0; i < buddies.size(); ++i) {
+        BuddyKeyCache::EpochKeys keys, expected;
+        cache.epoch_keys(keys, 7, buddies[i]);
+        expected_keys(expected, 7, alice_priv, buddies[i], alice_pub);
+        expect_equal(keys, expected);
+    }
+}
+
+struct PrecomputeArgs {
+    BuddyKeyCache *cache;
+    Epoch epoch;
+    const vector<PubKey> *buddies;
+};
+
+static void *precompute_thread(void *arg)
+{
+    PrecomputeArgs *args = (PrecomputeArgs *) arg;
+    args->cache->precompute(args->epoch, *args->buddies);
+    return NULL;
+}
+
+// The first calls to precompute may come from several threads at once
+TEST_F(BuddyKeyCacheTest, PrecomputeFromThreads) {
+    BuddyKeyCache cache(alice_priv, BuddyKeyCache::REGISTER);
+    vector<PubKey> buddies;
+    buddies.push_back(bob_pub);
+
+    static const int NUM_THREADS = 4;
+    pthread_t threads[NUM_THREADS];
+    PrecomputeArgs args[NUM_THREADS];
+    for (int t = 0; t < NUM_THREADS; ++t) {
+        args[t].cache = &cache;
+        args[t].epoch = 20 + t;
+        args[t].buddies = &buddies;
+        pthread_create(&threads[t], NULL, precompute_thread, &args[t]);
+    }
+    for (int t = 0; t < NUM_THREADS; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    cache.wait();
+
+    for (int t = 0; t < NUM_THREADS; ++t) {
+        BuddyKeyCache::EpochKeys keys, expected;
+        cache.epoch_keys(keys, 20 + t, bob_pub);
+        expected_keys(expected, 20 + t, alice_priv, bob_pub, alice_pub);
+        expect_equal(keys, expected);
+    }
+}
+
+TEST_F(BuddyKeyCacheTest, Copy) {
+    BuddyKeyCache cache(alice_priv, BuddyKeyCache::LOOKUP);
+    BuddyKeyCache::EpochKeys keys, copied;
+    cache.epoch_keys(keys, 3, bob_pub);
+
+    BuddyKeyCache copy(cache);
+    copy.epoch_keys(copied, 3, bob_pub);
+    expect_equal(keys, copied);
+
+    BuddyKeyCache assigned(bob_priv, BuddyKeyCache::REGISTER);
+    assigned = cache;
+    EXPECT_TRUE(assigned.pubkey() == alice_pub);
+    assigned.epoch_keys(copied, 3, bob_pub);
+    expect_equal(keys, copied);
+}
+
+class CombinedKeyCacheTest : public ::testing::Test {
+public:
+    vector<BLSPubKey> buddies;
+
+    virtual void SetUp() {
+        initPairing();
+        buddies.resize(20);
+        for (size_t i = 0; i < buddies.size(); ++i) {
+            BLSPrivKey priv;
+            genkeypair(buddies[i], priv);
+        }
+    }
+};
+
+TEST_F(CombinedKeyCacheTest, MatchesDirect) {
+    CombinedKeyCache cache;
+    // Some precomputed, and some not
+    cache.precompute(9, vector<BLSPubKey>(buddies.begin(), buddies.begin() + 5));
+
+    vector<CombinedKeyCache::EpochKeys> keys;
+    EXPECT_EQ(cache.epoch_keys(keys, 9, buddies), 0);
+    ASSERT_EQ(keys.size(), buddies.size());
+    for (size_t i = 0; i < buddies.size(); ++i) {
+        HashKey hash_key;
+        DataKey data_key;
+        EXPECT_EQ(hash_key_from_pk(hash_key, buddies[i], 9), 0);
+        H5(data_key, 9, buddies[i]);
+        EXPECT_EQ(memcmp(keys[i].hash_key, hash_key, HASHKEY_BYTES), 0);
+        EXPECT_EQ(memcmp(keys[i].data_key, data_key, DATAKEY_BYTES), 0);
+    }
+
+    // And again, from the cache
+    vector<CombinedKeyCache::EpochKeys> again;
+    EXPECT_EQ(cache.epoch_keys(again, 9, buddies), 0);
+    for (size_t i = 0; i < buddies.size(); ++i) {
+        EXPECT_EQ(memcmp(keys[i].hash_key, again[i].hash_key, HASHKEY_BYTES), 0);
+    }
+}
+
+// Looking up one epoch while the next is still being precomputed, over
+// enough epochs that the old background work is forgotten
+TEST_F(CombinedKeyCacheTest, PrecomputeNextEpoch) {
+    CombinedKeyCache cache;
+    for (Epoch epoch = 9; epoch < 15; ++epoch) {
+        vector<CombinedKeyCache::EpochKeys> keys;
+        EXPECT_EQ(cache.epoch_keys(keys, epoch, buddies), 0);
+        cache.precompute(epoch + 1, buddies);
+        ASSERT_EQ(keys.size(), buddies.size());
+        for (size_t i = 0; i < buddies.size(); ++i) {
+            HashKey hash_key;
+            EXPECT_EQ(hash_key_from_pk(hash_key, buddies[i], epoch), 0);
+            EXPECT_EQ(memcmp(keys[i].hash_key, hash_key, HASHKEY_BYTES), 0);
+        }
+    }
+    cache.wait();
+}
+
+// A forked child has none of the shared pool's workers, so it must get a
+// pool of its own rather than wait forever on the parent's
+TEST_F(CombinedKeyCacheTest, AfterFork) {
+    CombinedKeyCache cache;
+    vector<CombinedKeyCache::EpochKeys> keys;
+    EXPECT_EQ(cache.epoch_keys(keys, 9, buddies), 0);
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        CombinedKeyCache childcache;
+        vector<CombinedKeyCache::EpochKeys> childkeys;
+        int err = childcache.epoch_keys(childkeys, 9, buddies);
+        bool match = (err == 0 && childkeys.size() == keys.size());
+        for (size_t i = 0; match && i < keys.size(); ++i) {
+            match = memcmp(childkeys[i].hash_key, keys[i].hash_key,
+                HASHKEY_BYTES) == 0;
+        }
+        _exit(match ? 0 : 1);
+    }
+
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+}
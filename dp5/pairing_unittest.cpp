@@ -1,4 +1,5 @@
 #include "dp5params.h"
+#include "dp5pairing.h"
 #include <Pairing.h>
 #include "gtest/gtest.h"
 
@@ -94,3 +95,32 @@ TEST_F(BLSTest, HashPKErrorInvalid) {
 
 	EXPECT_NE(hash_key_from_pk(hashkey, pubkey3, 0), 0);
 }
+
+TEST(PairingContextTest, FixedBasePow) {
+	initPairing();
+	PairingContext &ctx = PairingContext::get();
+	Pairing pairing;
+
+	Zr exponents[] = { Zr(0), Zr(1), Zr(15), Zr(16), Zr(23), Zr(true),
+		Zr(true) };
+	for (size_t i = 0; i < sizeof(exponents)/sizeof(exponents[0]); ++i) {
+		G1 expected = pairing.g1_get_gen() ^ exponents[i];
+		EXPECT_EQ(ctx.g1_gen_pow(exponents[i]), expected);
+	}
+}
+
+TEST(PairingContextTest, EpochHash) {
+	initPairing();
+	PairingContext &ctx = PairingContext::get();
+	Pairing pairing;
+
+	// More epochs than are cached, twice over
+	for (int round = 0; round < 2; ++round) {
+		for (Epoch e = 100; e < 110; ++e) {
+			unsigned char E[EPOCH_BYTES];
+			epoch_num_to_bytes(E, e);
+			G2 expected(pairing, E, EPOCH_BYTES);
+			EXPECT_EQ(ctx.epoch_hash(e), expected);
+		}
+	}
+}
@@ -0,0 +1,100 @@
+#include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <set>
+#include <string>
+
+#include "dp5params.h"
+#include "gtest/gtest.h"
+
+using namespace dp5;
+using namespace dp5::internal;
+
+using std::string;
+using std::set;
+
+static string random_string(unsigned int len) {
+	string s(len, '\0');
+	if (len > 0) {
+		random_bytes((unsigned char *) &s[0], len);
+	}
+	return s;
+}
+
+TEST(RandomBytes, Distinct) {
+	set<string> seen;
+	for (int i = 0; i < 1000; ++i) {
+		EXPECT_TRUE(seen.insert(random_string(16)).second);
+	}
+}
+
+TEST(RandomBytes, ZeroLength) {
+	unsigned char buf[1] = { 0x5a };
+	random_bytes(buf, 0);
+	EXPECT_EQ(buf[0], 0x5a);
+}
+
+// Requests larger than, and straddling, the internal buffer
+TEST(RandomBytes, Large) {
+	random_string(5);
+	string a = random_string(10000);
+	string b = random_string(10000);
+	EXPECT_NE(a, b);
+
+	// Crude sanity check: every byte value shows up
+	set<unsigned char> values(a.begin(), a.end());
+	EXPECT_EQ(values.size(), 256u);
+}
+
+TEST(RandomBytes, ByteArray) {
+	PrivKey a, b;
+	a.random();
+	b.random();
+	EXPECT_FALSE(a == b);
+}
+
+static void *thread_random(void *out) {
+	*(string *) out = random_string(64);
+	return NULL;
+}
+
+TEST(RandomBytes, Threads) {
+	const int num_threads = 8;
+	pthread_t threads[num_threads];
+	string outputs[num_threads];
+	for (int i = 0; i < num_threads; ++i) {
+		pthread_create(&threads[i], NULL, thread_random, &outputs[i]);
+	}
+	for (int i = 0; i < num_threads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	set<string> seen(outputs, outputs + num_threads);
+	seen.insert(random_string(64));
+	EXPECT_EQ(seen.size(), (size_t) num_threads + 1);
+}
+
+// A child process must not produce the same bytes as its parent
+TEST(RandomBytes, Fork) {
+	// Make sure the parent's generator has buffered output
+	random_string(1);
+
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	pid_t pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0) {
+		string s = random_string(32);
+		ssize_t res = write(fds[1], s.data(), s.size());
+		_exit(res == 32 ? 0 : 1);
+	}
+	close(fds[1]);
+	char childbuf[32];
+	ASSERT_EQ(read(fds[0], childbuf, sizeof(childbuf)), 32);
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	EXPECT_EQ(WEXITSTATUS(status), 0);
+
+	string parent = random_string(32);
+	EXPECT_NE(parent, string(childbuf, 32));
+}
@@ -9,6 +9,13 @@
 
   void nativebuffer_purge(nativebuffer buf);
 
+  /* Arena of the buffers handed back by the library */
+
+  typedef struct _DP5Arena DP5Arena;
+
+  DP5Arena * Arena_alloc();
+  void Arena_release(DP5Arena * arena);
+
   /* Init functions */
 
   void * Init_init();
@@ -61,6 +68,7 @@
       unsigned int epoch,
       unsigned int friends_num,
       char * data,
+      DP5Arena * arena,
       nativebuffer * msg);
 
   int RegClient_complete(
@@ -121,12 +129,21 @@
   void LookupClient_metadata_req(
       DP5LookupClient * cli,
       unsigned int epoch,
+      DP5Arena * arena,
       nativebuffer * msg);
 
   int LookupClient_metadata_rep(
       DP5LookupClient * cli,
       nativebuffer data);
 
+  bool LookupClient_use_cached_metadata(
+      DP5LookupClient * cli,
+      unsigned int epoch);
+
+  int LookupClient_metadata_prefetch(
+      DP5LookupClient * cli,
+      nativebuffer data);
+
   typedef struct _DP5LookupClient_Request DP5LookupClient_Request;
 
   DP5LookupClient_Request * LookupRequest_lookup(
@@ -134,16 +151,50 @@
       unsigned int buds_len,
       void * buds,
       unsigned int num_servers,
+      DP5Arena * arena,
       nativebuffer * msg);
 
   int LookupRequest_reply(
       DP5LookupClient_Request * req,
       unsigned int num_servers,
       nativebuffer * replies,
+      DP5Arena * arena,
+      nativebuffer * msg);
+
+  int LookupRequest_add_reply(
+      DP5LookupClient_Request * req,
+      unsigned int server,
+      nativebuffer reply);
+
+  int LookupRequest_decode(
+      DP5LookupClient_Request * req,
+      DP5Arena * arena,
+      nativebuffer * msg);
+
+  bool LookupRequest_is_download(DP5LookupClient_Request * req);
+
+  int LookupRequest_download_feed(
+      DP5LookupClient_Request * req,
+      nativebuffer chunk);
+
+  int LookupRequest_download_finish(
+      DP5LookupClient_Request * req,
+      DP5Arena * arena,
       nativebuffer * msg);
 
   void LookupRequest_delete(DP5LookupClient_Request * p);
 
+  void LookupClient_observe_metadata(
+      DP5LookupClient * cli,
+      unsigned int server,
+      double seconds);
+
+  void LookupClient_observe_lookup(
+      DP5LookupClient * cli,
+      DP5LookupClient_Request * req,
+      unsigned int num_servers,
+      double * seconds);
+
   /* Combined Lookup Client */
 
   typedef struct _DP5CombinedLookupClient DP5CombinedLookupClient;
@@ -12,6 +12,45 @@ void nativebuffer_purge(nativebuffer buf){
     if (buf.buf != NULL) free(buf.buf);
 }
 
+// --------- Arena functions -----------------------
+
+// The library's own strings are swapped into the arena rather than
+// copied out; a deque never moves its elements as it grows
+typedef struct _DP5Arena {
+    deque<string> strings;
+} DP5Arena;
+
+DP5Arena * Arena_alloc(){
+    return new DP5Arena();
+}
+
+void Arena_release(DP5Arena * arena){
+    delete arena;
+}
+
+// Take over s, and point buf at it
+static void arena_keep(DP5Arena * arena, string &s, nativebuffer * buf){
+    if (s.empty()) {
+        buf->len = 0;
+        buf->buf = NULL;
+        return;
+    }
+    arena->strings.push_back(string());
+    arena->strings.back().swap(s);
+    buf->len = arena->strings.back().size();
+    buf->buf = &(arena->strings.back()[0]);
+}
+
+// Hand the data of each buddy over to the arena
+template<typename Presence>
+static void arena_keep_presence(DP5Arena * arena,
+    vector<Presence> &presence, nativebuffer * msg){
+
+    for (unsigned int j = 0; j < presence.size(); j++){
+        arena_keep(arena, presence[j].data, &msg[j]);
+    }
+}
+
 // Initialize libraries
 void Init_init(){
     ZZ_p::init(to_ZZ(256));
@@ -118,6 +157,7 @@ int RegClient_start(
     unsigned int epoch,
     unsigned int friends_num,
     char * data,
+    DP5Arena * arena,
     nativebuffer * msg){
 
     vector<BuddyInfo> buds;
@@ -136,9 +176,7 @@ int RegClient_start(
     int err1 = reg->start_reg(msgCtoS, next_epoch, buds);
     if (err1) return err1;
 
-    msg->len = msgCtoS.size();
-    msg->buf = (char *)malloc(msg->len);
-    memcpy(msg->buf, msgCtoS.data(), msg->len);
+    arena_keep(arena, msgCtoS, msg);
 
     return 0x00;
 }
@@ -239,6 +277,37 @@ unsigned int RegServer_epoch_change(
 
 // ---------- Combined Lookup client functions -----------
 
+// Process the replies to req.  A download-mode reply is streamed
+// through in place, so the database is never copied; the others are
+// copied once, into the strings lookup_reply takes.
+template<typename Request, typename Presence>
+static int request_reply(
+    Request * req,
+    unsigned int num_servers,
+    nativebuffer * replies,
+    vector<Presence> & presence){
+
+    if (req->is_download()) {
+        for (unsigned int i = 0; i < num_servers; i++){
+            if (replies[i].len == 0) continue;
+            int err = req->download_feed(replies[i].buf, replies[i].len);
+            if (err) return err;
+            return req->download_finish(presence);
+        }
+        // Did not find a single download reply
+        return 0x16;
+    }
+
+    vector<string> msgStoCpir(num_servers);
+    for (unsigned int i = 0; i < num_servers; i++){
+        if (replies[i].len > 0){
+            msgStoCpir[i].assign(replies[i].buf, replies[i].len);
+        }
+    }
+
+    return req->lookup_reply(presence, msgStoCpir);
+}
+
 DP5CombinedLookupClient * LookupClientCB_alloc(){
     return new DP5CombinedLookupClient();
 }
@@ -313,20 +382,8 @@ int LookupRequestCB_reply(
     void processprez(char*, bool, size_t, const void*)
     ){
 
-    vector<string> msgStoCpir;
-    for (unsigned int i = 0; i < num_servers; i++){
-        string msg;
-        if (replies[i].len > 0){
-            msg.append(replies[i].buf, replies[i].len);
-        }
-        else {
-            msg = "";
-        }
-        msgStoCpir.push_back(msg);
-    }
-
     vector<typename DP5CombinedLookupClient::Presence> presence;
-    int err4 = req->lookup_reply(presence, msgStoCpir);
+    int err4 = request_reply(req, num_servers, replies, presence);
     if (err4) return err4;
 
 
@@ -358,14 +415,13 @@ void LookupClient_delete(DP5LookupClient * p){
 void LookupClient_metadata_req(
     DP5LookupClient * cli,
     unsigned int epoch,
+    DP5Arena * arena,
     nativebuffer * msg){
 
     string output;
     cli->metadata_request(output, epoch);
 
-    msg->len = output.size();
-    msg->buf = (char *)malloc(msg->len);
-    memcpy(msg->buf, output.data(), msg->len);
+    arena_keep(arena, output, msg);
 }
 
 int LookupClient_metadata_rep(
@@ -379,11 +435,28 @@ int LookupClient_metadata_rep(
     return err;
 }
 
+bool LookupClient_use_cached_metadata(
+    DP5LookupClient * cli,
+    unsigned int epoch){
+
+    return cli->use_cached_metadata(epoch);
+}
+
+int LookupClient_metadata_prefetch(
+    DP5LookupClient * cli,
+    nativebuffer data){
+
+    string msgStoC;
+    msgStoC.append((char *) data.buf, data.len);
+    return cli->metadata_prefetch(msgStoC);
+}
+
 DP5LookupClient::Request * LookupRequest_lookup(
     DP5LookupClient * cli,
     unsigned int buds_len,
     void * buds,
     unsigned int num_servers,
+    DP5Arena * arena,
     nativebuffer * msg
     ){
 
@@ -402,18 +475,8 @@ DP5LookupClient::Request * LookupRequest_lookup(
     cli->lookup_request(*req, vbuds, num_servers, num_servers-1);
 
     vector<string> msgCtoSpir = req->get_msgs();
-    vector<string> msgStoCpir;
     for(unsigned int s = 0; s < msgCtoSpir.size(); s++){
-        if (msgCtoSpir[s] == "") {
-            msg[s].len = 0;
-            msg[s].buf = NULL;
-        }
-        else
-        {
-            msg[s].len = msgCtoSpir[s].size();
-            msg[s].buf = (char *)malloc(msg[s].len);
-            memcpy(msg[s].buf, msgCtoSpir[s].data(), msg[s].len);
-        }
+        arena_keep(arena, msgCtoSpir[s], &msg[s]);
     }
 
     return req;
@@ -423,31 +486,70 @@ int LookupRequest_reply(
     DP5LookupClient::Request * req,
     unsigned int num_servers,
     nativebuffer * replies,
+    DP5Arena * arena,
     nativebuffer * msg){
 
-    vector<string> msgStoCpir;
-    for (unsigned int i = 0; i < num_servers; i++){
-        string msg;
-        if (replies[i].len >0){
-            msg.append(replies[i].buf, replies[i].len);
-        }
-        else {
-            msg = "";
-        }
-        msgStoCpir.push_back(msg);
-    }
-
     vector<typename DP5LookupClient::Presence> presence;
-    int err4 = req->lookup_reply(presence, msgStoCpir);
+    int err4 = request_reply(req, num_servers, replies, presence);
     if (err4) return err4;
 
+    arena_keep_presence(arena, presence, msg);
 
-    for (unsigned int j = 0; j < presence.size(); j++){
-        msg[j].len = presence[j].data.size();
-        msg[j].buf = (char *)malloc(msg[j].len);
-        memcpy(msg[j].buf, presence[j].data.data(), msg[j].len);
+    return 0;
+}
+
+int LookupRequest_add_reply(
+    DP5LookupClient::Request * req,
+    unsigned int server,
+    nativebuffer reply){
+
+    // No reply from this server
+    if (reply.len == 0) return 0x00;
+
+    if (req->is_download()) {
+        return req->download_feed(reply.buf, reply.len);
     }
 
+    string msgStoC(reply.buf, reply.len);
+    return req->add_reply(server, msgStoC);
+}
+
+int LookupRequest_decode(
+    DP5LookupClient::Request * req,
+    DP5Arena * arena,
+    nativebuffer * msg){
+
+    vector<typename DP5LookupClient::Presence> presence;
+    int err = req->decode(presence);
+    if (err) return err;
+
+    arena_keep_presence(arena, presence, msg);
+
+    return 0;
+}
+
+bool LookupRequest_is_download(DP5LookupClient::Request * req){
+    return req->is_download();
+}
+
+int LookupRequest_download_feed(
+    DP5LookupClient::Request * req,
+    nativebuffer chunk){
+
+    return req->download_feed(chunk.buf, chunk.len);
+}
+
+int LookupRequest_download_finish(
+    DP5LookupClient::Request * req,
+    DP5Arena * arena,
+    nativebuffer * msg){
+
+    vector<typename DP5LookupClient::Presence> presence;
+    int err = req->download_finish(presence);
+    if (err) return err;
+
+    arena_keep_presence(arena, presence, msg);
+
     return 0;
 }
 
@@ -455,6 +557,24 @@ void LookupRequest_delete(DP5LookupClient::Request * p){
     delete p;
 }
 
+void LookupClient_observe_metadata(
+    DP5LookupClient * cli,
+    unsigned int server,
+    double seconds){
+
+    cli->observe_metadata(server, seconds);
+}
+
+void LookupClient_observe_lookup(
+    DP5LookupClient * cli,
+    DP5LookupClient::Request * req,
+    unsigned int num_servers,
+    double * seconds){
+
+    vector<double> reply_seconds(seconds, seconds + num_servers);
+    cli->observe_lookup(*req, reply_seconds);
+}
+
 
 // --------- Lookup Server functios -------------
 
@@ -1,5 +1,6 @@
 #include <vector>
 #include <set>
+#include <deque>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -36,6 +37,14 @@ extern "C" {
 
     void nativebuffer_purge(nativebuffer buf);
 
+    // The buffers the library hands back are borrowed views into an
+    // arena, valid until the arena is released; one arena can hold
+    // every message of a registration or lookup
+    typedef struct _DP5Arena DP5Arena;
+
+    DP5Arena * Arena_alloc();
+    void Arena_release(DP5Arena * arena);
+
     /* Init functions */
 
     void Init_init();
@@ -83,6 +92,7 @@ extern "C" {
         unsigned int epoch,
         unsigned int friends_num,
         char * data,
+        DP5Arena * arena,
         nativebuffer * msg);
 
     int RegClient_complete(
@@ -177,24 +187,82 @@ extern "C" {
     void LookupClient_metadata_req(
         DP5LookupClient * cli,
         unsigned int epoch,
+        DP5Arena * arena,
         nativebuffer * msg);
 
     int LookupClient_metadata_rep(
         DP5LookupClient * cli,
         nativebuffer data);
 
+    // The client caches the metadata of recent epochs: use epoch's if
+    // it is cached (true), so that the metadata round trip can be
+    // skipped, or cache the reply to a metadata request made ahead of
+    // time without making it current
+    bool LookupClient_use_cached_metadata(
+        DP5LookupClient * cli,
+        unsigned int epoch);
+
+    int LookupClient_metadata_prefetch(
+        DP5LookupClient * cli,
+        nativebuffer data);
+
     DP5LookupClient::Request * LookupRequest_lookup(
         DP5LookupClient * cli,
         unsigned int buds_len,
         void * buds,
         unsigned int num_servers,
+        DP5Arena * arena,
         nativebuffer * msg);
 
     int LookupRequest_reply(
         DP5LookupClient::Request * req,
         unsigned int num_servers,
         nativebuffer * replies,
+        DP5Arena * arena,
+        nativebuffer * msg);
+
+    // Pass each server's reply as it arrives, then decode once they
+    // are all in.  The reply is only read during the call, so it can
+    // be the caller's own memory; a download-mode reply is consumed
+    // in place rather than copied.
+    int LookupRequest_add_reply(
+        DP5LookupClient::Request * req,
+        unsigned int server,
+        nativebuffer reply);
+
+    int LookupRequest_decode(
+        DP5LookupClient::Request * req,
+        DP5Arena * arena,
+        nativebuffer * msg);
+
+    // Streamed download-mode replies: feed the reply from the server
+    // sent the (only) non-empty request in chunks as it arrives, then
+    // finish.  Only the needed buckets are kept in memory.
+    bool LookupRequest_is_download(DP5LookupClient::Request * req);
+
+    int LookupRequest_download_feed(
+        DP5LookupClient::Request * req,
+        nativebuffer chunk);
+
+    int LookupRequest_download_finish(
+        DP5LookupClient::Request * req,
+        DP5Arena * arena,
         nativebuffer * msg);
 
     void LookupRequest_delete(DP5LookupClient::Request * p);
+
+    // Timings for the client's cost model, which chooses between PIR
+    // and downloads: how long a metadata request to server took, and
+    // how long each server's reply to req took (negative for none),
+    // in seconds
+    void LookupClient_observe_metadata(
+        DP5LookupClient * cli,
+        unsigned int server,
+        double seconds);
+
+    void LookupClient_observe_lookup(
+        DP5LookupClient * cli,
+        DP5LookupClient::Request * req,
+        unsigned int num_servers,
+        double * seconds);
 }
@@ -40,6 +40,7 @@ var lookup_server2 string
 
 var epoch_len int
 var dataenc_bytes int
+var prefetch_metadata bool
 
 var c_clear string
 var c_client string
@@ -74,6 +75,7 @@ func main() {
 
     flag.IntVar(&epoch_len, "e", 30, "Epoch length")
     flag.IntVar(&dataenc_bytes, "d", 48, "Ciphertext length")
+    flag.BoolVar(&prefetch_metadata, "pm", false, "Prefetch the next epoch's lookup metadata")
 
     flag.Parse()
 